@@ -50,13 +50,17 @@ inline int64_t GetUsec() {
   return (tv.tv_sec * 1000000l) + tv.tv_usec;
 }
 
-// inline void Pause() {
-// #if Isx86_64
-//   __pause();
-// #else
-//   // Nothing on Arm, etc. 
-// #endif
-// }
+// Slow down speculation in a spin loop, and give its cycles to any
+// hyperthread sharing the core
+inline void Pause() {
+#if Isx86_64
+  _mm_pause();
+#elif IsArm_64
+  asm volatile("yield");
+#else
+  // Nothing elsewhere
+#endif
+}
 
 
 #endif	// __TIMERCOUNTERS_H__
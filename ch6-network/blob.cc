@@ -0,0 +1,45 @@
+#include "blob.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BlobFile* blob_open(const char* const path) {
+  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+  const int fd = open(path, O_RDWR|O_CREAT|O_TRUNC, RW_MODE);
+  if (-1 == fd) return NULL;
+  return new BlobFile{fd, 0};
+}
+
+int blob_append(
+  BlobFile* const blobs,
+  const uint8_t* data,
+  size_t n_bytes,
+  uint64_t* const offset
+) {
+  *offset = __atomic_fetch_add(&blobs->len, n_bytes, __ATOMIC_RELAXED);
+  uint64_t at = *offset;
+  while (n_bytes > 0) {
+    const ssize_t n = pwrite(blobs->fd, data, n_bytes, at);
+    if (n < 0) return -1;
+    data += n;
+    at += n;
+    n_bytes -= n;
+  }
+  return 0;
+}
+
+int blob_read(const BlobFile* const blobs, uint64_t offset, uint8_t* buf, size_t n_bytes) {
+  while (n_bytes > 0) {
+    const ssize_t n = pread(blobs->fd, buf, n_bytes, offset);
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      return -1;
+    }
+    buf += n;
+    offset += n;
+    n_bytes -= n;
+  }
+  return 0;
+}
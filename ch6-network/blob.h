@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An append-only file of large values, so that they live in the page cache
+// rather than on the heap, and can be sent from there with conn_send_file().
+//
+// Values are only ever appended: one that is overwritten stays in the file,
+// unreferenced, until the file is recreated on the next start.
+struct BlobFile {
+  int fd;
+  // Bytes appended or reserved so far.
+  uint64_t len;
+};
+
+// Creates the blob file at path, truncating it if it exists.
+//
+// Returns NULL on error.
+BlobFile* blob_open(const char* path);
+
+// Appends n_bytes from data and sets *offset to where they start. Safe to
+// call from several threads at once: each append reserves its own range of
+// the file before writing it.
+//
+// Returns -1 and sets errno on error.
+int blob_append(BlobFile* blobs, const uint8_t* data, size_t n_bytes, uint64_t* offset);
+
+// Reads n_bytes at offset into buf.
+//
+// Returns -1 and sets errno on error.
+int blob_read(const BlobFile* blobs, uint64_t offset, uint8_t* buf, size_t n_bytes);
@@ -0,0 +1,71 @@
+#include "busy_poll.h"
+
+#include <sys/socket.h>
+
+#include "phases.h"
+#include "../ch2-cpu/timecounters.h"
+
+int busy_poll_wait(BusyPoll* const poller, pollfd* const fds, const nfds_t n_fds) {
+  ++poller->n_waits;
+  const uint64_t per_us = cycles_per_us();
+  const uint64_t start = read_cycles();
+  const uint64_t spin_end = start + poller->spin_us * per_us;
+  if (poller->spin_us > 0) {
+    while (true) {
+      const int n_ready = poll(fds, n_fds, 0);
+      if (0 != n_ready) {
+        ++poller->n_spun;
+        poller->spin_cycles += read_cycles() - start;
+        return n_ready;
+      }
+      if (read_cycles() >= spin_end) break;
+      Pause();
+    }
+  }
+
+  if (poller->spin_us > 0) {
+    const uint64_t spun = read_cycles() - start;
+    poller->spin_cycles += spun;
+    poller->wasted_cycles += spun;
+  }
+  ++poller->n_blocked;
+  const int n_ready = poll(fds, n_fds, -1);
+  if (read_cycles() - start < poller->max_us * per_us) {
+    poller->spin_us = poller->max_us;
+  } else {
+    poller->spin_us /= 2;
+  }
+  return n_ready;
+}
+
+int busy_poll_socket(const int sock_fd, const uint32_t usec) {
+  const int value = usec;
+  return setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+}
+
+void busy_poll_report(
+  FILE* const out,
+  const char* const name,
+  const uint16_t port,
+  const BusyPoll* const poller,
+  const uint64_t cpu_ns,
+  const uint64_t wall_ns
+) {
+  const double per_ms = cycles_per_us() * 1000.0;
+  fprintf(
+    out,
+    "%d %s: %lu waits, %lu (%.1f%%) ended spinning, %lu blocked;"
+    " spun %.1f ms, %.1f ms in vain; CPU %.1f ms in %.1f s (%.1f%%)\n",
+    port,
+    name,
+    poller->n_waits,
+    poller->n_spun,
+    poller->n_waits == 0 ? 0.0 : 100.0 * poller->n_spun / poller->n_waits,
+    poller->n_blocked,
+    poller->spin_cycles / per_ms,
+    poller->wasted_cycles / per_ms,
+    cpu_ns / 1e6,
+    wall_ns / 1e9,
+    wall_ns == 0 ? 0.0 : 100.0 * cpu_ns / wall_ns
+  );
+}
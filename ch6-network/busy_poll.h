@@ -0,0 +1,57 @@
+#pragma once
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Waiting on sockets by spinning rather than sleeping.
+//
+// A thread blocked in poll() or read() is woken by the kernel when bytes
+// arrive, and pays for the wakeup, and on a busy CPU the context switch, on
+// every request. A BusyPoll instead checks the sockets without waiting, with
+// Pause() in between, for up to a budget of spin_us, and only blocks once
+// that runs out. The thread's CPU is busy the whole time it spins, so what it
+// saves in latency it pays for in CPU, which busy_poll_report() shows.
+//
+// The budget adapts, so that an idle socket costs no CPU: each wait that
+// spins through its budget and has to block anyway halves it, down to 0.
+// A wait that turns out to end within max_us of starting, counting the time
+// blocked, would have been caught by spinning for max_us, so it sets the
+// budget back to max_us.
+struct BusyPoll {
+  uint32_t max_us;
+  uint32_t spin_us;
+
+  // Totals since the start, for busy_poll_report().
+  uint64_t n_waits = 0;
+  // Waits that ended while spinning, and that blocked.
+  uint64_t n_spun = 0;
+  uint64_t n_blocked = 0;
+  // read_cycles() ticks spent spinning, and those of them spent on waits that
+  // blocked anyway.
+  uint64_t spin_cycles = 0;
+  uint64_t wasted_cycles = 0;
+
+  explicit BusyPoll(uint32_t max_us) : max_us(max_us), spin_us(max_us) {}
+};
+
+// Waits like poll(fds, n_fds, -1), spinning first.
+int busy_poll_wait(BusyPoll* poller, pollfd* fds, nfds_t n_fds);
+
+// Sets SO_BUSY_POLL on the socket, so that a blocking read of it that finds
+// nothing has the kernel poll the NIC's queue for up to usec before sleeping.
+// Raising it above net.core.busy_read needs CAP_NET_ADMIN.
+//
+// Returns -1 on error.
+int busy_poll_socket(int sock_fd, uint32_t usec);
+
+// Prints the poller's totals as a line for the thread called name on port,
+// next to the CPU time the thread used, cpu_ns, over wall_ns.
+void busy_poll_report(
+  FILE* out,
+  const char* name,
+  uint16_t port,
+  const BusyPoll* poller,
+  uint64_t cpu_ns,
+  uint64_t wall_ns
+);
@@ -5,24 +5,56 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "histogram.h"
 #include "log.h"
 #include "my_rpc.h"
 #include "network.h"
+#include "phases.h"
 #include "rpc.h"
+#include "shard.h"
+#include "udp.h"
+#include "workload.h"
 
+// Describes the strings used as keys or values: the nth RPC's string is base,
+// incremented n times if increment_base, then padded with random characters
+// to padded_length.
 struct StrConfig {
   const char* base = NULL;
   bool increment_base = false;
   size_t padded_length = 0;
 };
 
+const char* const DEFAULT_STR_BASE = "foo bar baz";
+
+// The mix command's default key base, which has room to count to a billion.
+const char* const DEFAULT_MIX_KEY_BASE = "user000000000";
+
 enum class Command {
   Ping,
   Write,
   Read,
-  Quit
+  // Deletes -key, on a server with -engine lsm.
+  Delete,
+  Quit,
+  // Reads and writes, in a ratio and over keys given by a MixConfig.
+  Mix,
+  // Lists the keys from -key up to -end.
+  Scan,
+  // Has the server write its keystore to a file.
+  Snapshot
+};
+
+// The mix command's workload.
+struct MixConfig {
+  double read_fraction = 0.5;
+  KeyDistConfig key_dist;
+  // If value_sizes_given is false, values are the -value length.
+  SizeDist value_sizes;
+  bool value_sizes_given = false;
+  bool preload = false;
 };
 
 struct Args {
@@ -33,15 +65,143 @@ struct Args {
   uint32_t wait_ms = 0;
   bool seed1 = false;
   bool verbose = false;
+  bool compact = false;
+  bool udp = false;
+  RpcPriority priority = RpcPriority::Normal;
+  const char* hist_fn = NULL;
+  LogFormat log_format = LogFormat::Rows;
+  // If nonzero, keys are sharded over ports PORT to PORT + n_shards - 1.
+  uint32_t n_shards = 0;
+  int vnodes = 64;
+  // If nonnegative, port PORT + n_shards joins after this many RPCs.
+  int64_t add_shard_after = -1;
   Command command;
   char* command_str;
   StrConfig key_config;
   StrConfig value_config;
+  MixConfig mix;
+  // The scan command's bounds, besides its -key start. NULL for no end, and
+  // 0 for no limit.
+  const char* scan_end = NULL;
+  uint32_t scan_limit = 0;
 };
 
 void usage() {
-  fprintf(stderr, "bad usage\n");
-  // TODO
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tclient SERVER PORT [-rep N] [-k N] [-waitms N] [-seed1] [-verbose]\n"
+    "\t       [-compact] [-udp] [-priority high|normal] [-hist FILE]\n"
+    "\t       [-log-format rows|columns]\n"
+    "\t       [-shards N [-vnodes N] [-addshard N]]\n"
+    "\t       COMMAND [-key STR] [-value STR]\n"
+    "\t       [-workload a|b|c] [-reads FRAC] [-keys N] [-dist DIST]\n"
+    "\t       [-vsize SIZES] [-preload] [-end STR] [-limit N]\n"
+    "\n"
+    "Opens N (-rep) connections one after another to SERVER:PORT, and sends N (-k)\n"
+    "COMMANDs on each, waiting -waitms milliseconds after each response.\n"
+    "SERVER is an IPv4 address, or shm: for shared memory to a server on this host.\n"
+    "\n"
+    "-udp sends each RPC as a datagram to a server started with -udp, sending it\n"
+    "again if the response doesn't come within 5 ms, then 10 ms, and so on. Only\n"
+    "ping, read, write and mix can go over UDP, and neither can -compact or -shards.\n"
+    "Responses that don't fit in a datagram come back failed.\n"
+    "\n"
+    "-priority high has the server send the responses ahead of normal ones waiting\n"
+    "to go out, e.g. big reads on other connections. It has no effect with -shards.\n"
+    "\n"
+    "-log-format columns writes client.log in blocks of columns rather than 96-byte\n"
+    "rows. See log.h.\n"
+    "\n"
+    "-shards spreads the keys over N (-shards) ports from PORT up with consistent\n"
+    "hashing, -vnodes points per port (default 64), and sends each read or write to\n"
+    "its key's port. ping and quit go to the ports in turn. -addshard adds one more\n"
+    "port after N (-addshard) RPCs; reads fall back to a moved key's old port, and\n"
+    "mix copies its whole keyspace over right away. The ports of one server share a\n"
+    "keystore, so for shards that hold their own keys, run a server per port.\n"
+    "\n"
+    "COMMAND is one of ping, write, read, delete, quit, mix, scan or snapshot.\n"
+    "\n"
+    "STR is BASE [+] [PADLEN]. With +, the nth RPC of a connection uses BASE\n"
+    "incremented n times, e.g. kkkkk, kkkkl, kkkkm, ... Strings shorter than PADLEN\n"
+    "are padded to it with random characters, seeded with 1 if -seed1 is given.\n"
+    "\n"
+    "mix sends reads (a fraction -reads of the RPCs, default 0.5) and writes of\n"
+    "random keys. Key i of -keys N (default 100000) is the -key BASE incremented i\n"
+    "times (default %s). DIST picks keys:\n"
+    "\tuniform                     every key equally likely (the default)\n"
+    "\tzipf[:THETA]                Zipfian with exponent THETA (default 0.99)\n"
+    "\thotspot[:HOT_KEYS:HOT_OPS]  fraction HOT_OPS of RPCs (default 0.8) go to\n"
+    "\t                            fraction HOT_KEYS of keys (default 0.2)\n"
+    "SIZES picks written value lengths: LEN, MIN-MAX (uniform), or a weighted list\n"
+    "LEN@WEIGHT,LEN@WEIGHT,... The default is the -value length. -preload writes\n"
+    "every key once before the first connection's RPCs, untimed. -workload sets\n"
+    "YCSB's core mixes over a Zipfian: a is 50%% reads, b 95%%, c 100%%.\n"
+    "\n"
+    "scan lists up to -limit N keys (default all) from the -key STR up to but not\n"
+    "including -end STR (default no end), received in batches. -verbose prints\n"
+    "them. The latency is to the last batch.\n"
+    "\n"
+    "delete removes the -key STR, on a server with -engine lsm.\n"
+    "\n"
+    "snapshot has the server write its keystore to a file from a forked child, and\n"
+    "prints how long that took and how many pages were copied on write meanwhile.\n",
+    DEFAULT_MIX_KEY_BASE
+  );
+}
+
+// Parses "BASE [+] [PADLEN]" starting at argv[next_arg] into *config.
+//
+// Returns the index of the first argument after it.
+int parse_str_config(const int argc, char** const argv, int next_arg, StrConfig* const config) {
+  if (next_arg >= argc) usage(), exit(1);
+  config->base = argv[next_arg++];
+  config->padded_length = strlen(config->base);
+
+  if (next_arg < argc && strcmp(argv[next_arg], "+") == 0) {
+    config->increment_base = true;
+    ++next_arg;
+  }
+  if (next_arg < argc && argv[next_arg][0] != '-') {
+    char* end;
+    errno = 0;
+    const long padded_length = strtol(argv[next_arg], &end, 10);
+    if (errno != 0 || *end != '\0' || padded_length < 0) {
+      fprintf(stderr, "could not parse padded length from \"%s\"\n", argv[next_arg]);
+      usage();
+      exit(1);
+    }
+    if ((size_t) padded_length > config->padded_length) {
+      config->padded_length = padded_length;
+    }
+    ++next_arg;
+  }
+  return next_arg;
+}
+
+// Returns how many distinct strings, base included, incrementing base gives
+// before it carries out of its run of trailing letters and digits (see
+// increment_str()), saturating at UINT64_MAX.
+uint64_t key_capacity(const char* const base) {
+  uint64_t capacity = 1;
+  uint64_t base_value = 0;
+  for (size_t i = strlen(base); i > 0; --i) {
+    const char c = base[i - 1];
+    uint64_t radix, digit;
+    if (c >= 'a' && c <= 'z') {
+      radix = 26; digit = c - 'a';
+    } else if (c >= 'A' && c <= 'Z') {
+      radix = 26; digit = c - 'A';
+    } else if (c >= '0' && c <= '9') {
+      radix = 10; digit = c - '0';
+    } else {
+      break;
+    }
+    if (capacity > UINT64_MAX / radix) return UINT64_MAX;
+    base_value += digit * capacity;
+    capacity *= radix;
+  }
+  return capacity - base_value;
 }
 
 Args parse_args(int argc, char** argv) {
@@ -76,6 +236,44 @@ Args parse_args(int argc, char** argv) {
       args.seed1 = true;
     } else if (strcmp("-verbose", argv[next_arg]) == 0) {
       args.verbose = true;
+    } else if (strcmp("-compact", argv[next_arg]) == 0) {
+      args.compact = true;
+    } else if (strcmp("-udp", argv[next_arg]) == 0) {
+      args.udp = true;
+    } else if (strcmp("-priority", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      if (strcmp(argv[next_arg+1], "high") == 0) {
+        args.priority = RpcPriority::High;
+      } else if (strcmp(argv[next_arg+1], "normal") != 0) {
+        usage();
+        exit(1);
+      }
+      ++next_arg;
+    } else if (strcmp("-shards", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.n_shards = atoi(argv[next_arg+1]);
+      ++next_arg;
+    } else if (strcmp("-vnodes", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.vnodes = atoi(argv[next_arg+1]);
+      ++next_arg;
+    } else if (strcmp("-addshard", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.add_shard_after = atoll(argv[next_arg+1]);
+      ++next_arg;
+    } else if (strcmp("-log-format", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      if (strcmp("columns", argv[next_arg+1]) == 0) {
+        args.log_format = LogFormat::Columns;
+      } else if (strcmp("rows", argv[next_arg+1]) != 0) {
+        fprintf(stderr, "-log-format must be rows or columns\n");
+        exit(1);
+      }
+      ++next_arg;
+    } else if (strcmp("-hist", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.hist_fn = argv[next_arg+1];
+      ++next_arg;
     } else {
       // This must be the command! We'll handle it and the other two flags
       // separately.
@@ -91,48 +289,84 @@ Args parse_args(int argc, char** argv) {
     args.command = Command::Write;
   } else if (strcmp(args.command_str, "read") == 0) {
     args.command = Command::Read;
+  } else if (strcmp(args.command_str, "delete") == 0) {
+    args.command = Command::Delete;
   } else if (strcmp(args.command_str, "quit") == 0) {
     args.command = Command::Quit;
+  } else if (strcmp(args.command_str, "mix") == 0) {
+    args.command = Command::Mix;
+  } else if (strcmp(args.command_str, "scan") == 0) {
+    args.command = Command::Scan;
+  } else if (strcmp(args.command_str, "snapshot") == 0) {
+    args.command = Command::Snapshot;
   } else {
     fprintf(stderr, "unrecognized command: \"%s\"\n", args.command_str);
     usage();
     exit(1);
   }
 
-  for (; next_arg < argc; ++next_arg) {
-    // TODO: factor out common logic.
+  while (next_arg < argc) {
     if (strcmp("-key", argv[next_arg]) == 0) {
+      next_arg = parse_str_config(argc, argv, next_arg + 1, &args.key_config);
+    } else if (strcmp("-value", argv[next_arg]) == 0) {
+      next_arg = parse_str_config(argc, argv, next_arg + 1, &args.value_config);
+    } else if (strcmp("-workload", argv[next_arg]) == 0) {
       if (next_arg+1 >= argc) usage(), exit(1);
-      args.key_config.base = argv[next_arg+1];
-      next_arg += 2;
-      if (next_arg < argc && strcmp(argv[next_arg], "+") == 0) {
-        args.key_config.increment_base = true;
-        ++next_arg;
-      }
-      if (next_arg < argc && argv[next_arg][0] != '-') {
-        args.key_config.padded_length = strtol(argv[next_arg+3], NULL, 10);
-        ++next_arg;
+      const char* const workload = argv[next_arg+1];
+      if (strcmp(workload, "a") == 0) {
+        args.mix.read_fraction = 0.5;
+      } else if (strcmp(workload, "b") == 0) {
+        args.mix.read_fraction = 0.95;
+      } else if (strcmp(workload, "c") == 0) {
+        args.mix.read_fraction = 1;
       } else {
-        args.key_config.padded_length = strlen(args.key_config.base);
+        fprintf(stderr, "unrecognized workload: \"%s\"\n", workload);
+        usage();
+        exit(1);
       }
-      --next_arg;
-      continue;
-    } else if (strcmp("-value", argv[next_arg]) == 0) {
+      args.mix.key_dist.kind = KeyDistKind::Zipfian;
+      next_arg += 2;
+    } else if (strcmp("-reads", argv[next_arg]) == 0) {
       if (next_arg+1 >= argc) usage(), exit(1);
-      args.value_config.base = argv[next_arg+1];
+      char* end;
+      args.mix.read_fraction = strtod(argv[next_arg+1], &end);
+      if (*end != '\0' || !(args.mix.read_fraction >= 0 && args.mix.read_fraction <= 1)) {
+        fprintf(stderr, "-reads expects a fraction from 0 to 1, got \"%s\"\n", argv[next_arg+1]);
+        exit(1);
+      }
       next_arg += 2;
-      if (next_arg < argc && strcmp(argv[next_arg], "+") == 0) {
-        args.value_config.increment_base = true;
-        ++next_arg;
+    } else if (strcmp("-keys", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.mix.key_dist.n_keys = strtoull(argv[next_arg+1], NULL, 10);
+      next_arg += 2;
+    } else if (strcmp("-dist", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      if (!parse_key_dist(argv[next_arg+1], &args.mix.key_dist)) {
+        fprintf(stderr, "could not parse key distribution \"%s\"\n", argv[next_arg+1]);
+        usage();
+        exit(1);
       }
-      if (next_arg < argc && argv[next_arg][0] != '-') {
-        args.value_config.padded_length = strtol(argv[next_arg+3], NULL, 10);
-        ++next_arg;
-      } else {
-        args.value_config.padded_length = strlen(args.value_config.base);
+      next_arg += 2;
+    } else if (strcmp("-vsize", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      if (!args.mix.value_sizes.parse(argv[next_arg+1])) {
+        fprintf(stderr, "could not parse value sizes \"%s\"\n", argv[next_arg+1]);
+        usage();
+        exit(1);
       }
-      --next_arg;
-      continue;
+      args.mix.value_sizes_given = true;
+      next_arg += 2;
+    } else if (strcmp("-preload", argv[next_arg]) == 0) {
+      args.mix.preload = true;
+      ++next_arg;
+    } else if (strcmp("-end", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.scan_end = argv[next_arg+1];
+      next_arg += 2;
+    } else if (strcmp("-limit", argv[next_arg]) == 0) {
+      if (next_arg+1 >= argc) usage(), exit(1);
+      args.scan_limit = strtoul(argv[next_arg+1], NULL, 10);
+      next_arg += 2;
     } else {
       fprintf(stderr, "unrecognized arg: %s\n", argv[next_arg]);
       usage();
@@ -141,6 +375,40 @@ Args parse_args(int argc, char** argv) {
   }
 
   // Done parsing, let's validate.
+  if (args.vnodes < 1) {
+    fprintf(stderr, "-vnodes must be positive\n");
+    exit(1);
+  }
+  if (args.udp) {
+    const bool udp_command = Command::Ping == args.command
+      || Command::Read == args.command
+      || Command::Write == args.command
+      || Command::Mix == args.command;
+    if (!udp_command || args.compact || args.n_shards > 0) {
+      fprintf(stderr, "-udp only works with ping, read, write and mix, without -compact or -shards\n");
+      exit(1);
+    }
+  }
+  if (args.add_shard_after >= 0 && args.n_shards == 0) {
+    fprintf(stderr, "-addshard needs -shards\n");
+    exit(1);
+  }
+  if (Command::Scan == args.command) {
+    if (args.n_shards > 0) {
+      fprintf(stderr, "scan can't span -shards\n");
+      exit(1);
+    }
+    if (NULL != args.scan_end && strlen(args.scan_end) > MAX_KEY_LEN) {
+      fprintf(stderr, "-end must be at most %zu bytes\n", MAX_KEY_LEN);
+      exit(1);
+    }
+    // Scan from the empty key, ie. the start, unless given one.
+    if (NULL == args.key_config.base) args.key_config.base = "";
+  }
+  if (Command::Delete == args.command && NULL == args.key_config.base) {
+    fprintf(stderr, "delete command expects -key arg\n");
+    exit(1);
+  }
   if (Command::Write == args.command) {
     bool fail = false;
     if (NULL == args.key_config.base) {
@@ -153,60 +421,385 @@ Args parse_args(int argc, char** argv) {
     }
     if (fail) exit(1);
   }
+  if (Command::Mix == args.command) {
+    if (args.mix.key_dist.n_keys < 2) {
+      fprintf(stderr, "mix command expects at least 2 -keys\n");
+      exit(1);
+    }
+    if (KeyDistKind::Zipfian == args.mix.key_dist.kind
+        && args.mix.key_dist.n_keys > KeyDist::MAX_ZIPFIAN_KEYS) {
+      fprintf(stderr, "zipf supports at most %lu -keys\n", KeyDist::MAX_ZIPFIAN_KEYS);
+      exit(1);
+    }
+    if (NULL == args.key_config.base) args.key_config.base = DEFAULT_MIX_KEY_BASE;
+    // Key i is always the base incremented i times, + or not.
+    args.key_config.increment_base = true;
+    if (key_capacity(args.key_config.base) < args.mix.key_dist.n_keys) {
+      fprintf(stderr, "key base \"%s\" can't count to %lu keys\n",
+              args.key_config.base, args.mix.key_dist.n_keys);
+      exit(1);
+    }
+  }
+  if (NULL == args.key_config.base) args.key_config.base = DEFAULT_STR_BASE;
+  if (NULL == args.value_config.base) args.value_config.base = DEFAULT_STR_BASE;
+  if (args.key_config.padded_length == 0) {
+    args.key_config.padded_length = strlen(args.key_config.base);
+  }
+  if (args.value_config.padded_length == 0) {
+    args.value_config.padded_length = strlen(args.value_config.base);
+  }
+  if (args.key_config.padded_length > MAX_KEY_LEN) {
+    fprintf(stderr, "keys must be at most %zu bytes\n", MAX_KEY_LEN);
+    exit(1);
+  }
+  if (Command::Mix == args.command) {
+    if (args.mix.value_sizes_given) {
+      if (args.mix.value_sizes.max() > args.value_config.padded_length) {
+        args.value_config.padded_length = args.mix.value_sizes.max();
+      }
+    } else {
+      args.mix.value_sizes = SizeDist(args.value_config.padded_length);
+    }
+  }
+  if (args.value_config.padded_length > MAX_VALUE_LEN) {
+    fprintf(stderr, "values must be at most %zu bytes\n", MAX_VALUE_LEN);
+    exit(1);
+  }
 
   return args;
 }
 
-// Produce the nth string according to the given StrConfig.
-void gen_str_direct(
-  const StrConfig* const config,
-  const int n,
-  size_t* const length,
-  char** const data
-) {
-  if (NULL == config->base) {
-    *length = 12;
-    *data = (char*)malloc(*length);
-    memcpy(*data, "foo bar baz", *length);
-    return;
+// Fills buf, which must hold config->padded_length bytes, with the base
+// string followed by random padding.
+//
+// Done once per run, so that producing each RPC's string with gen_str() only
+// rewrites the base.
+void gen_str_init(const StrConfig* const config, char* const buf) {
+  const size_t base_len = strlen(config->base);
+  memcpy(buf, config->base, base_len);
+  for (size_t i = base_len; i < config->padded_length; ++i) {
+    // Printable, so that the logged prefix of a body stays readable.
+    buf[i] = '!' + random() % ('~' - '!' + 1);
+  }
+}
+
+// Adds n to the run of characters at the end of buf that are all letters or
+// digits, treating each character as a digit within its own class, so that
+// kkkkk + 1 = kkkkl and az9 + 1 = ba0. Stops carrying at the first character
+// that isn't a letter or digit.
+void increment_str(char* const buf, const size_t len, uint64_t n) {
+  for (size_t i = len; i > 0 && n > 0; --i) {
+    char& c = buf[i - 1];
+    char first;
+    int radix;
+    if (c >= 'a' && c <= 'z') {
+      first = 'a'; radix = 26;
+    } else if (c >= 'A' && c <= 'Z') {
+      first = 'A'; radix = 26;
+    } else if (c >= '0' && c <= '9') {
+      first = '0'; radix = 10;
+    } else {
+      break;
+    }
+    const uint64_t digit = (c - first) + n;
+    c = first + digit % radix;
+    n = digit / radix;
   }
-  // TODO: full gen logic include increment and padlen.
-  *length = strlen(config->base);
-  *data = (char*)malloc(*length);
-  memcpy(*data, config->base, *length);
 }
 
-// Produce the nth string according to the given StrConfig.
-LenStr gen_str(const StrConfig* const config, const int n) {
-  size_t length;
-  char* data;
-  gen_str_direct(config, n, &length, &data);
-  return LenStr(length, data);
+// Rewrites buf, which gen_str_init() has already filled, to hold the nth
+// string according to the given StrConfig. The padding is left as is.
+//
+// Returns the length of the string.
+size_t gen_str(const StrConfig* const config, const uint64_t n, char* const buf) {
+  if (config->increment_base) {
+    const size_t base_len = strlen(config->base);
+    memcpy(buf, config->base, base_len);
+    increment_str(buf, base_len, n);
+  }
+  return config->padded_length;
 }
 
 const char* const log_fn = "client.log";
 
+// Where RPCs go: over one connection, or if shards isn't NULL, to the
+// endpoint that owns the key, or if udp isn't NULL, in datagrams.
+struct Target {
+  Connection* connection;
+  ShardedClient* shards;
+  UdpClient* udp;
+};
+
+void print_snapshot_result(const RPCMessage* const response) {
+  SnapshotResult result;
+  if (response->header.status != RpcStatus::Ok || response->mark.data_len != sizeof(result)) {
+    printf("snapshot failed: %s\n", status_str(response->header.status));
+    return;
+  }
+  memcpy(&result, response->body, sizeof(result));
+  printf(
+    "snapshot of %lu keys, %.1f MiB in %.3f ms, fork %.3f ms, "
+    "%lu pages (%.1f MiB) copied on write\n",
+    result.n_keys,
+    result.n_bytes / (1024.0 * 1024),
+    result.duration_us / 1e3,
+    result.fork_us / 1e3,
+    result.cow_pages,
+    result.cow_pages * sysconf(_SC_PAGESIZE) / (1024.0 * 1024)
+  );
+}
+
+// Sends a request and waits for its response, logging both. A sharded ping or
+// quit goes to endpoint seq, modulo the number of endpoints.
+//
+// Returns the round trip time in nanoseconds, from just before the request is
+// sent to just after the whole response is in.
+uint64_t call(
+  const Target& target,
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const char* const method,
+  const uint64_t seq,
+  const int log_fd,
+  const bool verbose,
+  RPCMessage* const response
+) {
+  const uint64_t start_ns = now_nsec();
+  if (NULL != target.shards) {
+    ShardedClient* const shards = target.shards;
+    int result;
+    if (strcmp(method, "read") == 0) {
+      result = shards->read((const char*) body, n_bytes, response);
+    } else if (strcmp(method, "delete") == 0) {
+      result = shards->call(shards->owner((const char*) body, n_bytes), body, n_bytes, method, response);
+    } else if (strcmp(method, "write") == 0) {
+      result = shards->write((WriteRequest*) body, response);
+    } else {
+      result = shards->call(seq % shards->n_endpoints(), body, n_bytes, method, response);
+    }
+    if (-1 == result) {
+      fprintf(stderr, "failed to call %s on a shard: %m\n", method);
+      exit(1);
+    }
+  } else if (NULL != target.udp) {
+    if (-1 == udp_call(target.udp, body, n_bytes, method, log_fd, response)) {
+      fprintf(stderr, "failed to call %s over UDP: %m\n", method);
+      exit(1);
+    }
+  } else {
+    rpc_send_req(target.connection, body, n_bytes, /*parent_rpc=*/0, method, log_fd);
+    if (-1 == rpc_recv_resp(target.connection, response)) {
+      fprintf(stderr, "failed to receive the response: %m\n");
+      exit(1);
+    }
+  }
+  const uint64_t latency_ns = now_nsec() - start_ns;
+  // The others log their own responses.
+  if (NULL == target.shards && NULL == target.udp) log(log_fd, response);
+  if (verbose) response->pretty_print();
+  if (strcmp(method, "snapshot") == 0) print_snapshot_result(response);
+  rpc_free_body(response);
+  return latency_ns;
+}
+
+// Sends a scan request and receives its batches of keys, logging each. The
+// last batch's response is left in *response, with its body freed.
+//
+// Returns the time in nanoseconds from just before the request is sent to
+// just after the last batch is in.
+uint64_t scan(
+  Connection* const connection,
+  ScanRequest* const request,
+  const int log_fd,
+  const bool verbose,
+  RPCMessage* const response
+) {
+  const uint64_t start_ns = now_nsec();
+  rpc_send_req(connection, (uint8_t*) request, request->full_len(), /*parent_rpc=*/0, "scan", log_fd);
+  uint64_t n_keys = 0;
+  uint64_t n_batches = 0;
+  bool last = false;
+  while (!last) {
+    if (-1 == rpc_recv_resp(connection, response)) {
+      fprintf(stderr, "failed to receive the response: %m\n");
+      exit(1);
+    }
+    log(log_fd, response);
+    ++n_batches;
+    const uint8_t* const body = response->body;
+    const size_t len = response->mark.data_len;
+    if (response->header.status != RpcStatus::Ok || len == 0) {
+      fprintf(stderr, "scan failed with status %d\n", (int) response->header.status);
+      exit(1);
+    }
+    last = body[0] & SCAN_LAST_BATCH;
+    for (size_t at = 1; at < len; at += 1 + body[at]) {
+      if (at + 1 + body[at] > len) {
+        fprintf(stderr, "scan batch is truncated\n");
+        exit(1);
+      }
+      if (verbose) printf("%.*s\n", (int) body[at], body + at + 1);
+      ++n_keys;
+    }
+    rpc_free_body(response);
+  }
+  const uint64_t latency_ns = now_nsec() - start_ns;
+  printf("scanned %lu keys in %lu batches\n", n_keys, n_batches);
+  return latency_ns;
+}
+
+// Writes every key in the mix's keyspace once, with values of the mix's sizes.
+void preload(
+  const Target& target,
+  const Args& args,
+  WriteRequest* const write_req,
+  Rng* const rng,
+  const int log_fd
+) {
+  const uint64_t start_ns = now_nsec();
+  for (uint64_t key = 0; key < args.mix.key_dist.n_keys; ++key) {
+    gen_str(&args.key_config, key, write_req->key());
+    WriteRequest::Init(write_req, args.key_config.padded_length, args.mix.value_sizes.draw(rng));
+    RPCMessage response;
+    call(target, (uint8_t*) write_req, write_req->full_len(), "write", key, log_fd, false, &response);
+  }
+  printf(
+    "preloaded %lu keys in %.3f s\n",
+    args.mix.key_dist.n_keys,
+    (now_nsec() - start_ns) / 1e9
+  );
+}
+
+// Opens a sharded client over the first n_shards ports from args.port.
+ShardedClient* open_shards(const Args& args, const uint32_t n_shards, const int log_fd) {
+  ShardedClient* const shards = new ShardedClient(args.vnodes, args.compact, log_fd);
+  for (uint32_t i = 0; i < n_shards; ++i) {
+    if (-1 == shards->add_endpoint(args.server, args.port + i)) {
+      fprintf(stderr, "failed to connect to %s:%d: %m\n", args.server, args.port + i);
+      exit(1);
+    }
+  }
+  return shards;
+}
+
+// Adds the next port to shards, and copies the mix's keys that moved to it.
+void add_shard(const Args& args, ShardedClient* const shards, char* const key_buf) {
+  const uint16_t port = args.port + shards->n_endpoints();
+  if (-1 == shards->add_endpoint(args.server, port)) {
+    fprintf(stderr, "failed to connect to %s:%d: %m\n", args.server, port);
+    exit(1);
+  }
+  if (Command::Mix != args.command) {
+    printf("added shard %s:%d\n", args.server, port);
+    return;
+  }
+
+  const uint64_t start_ns = now_nsec();
+  uint64_t n_moved = 0;
+  for (uint64_t key = 0; key < args.mix.key_dist.n_keys; ++key) {
+    const size_t key_len = gen_str(&args.key_config, key, key_buf);
+    const int moved = shards->migrate(key_buf, key_len);
+    if (-1 == moved) {
+      fprintf(stderr, "failed to migrate a key: %m\n");
+      exit(1);
+    }
+    n_moved += moved;
+  }
+  printf(
+    "added shard %s:%d, moved %lu of %lu keys (%.1f%%) in %.3f s\n",
+    args.server,
+    port,
+    n_moved,
+    args.mix.key_dist.n_keys,
+    100.0 * n_moved / args.mix.key_dist.n_keys,
+    (now_nsec() - start_ns) / 1e9
+  );
+}
+
 int main(int argc, char** argv) {
   Args args = parse_args(argc, argv);
 
   // Open logfile.
-  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
-  int log_fd = creat(log_fn, RW_MODE);
+  int log_fd = log_open(log_fn, args.log_format);
   if (-1 == log_fd) {
     fprintf(stderr, "failed to open log file \"%s\": %m\n", log_fn);
     exit(1);
   }
 
+  // Every RPC's body is built in one of these buffers, which are allocated and
+  // padded once up front, so that the client doesn't spend time (and skew
+  // the latencies it measures) allocating and filling a body per RPC.
+  srandom(args.seed1 ? 1 : time(NULL));
+  char* const key_buf = (char*) malloc(args.key_config.padded_length);
+  char* const value_buf = (char*) malloc(args.value_config.padded_length);
+  gen_str_init(&args.key_config, key_buf);
+  gen_str_init(&args.value_config, value_buf);
+  WriteRequest* const write_req = WriteRequest::Init(
+    malloc(sizeof(WriteRequest) + args.key_config.padded_length + args.value_config.padded_length),
+    args.key_config.padded_length,
+    args.value_config.padded_length
+  );
+  memcpy(write_req->key(), key_buf, args.key_config.padded_length);
+  memcpy(write_req->value(), value_buf, args.value_config.padded_length);
+  const size_t scan_end_len = NULL == args.scan_end ? 0 : strlen(args.scan_end);
+  ScanRequest* const scan_req = ScanRequest::Init(
+    malloc(sizeof(ScanRequest) + args.key_config.padded_length + scan_end_len),
+    args.key_config.padded_length,
+    scan_end_len,
+    NULL != args.scan_end,
+    args.scan_limit
+  );
+  memcpy(scan_req->start(), key_buf, args.key_config.padded_length);
+  if (NULL != args.scan_end) memcpy(scan_req->end(), args.scan_end, scan_end_len);
+
+  // Round-trip time of every RPC, in nanoseconds, and for the mix command,
+  // of its reads and writes separately.
+  LatencyHistogram* latencies = new LatencyHistogram();
+  LatencyHistogram* read_latencies = new LatencyHistogram();
+  LatencyHistogram* write_latencies = new LatencyHistogram();
+
+  // The mix's choices come from their own generator, so that -seed1 repeats
+  // the same sequence of RPCs.
+  Rng rng(args.seed1 ? 1 : time(NULL) ^ ((uint64_t) getpid() << 32));
+  const KeyDist* const key_dist =
+    Command::Mix == args.command ? new KeyDist(args.mix.key_dist) : NULL;
+
+  // With -shards, each RPC counts toward -addshard, and how many went to each
+  // port is printed at the end.
+  uint64_t n_rpcs = 0;
+  uint32_t n_shards = args.n_shards;
+  std::vector<uint64_t> rpcs_per_shard;
+  // With -udp, how many requests were sent again.
+  uint64_t n_retransmits = 0;
+  // Responses by status, to count the ones that weren't OK, e.g. a backup's
+  // STALE reads.
+  uint64_t n_by_status[16] = {};
+
   for (unsigned int i = 0; i < args.n_conns; ++i) {
     Connection connection;
-    if (-1 == tcp_connect(args.server, args.port, &connection)) {
+    ShardedClient* shards = NULL;
+    UdpClient* udp = NULL;
+    if (n_shards > 0) {
+      shards = open_shards(args, n_shards, log_fd);
+    } else if (args.udp) {
+      udp = new UdpClient();
+      if (-1 == udp_connect(args.server, args.port, &udp->connection)) {
+        fprintf(stderr, "failed to open a UDP socket to %s:%d: %m\n", args.server, args.port);
+        exit(1);
+      }
+      connection = udp->connection;
+    } else if (-1 == net_connect(args.server, args.port, &connection)) {
       char* errstr = strerror(errno);
       fprintf(stderr, "failed to connect to %s:%d: %s\n",
               args.server, args.port, errstr);
       exit(1);
     }
 
-    if (args.verbose) {
+    connection.priority = (uint8_t) args.priority;
+    if (NULL != udp) udp->connection.priority = connection.priority;
+    const Target target = {&connection, shards, udp};
+
+    if (args.verbose && NULL == shards) {
       printf(
         "client connected from %d.%d.%d.%d:%d to %d.%d.%d.%d:%d\n",
         (connection.client_ip & 0xff000000) >> 24,
@@ -222,31 +815,68 @@ int main(int argc, char** argv) {
       );
     }
 
+    if (NULL == shards && args.compact && -1 == rpc_negotiate_compact(&connection, log_fd)) {
+      fprintf(stderr, "server refused the compact wire format\n");
+      exit(1);
+    }
+
+    if (Command::Mix == args.command && args.mix.preload && i == 0) {
+      preload(target, args, write_req, &rng, log_fd);
+    }
+
     for (unsigned int j = 0; j < args.rpcs_per_conn; ++j) {
-      uint8_t* body = NULL;
+      if (NULL != shards && (int64_t) n_rpcs == args.add_shard_after) {
+        add_shard(args, shards, key_buf);
+        n_shards = shards->n_endpoints();
+      }
+      ++n_rpcs;
+
+      const uint8_t* body = NULL;
       size_t n_bytes = 0;
+      const char* method = args.command_str;
+      LatencyHistogram* op_latencies = NULL;
       switch (args.command) {
         case Command::Ping:
-          gen_str_direct(&args.value_config, j, &n_bytes, (char**)&body);
+          n_bytes = gen_str(&args.value_config, j, value_buf);
+          body = (uint8_t*) value_buf;
           break;
 
         case Command::Quit:
+        case Command::Snapshot:
           break;
 
-        case Command::Write: {
-          LenStr key   = gen_str(&args.key_config,   j); // TODO
-          LenStr value = gen_str(&args.value_config, j);
-          const auto write_req = WriteRequest::Make(
-            key.data,   key.length,
-            value.data, value.length
-          );
+        case Command::Write:
+          gen_str(&args.key_config,   j, write_req->key());
+          gen_str(&args.value_config, j, write_req->value());
           body = (uint8_t*) write_req;
           n_bytes = write_req->full_len();
           break;
-        }
 
-        case Command::Read: {
-          gen_str_direct(&args.key_config, j, &n_bytes, (char**)&body);
+        case Command::Read:
+        case Command::Delete:
+          n_bytes = gen_str(&args.key_config, j, key_buf);
+          body = (uint8_t*) key_buf;
+          break;
+
+        case Command::Scan:
+          gen_str(&args.key_config, j, scan_req->start());
+          break;
+
+        case Command::Mix: {
+          const uint64_t key = key_dist->draw(&rng);
+          if (rng.uniform() < args.mix.read_fraction) {
+            method = "read";
+            n_bytes = gen_str(&args.key_config, key, key_buf);
+            body = (uint8_t*) key_buf;
+            op_latencies = read_latencies;
+          } else {
+            method = "write";
+            gen_str(&args.key_config, key, write_req->key());
+            WriteRequest::Init(write_req, args.key_config.padded_length, args.mix.value_sizes.draw(&rng));
+            body = (uint8_t*) write_req;
+            n_bytes = write_req->full_len();
+            op_latencies = write_latencies;
+          }
           break;
         }
 
@@ -254,17 +884,13 @@ int main(int argc, char** argv) {
           fprintf(stderr, "unrecognized command: \"%s\"\n", args.command_str);
           exit(1);
       }
-      rpc_send_req(&connection, body, n_bytes, /*parent_rpc=*/0, args.command_str, log_fd);
-      free(body);
-
       RPCMessage response;
-      if (-1 == rpc_recv_resp(&connection, &response)) {
-        fprintf(stderr, "failed to receive the response: %m\n");
-        exit(1);
-      }
-      log(log_fd, &response);
-      if (args.verbose) response.pretty_print();
-      free(response.body);
+      const uint64_t latency_ns = Command::Scan == args.command
+        ? scan(&connection, scan_req, log_fd, args.verbose, &response)
+        : call(target, body, n_bytes, method, j, log_fd, args.verbose, &response);
+      latencies->record(latency_ns);
+      if (NULL != op_latencies) op_latencies->record(latency_ns);
+      ++n_by_status[(uint32_t) response.header.status % 16];
 
       uint64_t now;
       do {
@@ -275,7 +901,42 @@ int main(int argc, char** argv) {
       } while (now - response.header.res_recv_time_us < args.wait_ms * 1000);
     }
 
-    close(connection.sock_fd);
+    if (NULL != shards) {
+      rpcs_per_shard.resize(shards->n_endpoints());
+      for (size_t k = 0; k < shards->n_endpoints(); ++k) rpcs_per_shard[k] += shards->n_rpcs(k);
+      delete shards;
+    } else if (NULL != udp) {
+      n_retransmits += udp->n_retransmits;
+      udp_close(udp);
+    } else {
+      conn_close(&connection);
+    }
+  }
+
+  for (size_t k = 0; k < rpcs_per_shard.size(); ++k) {
+    printf("shard %s:%zu: %lu rpcs\n", args.server, args.port + k, rpcs_per_shard[k]);
+  }
+  if (args.udp) printf("%lu requests sent again\n", n_retransmits);
+  for (uint32_t status = 1; status < 16; ++status) {
+    if (n_by_status[status] == 0) continue;
+    printf("%lu responses %s\n", n_by_status[status], status_str((RpcStatus) status));
+  }
+
+  if (Command::Mix == args.command) {
+    printf("reads: ");
+    read_latencies->print(stdout, 1000, "us");
+    printf("writes: ");
+    write_latencies->print(stdout, 1000, "us");
+    printf("all: ");
+  }
+  latencies->print(stdout, 1000, "us");
+  if (-1 == log_close(log_fd)) {
+    fprintf(stderr, "failed to write log file \"%s\": %m\n", log_fn);
+    exit(1);
+  }
+  if (NULL != args.hist_fn && !latencies->save(args.hist_fn)) {
+    fprintf(stderr, "failed to save histogram to \"%s\": %m\n", args.hist_fn);
+    exit(1);
   }
 
   return 0;
@@ -0,0 +1,327 @@
+#include "coro_rpc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace {
+
+// Frames are pooled in classes of FRAME_CLASS_LEN bytes, up to
+// FRAME_MAX_POOLED_LEN. A freed frame's first bytes link it into its class's
+// free list.
+constexpr size_t FRAME_CLASS_LEN = 64;
+constexpr size_t FRAME_MAX_POOLED_LEN = 4096;
+constexpr size_t N_FRAME_CLASSES = FRAME_MAX_POOLED_LEN / FRAME_CLASS_LEN;
+
+struct FreeFrame {
+  FreeFrame* next;
+};
+
+struct FramePool {
+  FreeFrame* free[N_FRAME_CLASSES];
+  CoroFrameStats stats;
+};
+
+thread_local FramePool frame_pool;
+
+size_t frame_class(const size_t n_bytes) {
+  return (n_bytes + FRAME_CLASS_LEN - 1) / FRAME_CLASS_LEN - 1;
+}
+
+}  // namespace
+
+void* coro_frame_alloc(const size_t n_bytes) {
+  if (n_bytes > FRAME_MAX_POOLED_LEN) return malloc(n_bytes);
+  const size_t i = frame_class(n_bytes);
+  FreeFrame* const frame = frame_pool.free[i];
+  if (NULL != frame) {
+    frame_pool.free[i] = frame->next;
+    ++frame_pool.stats.n_reused;
+    return frame;
+  }
+  ++frame_pool.stats.n_allocated;
+  return malloc((i + 1) * FRAME_CLASS_LEN);
+}
+
+void coro_frame_free(void* const frame, const size_t n_bytes) {
+  if (n_bytes > FRAME_MAX_POOLED_LEN) {
+    free(frame);
+    return;
+  }
+  const size_t i = frame_class(n_bytes);
+  FreeFrame* const free_frame = (FreeFrame*) frame;
+  free_frame->next = frame_pool.free[i];
+  frame_pool.free[i] = free_frame;
+}
+
+CoroFrameStats coro_frame_stats() { return frame_pool.stats; }
+
+bool RpcCall::await_suspend(const std::coroutine_handle<> awaiter) {
+  awaiter_ = awaiter;
+  return conn_->start(this);
+}
+
+RpcLoop* RpcLoop::Open() {
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == epoll_fd) return NULL;
+  RpcLoop* const loop = new RpcLoop();
+  loop->epoll_fd_ = epoll_fd;
+  return loop;
+}
+
+RpcLoop::~RpcLoop() {
+  resume_ready();
+  close(epoll_fd_);
+}
+
+void RpcLoop::drain() {
+  resume_ready();
+  while (any_in_flight()) poll();
+}
+
+bool RpcLoop::any_in_flight() const {
+  for (const RpcConn* const conn : conns_) {
+    if (!conn->in_flight_.empty()) return true;
+  }
+  return false;
+}
+
+void RpcLoop::poll() {
+  resume_ready();
+  if (!any_in_flight()) {
+    // Only a response can resume the task, and none is coming.
+    fprintf(stderr, "RpcLoop: the task is waiting on something other than a call\n");
+    abort();
+  }
+
+  constexpr int MAX_EVENTS = 64;
+  epoll_event events[MAX_EVENTS];
+  const int n_events = epoll_wait(epoll_fd_, events, MAX_EVENTS, -1);
+  if (-1 == n_events) {
+    if (EINTR == errno) return;
+    // The loop can't wait for anything any more, so fail every call.
+    const int error = errno;
+    for (RpcConn* const conn : conns_) conn->fail(error);
+    resume_ready();
+    return;
+  }
+  for (int i = 0; i < n_events; ++i) {
+    RpcConn* const conn = (RpcConn*) events[i].data.ptr;
+    if (0 != conn->failed_) continue;
+    if ((events[i].events & EPOLLOUT) && -1 == conn->flush()) {
+      conn->fail(errno);
+      continue;
+    }
+    if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && -1 == conn->receive()) {
+      conn->fail(0 == errno ? ECONNRESET : errno);
+    }
+  }
+  resume_ready();
+}
+
+void RpcLoop::resume_ready() {
+  // Resumed calls may make more calls ready, e.g. by closing a connection,
+  // which go on the end.
+  for (size_t i = 0; i < ready_.size(); ++i) ready_[i]->awaiter_.resume();
+  ready_.clear();
+}
+
+RpcConn* RpcConn::Open(
+  RpcLoop* const loop,
+  const char* const server,
+  const int port,
+  const uint32_t window,
+  const bool compact,
+  const int log_fd
+) {
+  if (0 == window) {
+    errno = EINVAL;
+    return NULL;
+  }
+  RpcConn* const conn = new RpcConn();
+  conn->log_fd_ = log_fd;
+  conn->window_ = window;
+  conn->in_flight_.reserve(window);
+  if (-1 == tcp_connect(server, port, &conn->connection_)) {
+    delete conn;
+    return NULL;
+  }
+  if (compact && -1 == rpc_negotiate_compact(&conn->connection_, log_fd)) {
+    const int error = errno;
+    conn_close(&conn->connection_);
+    delete conn;
+    errno = error;
+    return NULL;
+  }
+
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if (-1 == epoll_ctl(loop->epoll_fd_, EPOLL_CTL_ADD, conn->connection_.sock_fd, &event)) {
+    const int error = errno;
+    conn_close(&conn->connection_);
+    delete conn;
+    errno = error;
+    return NULL;
+  }
+  conn->loop_ = loop;
+  loop->conns_.push_back(conn);
+  return conn;
+}
+
+RpcConn::~RpcConn() {
+  // Not connected yet, if Open() failed.
+  if (NULL == loop_) return;
+  fail(ECONNABORTED);
+  epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_DEL, connection_.sock_fd, NULL);
+  std::vector<RpcConn*>& conns = loop_->conns_;
+  for (size_t i = 0; i < conns.size(); ++i) {
+    if (conns[i] == this) {
+      conns[i] = conns.back();
+      conns.pop_back();
+      break;
+    }
+  }
+  conn_close(&connection_);
+}
+
+bool RpcConn::start(RpcCall* const call) {
+  if (0 != failed_) {
+    call->response_.error_ = failed_;
+    return false;
+  }
+  if (in_flight_.size() < window_) {
+    if (-1 == send(call)) {
+      // The calls already in flight are resumed by the loop, as this one's
+      // awaiter hasn't let go of the thread yet.
+      fail(errno);
+      call->response_.error_ = failed_;
+      return false;
+    }
+    return true;
+  }
+
+  call->next_ = NULL;
+  if (NULL == waiting_tail_) {
+    waiting_head_ = call;
+  } else {
+    waiting_tail_->next_ = call;
+  }
+  waiting_tail_ = call;
+  if (++n_waiting_ > max_waiting_) max_waiting_ = n_waiting_;
+  return true;
+}
+
+int RpcConn::send(RpcCall* const call) {
+  RPCMessage request;
+  if (-1 == rpc_fill_req(&connection_, call->n_bytes_, /*parent_rpc=*/0, call->method_, &request)) return -1;
+  uint8_t head[RPC_HEAD_MAX_LEN];
+  const size_t head_len = rpc_encode_head(&connection_, &request, head);
+
+  // Behind requests that are still buffered, this one has to wait its turn.
+  size_t n_sent = 0;
+  if (out_start_ == out_.size()) {
+    const iovec iov[2] = {
+      {head, head_len},
+      {(void*) call->body_, call->n_bytes_},
+    };
+    const ssize_t n = conn_try_writev(&connection_, iov, 2, false);
+    if (-1 == n) return -1;
+    n_sent = n;
+  }
+  if (n_sent < head_len) out_.insert(out_.end(), head + n_sent, head + head_len);
+  const size_t body_sent = n_sent > head_len ? n_sent - head_len : 0;
+  out_.insert(out_.end(), call->body_ + body_sent, call->body_ + call->n_bytes_);
+  if (out_start_ < out_.size() && -1 == watch_writable(true)) return -1;
+
+  if (log_fd_ >= 0) {
+    request.body = (uint8_t*) call->body_;
+    log(log_fd_, &request);
+  }
+  call->rpc_id_ = request.header.rpc_id;
+  in_flight_.push_back(call);
+  ++n_calls_;
+  return 0;
+}
+
+int RpcConn::flush() {
+  if (out_start_ < out_.size()) {
+    const iovec iov = {out_.data() + out_start_, out_.size() - out_start_};
+    const ssize_t n = conn_try_writev(&connection_, &iov, 1, false);
+    if (-1 == n) return -1;
+    out_start_ += n;
+  }
+  if (out_start_ < out_.size()) return 0;
+  out_.clear();
+  out_start_ = 0;
+  return watch_writable(false);
+}
+
+int RpcConn::receive() {
+  // The socket is readable, so the first read won't block, and the rest only
+  // finish messages whose beginnings are buffered already.
+  errno = 0;
+  do {
+    RpcResponse response;
+    if (-1 == rpc_recv_resp(&connection_, &response.message_)) return -1;
+    if (log_fd_ >= 0) log(log_fd_, &response.message_);
+    size_t i = 0;
+    while (i < in_flight_.size() && in_flight_[i]->rpc_id_ != response.message_.header.rpc_id) ++i;
+    // Not a response to anything called, so there's no one to give it to.
+    if (i == in_flight_.size()) continue;
+
+    RpcCall* const call = in_flight_[i];
+    in_flight_[i] = in_flight_.back();
+    in_flight_.pop_back();
+    response.error_ = 0;
+    call->response_ = std::move(response);
+    loop_->ready_.push_back(call);
+  } while (conn_n_buffered(&connection_) > 0);
+  return refill();
+}
+
+int RpcConn::refill() {
+  while (NULL != waiting_head_ && in_flight_.size() < window_) {
+    RpcCall* const call = waiting_head_;
+    waiting_head_ = call->next_;
+    if (NULL == waiting_head_) waiting_tail_ = NULL;
+    --n_waiting_;
+    if (-1 == send(call)) {
+      // Not in flight, nor waiting, so it has to be failed here.
+      call->response_.error_ = errno;
+      loop_->ready_.push_back(call);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void RpcConn::fail(const int error) {
+  if (0 == failed_) failed_ = error;
+  for (RpcCall* const call : in_flight_) {
+    call->response_.error_ = failed_;
+    loop_->ready_.push_back(call);
+  }
+  in_flight_.clear();
+  for (RpcCall* call = waiting_head_; NULL != call; call = call->next_) {
+    call->response_.error_ = failed_;
+    loop_->ready_.push_back(call);
+  }
+  waiting_head_ = waiting_tail_ = NULL;
+  n_waiting_ = 0;
+  out_.clear();
+  out_start_ = 0;
+}
+
+int RpcConn::watch_writable(const bool writable) {
+  if (writable == watching_writable_) return 0;
+  epoll_event event = {};
+  event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+  event.data.ptr = this;
+  if (-1 == epoll_ctl(loop_->epoll_fd_, EPOLL_CTL_MOD, connection_.sock_fd, &event)) return -1;
+  watching_writable_ = writable;
+  return 0;
+}
@@ -0,0 +1,512 @@
+#pragma once
+
+// A coroutine client API, for issuing many RPCs at once from one thread.
+//
+// Each call is a coroutine that co_awaits conn->call(method, body), and gets
+// the response back as the value of the co_await:
+//
+//   Task<size_t> value_len(RpcConn* conn, std::string_view key) {
+//     RpcResponse response = co_await conn->call("read", key);
+//     co_return response.ok() ? response.body_len() : 0;
+//   }
+//
+// The calls of a thread share one RpcLoop, which runs a top-level Task to
+// completion with run(). While the task waits, the loop waits in epoll for
+// responses on all of its connections, and resumes each call whose response
+// has come. when_all() and when_any() run several tasks at once.
+//
+// A connection sends a call's request as soon as it is awaited, unless it
+// already has window calls in flight, in which case the call waits its turn
+// in a queue. Requests that don't fit in the socket right away are buffered
+// and sent as it drains, so the loop never blocks on a send. A response that
+// has started arriving is read to its end before the loop moves on.
+//
+// Responses are matched to calls by rpc_id, so they may come in any order.
+// An RPC that is answered with several responses, like scan, can't be called
+// this way.
+//
+// Task frames come from a per-thread pool of recycled ones, and a waiting
+// call is linked into its connection's queue through its own frame, so that
+// once the pool has warmed up, calls cost no allocation.
+//
+// Needs C++20. Everything here is single-threaded: a loop, its connections
+// and its tasks belong to the thread that made the loop.
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <coroutine>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "network.h"
+#include "rpc.h"
+
+// Allocates and frees coroutine frames from the calling thread's pool, which
+// keeps freed frames by size to hand out again. Frames bigger than the pool
+// handles come from malloc().
+void* coro_frame_alloc(size_t n_bytes);
+void coro_frame_free(void* frame, size_t n_bytes);
+
+// Frames the calling thread's pool has got from malloc(), and those it has
+// handed out again.
+struct CoroFrameStats {
+  uint64_t n_allocated;
+  uint64_t n_reused;
+};
+
+CoroFrameStats coro_frame_stats();
+
+template <typename T>
+class Task;
+
+namespace coro_detail {
+
+struct PromiseBase {
+  // Resumed when the task finishes: the coroutine that awaited it.
+  std::coroutine_handle<> continuation;
+
+  static void* operator new(const size_t n_bytes) { return coro_frame_alloc(n_bytes); }
+  static void operator delete(void* const frame, const size_t n_bytes) { coro_frame_free(frame, n_bytes); }
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(const std::coroutine_handle<Promise> done) noexcept {
+      const std::coroutine_handle<> continuation = done.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  // Nothing here throws on purpose, so an exception is a bug.
+  void unhandled_exception() { abort(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  template <typename U>
+  void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+  T result() { return std::move(*value); }
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+  void result() {}
+};
+
+}  // namespace coro_detail
+
+// A coroutine that returns a T. It starts when it is first awaited, or run()
+// by an RpcLoop, and its frame is freed with the Task.
+template <typename T = void>
+class Task {
+public:
+  using promise_type = coro_detail::Promise<T>;
+
+  Task() = default;
+  explicit Task(const std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+  Task(Task&& other) : handle_(std::exchange(other.handle_, nullptr)) {}
+  Task& operator=(Task&& other) {
+    if (this != &other) {
+      if (handle_) handle_.destroy();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if (handle_) handle_.destroy();
+  }
+
+  bool done() const { return handle_.done(); }
+
+  // Awaiting a task runs it until it suspends, and resumes the awaiter once
+  // it has returned.
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(const std::coroutine_handle<> awaiter) {
+    handle_.promise().continuation = awaiter;
+    return handle_;
+  }
+  T await_resume() { return handle_.promise().result(); }
+
+private:
+  friend class RpcLoop;
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+Task<T> coro_detail::Promise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> coro_detail::Promise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// The response to a call, which owns its body.
+class RpcResponse {
+public:
+  RpcResponse() = default;
+  RpcResponse(RpcResponse&& other) : message_(other.message_), error_(other.error_) {
+    other.message_.body = NULL;
+    other.message_.chunk = NULL;
+  }
+  RpcResponse& operator=(RpcResponse&& other) {
+    if (this != &other) {
+      rpc_free_body(&message_);
+      message_ = other.message_;
+      error_ = other.error_;
+      other.message_.body = NULL;
+      other.message_.chunk = NULL;
+    }
+    return *this;
+  }
+  RpcResponse(const RpcResponse&) = delete;
+  RpcResponse& operator=(const RpcResponse&) = delete;
+  ~RpcResponse() { rpc_free_body(&message_); }
+
+  // False if no response came, because the connection failed or was closed.
+  bool ok() const { return 0 == error_; }
+  // If not ok(), the errno of the failure.
+  int error() const { return error_; }
+
+  const RPCMessage& message() const { return message_; }
+  RpcStatus status() const { return message_.header.status; }
+  const uint8_t* body() const { return message_.body; }
+  size_t body_len() const { return message_.mark.data_len; }
+
+private:
+  friend class RpcConn;
+
+  RPCMessage message_ = {};
+  int error_ = ECONNABORTED;
+};
+
+class RpcConn;
+
+// What conn->call() returns, to be co_awaited right away. The request goes
+// out from await_suspend(), so body has to stay put until the call returns,
+// which it does, in the awaiting coroutine's frame.
+class RpcCall {
+public:
+  RpcCall(const RpcCall&) = delete;
+  RpcCall& operator=(const RpcCall&) = delete;
+
+  bool await_ready() { return false; }
+  bool await_suspend(std::coroutine_handle<> awaiter);
+  RpcResponse await_resume() { return std::move(response_); }
+
+private:
+  friend class RpcConn;
+  friend class RpcLoop;
+
+  RpcCall(RpcConn* const conn, const char* const method, const void* const body, const size_t n_bytes)
+    : conn_(conn), method_(method), body_((const uint8_t*) body), n_bytes_(n_bytes) {}
+
+  RpcConn* conn_;
+  const char* method_;
+  const uint8_t* body_;
+  size_t n_bytes_;
+  std::coroutine_handle<> awaiter_;
+  uint32_t rpc_id_ = 0;
+  // The next call waiting for room in the window.
+  RpcCall* next_ = NULL;
+  RpcResponse response_;
+};
+
+// One thread's event loop, over the connections opened on it.
+class RpcLoop {
+public:
+  // Returns NULL and sets errno on error.
+  static RpcLoop* Open();
+
+  RpcLoop(const RpcLoop&) = delete;
+  RpcLoop& operator=(const RpcLoop&) = delete;
+
+  // Its connections have to be closed first. Calls that were still in
+  // flight on them are resumed here, without a response, so that their
+  // coroutines finish.
+  ~RpcLoop();
+
+  // Runs task until it returns, and returns what it returned. Not to be
+  // called from a task.
+  template <typename T>
+  T run(Task<T> task) {
+    task.handle_.resume();
+    while (!task.done()) poll();
+    return task.handle_.promise().result();
+  }
+
+  // Runs until no calls are in flight, e.g. those that lost a when_any(), so
+  // that the connections can be closed without leaving the server to answer
+  // into a closed socket.
+  void drain();
+
+private:
+  friend class RpcConn;
+
+  RpcLoop() = default;
+
+  bool any_in_flight() const;
+
+  // Waits for at least one connection to be ready, handles what is ready, and
+  // resumes the calls that got their responses.
+  void poll();
+
+  // Resumes the calls made ready since the last time, and any they make
+  // ready in turn.
+  void resume_ready();
+
+  int epoll_fd_ = -1;
+  std::vector<RpcConn*> conns_;
+  // Calls that have their responses, or have failed, to be resumed once the
+  // connections are done with them.
+  std::vector<RpcCall*> ready_;
+};
+
+// A connection to one server port, whose calls are run by loop.
+class RpcConn {
+public:
+  // Connects to server:port over TCP, and if compact is set, switches the
+  // connection to the compact wire format. At most window calls are in
+  // flight at once. Requests and responses are logged to log_fd, unless it is
+  // negative.
+  //
+  // Returns NULL and sets errno on error.
+  static RpcConn* Open(
+    RpcLoop* loop,
+    const char* server,
+    int port,
+    uint32_t window,
+    bool compact,
+    int log_fd
+  );
+
+  RpcConn(const RpcConn&) = delete;
+  RpcConn& operator=(const RpcConn&) = delete;
+
+  // Closes the connection. Calls still in flight on it get no response.
+  ~RpcConn();
+
+  // Calls method with body. The result must be co_awaited right away.
+  RpcCall call(const char* const method, const void* const body, const size_t n_bytes) {
+    return RpcCall(this, method, body, n_bytes);
+  }
+  RpcCall call(const char* const method, const std::string_view body) {
+    return RpcCall(this, method, body.data(), body.size());
+  }
+
+  const Connection& connection() const { return connection_; }
+
+  // Calls sent, and the most that were waiting for room in the window at
+  // once.
+  uint64_t n_calls() const { return n_calls_; }
+  uint64_t max_waiting() const { return max_waiting_; }
+
+private:
+  friend class RpcCall;
+  friend class RpcLoop;
+
+  RpcConn() = default;
+
+  // Sends call, or queues it if the window is full. Returns false if it
+  // failed right away.
+  bool start(RpcCall* call);
+  // Sends call's request, buffering what doesn't fit in the socket.
+  int send(RpcCall* call);
+  // Writes out as much of the buffered requests as fits.
+  int flush();
+  // Reads the responses that have come and readies their calls.
+  int receive();
+  // Sends the calls waiting for room while there is.
+  int refill();
+  // Readies every call in flight or waiting without a response, and stops
+  // taking calls.
+  void fail(int error);
+  // Has the loop wait for the socket to be writable as well as readable, or
+  // not.
+  int watch_writable(bool writable);
+
+  RpcLoop* loop_ = NULL;
+  Connection connection_;
+  int log_fd_;
+  uint32_t window_;
+  // Calls whose requests have been sent, or buffered.
+  std::vector<RpcCall*> in_flight_;
+  RpcCall* waiting_head_ = NULL;
+  RpcCall* waiting_tail_ = NULL;
+  uint64_t n_waiting_ = 0;
+  // Request bytes that didn't fit in the socket, from out_start_ on.
+  std::vector<uint8_t> out_;
+  size_t out_start_ = 0;
+  bool watching_writable_ = false;
+  // The errno of the failure that ended the connection, or 0.
+  int failed_ = 0;
+
+  uint64_t n_calls_ = 0;
+  uint64_t max_waiting_ = 0;
+};
+
+namespace coro_detail {
+
+// A coroutine that starts right away and frees itself when it finishes, for
+// running one of the tasks of when_all() or when_any().
+struct Detached {
+  struct promise_type {
+    static void* operator new(const size_t n_bytes) { return coro_frame_alloc(n_bytes); }
+    static void operator delete(void* const frame, const size_t n_bytes) { coro_frame_free(frame, n_bytes); }
+
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+};
+
+// Counts down the tasks of a when_all() left to finish, and resumes its
+// caller after the last. Starts at one more than the number of tasks, for the
+// caller, which counts itself off once it has started them all.
+struct Latch {
+  size_t n_left;
+  std::coroutine_handle<> awaiter;
+
+  void count_down() {
+    if (0 == --n_left) awaiter.resume();
+  }
+};
+
+template <typename T>
+Detached run_counted(Task<T> task, Latch* const latch, std::optional<T>* const result) {
+  result->emplace(co_await std::move(task));
+  latch->count_down();
+}
+
+inline Detached run_counted(Task<void> task, Latch* const latch) {
+  co_await std::move(task);
+  latch->count_down();
+}
+
+// Starts the tasks with start(latch), and suspends until they have all
+// finished.
+template <typename Start>
+struct LatchAwaiter {
+  Latch latch;
+  Start start;
+
+  bool await_ready() { return false; }
+  bool await_suspend(const std::coroutine_handle<> awaiter) {
+    latch.awaiter = awaiter;
+    start(&latch);
+    // Suspends unless they have all finished already.
+    return 0 != --latch.n_left;
+  }
+  void await_resume() {}
+};
+
+template <typename Start>
+LatchAwaiter<Start> latch_awaiter(const size_t n_tasks, Start start) {
+  return LatchAwaiter<Start>{Latch{n_tasks + 1, {}}, std::move(start)};
+}
+
+// Shared by a when_any() and its tasks, the rest of which finish after it has
+// returned.
+template <typename T>
+struct Race {
+  bool decided = false;
+  size_t winner = 0;
+  std::optional<T> result;
+  std::coroutine_handle<> awaiter;
+};
+
+template <typename T>
+Detached run_raced(Task<T> task, const std::shared_ptr<Race<T>> race, const size_t i) {
+  T result = co_await std::move(task);
+  if (race->decided) co_return;
+  race->decided = true;
+  race->winner = i;
+  race->result.emplace(std::move(result));
+  // Only resumed once the when_any() has suspended.
+  if (race->awaiter) race->awaiter.resume();
+}
+
+}  // namespace coro_detail
+
+// Runs every task at once, and returns their results in order once they have
+// all finished.
+template <typename T>
+Task<std::vector<T>> when_all(std::vector<Task<T>> tasks) {
+  std::vector<std::optional<T>> results(tasks.size());
+  co_await coro_detail::latch_awaiter(tasks.size(), [&](coro_detail::Latch* const latch) {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      coro_detail::run_counted(std::move(tasks[i]), latch, &results[i]);
+    }
+  });
+  std::vector<T> out;
+  out.reserve(results.size());
+  for (std::optional<T>& result : results) out.push_back(std::move(*result));
+  co_return out;
+}
+
+inline Task<void> when_all(std::vector<Task<void>> tasks) {
+  co_await coro_detail::latch_awaiter(tasks.size(), [&](coro_detail::Latch* const latch) {
+    for (Task<void>& task : tasks) coro_detail::run_counted(std::move(task), latch);
+  });
+}
+
+// Like the above, for tasks of different types, none of them void.
+template <typename... Ts>
+Task<std::tuple<Ts...>> when_all(Task<Ts>... tasks) {
+  std::tuple<std::optional<Ts>...> results;
+  co_await coro_detail::latch_awaiter(sizeof...(Ts), [&](coro_detail::Latch* const latch) {
+    [&]<size_t... I>(std::index_sequence<I...>) {
+      (coro_detail::run_counted(std::move(tasks), latch, &std::get<I>(results)), ...);
+    }(std::index_sequence_for<Ts...>{});
+  });
+  co_return std::apply([](std::optional<Ts>&... result) { return std::tuple<Ts...>(std::move(*result)...); }, results);
+}
+
+// Runs every task at once, and returns the index and result of the first to
+// finish. The others run on to the end, and their results are dropped, so
+// anything they use has to outlive them, not just the when_any(). There has
+// to be at least one task.
+template <typename T>
+Task<std::pair<size_t, T>> when_any(std::vector<Task<T>> tasks) {
+  // Holds only pointers into the frame, as GCC 12 runs destructors more than
+  // once on the members of a brace-initialized co_await operand.
+  struct Awaiter {
+    const std::shared_ptr<coro_detail::Race<T>>* race;
+    std::vector<Task<T>>* tasks;
+
+    bool await_ready() { return false; }
+    bool await_suspend(const std::coroutine_handle<> awaiter) {
+      for (size_t i = 0; i < tasks->size(); ++i) coro_detail::run_raced(std::move((*tasks)[i]), *race, i);
+      if ((*race)->decided) return false;
+      (*race)->awaiter = awaiter;
+      return true;
+    }
+    void await_resume() {}
+  };
+
+  const auto race = std::make_shared<coro_detail::Race<T>>();
+  co_await Awaiter{&race, &tasks};
+  co_return std::pair<size_t, T>(race->winner, std::move(*race->result));
+}
@@ -7,24 +7,21 @@
 #include <sys/param.h>
 #include <unistd.h>
 
+#include "log.h"
 #include "rpc.h"
 
 void usage(char** argv) {
   fprintf(
     stderr,
     "usage:\n"
-    "\t%s LOG_FILE\n",
+    "\t%s [-from US] [-to US] LOG_FILE\n"
+    "\n"
+    "Dumps the records of a log of either format as JSON, only those sent from\n"
+    "US (-from) to US (-to), in microseconds since the epoch, if given.\n",
     argv[0]
   );
 }
 
-struct LogMessage {
-  RPCHeader header;
-  uint8_t body[24];
-};
-
-static_assert(96 == sizeof(LogMessage));
-
 void myputs(FILE* fd, const char* s) {
   for (; *s; ++s) fputc(*s, fd);
 }
@@ -52,35 +49,42 @@ void fhexdumpn(FILE* fd, const char* s, size_t n) {
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2) usage(argv), exit(1);
+  uint64_t from_us = 0;
+  uint64_t to_us = UINT64_MAX;
+  int arg = 1;
+  for (; arg + 1 < argc; arg += 2) {
+    if (strcmp(argv[arg], "-from") == 0) {
+      from_us = strtoull(argv[arg + 1], NULL, 10);
+    } else if (strcmp(argv[arg], "-to") == 0) {
+      to_us = strtoull(argv[arg + 1], NULL, 10);
+    } else {
+      break;
+    }
+  }
+  if (arg + 1 != argc) usage(argv), exit(1);
+  const char* const log_fn = argv[arg];
 
-  int log_fd = open(argv[1], O_RDONLY);
-  if (-1 == log_fd) {
-    fprintf(stderr, "failed to open logfile \"%s\": %m", argv[1]);
+  LogReader* reader = LogReader::Open(log_fn);
+  if (NULL == reader) {
+    fprintf(stderr, "failed to open logfile \"%s\": %m", log_fn);
     exit(1);
   }
+  reader->set_window(from_us, to_us);
 
-  // Logs are arranged as MARK HEADER BODY_TRUNC,
-  // where BODY_TRUNC is 24 bytes of truncated or zero-extended data.
+  // Logs are either arranged as HEADER BODY_TRUNC [EXTENSION], where
+  // BODY_TRUNC is 24 bytes of truncated or zero-extended data, or in blocks
+  // of columns. See log.h.
 
   putchar('[');
   bool is_first_message = true;
   while (true) {
-    LogMessage message;
-    ssize_t n_bytes = read(log_fd, &message, sizeof(LogMessage));
-    if (-1 == n_bytes) {
-      perror("failed to read log message from file");
-      exit(1);
-    }
-    if (0 == n_bytes) break; // EOF.
-    if (n_bytes != sizeof(LogMessage)) {
-      fprintf(
-        stderr,
-        "couldn't read full message from file. got %ld bytes instead\n", 
-        n_bytes
-      );
+    LogRecord message;
+    const int result = reader->next(&message);
+    if (-1 == result) {
+      fprintf(stderr, "\"%s\" is truncated or corrupt\n", log_fn);
       exit(1);
     }
+    if (0 == result) break; // EOF.
 
     if (!is_first_message) {
       myputs(stdout, ",\n");
@@ -138,11 +142,30 @@ int main(int argc, char** argv) {
 
     myputs(stdout, "\t\"body\":     \"");
     fhexdumpn(stdout, (char*)message.body, 24);
-    myputs(stdout, "\"\n");
+    myputs(stdout, "\"");
+
+    if (message.has_phases) {
+      // Cycles since the request was received, and the same in
+      // microseconds.
+      const PhaseTimes& phases = message.phases;
+      printf(",\n\t\"cycles_per_us\": %u,\n\t\"phases\": {", phases.cycles_per_us);
+      for (int i = 0; i < N_PHASES; ++i) {
+        printf(
+          "%s\n\t\t\"%s\": {\"cycles\": %u, \"us\": %.3f}",
+          i == 0 ? "" : ",",
+          phase_name((RequestPhase) i),
+          phases.cycles[i],
+          (double) phases.cycles[i] / phases.cycles_per_us
+        );
+      }
+      myputs(stdout, "\n\t}");
+    }
+    myputs(stdout, "\n");
 
     myputs(stdout, "}");
   }
   myputs(stdout, "]\n");
 
+  delete reader;
   return 0;
 }
@@ -0,0 +1,155 @@
+#include "executor.h"
+
+#include <errno.h>
+#include <sched.h>
+
+#include "../ch2-cpu/timecounters.h"
+
+// How many times an idle worker re-checks for work before going to sleep.
+// Sleeping costs a futex wait plus a wakeup on the next submit(), which is
+// about what a small RPC costs end to end, so stay awake a little first.
+// Each re-check is followed by Pause(), so the spin doesn't flood the
+// pipeline with speculative loads or starve a hyperthread sibling.
+constexpr int SPINS_BEFORE_SLEEP = 2000;
+
+Executor* Executor::Start(const ExecutorConfig& config) {
+  if (config.n_workers < 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  Executor* executor = new Executor();
+  for (int i = 0; i < config.n_workers; ++i) {
+    Worker* worker = new Worker();
+    worker->executor = executor;
+    worker->index = i;
+    worker->lock.lock = 0;
+    executor->workers_.push_back(worker);
+  }
+
+  for (Worker* worker : executor->workers_) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (!config.cpus.empty()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(config.cpus[worker->index % config.cpus.size()], &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    const int err = pthread_create(&worker->thread, &attr, worker_main, worker);
+    pthread_attr_destroy(&attr);
+    if (0 != err) {
+      // Stop the workers that did start. They look at every worker's deque
+      // for work, so none is freed until they are all joined.
+      pthread_mutex_lock(&executor->idle_mutex_);
+      executor->stopping_ = true;
+      pthread_cond_broadcast(&executor->idle_cond_);
+      pthread_mutex_unlock(&executor->idle_mutex_);
+      for (int i = 0; i < worker->index; ++i) pthread_join(executor->workers_[i]->thread, NULL);
+      for (Worker* const w : executor->workers_) delete w;
+      delete executor;
+      errno = err;
+      return NULL;
+    }
+  }
+
+  return executor;
+}
+
+void Executor::submit(Task task) {
+  const uint32_t index = __atomic_fetch_add(&next_worker_, 1, __ATOMIC_RELAXED);
+  Worker* worker = workers_[index % workers_.size()];
+  {
+    SpinLock spinlock(&worker->lock);
+    worker->tasks.push_back(task);
+    __atomic_store_n(&worker->n_tasks, worker->tasks.size(), __ATOMIC_RELAXED);
+  }
+
+  // Pairs with the increment of n_sleeping_ in worker_main(): either we see
+  // the sleeper and wake it, or it sees our task and doesn't go to sleep.
+  __atomic_add_fetch(&n_queued_, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&n_sleeping_, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idle_mutex_);
+    pthread_cond_signal(&idle_cond_);
+    pthread_mutex_unlock(&idle_mutex_);
+  }
+}
+
+void Executor::shutdown() {
+  pthread_mutex_lock(&idle_mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&idle_cond_);
+  pthread_mutex_unlock(&idle_mutex_);
+
+  for (Worker* worker : workers_) {
+    pthread_join(worker->thread, NULL);
+    delete worker;
+  }
+  workers_.clear();
+}
+
+bool Executor::pop_own(Worker* const worker, Task* const out) {
+  SpinLock spinlock(&worker->lock);
+  if (worker->tasks.empty()) return false;
+  *out = worker->tasks.front();
+  worker->tasks.pop_front();
+  __atomic_store_n(&worker->n_tasks, worker->tasks.size(), __ATOMIC_RELAXED);
+  return true;
+}
+
+bool Executor::steal(Worker* const thief, Task* const out) {
+  const size_t n = workers_.size();
+  for (size_t i = 1; i < n; ++i) {
+    Worker* victim = workers_[(thief->index + i) % n];
+    // Peek without the lock so that idle workers don't hammer the spinlocks
+    // of busy ones. A stale answer just means we look again next time.
+    if (__atomic_load_n(&victim->n_tasks, __ATOMIC_RELAXED) == 0) continue;
+    SpinLock spinlock(&victim->lock);
+    if (victim->tasks.empty()) continue;
+    *out = victim->tasks.back();
+    victim->tasks.pop_back();
+    __atomic_store_n(&victim->n_tasks, victim->tasks.size(), __ATOMIC_RELAXED);
+    return true;
+  }
+  return false;
+}
+
+bool Executor::find_task(Worker* const worker, Task* const out) {
+  if (!pop_own(worker, out) && !steal(worker, out)) return false;
+  __atomic_sub_fetch(&n_queued_, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+void* Executor::worker_main(void* const void_worker) {
+  Worker* const worker = (Worker*) void_worker;
+  Executor* const executor = worker->executor;
+
+  while (true) {
+    Task task;
+    if (executor->find_task(worker, &task)) {
+      task.fn(task.arg);
+      continue;
+    }
+
+    bool found = false;
+    for (int i = 0; i < SPINS_BEFORE_SLEEP && !found; ++i) {
+      found = __atomic_load_n(&executor->n_queued_, __ATOMIC_RELAXED) > 0;
+      Pause();
+    }
+    if (found) continue;
+
+    pthread_mutex_lock(&executor->idle_mutex_);
+    __atomic_add_fetch(&executor->n_sleeping_, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&executor->n_queued_, __ATOMIC_SEQ_CST) == 0
+           && !executor->stopping_) {
+      pthread_cond_wait(&executor->idle_cond_, &executor->idle_mutex_);
+    }
+    __atomic_sub_fetch(&executor->n_sleeping_, 1, __ATOMIC_SEQ_CST);
+    const bool stop = executor->stopping_
+      && __atomic_load_n(&executor->n_queued_, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&executor->idle_mutex_);
+    if (stop) break;
+  }
+
+  return NULL;
+}
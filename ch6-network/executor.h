@@ -0,0 +1,83 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include "spinlock.h"
+
+// A unit of work for the Executor: fn(arg) is run on exactly one worker.
+struct Task {
+  void (*fn)(void* arg);
+  void* arg;
+};
+
+struct ExecutorConfig {
+  // Number of worker threads. Must be at least 1.
+  int n_workers = 1;
+
+  // CPUs to pin workers to. Worker i is pinned to cpus[i % cpus.size()].
+  // If empty, workers are left to the scheduler.
+  std::vector<int> cpus;
+};
+
+// A work-stealing pool of worker threads.
+//
+// Every worker owns a deque of tasks. submit() hands tasks to the workers
+// round-robin. A worker runs tasks from the front of its own deque, and when
+// that runs dry it steals from the back of another worker's deque, so that
+// one slow task only holds up the tasks queued behind it until some other
+// worker comes looking for work. Workers with nothing to do spin briefly and
+// then sleep until the next submit().
+class Executor {
+public:
+  // Starts the worker threads.
+  //
+  // Returns NULL and sets errno if a thread can't be started or pinned.
+  static Executor* Start(const ExecutorConfig& config);
+
+  // Queues a task. Safe to call from any thread.
+  void submit(Task task);
+
+  // Runs the tasks that are already queued, then stops and joins the
+  // workers. No task may be submitted after this is called.
+  void shutdown();
+
+  int n_workers() const { return (int) workers_.size(); }
+
+private:
+  struct Worker {
+    Executor* executor;
+    int index;
+    pthread_t thread;
+    LockAndHist lock;
+    std::deque<Task> tasks;
+
+    // tasks.size(), readable without the lock.
+    size_t n_tasks = 0;
+  };
+
+  Executor() = default;
+
+  static void* worker_main(void* void_worker);
+
+  bool pop_own(Worker* worker, Task* out);
+  bool steal(Worker* thief, Task* out);
+  bool find_task(Worker* worker, Task* out);
+
+  std::vector<Worker*> workers_;
+
+  // Index of the worker that receives the next submitted task.
+  uint32_t next_worker_ = 0;
+
+  // Number of tasks queued but not yet started, across all workers.
+  int64_t n_queued_ = 0;
+
+  // Sleeping workers wait on idle_cond_ for n_queued_ to become nonzero.
+  pthread_mutex_t idle_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t idle_cond_ = PTHREAD_COND_INITIALIZER;
+  int n_sleeping_ = 0;
+  bool stopping_ = false;
+};
@@ -0,0 +1,242 @@
+// Issues many concurrent RPCs from one thread with the coroutine client API
+// in coro_rpc.h, over a connection to each of a range of server ports, and
+// prints the throughput and latency percentiles.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "coro_rpc.h"
+#include "histogram.h"
+#include "my_rpc.h"
+#include "phases.h"
+
+struct Args {
+  const char* server;
+  int start_port;
+  int end_port;
+  uint64_t n_rpcs = 100000;
+  uint32_t n_callers = 1000;
+  uint32_t window = 64;
+  const char* method = "ping";
+  size_t size = 64;
+  bool first = false;
+  bool compact = false;
+};
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tfanout [-k N] [-callers N] [-window N] [-method ping|read] [-size BYTES]\n"
+    "\t       [-first] [-compact] SERVER START_PORT END_PORT\n"
+    "\n"
+    "Opens a connection to each port in [START_PORT, END_PORT] and, from one\n"
+    "thread, makes N (-k, default 100000) RPCs from N (-callers, default 1000)\n"
+    "coroutines at once, each making one call after another, to the ports in turn.\n"
+    "Each connection has up to N (-window, default 64) requests out at once, and\n"
+    "the rest of the calls to it wait their turn. Latency is from a call's start,\n"
+    "so it includes that wait. ping sends BYTES (default 64) of body, and read\n"
+    "reads a value of BYTES that is written first through each port.\n"
+    "\n"
+    "With -first, each call goes to every port at once, and returns with the first\n"
+    "response, as for a read hedged over replicas. Its latency is the first's, and\n"
+    "the ports' wins are counted.\n"
+    "\n"
+    "Prints the throughput and latency percentiles, and how many coroutine frames\n"
+    "were malloc()ed, against those reused.\n"
+  );
+}
+
+Args parse_args(const int argc, char** const argv) {
+  Args args;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-first") == 0) {
+      args.first = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-compact") == 0) {
+      args.compact = true;
+      continue;
+    }
+    if (i + 1 >= argc) usage(), exit(1);
+    if (strcmp(argv[i], "-k") == 0) {
+      args.n_rpcs = strtoull(argv[i + 1], NULL, 10);
+    } else if (strcmp(argv[i], "-callers") == 0) {
+      args.n_callers = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-window") == 0) {
+      args.window = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-method") == 0) {
+      args.method = argv[i + 1];
+    } else if (strcmp(argv[i], "-size") == 0) {
+      args.size = strtoull(argv[i + 1], NULL, 10);
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+    ++i;
+  }
+  if (i + 3 != argc) usage(), exit(1);
+  args.server = argv[i];
+  args.start_port = atoi(argv[i + 1]);
+  args.end_port = atoi(argv[i + 2]);
+
+  if (args.n_rpcs < 1 || args.n_callers < 1 || args.window < 1) {
+    fprintf(stderr, "-k, -callers and -window must be positive\n");
+    exit(1);
+  }
+  if (args.start_port <= 0 || args.end_port < args.start_port) {
+    fprintf(stderr, "START_PORT must be positive and at most END_PORT\n");
+    exit(1);
+  }
+  if (strcmp(args.method, "ping") != 0 && strcmp(args.method, "read") != 0) {
+    fprintf(stderr, "-method must be ping or read\n");
+    exit(1);
+  }
+  if (args.size > MAX_VALUE_LEN) {
+    fprintf(stderr, "-size must be at most %zu\n", MAX_VALUE_LEN);
+    exit(1);
+  }
+  return args;
+}
+
+const char KEY[] = "fanout";
+
+struct Run {
+  const Args* args;
+  std::vector<RpcConn*> conns;
+  std::vector<uint8_t> body;
+  // The next call to make, of args->n_rpcs.
+  uint64_t next_call = 0;
+
+  LatencyHistogram latencies;
+  uint64_t n_failed = 0;
+  uint64_t n_not_ok = 0;
+  // With -first, how many calls each port answered first.
+  std::vector<uint64_t> n_wins;
+};
+
+void count_response(Run* const run, const RpcResponse& response) {
+  if (!response.ok()) {
+    ++run->n_failed;
+  } else if (response.status() != RpcStatus::Ok) {
+    ++run->n_not_ok;
+  }
+}
+
+Task<RpcResponse> call_on(RpcConn* const conn, const char* const method, const std::vector<uint8_t>* const body) {
+  co_return co_await conn->call(method, body->data(), body->size());
+}
+
+Task<void> caller(Run* const run) {
+  const Args& args = *run->args;
+  while (run->next_call < args.n_rpcs) {
+    const uint64_t i = run->next_call++;
+    const uint64_t start_ns = now_nsec();
+    if (args.first) {
+      std::vector<Task<RpcResponse>> calls;
+      for (RpcConn* const conn : run->conns) calls.push_back(call_on(conn, args.method, &run->body));
+      const auto [winner, response] = co_await when_any(std::move(calls));
+      run->latencies.record(now_nsec() - start_ns);
+      ++run->n_wins[winner];
+      count_response(run, response);
+    } else {
+      RpcConn* const conn = run->conns[i % run->conns.size()];
+      const RpcResponse response = co_await conn->call(args.method, run->body.data(), run->body.size());
+      run->latencies.record(now_nsec() - start_ns);
+      count_response(run, response);
+    }
+  }
+}
+
+Task<bool> write_value(Run* const run) {
+  std::vector<uint8_t> write_buf(sizeof(WriteRequest) + sizeof(KEY) - 1 + run->args->size);
+  WriteRequest* const write_req = (WriteRequest*) write_buf.data();
+  WriteRequest::Init(write_req, sizeof(KEY) - 1, run->args->size);
+  memcpy(write_req->key(), KEY, sizeof(KEY) - 1);
+  memset(write_req->value(), 'v', run->args->size);
+  std::vector<Task<RpcResponse>> writes;
+  for (RpcConn* const conn : run->conns) writes.push_back(call_on(conn, "write", &write_buf));
+  for (const RpcResponse& response : co_await when_all(std::move(writes))) {
+    if (!response.ok() || response.status() != RpcStatus::Ok) co_return false;
+  }
+  co_return true;
+}
+
+Task<void> run_callers(Run* const run) {
+  std::vector<Task<void>> callers;
+  for (uint32_t i = 0; i < run->args->n_callers; ++i) callers.push_back(caller(run));
+  co_await when_all(std::move(callers));
+}
+
+int main(int argc, char** argv) {
+  const Args args = parse_args(argc, argv);
+
+  RpcLoop* const loop = RpcLoop::Open();
+  if (NULL == loop) {
+    perror("couldn't make the event loop");
+    exit(1);
+  }
+  Run* const run = new Run();
+  run->args = &args;
+  for (int port = args.start_port; port <= args.end_port; ++port) {
+    RpcConn* const conn = RpcConn::Open(loop, args.server, port, args.window, args.compact, /*log_fd=*/-1);
+    if (NULL == conn) {
+      fprintf(stderr, "failed to connect to %s:%d: %m\n", args.server, port);
+      exit(1);
+    }
+    run->conns.push_back(conn);
+  }
+  run->n_wins.assign(run->conns.size(), 0);
+
+  if (strcmp(args.method, "read") == 0) {
+    if (!loop->run(write_value(run))) {
+      fprintf(stderr, "couldn't write the value to read\n");
+      exit(1);
+    }
+    run->body.assign(KEY, KEY + sizeof(KEY) - 1);
+  } else {
+    run->body.assign(args.size, 'p');
+  }
+
+  const CoroFrameStats frames_before = coro_frame_stats();
+  const uint64_t start_ns = now_nsec();
+  loop->run(run_callers(run));
+  const double elapsed_s = (now_nsec() - start_ns) / 1e9;
+  const CoroFrameStats frames = coro_frame_stats();
+
+  printf(
+    "%lu %s calls from %u callers over %zu connections in %.3f s (%.0f rpcs/s)\n",
+    args.n_rpcs, args.method, args.n_callers, run->conns.size(), elapsed_s, args.n_rpcs / elapsed_s
+  );
+  run->latencies.print(stdout, 1000, "us");
+  if (run->n_failed > 0 || run->n_not_ok > 0) {
+    printf("%lu calls failed, %lu answered not OK\n", run->n_failed, run->n_not_ok);
+  }
+  if (args.first) {
+    for (size_t i = 0; i < run->conns.size(); ++i) {
+      printf("port %d answered first %lu times\n", args.start_port + (int) i, run->n_wins[i]);
+    }
+  }
+  uint64_t max_waiting = 0;
+  for (const RpcConn* const conn : run->conns) {
+    if (conn->max_waiting() > max_waiting) max_waiting = conn->max_waiting();
+  }
+  printf("up to %lu calls waited for a connection's window\n", max_waiting);
+  printf(
+    "coroutine frames: %lu malloc()ed, %lu reused\n",
+    frames.n_allocated - frames_before.n_allocated,
+    frames.n_reused - frames_before.n_reused
+  );
+
+  // The calls that lost a race with -first may still be out.
+  loop->drain();
+  for (RpcConn* const conn : run->conns) delete conn;
+  delete loop;
+  delete run;
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include "histogram.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+#include "varint.h"
+
+// File format, all integers little-endian:
+//
+// +-------+---------+-----------------+-------+-----+-----+-----+-------------+---------
+// | magic | version | sub_bucket_bits | count | min | max | sum | payload_len | payload
+// +-------+---------+-----------------+-------+-----+-----+-----+-------------+---------
+//    8 B      4 B          4 B           8 B    8 B   8 B   8 B       4 B
+//
+// The payload lists the nonzero buckets as varint pairs: the gap since the
+// previous nonzero bucket's index, then the bucket's count. A typical run
+// fills a few hundred buckets, so a file is a few hundred bytes to a few KB.
+
+constexpr char HIST_MAGIC[8] = {'U', 'S', 'D', 'H', 'I', 'S', 'T', '\0'};
+constexpr uint32_t HIST_VERSION = 1;
+
+struct HistFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t sub_bucket_bits;
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint32_t payload_len;
+} __attribute__((packed));
+
+int LatencyHistogram::index_of(const uint64_t value) {
+  if (value < 2 * SUB_BUCKET_HALF) return value;
+  const int msb = 63 - __builtin_clzll(value);
+  const int bucket = msb - (SUB_BUCKET_BITS - 1);
+  return SUB_BUCKET_HALF * bucket + (value >> bucket);
+}
+
+uint64_t LatencyHistogram::lowest_value_at(const int index) {
+  if (index < 2 * SUB_BUCKET_HALF) return index;
+  const int bucket = index / SUB_BUCKET_HALF - 1;
+  return (uint64_t) (index - SUB_BUCKET_HALF * bucket) << bucket;
+}
+
+uint64_t LatencyHistogram::highest_value_at(const int index) {
+  if (index < 2 * SUB_BUCKET_HALF) return index;
+  const int bucket = index / SUB_BUCKET_HALF - 1;
+  return lowest_value_at(index) + ((uint64_t) 1 << bucket) - 1;
+}
+
+void LatencyHistogram::record(const uint64_t value) {
+  ++counts_[index_of(value)];
+  ++count_;
+  sum_ += value;
+  if (value < min_) min_ = value;
+  if (value > max_) max_ = value;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int i = 0; i < N_COUNTS; ++i) counts_[i] += other.counts_[i];
+  count_ += other.count_;
+  sum_ += other.sum_;
+  if (other.min_ < min_) min_ = other.min_;
+  if (other.max_ > max_) max_ = other.max_;
+}
+
+uint64_t LatencyHistogram::percentile(const double q) const {
+  if (count_ == 0) return 0;
+  if (q <= 0) return min_;
+
+  uint64_t rank = ceil(q * count_);
+  if (rank < 1) rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < N_COUNTS; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      const uint64_t value = highest_value_at(i);
+      return value < max_ ? value : max_;
+    }
+  }
+  return max_;
+}
+
+void LatencyHistogram::print(FILE* const out, const double divisor, const char* const units) const {
+  fprintf(out, "%lu rpcs\n", count_);
+  if (count_ == 0) return;
+  fprintf(
+    out,
+    "latency (%s): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f"
+    "  p99.99 %.1f  max %.1f  mean %.1f\n",
+    units,
+    min() / divisor,
+    percentile(0.5) / divisor,
+    percentile(0.9) / divisor,
+    percentile(0.99) / divisor,
+    percentile(0.999) / divisor,
+    percentile(0.9999) / divisor,
+    max() / divisor,
+    mean() / divisor
+  );
+}
+
+bool LatencyHistogram::save(const char* const path) const {
+  std::vector<uint8_t> payload;
+  int prev_index = 0;
+  for (int i = 0; i < N_COUNTS; ++i) {
+    if (counts_[i] == 0) continue;
+    uint8_t buf[2 * VARINT_MAX_LEN];
+    size_t len = put_varint(buf, i - prev_index);
+    len += put_varint(buf + len, counts_[i]);
+    payload.insert(payload.end(), buf, buf + len);
+    prev_index = i;
+  }
+
+  HistFileHeader header;
+  memcpy(header.magic, HIST_MAGIC, sizeof(HIST_MAGIC));
+  header.version = HIST_VERSION;
+  header.sub_bucket_bits = SUB_BUCKET_BITS;
+  header.count = count_;
+  header.min = min_;
+  header.max = max_;
+  header.sum = sum_;
+  header.payload_len = payload.size();
+
+  FILE* file = fopen(path, "wb");
+  if (NULL == file) return false;
+  bool ok = 1 == fwrite(&header, sizeof(header), 1, file);
+  if (ok && !payload.empty()) ok = 1 == fwrite(payload.data(), payload.size(), 1, file);
+  const int err_save = errno;
+  if (0 != fclose(file)) return false;
+  errno = err_save;
+  return ok;
+}
+
+bool LatencyHistogram::merge_from_file(const char* const path) {
+  FILE* file = fopen(path, "rb");
+  if (NULL == file) return false;
+
+  HistFileHeader header;
+  std::vector<uint8_t> payload;
+  bool ok = 1 == fread(&header, sizeof(header), 1, file)
+    && 0 == memcmp(header.magic, HIST_MAGIC, sizeof(HIST_MAGIC))
+    && header.version == HIST_VERSION
+    && header.sub_bucket_bits == SUB_BUCKET_BITS;
+  if (ok) {
+    payload.resize(header.payload_len);
+    ok = payload.empty() || 1 == fread(payload.data(), payload.size(), 1, file);
+  }
+  fclose(file);
+  if (!ok) return false;
+
+  // Decode into a scratch histogram first so that a corrupt file leaves this
+  // one untouched.
+  LatencyHistogram* other = new LatencyHistogram();
+  const uint8_t* p = payload.data();
+  const uint8_t* const end = p + payload.size();
+  uint64_t index = 0;
+  while (ok && p < end) {
+    uint64_t gap, count;
+    ok = get_varint(&p, end, &gap) && get_varint(&p, end, &count);
+    index += gap;
+    ok = ok && index < N_COUNTS;
+    if (ok) other->counts_[index] += count;
+  }
+  other->count_ = header.count;
+  other->min_ = header.min;
+  other->max_ = header.max;
+  other->sum_ = header.sum;
+  if (ok) merge(*other);
+  delete other;
+  return ok;
+}
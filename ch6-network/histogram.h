@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A log-linear latency histogram, in the style of HdrHistogram.
+//
+// Values below 2^SUB_BUCKET_BITS get a bucket each. Above that, every power
+// of two is split into 2^(SUB_BUCKET_BITS-1) equal buckets, so any value is
+// recorded to within 1 part in 2^(SUB_BUCKET_BITS-1) of its true value, from
+// nanoseconds up to centuries, in a fixed ~58 KB of counts.
+//
+// Recording is a shift, a count-leading-zeros and an increment, with no
+// atomics: a histogram belongs to one thread. Threads (or processes) that
+// record in parallel each keep their own and merge them at the end.
+class LatencyHistogram {
+public:
+  static constexpr int SUB_BUCKET_BITS = 8;
+  static constexpr int SUB_BUCKET_HALF = 1 << (SUB_BUCKET_BITS - 1);
+  static constexpr int N_COUNTS = SUB_BUCKET_HALF * (64 - SUB_BUCKET_BITS + 2);
+
+  void record(uint64_t value);
+
+  // Adds other's values to this histogram.
+  void merge(const LatencyHistogram& other);
+
+  uint64_t count() const { return count_; }
+  uint64_t min() const { return count_ == 0 ? 0 : min_; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ == 0 ? 0 : (double) sum_ / count_; }
+
+  // Returns a value such that a fraction q of the recorded values are at most
+  // it, to within the bucket precision. q is in [0, 1].
+  uint64_t percentile(double q) const;
+
+  // Prints the count and a line of percentiles, with values divided by
+  // divisor and labeled with units, e.g. print(stdout, 1000, "us") for
+  // values recorded in nanoseconds.
+  void print(FILE* out, double divisor, const char* units) const;
+
+  // Writes the histogram to path in a compact binary format.
+  //
+  // Returns false and sets errno on failure.
+  bool save(const char* path) const;
+
+  // Reads a histogram written by save() and merges it into this one.
+  //
+  // Returns false on failure.
+  bool merge_from_file(const char* path);
+
+private:
+  static int index_of(uint64_t value);
+  static uint64_t lowest_value_at(int index);
+  static uint64_t highest_value_at(int index);
+
+  uint64_t counts_[N_COUNTS] = {};
+  uint64_t count_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+  uint64_t sum_ = 0;
+};
@@ -0,0 +1,254 @@
+#include "key_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Control bytes. A full slot's is the low 7 bits of its key's hash, so
+// neither of these ever matches one.
+static constexpr uint8_t CTRL_EMPTY = 0x80;
+// Was full, but its key has moved on to the new table during a resize. Not
+// empty, so that probes for keys further along keep going past it.
+static constexpr uint8_t CTRL_MOVED = 0xfe;
+
+struct KeyTable::Slot {
+  void* value;
+  uint8_t key_len;
+  // The key if it is at most INLINE_KEY_LEN bytes, and otherwise a pointer to
+  // it in the arena.
+  char key[INLINE_KEY_LEN];
+};
+
+// Half a cache line on 64-bit machines.
+static_assert(sizeof(KeyTable::Slot) == sizeof(void*) + 1 + KeyTable::INLINE_KEY_LEN);
+
+struct KeyTable::Table {
+  // A power of 2.
+  size_t n_groups;
+  size_t n_full;
+  // n_groups * GROUP_SLOTS of each, in one allocation.
+  uint8_t* ctrl;
+  Slot* slots;
+};
+
+static const char* slot_key(const KeyTable::Slot* const slot) {
+  if (slot->key_len <= KeyTable::INLINE_KEY_LEN) return slot->key;
+  const char* key;
+  memcpy(&key, slot->key, sizeof(key));
+  return key;
+}
+
+// Returns a bit mask of the bytes of the group of control bytes at ctrl that
+// equal byte.
+static uint32_t match_byte(const uint8_t* const ctrl, const uint8_t byte) {
+#ifdef __SSE2__
+  const __m128i group = _mm_load_si128((const __m128i*) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+  uint32_t mask = 0;
+  for (size_t i = 0; i < KeyTable::GROUP_SLOTS; ++i) mask |= (uint32_t) (ctrl[i] == byte) << i;
+  return mask;
+#endif
+}
+
+// Limits each table to 7/8 full, so that probes stay short.
+static size_t max_full(const size_t n_groups) {
+  return n_groups * KeyTable::GROUP_SLOTS / 8 * 7;
+}
+
+static KeyTable::Table* new_table(const size_t n_groups) {
+  const size_t n_slots = n_groups * KeyTable::GROUP_SLOTS;
+  const size_t ctrl_len = n_slots;
+  uint8_t* const buf = (uint8_t*) aligned_alloc(64, ctrl_len + n_slots * sizeof(KeyTable::Slot));
+  if (NULL == buf) abort();
+  memset(buf, CTRL_EMPTY, ctrl_len);
+
+  KeyTable::Table* const table = new KeyTable::Table();
+  table->n_groups = n_groups;
+  table->n_full = 0;
+  table->ctrl = buf;
+  table->slots = (KeyTable::Slot*) (buf + ctrl_len);
+  return table;
+}
+
+static void delete_table(KeyTable::Table* const table) {
+  free(table->ctrl);
+  delete table;
+}
+
+static size_t table_len(const KeyTable::Table* const table) {
+  return sizeof(*table) + table->n_groups * KeyTable::GROUP_SLOTS * (1 + sizeof(KeyTable::Slot));
+}
+
+KeyTable::KeyTable() : table_(new_table(1)) {}
+
+KeyTable::~KeyTable() {
+  delete_table(table_);
+  if (NULL != old_) delete_table(old_);
+  while (NULL != arena_) {
+    char* previous;
+    memcpy(&previous, arena_, sizeof(previous));
+    free(arena_);
+    arena_ = previous;
+  }
+}
+
+// Mixes 8 bytes at a time, and finishes with MurmurHash3's finalizer, so the
+// low 7 bits and the high bits used to pick a group are both well spread.
+uint64_t KeyTable::hash_key(const char* const key, const size_t key_len) {
+  uint64_t h = 0x9e3779b97f4a7c15ull ^ key_len;
+  size_t i = 0;
+  for (; i + 8 <= key_len; i += 8) {
+    uint64_t word;
+    memcpy(&word, key + i, 8);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 29;
+  }
+  if (i < key_len) {
+    uint64_t word = 0;
+    memcpy(&word, key + i, key_len - i);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Probes visit groups at triangular offsets from the hash's home group,
+// which visits every group once when their number is a power of 2.
+KeyTable::Slot* KeyTable::find_in(
+  const Table* const table,
+  const uint64_t hash,
+  const char* const key,
+  const size_t key_len
+) {
+  const size_t mask = table->n_groups - 1;
+  const uint8_t h2 = hash & 0x7f;
+  size_t group = (hash >> 7) & mask;
+  for (size_t step = 1; step <= table->n_groups; ++step) {
+    const uint8_t* const ctrl = table->ctrl + group * GROUP_SLOTS;
+    for (uint32_t match = match_byte(ctrl, h2); match != 0; match &= match - 1) {
+      Slot* const slot = &table->slots[group * GROUP_SLOTS + __builtin_ctz(match)];
+      if (slot->key_len == key_len && 0 == memcmp(slot_key(slot), key, key_len)) return slot;
+    }
+    // A key is never placed past a group with room in it.
+    if (0 != match_byte(ctrl, CTRL_EMPTY)) return NULL;
+    group = (group + step) & mask;
+  }
+  return NULL;
+}
+
+KeyTable::Slot* KeyTable::claim_in(Table* const table, const uint64_t hash) {
+  const size_t mask = table->n_groups - 1;
+  size_t group = (hash >> 7) & mask;
+  for (size_t step = 1; ; ++step) {
+    uint8_t* const ctrl = table->ctrl + group * GROUP_SLOTS;
+    const uint32_t empty = match_byte(ctrl, CTRL_EMPTY);
+    if (0 != empty) {
+      const size_t i = group * GROUP_SLOTS + __builtin_ctz(empty);
+      table->ctrl[i] = hash & 0x7f;
+      ++table->n_full;
+      return &table->slots[i];
+    }
+    group = (group + step) & mask;
+  }
+}
+
+void* KeyTable::find(const char* const key, const size_t key_len) const {
+  const uint64_t hash = hash_key(key, key_len);
+  const Slot* slot = find_in(table_, hash, key, key_len);
+  if (NULL == slot && NULL != old_) slot = find_in(old_, hash, key, key_len);
+  return NULL == slot ? NULL : slot->value;
+}
+
+void* KeyTable::put(const char* const key, const size_t key_len, void* const value) {
+  const uint64_t hash = hash_key(key, key_len);
+  Slot* slot = find_in(table_, hash, key, key_len);
+  // A key not migrated yet is replaced where it is, and moves later.
+  if (NULL == slot && NULL != old_) slot = find_in(old_, hash, key, key_len);
+  if (NULL != slot) {
+    void* const replaced = slot->value;
+    slot->value = value;
+    return replaced;
+  }
+
+  if (table_->n_full + 1 > max_full(table_->n_groups)) grow();
+  slot = claim_in(table_, hash);
+  slot->value = value;
+  slot->key_len = key_len;
+  if (key_len <= INLINE_KEY_LEN) {
+    memcpy(slot->key, key, key_len);
+  } else {
+    const char* const stored = store_key(key, key_len);
+    memcpy(slot->key, &stored, sizeof(stored));
+  }
+  ++size_;
+
+  // Two groups per new key empties the old table long before the new one
+  // fills up, which takes as many new keys as the old one held.
+  if (NULL != old_) migrate(2);
+  return NULL;
+}
+
+void KeyTable::grow() {
+  // Only if keys came in faster than they were migrated, which they can't.
+  if (NULL != old_) migrate(SIZE_MAX);
+  old_ = table_;
+  table_ = new_table(old_->n_groups * 2);
+  migrate_group_ = 0;
+}
+
+void KeyTable::migrate(const size_t n_groups) {
+  for (size_t n = 0; n < n_groups && migrate_group_ < old_->n_groups; ++n, ++migrate_group_) {
+    for (size_t i = migrate_group_ * GROUP_SLOTS; i < (migrate_group_ + 1) * GROUP_SLOTS; ++i) {
+      if (old_->ctrl[i] & 0x80) continue;
+      const Slot& from = old_->slots[i];
+      Slot* const to = claim_in(table_, hash_key(slot_key(&from), from.key_len));
+      *to = from;
+      old_->ctrl[i] = CTRL_MOVED;
+    }
+  }
+  if (migrate_group_ == old_->n_groups) {
+    delete_table(old_);
+    old_ = NULL;
+  }
+}
+
+const char* KeyTable::store_key(const char* const key, const size_t key_len) {
+  if (arena_used_ + key_len > ARENA_CHUNK_LEN) {
+    char* const chunk = (char*) malloc(ARENA_CHUNK_LEN);
+    if (NULL == chunk) abort();
+    memcpy(chunk, &arena_, sizeof(arena_));
+    arena_ = chunk;
+    arena_used_ = sizeof(arena_);
+    ++n_arena_chunks_;
+  }
+  char* const stored = arena_ + arena_used_;
+  memcpy(stored, key, key_len);
+  arena_used_ += key_len;
+  return stored;
+}
+
+void KeyTable::for_each(const Visitor visit, void* const arg) const {
+  const Table* const tables[2] = {table_, old_};
+  for (const Table* const table : tables) {
+    if (NULL == table) continue;
+    for (size_t i = 0; i < table->n_groups * GROUP_SLOTS; ++i) {
+      if (table->ctrl[i] & 0x80) continue;
+      const Slot& slot = table->slots[i];
+      visit(arg, slot_key(&slot), slot.key_len, slot.value);
+    }
+  }
+}
+
+size_t KeyTable::memory_usage() const {
+  size_t len = sizeof(*this) + table_len(table_) + n_arena_chunks_ * ARENA_CHUNK_LEN;
+  if (NULL != old_) len += table_len(old_);
+  return len;
+}
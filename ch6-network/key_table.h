@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A hash table from keys of up to 255 bytes to pointers, for the keystore,
+// laid out to make a lookup touch as little memory as possible.
+//
+// It is open-addressed in the style of Abseil's Swiss tables: alongside the
+// slots is an array of one-byte control words, one per slot, holding 7 bits
+// of the key's hash if the slot is full. A lookup hashes the key once, picks
+// a group of 16 control bytes, and compares them all at once to the hash
+// bits with SSE2; only the few slots that match have their keys compared.
+// Keys up to INLINE_KEY_LEN bytes, which is most of them, live in the slot
+// itself, and longer ones in an arena of big chunks. Values stay wherever the
+// caller keeps them, so the probed arrays hold nothing but keys.
+//
+// Growing doesn't rehash the whole table at once, which would stall whoever
+// triggered it for as long as the table is big. Instead the old table stays
+// around, lookups check both, and each put() moves a couple of groups across
+// until the old one is empty.
+//
+// There is no erase, as the keystore never deletes. Not thread-safe.
+class KeyTable {
+public:
+  static constexpr size_t GROUP_SLOTS = 16;
+  static constexpr size_t INLINE_KEY_LEN = 23;
+
+  // Defined in key_table.cc.
+  struct Slot;
+  struct Table;
+
+  KeyTable();
+  ~KeyTable();
+
+  KeyTable(const KeyTable&) = delete;
+  KeyTable& operator=(const KeyTable&) = delete;
+
+  // Returns the value stored under key, or NULL if there is none.
+  void* find(const char* key, size_t key_len) const;
+
+  // Stores value, which must not be NULL, under key.
+  //
+  // Returns the value it replaced, or NULL if the key is new.
+  void* put(const char* key, size_t key_len, void* value);
+
+  // Called on each key and its value by for_each().
+  typedef void (*Visitor)(void* arg, const char* key, size_t key_len, void* value);
+
+  // Visits every key, in no particular order.
+  void for_each(Visitor visit, void* arg) const;
+
+  size_t size() const { return size_; }
+
+  // Returns the number of bytes allocated for the control bytes, slots and
+  // long keys, not counting values.
+  size_t memory_usage() const;
+
+private:
+  static uint64_t hash_key(const char* key, size_t key_len);
+
+  // Returns the slot holding key in table, or NULL.
+  static Slot* find_in(const Table* table, uint64_t hash, const char* key, size_t key_len);
+
+  // Puts a key that isn't in table yet into its first free slot, which
+  // there must be.
+  static Slot* claim_in(Table* table, uint64_t hash);
+
+  // Starts moving everything to a table twice the size.
+  void grow();
+
+  // Moves up to n_groups of the old table's groups to the current one.
+  void migrate(size_t n_groups);
+
+  // Returns a copy of a long key in the arena.
+  const char* store_key(const char* key, size_t key_len);
+
+  Table* table_;
+  // The table being migrated out of, or NULL.
+  Table* old_ = NULL;
+  // The old table's next group to migrate.
+  size_t migrate_group_ = 0;
+  size_t size_ = 0;
+
+  // Long keys are bump-allocated from chunks of ARENA_CHUNK_LEN bytes, and
+  // only freed with the table. Each chunk starts with a pointer to the one
+  // before it; arena_ is the newest.
+  static constexpr size_t ARENA_CHUNK_LEN = 64 * 1024;
+  char* arena_ = NULL;
+  size_t arena_used_ = ARENA_CHUNK_LEN;
+  size_t n_arena_chunks_ = 0;
+};
@@ -0,0 +1,152 @@
+// Compares the server's KeyTable with the std::unordered_map it replaced, on
+// the cost of a lookup and the memory per key.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "key_table.h"
+#include "phases.h"
+#include "workload.h"
+
+struct Args {
+  size_t n_keys = 1000000;
+  size_t key_len = 16;
+  size_t n_lookups = 10000000;
+};
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tkeytable_bench [-keys N] [-keylen LEN] [-lookups N]\n"
+    "\n"
+    "Inserts N (-keys, default 1000000) keys of LEN (-keylen, default 16) bytes\n"
+    "into a KeyTable and into a std::unordered_map<std::string, void*>, then looks\n"
+    "up N (-lookups, default 10000000) random keys in each, half of them missing.\n"
+    "Prints ns per insert and lookup, and heap bytes per key, from mallinfo2().\n"
+  );
+}
+
+Args parse_args(const int argc, char** const argv) {
+  Args args;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) usage(), exit(1);
+    const size_t value = strtoull(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "-keys") == 0) {
+      args.n_keys = value;
+    } else if (strcmp(argv[i], "-keylen") == 0) {
+      args.key_len = value;
+    } else if (strcmp(argv[i], "-lookups") == 0) {
+      args.n_lookups = value;
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (args.n_keys == 0 || args.n_lookups == 0 || args.key_len < 12 || args.key_len > UINT8_MAX) {
+    fprintf(stderr, "-keys and -lookups must be positive, and -keylen from 12 to %d\n", UINT8_MAX);
+    exit(1);
+  }
+  return args;
+}
+
+// Big tables are mmap()ed rather than carved out of the heap.
+size_t heap_in_use() {
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// Key i, padded to key_len. Odd i are never inserted, for missed lookups.
+void make_key(const uint64_t i, const size_t key_len, char* const buf) {
+  char digits[32];
+  snprintf(digits, sizeof(digits), "user%08lu", i);
+  memset(buf, 'x', key_len);
+  memcpy(buf, digits, strlen(digits));
+}
+
+struct Result {
+  double insert_ns;
+  double lookup_ns;
+  double bytes_per_key;
+};
+
+// Table has find(key, len) and put(key, len, value) like KeyTable's.
+template <typename Table>
+Result measure(const Args& args, const std::vector<uint64_t>& lookups, const char* const name) {
+  std::vector<char> key(args.key_len);
+  const size_t heap_before = heap_in_use();
+  Table* const table = new Table();
+
+  uint64_t start_ns = now_nsec();
+  for (uint64_t i = 0; i < args.n_keys; ++i) {
+    make_key(2 * i, args.key_len, key.data());
+    table->put(key.data(), args.key_len, (void*) (i + 1));
+  }
+  const uint64_t insert_ns = now_nsec() - start_ns;
+  const size_t heap_len = heap_in_use() - heap_before;
+
+  // The keys are made up front, so that only lookups are timed, and cycled
+  // through to make up the count.
+  std::vector<char> keys(lookups.size() * args.key_len);
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    make_key(lookups[i], args.key_len, &keys[i * args.key_len]);
+  }
+  uint64_t n_found = 0;
+  start_ns = now_nsec();
+  for (size_t i = 0, k = 0; i < args.n_lookups; ++i, k = k + 1 == lookups.size() ? 0 : k + 1) {
+    n_found += NULL != table->find(&keys[k * args.key_len], args.key_len);
+  }
+  const uint64_t lookup_ns = now_nsec() - start_ns;
+  printf("%s: found %lu of %zu\n", name, n_found, args.n_lookups);
+
+  delete table;
+  return Result{
+    (double) insert_ns / args.n_keys,
+    (double) lookup_ns / args.n_lookups,
+    (double) heap_len / args.n_keys,
+  };
+}
+
+// The keystore's map before KeyTable, behind the same interface.
+class StdMap {
+public:
+  void* find(const char* const key, const size_t key_len) const {
+    const auto iter = map_.find(std::string(key, key_len));
+    return iter == map_.end() ? NULL : iter->second;
+  }
+
+  void* put(const char* const key, const size_t key_len, void* const value) {
+    const auto inserted = map_.emplace(std::string(key, key_len), value);
+    if (inserted.second) return NULL;
+    void* const replaced = inserted.first->second;
+    inserted.first->second = value;
+    return replaced;
+  }
+
+private:
+  std::unordered_map<std::string, void*> map_;
+};
+
+int main(int argc, char** argv) {
+  const Args args = parse_args(argc, argv);
+
+  // At most a million distinct keys are looked up, so that they fit in
+  // memory.
+  Rng rng(1);
+  std::vector<uint64_t> lookups(args.n_lookups < 1000000 ? args.n_lookups : 1000000);
+  for (uint64_t& key : lookups) key = rng.below(2 * args.n_keys);
+
+  const Result map = measure<StdMap>(args, lookups, "unordered_map");
+  const Result table = measure<KeyTable>(args, lookups, "KeyTable");
+  printf("%-16s %12s %12s %12s\n", "", "insert ns", "lookup ns", "bytes/key");
+  printf("%-16s %12.1f %12.1f %12.1f\n", "unordered_map", map.insert_ns, map.lookup_ns, map.bytes_per_key);
+  printf("%-16s %12.1f %12.1f %12.1f\n", "KeyTable", table.insert_ns, table.lookup_ns, table.bytes_per_key);
+  return 0;
+}
@@ -1,21 +1,505 @@
 #include "log.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-// Logs the header and the first 24 bytes of the body, truncated or
-// zero-extended to fit a length of 24.
-int log(int log_fd, const RPCMessage* message) {
-  if (-1 == write(log_fd, &message->header, sizeof(message->header))) {
+#include <algorithm>
+
+#include "varint.h"
+
+namespace {
+
+// Records logged to a columnar log and not yet written out.
+struct ColumnWriter {
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<LogRecord> records;
+};
+
+// Columnar logs by file descriptor, looked up by every log() call, so
+// without a lock: set and cleared atomically by log_open() and log_close().
+constexpr int LOG_MAX_FDS = 4096;
+ColumnWriter* column_writers[LOG_MAX_FDS];
+
+ColumnWriter* column_writer(const int log_fd) {
+  if (log_fd < 0 || log_fd >= LOG_MAX_FDS) return NULL;
+  return __atomic_load_n(&column_writers[log_fd], __ATOMIC_ACQUIRE);
+}
+
+// Each column is built in a vector of its own before they're written out in
+// one go.
+void append_varint(std::vector<uint8_t>* const column, const uint64_t value) {
+  uint8_t buf[VARINT_MAX_LEN];
+  column->insert(column->end(), buf, buf + put_varint(buf, value));
+}
+
+void append_bytes(std::vector<uint8_t>* const column, const void* const bytes, const size_t len) {
+  column->insert(column->end(), (const uint8_t*) bytes, (const uint8_t*) bytes + len);
+}
+
+// A time other than T1, as a delta from it, leaving 0 for an unset one.
+uint64_t encode_time(const uint64_t time_us, const uint64_t send_time_us) {
+  if (0 == time_us) return 0;
+  return zigzag((int64_t) (time_us - send_time_us)) + 1;
+}
+
+uint64_t decode_time(const uint64_t encoded, const uint64_t send_time_us) {
+  if (0 == encoded) return 0;
+  return send_time_us + unzigzag(encoded - 1);
+}
+
+struct Addrs {
+  uint32_t client_ip;
+  uint32_t server_ip;
+  uint16_t client_port;
+  uint16_t server_port;
+
+  bool operator==(const Addrs& other) const {
+    return client_ip == other.client_ip && server_ip == other.server_ip
+      && client_port == other.client_port && server_port == other.server_port;
+  }
+};
+
+static_assert(sizeof(Addrs) == 12);
+
+// Returns the index of value in dict, adding it if it isn't there. Blocks
+// see a handful of distinct methods and peers, so a linear search does.
+template <typename T>
+uint64_t dict_index(std::vector<T>* const dict, const T& value) {
+  const auto found = std::find(dict->begin(), dict->end(), value);
+  if (found != dict->end()) return found - dict->begin();
+  dict->push_back(value);
+  return dict->size() - 1;
+}
+
+struct Method {
+  char name[8];
+
+  bool operator==(const Method& other) const { return 0 == memcmp(name, other.name, 8); }
+};
+
+// Encodes records as a block and writes it to log_fd in one write().
+int write_block(const int log_fd, const std::vector<LogRecord>& records) {
+  std::vector<uint8_t> columns[LOG_N_COLUMNS];
+  auto column = [&columns](const LogColumn which) { return &columns[(int) which]; };
+
+  LogBlockHeader block = {};
+  block.n_records = records.size();
+  block.min_send_time_us = UINT64_MAX;
+  block.min_rpc_id = UINT32_MAX;
+
+  uint32_t prev_rpc_id = 0;
+  uint64_t prev_send_time_us = 0;
+  uint64_t prev_recv_cycles = 0;
+  std::vector<Addrs> addrs_dict;
+  std::vector<uint64_t> addrs_indices;
+  std::vector<Method> method_dict;
+  std::vector<uint64_t> method_indices;
+  for (const LogRecord& record : records) {
+    const RPCHeader& header = record.header;
+    block.min_send_time_us = MIN(block.min_send_time_us, header.req_send_time_us);
+    block.max_send_time_us = MAX(block.max_send_time_us, header.req_send_time_us);
+    block.min_rpc_id = MIN(block.min_rpc_id, header.rpc_id);
+    block.max_rpc_id = MAX(block.max_rpc_id, header.rpc_id);
+
+    append_varint(column(LogColumn::RpcId), zigzag((int64_t) header.rpc_id - prev_rpc_id));
+    prev_rpc_id = header.rpc_id;
+    append_varint(column(LogColumn::Parent), header.parent);
+
+    std::vector<uint8_t>* const times = column(LogColumn::Times);
+    append_varint(times, zigzag((int64_t) (header.req_send_time_us - prev_send_time_us)));
+    prev_send_time_us = header.req_send_time_us;
+    append_varint(times, encode_time(header.req_recv_time_us, header.req_send_time_us));
+    append_varint(times, encode_time(header.res_send_time_us, header.req_send_time_us));
+    append_varint(times, encode_time(header.res_recv_time_us, header.req_send_time_us));
+
+    addrs_indices.push_back(dict_index(
+      &addrs_dict, Addrs{header.client_ip, header.server_ip, header.client_port, header.server_port}
+    ));
+
+    column(LogColumn::Lens)->push_back(header.req_len_log);
+    column(LogColumn::Lens)->push_back(header.res_len_log);
+    append_varint(column(LogColumn::Kind), (uint16_t) header.message_type);
+    append_varint(column(LogColumn::Kind), (uint32_t) header.status);
+
+    Method method;
+    memcpy(method.name, header.method, 8);
+    method_indices.push_back(dict_index(&method_dict, method));
+
+    uint8_t body_len = sizeof(record.body);
+    while (body_len > 0 && 0 == record.body[body_len - 1]) --body_len;
+    column(LogColumn::Body)->push_back(body_len);
+    append_bytes(column(LogColumn::Body), record.body, body_len);
+
+    std::vector<uint8_t>* const phases = column(LogColumn::Phases);
+    phases->push_back(record.has_phases);
+    if (record.has_phases) {
+      append_varint(phases, zigzag((int64_t) (record.phases.recv_cycles - prev_recv_cycles)));
+      prev_recv_cycles = record.phases.recv_cycles;
+      for (int i = 0; i < N_PHASES; ++i) append_varint(phases, record.phases.cycles[i]);
+      append_varint(phases, record.phases.cycles_per_us);
+    }
+  }
+
+  append_varint(column(LogColumn::Addrs), addrs_dict.size());
+  append_bytes(column(LogColumn::Addrs), addrs_dict.data(), addrs_dict.size() * sizeof(Addrs));
+  for (const uint64_t index : addrs_indices) append_varint(column(LogColumn::Addrs), index);
+  append_varint(column(LogColumn::Method), method_dict.size());
+  append_bytes(column(LogColumn::Method), method_dict.data(), method_dict.size() * sizeof(Method));
+  for (const uint64_t index : method_indices) append_varint(column(LogColumn::Method), index);
+
+  iovec iov[1 + LOG_N_COLUMNS];
+  iov[0] = {&block, sizeof(block)};
+  size_t block_len = sizeof(block);
+  for (int i = 0; i < LOG_N_COLUMNS; ++i) {
+    block.column_len[i] = columns[i].size();
+    iov[1 + i] = {columns[i].data(), columns[i].size()};
+    block_len += columns[i].size();
+  }
+  const ssize_t n_written = writev(log_fd, iov, 1 + LOG_N_COLUMNS);
+  if (-1 == n_written) return -1;
+  if ((size_t) n_written != block_len) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+}  // namespace
+
+LogExtension log_extension(const RPCHeader& header) {
+  if (0 != memcmp(header.pad, LOG_EXT_TAG, sizeof(LOG_EXT_TAG))) return LogExtension::None;
+  return (LogExtension) header.pad[2];
+}
+
+size_t log_extension_len(const RPCHeader& header) {
+  if (LogExtension::None == log_extension(header)) return 0;
+  return (uint8_t) header.pad[3] * 8;
+}
+
+int log_open(const char* const path, const LogFormat format) {
+  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+  const int log_fd = creat(path, RW_MODE);
+  if (-1 == log_fd || LogFormat::Rows == format) return log_fd;
+  if (log_fd >= LOG_MAX_FDS) {
+    close(log_fd);
+    errno = EMFILE;
     return -1;
   }
-  uint8_t log_body[24];
+  if (sizeof(LOG_COLUMNS_MAGIC) != write(log_fd, LOG_COLUMNS_MAGIC, sizeof(LOG_COLUMNS_MAGIC))) {
+    close(log_fd);
+    return -1;
+  }
+  ColumnWriter* const writer = new ColumnWriter();
+  writer->records.reserve(LOG_BLOCK_RECORDS);
+  __atomic_store_n(&column_writers[log_fd], writer, __ATOMIC_RELEASE);
+  return log_fd;
+}
+
+int log_close(const int log_fd) {
+  ColumnWriter* const writer = column_writer(log_fd);
+  int result = 0;
+  if (NULL != writer) {
+    __atomic_store_n(&column_writers[log_fd], NULL, __ATOMIC_RELEASE);
+    if (!writer->records.empty()) result = write_block(log_fd, writer->records);
+    delete writer;
+  }
+  if (-1 == close(log_fd)) result = -1;
+  return result;
+}
+
+// A row record goes out in a single write() so that records logged by
+// several threads to the same file don't interleave. A columnar log's
+// records are gathered under its writer's lock, which also orders its
+// blocks.
+int log(int log_fd, const RPCMessage* message) {
+  ColumnWriter* const writer = column_writer(log_fd);
+  if (NULL != writer) {
+    LogRecord record;
+    memcpy(&record.header, &message->header, sizeof(RPCHeader));
+    memset(record.header.pad, 0, sizeof(record.header.pad));
+    memset(record.body, 0, sizeof(record.body));
+    if (message->body != NULL) {
+      memcpy(record.body, message->body, MIN(sizeof(record.body), message->mark.data_len));
+    }
+    record.has_phases = NULL != message->phases && RpcMessageType::Response == message->header.message_type;
+    if (record.has_phases) {
+      memcpy(&record.phases, message->phases, sizeof(PhaseTimes));
+    } else {
+      memset(&record.phases, 0, sizeof(PhaseTimes));
+    }
+
+    int result = 0;
+    pthread_mutex_lock(&writer->mutex);
+    writer->records.push_back(record);
+    if (writer->records.size() >= LOG_BLOCK_RECORDS) {
+      result = write_block(log_fd, writer->records);
+      writer->records.clear();
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return result;
+  }
+
+  uint8_t record[LOG_RECORD_LEN + sizeof(PhaseTimes)];
+  RPCHeader* const header = (RPCHeader*) record;
+  memcpy(header, &message->header, sizeof(RPCHeader));
+  // The pad isn't necessarily zeroed on the wire, so that a stray tag
+  // doesn't make it look extended.
+  memset(header->pad, 0, sizeof(header->pad));
+  size_t record_len = LOG_RECORD_LEN;
+
+  // Requests are logged before they're answered, so only the response has
+  // the full set of times.
+  if (NULL != message->phases && RpcMessageType::Response == message->header.message_type) {
+    memcpy(header->pad, LOG_EXT_TAG, sizeof(LOG_EXT_TAG));
+    header->pad[2] = (char) LogExtension::Phases;
+    header->pad[3] = sizeof(PhaseTimes) / 8;
+    memcpy(record + LOG_RECORD_LEN, message->phases, sizeof(PhaseTimes));
+    record_len += sizeof(PhaseTimes);
+  }
+
+  uint8_t* const log_body = record + sizeof(RPCHeader);
   memset(log_body, 0, 24);
   if (message->body != NULL) {
     memcpy(log_body, message->body, MIN(24, message->mark.data_len));
   }
-  if (-1 == write(log_fd, log_body, 24)) return -1;
+  if (-1 == write(log_fd, record, record_len)) return -1;
   return 0;
 }
 
+LogReader* LogReader::Open(const char* const path, const uint32_t columns) {
+  FILE* const file = fopen(path, "rb");
+  if (NULL == file) return NULL;
+  LogReader* const reader = new LogReader();
+  reader->file_ = file;
+  reader->columns_ = columns;
+  char magic[sizeof(LOG_COLUMNS_MAGIC)];
+  if (1 == fread(magic, sizeof(magic), 1, file)
+      && 0 == memcmp(magic, LOG_COLUMNS_MAGIC, sizeof(LOG_COLUMNS_MAGIC))) {
+    reader->format_ = LogFormat::Columns;
+    reader->bytes_read_ = sizeof(magic);
+  } else {
+    rewind(file);
+  }
+  return reader;
+}
+
+LogReader::~LogReader() {
+  if (NULL != file_) fclose(file_);
+}
+
+void LogReader::set_window(const uint64_t from_us, const uint64_t to_us) {
+  from_us_ = from_us;
+  to_us_ = to_us;
+}
+
+int LogReader::next(LogRecord* const record) {
+  while (true) {
+    if (LogFormat::Columns == format_) {
+      if (next_in_block_ == block_.size()) {
+        const int result = read_block();
+        if (result <= 0) return result;
+      }
+      *record = block_[next_in_block_++];
+    } else {
+      if (1 != fread(&record->header, sizeof(RPCHeader), 1, file_)) return feof(file_) ? 0 : -1;
+      if (1 != fread(record->body, sizeof(record->body), 1, file_)) return -1;
+      bytes_read_ += LOG_RECORD_LEN;
+      const size_t ext_len = log_extension_len(record->header);
+      record->has_phases = LogExtension::Phases == log_extension(record->header) && ext_len >= sizeof(PhaseTimes);
+      if (record->has_phases) {
+        if (1 != fread(&record->phases, sizeof(PhaseTimes), 1, file_)) return -1;
+        if (0 != fseek(file_, ext_len - sizeof(PhaseTimes), SEEK_CUR)) return -1;
+      } else {
+        memset(&record->phases, 0, sizeof(PhaseTimes));
+        if (0 != fseek(file_, ext_len, SEEK_CUR)) return -1;
+      }
+      bytes_read_ += ext_len;
+      memset(record->header.pad, 0, sizeof(record->header.pad));
+    }
+    const uint64_t send_time_us = record->header.req_send_time_us;
+    // Without the Times column, there are no times to go by.
+    if (LogFormat::Columns == format_ && !(columns_ & log_column_bit(LogColumn::Times))) return 1;
+    if (send_time_us >= from_us_ && send_time_us <= to_us_) return 1;
+  }
+}
+
+int LogReader::read_block() {
+  block_.clear();
+  next_in_block_ = 0;
+  while (true) {
+    LogBlockHeader header;
+    if (1 != fread(&header, sizeof(header), 1, file_)) return feof(file_) ? 0 : -1;
+    bytes_read_ += sizeof(header);
+    if (0 == header.n_records || header.n_records > LOG_BLOCK_RECORDS) return -1;
+    // No record takes anywhere near this much of any column, dictionary
+    // entry included, so a longer column is corrupt rather than something to
+    // allocate for.
+    constexpr uint64_t MAX_COLUMN_LEN_PER_RECORD = 256;
+    for (int i = 0; i < LOG_N_COLUMNS; ++i) {
+      if (header.column_len[i] > header.n_records * MAX_COLUMN_LEN_PER_RECORD) return -1;
+    }
+
+    if (header.max_send_time_us < from_us_ || header.min_send_time_us > to_us_) {
+      uint64_t block_len = 0;
+      for (int i = 0; i < LOG_N_COLUMNS; ++i) block_len += header.column_len[i];
+      if (0 != fseek(file_, block_len, SEEK_CUR)) return -1;
+      continue;
+    }
+
+    block_.assign(header.n_records, LogRecord{});
+    std::vector<uint8_t> column;
+    for (int i = 0; i < LOG_N_COLUMNS; ++i) {
+      if (!(columns_ & (1u << i))) {
+        if (0 != fseek(file_, header.column_len[i], SEEK_CUR)) return -1;
+        continue;
+      }
+      column.resize(header.column_len[i]);
+      if (!column.empty() && 1 != fread(column.data(), column.size(), 1, file_)) return -1;
+      bytes_read_ += column.size();
+      if (!decode_column((LogColumn) i, column.data(), column.data() + column.size())) return -1;
+    }
+    return 1;
+  }
+}
+
+bool LogReader::decode_column(const LogColumn which, const uint8_t* in, const uint8_t* const end) {
+  uint64_t value;
+  switch (which) {
+  case LogColumn::RpcId: {
+    uint32_t rpc_id = 0;
+    for (LogRecord& record : block_) {
+      if (!get_varint(&in, end, &value)) return false;
+      rpc_id += unzigzag(value);
+      record.header.rpc_id = rpc_id;
+    }
+    break;
+  }
+  case LogColumn::Parent:
+    for (LogRecord& record : block_) {
+      if (!get_varint(&in, end, &value)) return false;
+      record.header.parent = value;
+    }
+    break;
+  case LogColumn::Times: {
+    uint64_t send_time_us = 0;
+    for (LogRecord& record : block_) {
+      RPCHeader& header = record.header;
+      if (!get_varint(&in, end, &value)) return false;
+      send_time_us += unzigzag(value);
+      header.req_send_time_us = send_time_us;
+      uint64_t* const others[3] = {&header.req_recv_time_us, &header.res_send_time_us, &header.res_recv_time_us};
+      for (uint64_t* const time_us : others) {
+        if (!get_varint(&in, end, &value)) return false;
+        *time_us = decode_time(value, send_time_us);
+      }
+    }
+    break;
+  }
+  case LogColumn::Addrs: {
+    uint64_t n_addrs;
+    if (!get_varint(&in, end, &n_addrs) || n_addrs > (uint64_t) (end - in) / sizeof(Addrs)) return false;
+    std::vector<Addrs> dict(n_addrs);
+    memcpy(dict.data(), in, n_addrs * sizeof(Addrs));
+    in += n_addrs * sizeof(Addrs);
+    for (LogRecord& record : block_) {
+      if (!get_varint(&in, end, &value) || value >= n_addrs) return false;
+      record.header.client_ip = dict[value].client_ip;
+      record.header.server_ip = dict[value].server_ip;
+      record.header.client_port = dict[value].client_port;
+      record.header.server_port = dict[value].server_port;
+    }
+    break;
+  }
+  case LogColumn::Lens:
+    if ((size_t) (end - in) < 2 * block_.size()) return false;
+    for (LogRecord& record : block_) {
+      record.header.req_len_log = *in++;
+      record.header.res_len_log = *in++;
+    }
+    break;
+  case LogColumn::Kind:
+    for (LogRecord& record : block_) {
+      if (!get_varint(&in, end, &value)) return false;
+      record.header.message_type = (RpcMessageType) value;
+      if (!get_varint(&in, end, &value)) return false;
+      record.header.status = (RpcStatus) value;
+    }
+    break;
+  case LogColumn::Method: {
+    uint64_t n_methods;
+    if (!get_varint(&in, end, &n_methods) || n_methods > (uint64_t) (end - in) / sizeof(Method)) return false;
+    const uint8_t* const dict = in;
+    in += n_methods * sizeof(Method);
+    for (LogRecord& record : block_) {
+      if (!get_varint(&in, end, &value) || value >= n_methods) return false;
+      memcpy(record.header.method, dict + value * sizeof(Method), sizeof(Method));
+    }
+    break;
+  }
+  case LogColumn::Body:
+    for (LogRecord& record : block_) {
+      if (in == end || *in > sizeof(record.body) || (size_t) (end - in) < 1u + *in) return false;
+      const uint8_t body_len = *in++;
+      memcpy(record.body, in, body_len);
+      in += body_len;
+    }
+    break;
+  case LogColumn::Phases: {
+    uint64_t recv_cycles = 0;
+    for (LogRecord& record : block_) {
+      if (in == end) return false;
+      record.has_phases = *in++;
+      if (!record.has_phases) continue;
+      if (!get_varint(&in, end, &value)) return false;
+      recv_cycles += unzigzag(value);
+      record.phases.recv_cycles = recv_cycles;
+      for (int i = 0; i < N_PHASES; ++i) {
+        if (!get_varint(&in, end, &value)) return false;
+        record.phases.cycles[i] = value;
+      }
+      if (!get_varint(&in, end, &value)) return false;
+      record.phases.cycles_per_us = value;
+    }
+    break;
+  }
+  case LogColumn::N_COLUMNS:
+    return false;
+  }
+  return in == end;
+}
+
+
+int capture_open(const char* const path) {
+  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+  int capture_fd = creat(path, RW_MODE);
+  if (-1 == capture_fd) return -1;
+  if (sizeof(CAPTURE_MAGIC) != write(capture_fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC))) {
+    close(capture_fd);
+    return -1;
+  }
+  return capture_fd;
+}
+
+// Like log(), the record goes out in a single writev() so that records from
+// several threads don't interleave. A short write would leave a torn record
+// that load_capture() misparses, so it's an error too.
+int capture(int capture_fd, const RPCMessage* message) {
+  uint32_t data_len = message->mark.data_len;
+  iovec iov[3] = {
+    {(void*) &message->header, sizeof(RPCHeader)},
+    {&data_len, sizeof(data_len)},
+    {message->body, data_len},
+  };
+  const ssize_t n_written = writev(capture_fd, iov, 3);
+  if (-1 == n_written) return -1;
+  if ((size_t) n_written != sizeof(RPCHeader) + sizeof(data_len) + data_len) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
@@ -1,7 +1,204 @@
 #pragma once
 
+#include <stdio.h>
+
+#include <vector>
+
+#include "phases.h"
 #include "rpc.h"
 
-// Logs the header and the first few bytes of the body, if present.
+// A log file is a sequence of records, each the message's header followed by
+// the first 24 bytes of its body, truncated or zero-extended:
+//
+// +------------+------------+-------------
+// | RPC header | body[0:24] | extension
+// +------------+------------+-------------
+//      72 B         24 B      0 or pad[3] * 8 B
+//
+// A record whose header's pad starts with LOG_EXT_TAG is followed by an
+// extension of kind pad[2] and pad[3] * 8 bytes. A record without one is
+// exactly 96 bytes, as logs always were.
+constexpr size_t LOG_RECORD_LEN = sizeof(RPCHeader) + 24;
+constexpr char LOG_EXT_TAG[2] = {'X', 'T'};
+
+enum class LogExtension : uint8_t {
+  None,
+  // PhaseTimes from the server, after a response's record.
+  Phases,
+};
+
+// Returns the kind of extension following header's record.
+LogExtension log_extension(const RPCHeader& header);
+
+// Returns the length in bytes of the extension following header's record.
+size_t log_extension_len(const RPCHeader& header);
+
+// Logs the header and the first few bytes of the body, if present, plus the
+// message's phase times if it has them, in the format log_fd was opened
+// with.
 int log(int log_fd, const RPCMessage* message);
 
+// A columnar log file starts with LOG_COLUMNS_MAGIC, followed by blocks of up
+// to LOG_BLOCK_RECORDS records each. A block is a LogBlockHeader, then each
+// column in LogColumn order, its length in column_len:
+//
+// +-----------------+--------+--------+-----+-------------
+// | LogBlockHeader  | rpc_id | parent | ... | phases
+// +-----------------+--------+--------+-----+-------------
+//       104 B
+//
+// Each column holds one field, or a few that are read together, of every
+// record in the block in turn, so that a reader can skip the columns it
+// doesn't need, and so that fields that repeat from record to record encode
+// small:
+//
+//   RpcId   rpc_id, as a zigzag varint delta from the previous record's
+//   Parent  parent, as a varint
+//   Times   req_send_time_us as a zigzag varint delta from the previous
+//           record's, then each of the other three as a varint: 0 if it is
+//           0, and otherwise 1 more than its zigzag delta from
+//           req_send_time_us
+//   Addrs   a dictionary of the block's distinct client and server IP and
+//           port quadruples: a varint count, then each as 12 bytes in
+//           RPCHeader order; then each record's index into it, as a varint
+//   Lens    req_len_log and res_len_log, a byte each
+//   Kind    message_type and status, a varint each
+//   Method  a dictionary of the block's distinct methods, as a varint count
+//           and 8 bytes each, then each record's index into it, as a varint
+//   Body    the 24-byte body prefix without its trailing zeros, as a byte of
+//           length and that many bytes
+//   Phases  for each record, a byte that is 1 if it has PhaseTimes and 0 if
+//           not, and for those that do, recv_cycles as a zigzag varint delta
+//           from the previous ones' and each of cycles[] and cycles_per_us as
+//           a varint
+//
+// The block header indexes the block by the range of its req_send_time_us
+// and rpc_id, so a reader after a window of time can skip whole blocks.
+// Dictionaries and deltas start afresh in each block.
+//
+// Records are buffered until a block fills up, so a columnar log must be
+// closed with log_close() for its last block to be written out.
+constexpr char LOG_COLUMNS_MAGIC[8] = "USDLOGC";
+constexpr size_t LOG_BLOCK_RECORDS = 4096;
+
+enum class LogFormat {
+  // LOG_RECORD_LEN-byte records, as above.
+  Rows,
+  Columns,
+};
+
+enum class LogColumn {
+  RpcId,
+  Parent,
+  Times,
+  Addrs,
+  Lens,
+  Kind,
+  Method,
+  Body,
+  Phases,
+  N_COLUMNS
+};
+
+constexpr int LOG_N_COLUMNS = (int) LogColumn::N_COLUMNS;
+
+// A set of columns, for LogReader.
+constexpr uint32_t log_column_bit(const LogColumn column) { return 1u << (int) column; }
+constexpr uint32_t LOG_ALL_COLUMNS = (1u << LOG_N_COLUMNS) - 1;
+
+struct LogBlockHeader {
+  uint32_t n_records;
+  uint32_t pad;
+  uint64_t min_send_time_us;
+  uint64_t max_send_time_us;
+  uint32_t min_rpc_id;
+  uint32_t max_rpc_id;
+  uint64_t column_len[LOG_N_COLUMNS];
+};
+
+static_assert(sizeof(LogBlockHeader) == 104);
+
+// Creates the log file at path, truncating it if it exists.
+//
+// Returns the file descriptor, for log(), or -1 on error.
+int log_open(const char* path, LogFormat format);
+
+// Writes out what a columnar log has buffered, and closes log_fd. No other
+// thread may be logging to it.
+int log_close(int log_fd);
+
+// A record of either format, as read back.
+struct LogRecord {
+  // With pad zeroed.
+  RPCHeader header;
+  uint8_t body[24];
+  bool has_phases;
+  PhaseTimes phases;
+};
+
+// Reads a log of either format, telling them apart by LOG_COLUMNS_MAGIC.
+class LogReader {
+public:
+  // Opens the log at path. Of a columnar log, only the given columns are
+  // read, and the fields of the others are left zero; a row log's records
+  // are read whole.
+  //
+  // Returns NULL and sets errno on error.
+  static LogReader* Open(const char* path, uint32_t columns = LOG_ALL_COLUMNS);
+
+  LogReader(const LogReader&) = delete;
+  LogReader& operator=(const LogReader&) = delete;
+  ~LogReader();
+
+  LogFormat format() const { return format_; }
+
+  // Skips records whose req_send_time_us is outside [from_us, to_us]. Of a
+  // columnar log, whole blocks outside it are skipped by their index,
+  // without reading them.
+  void set_window(uint64_t from_us, uint64_t to_us);
+
+  // Reads the next record into *record.
+  //
+  // Returns 1 if there was one, 0 at the end of the log, and -1 if the log
+  // is truncated or corrupt.
+  int next(LogRecord* record);
+
+  // Bytes read from the file so far.
+  uint64_t bytes_read() const { return bytes_read_; }
+
+private:
+  LogReader() = default;
+
+  // Reads and decodes the next block of a columnar log into block_.
+  int read_block();
+  // Decodes a column of the block from [in, end) into block_.
+  bool decode_column(LogColumn which, const uint8_t* in, const uint8_t* end);
+
+  FILE* file_ = NULL;
+  LogFormat format_ = LogFormat::Rows;
+  uint32_t columns_ = LOG_ALL_COLUMNS;
+  std::vector<LogRecord> block_;
+  size_t next_in_block_ = 0;
+  uint64_t from_us_ = 0;
+  uint64_t to_us_ = UINT64_MAX;
+  uint64_t bytes_read_ = 0;
+};
+
+
+// Capture files hold requests in full, so that the traffic can be replayed
+// (see replay.cc). A capture file starts with CAPTURE_MAGIC, followed by one
+// record per request:
+//
+// +------------+----------+--------
+// | RPC header | data_len | body
+// +------------+----------+--------
+//      72 B        4 B     data_len B
+constexpr char CAPTURE_MAGIC[8] = "USDCAP1";
+
+// Creates the capture file at path, truncating it if it exists.
+//
+// Returns the file descriptor, or -1 on error.
+int capture_open(const char* path);
+
+// Appends a record for message to the capture file.
+int capture(int capture_fd, const RPCMessage* message);
@@ -0,0 +1,969 @@
+#include "lsm.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include "phases.h"
+
+// A data block is a series of entries, in key order, each:
+//
+// +---------+-----------+-----+-------
+// | key_len | value_len | key | value
+// +---------+-----------+-----+-------
+//     1 B       4 B
+//
+// with a value_len of TOMBSTONE_LEN, and no value, for a tombstone. The index
+// has, for each block, its last key as a u8 length and the key, and the
+// block's u64 offset. The Bloom filter is a bit array. The footer comes last.
+constexpr size_t ENTRY_HEAD_LEN = 1 + 4;
+constexpr uint32_t TOMBSTONE_LEN = UINT32_MAX;
+
+struct SSTableFooter {
+  uint64_t index_offset;
+  uint64_t index_len;
+  uint64_t bloom_offset;
+  uint64_t bloom_len;
+  uint64_t n_entries;
+  uint32_t n_hashes;
+  uint32_t pad;
+  uint64_t magic;
+};
+
+// "LSMSST1" and a NUL, read as a little-endian u64.
+constexpr uint64_t SSTABLE_MAGIC = 0x0031545353534d4cull;
+
+static void add_stat(uint64_t* const stat, const uint64_t n) {
+  __atomic_add_fetch(stat, n, __ATOMIC_RELAXED);
+}
+
+// FNV-1a, then a finalizer to mix the high bits, which pick the Bloom filter
+// probes, as well as the low ones.
+static uint64_t hash_key(const char* const key, const size_t key_len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < key_len; ++i) {
+    hash ^= (uint8_t) key[i];
+    hash *= 0x100000001b3ull;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int write_all(const int fd, const void* const buf, const size_t n_bytes) {
+  const uint8_t* p = (const uint8_t*) buf;
+  size_t left = n_bytes;
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      return -1;
+    }
+    p += n;
+    left -= n;
+  }
+  return 0;
+}
+
+static int pread_all(const int fd, void* const buf, const size_t n_bytes, const uint64_t offset) {
+  size_t done = 0;
+  while (done < n_bytes) {
+    const ssize_t n = pread(fd, (uint8_t*) buf + done, n_bytes - done, offset + done);
+    if (n < 0 && EINTR == errno) continue;
+    if (n <= 0) {
+      if (0 == n) errno = EIO;
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+struct LsmStore::MemTable {
+  struct Entry {
+    std::string value;
+    bool deleted;
+  };
+
+  std::map<std::string, Entry> entries;
+  // Bytes the entries would take up in a data block.
+  size_t len = 0;
+};
+
+struct LsmStore::SSTable {
+  std::string path;
+  int fd = -1;
+  uint64_t file_len = 0;
+  uint64_t n_entries = 0;
+  std::string smallest;
+  std::string largest;
+
+  // The last key of each data block. Block i spans from block_offsets[i] to
+  // block_offsets[i + 1], the last one ending where the index starts.
+  std::vector<std::string> last_keys;
+  std::vector<uint64_t> block_offsets;
+
+  std::vector<uint8_t> bloom;
+  uint32_t n_hashes = 0;
+
+  // Set once a compaction has merged it away. The file is deleted once the
+  // last Version holding it is gone.
+  bool obsolete = false;
+
+  ~SSTable() {
+    if (fd >= 0) close(fd);
+    if (__atomic_load_n(&obsolete, __ATOMIC_ACQUIRE)) unlink(path.c_str());
+  }
+
+  bool covers(const std::string& key) const {
+    return smallest <= key && key <= largest;
+  }
+
+  bool may_contain(const uint64_t hash) const {
+    const uint64_t n_bits = bloom.size() * 8;
+    const uint64_t delta = (hash >> 32) | 1;
+    uint64_t bit = hash;
+    for (uint32_t i = 0; i < n_hashes; ++i, bit += delta) {
+      const uint64_t at = bit % n_bits;
+      if (0 == (bloom[at / 8] & (1 << (at % 8)))) return false;
+    }
+    return true;
+  }
+
+  // Returns the first block that may hold key, or last_keys.size() if key is
+  // past them all.
+  size_t find_block(const std::string& key) const {
+    return std::lower_bound(last_keys.begin(), last_keys.end(), key) - last_keys.begin();
+  }
+
+  int read_block(const size_t i, std::vector<uint8_t>* const buf) const {
+    buf->resize(block_offsets[i + 1] - block_offsets[i]);
+    return pread_all(fd, buf->data(), buf->size(), block_offsets[i]);
+  }
+};
+
+struct LsmStore::Version {
+  // Level 0 newest first, and the other levels in key order.
+  std::vector<std::shared_ptr<SSTable>> levels[N_LEVELS];
+
+  uint64_t level_bytes(const int level) const {
+    uint64_t n_bytes = 0;
+    for (const auto& table : levels[level]) n_bytes += table->file_len;
+    return n_bytes;
+  }
+};
+
+// Parses the entry at *at in block, moving *at past it.
+//
+// Returns false at the end of the block, or if the entry is cut off.
+static bool parse_entry(
+  const std::vector<uint8_t>& block,
+  size_t* const at,
+  const char** const key,
+  size_t* const key_len,
+  const uint8_t** const value,
+  uint32_t* const value_len
+) {
+  if (*at + ENTRY_HEAD_LEN > block.size()) return false;
+  *key_len = block[*at];
+  memcpy(value_len, &block[*at + 1], sizeof(*value_len));
+  const size_t stored_len = *value_len == TOMBSTONE_LEN ? 0 : *value_len;
+  if (*at + ENTRY_HEAD_LEN + *key_len + stored_len > block.size()) return false;
+  *key = (const char*) &block[*at + ENTRY_HEAD_LEN];
+  *value = &block[*at + ENTRY_HEAD_LEN + *key_len];
+  *at += ENTRY_HEAD_LEN + *key_len + stored_len;
+  return true;
+}
+
+// Writes an SSTable from entries added in key order.
+class TableBuilder {
+public:
+  TableBuilder(LsmStore::SSTable* table, size_t block_len, int bloom_bits_per_key)
+    : table_(table), block_len_(block_len), bloom_bits_per_key_(bloom_bits_per_key) {}
+
+  int add(const std::string& key, const uint8_t* const value, const size_t value_len, const bool deleted) {
+    if (0 == table_->n_entries) table_->smallest = key;
+    const uint32_t stored_len = deleted ? TOMBSTONE_LEN : value_len;
+    block_.push_back(key.size());
+    block_.insert(block_.end(), (const uint8_t*) &stored_len, (const uint8_t*) &stored_len + sizeof(stored_len));
+    block_.insert(block_.end(), key.begin(), key.end());
+    if (!deleted) block_.insert(block_.end(), value, value + value_len);
+    last_key_ = key;
+    hashes_.push_back(hash_key(key.data(), key.size()));
+    ++table_->n_entries;
+    if (block_.size() >= block_len_) return write_block();
+    return 0;
+  }
+
+  // Bytes written so far, and buffered.
+  uint64_t len() const { return offset_ + block_.size(); }
+
+  // Writes the last block, the index, the filter and the footer, and fills
+  // in the rest of the table's in-memory copies of them.
+  int finish() {
+    if (-1 == write_block()) return -1;
+    table_->largest = last_key_;
+    table_->block_offsets.push_back(offset_);
+
+    std::vector<uint8_t> index;
+    for (size_t i = 0; i < table_->last_keys.size(); ++i) {
+      const std::string& key = table_->last_keys[i];
+      index.push_back(key.size());
+      index.insert(index.end(), key.begin(), key.end());
+      const uint64_t offset = table_->block_offsets[i];
+      index.insert(index.end(), (const uint8_t*) &offset, (const uint8_t*) &offset + sizeof(offset));
+    }
+
+    // About 0.69 probes per bit per key is what minimizes false positives.
+    const size_t n_bits = std::max<size_t>(64, hashes_.size() * bloom_bits_per_key_);
+    table_->bloom.assign((n_bits + 7) / 8, 0);
+    table_->n_hashes = std::max(1, (int) (bloom_bits_per_key_ * 0.69));
+    const uint64_t n_filter_bits = table_->bloom.size() * 8;
+    for (const uint64_t hash : hashes_) {
+      const uint64_t delta = (hash >> 32) | 1;
+      uint64_t bit = hash;
+      for (uint32_t i = 0; i < table_->n_hashes; ++i, bit += delta) {
+        const uint64_t at = bit % n_filter_bits;
+        table_->bloom[at / 8] |= 1 << (at % 8);
+      }
+    }
+
+    SSTableFooter footer = {};
+    footer.index_offset = offset_;
+    footer.index_len = index.size();
+    footer.bloom_offset = offset_ + index.size();
+    footer.bloom_len = table_->bloom.size();
+    footer.n_entries = table_->n_entries;
+    footer.n_hashes = table_->n_hashes;
+    footer.magic = SSTABLE_MAGIC;
+    if (-1 == write_all(table_->fd, index.data(), index.size())
+        || -1 == write_all(table_->fd, table_->bloom.data(), table_->bloom.size())
+        || -1 == write_all(table_->fd, &footer, sizeof(footer))) {
+      return -1;
+    }
+    table_->file_len = footer.bloom_offset + footer.bloom_len + sizeof(footer);
+    return 0;
+  }
+
+private:
+  int write_block() {
+    if (block_.empty()) return 0;
+    if (-1 == write_all(table_->fd, block_.data(), block_.size())) return -1;
+    table_->last_keys.push_back(last_key_);
+    table_->block_offsets.push_back(offset_);
+    offset_ += block_.size();
+    block_.clear();
+    return 0;
+  }
+
+  LsmStore::SSTable* const table_;
+  const size_t block_len_;
+  const int bloom_bits_per_key_;
+  std::vector<uint8_t> block_;
+  std::string last_key_;
+  uint64_t offset_ = 0;
+  std::vector<uint64_t> hashes_;
+};
+
+// An iterator over entries in key order. The entry it is on is in its
+// fields, until next() moves it on.
+class LsmStore::Iter {
+public:
+  virtual ~Iter() = default;
+
+  // Moves to the next entry, or past the end, setting valid to false.
+  //
+  // Returns -1 and sets errno on error.
+  virtual int next() = 0;
+
+  bool valid = false;
+  std::string key;
+  std::string value;
+  bool deleted = false;
+};
+
+// Over a memtable, from start on.
+class MemIter : public LsmStore::Iter {
+public:
+  MemIter(std::shared_ptr<const LsmStore::MemTable> memtable, const std::string& start)
+    : memtable_(std::move(memtable)), at_(memtable_->entries.lower_bound(start)) {
+    load();
+  }
+
+  int next() override {
+    ++at_;
+    load();
+    return 0;
+  }
+
+private:
+  void load() {
+    valid = at_ != memtable_->entries.end();
+    if (!valid) return;
+    key = at_->first;
+    value = at_->second.value;
+    deleted = at_->second.deleted;
+  }
+
+  const std::shared_ptr<const LsmStore::MemTable> memtable_;
+  std::map<std::string, LsmStore::MemTable::Entry>::const_iterator at_;
+};
+
+// Over one SSTable, from start on, reading a block at a time and counting the
+// bytes read into *bytes_read.
+class TableIter : public LsmStore::Iter {
+public:
+  TableIter(std::shared_ptr<LsmStore::SSTable> table, uint64_t* const bytes_read)
+    : table_(std::move(table)), bytes_read_(bytes_read) {}
+
+  // Moves to the first entry >= start.
+  int seek(const std::string& start) {
+    block_ = table_->find_block(start);
+    at_ = 0;
+    buf_.clear();
+    if (block_ < table_->last_keys.size() && -1 == load_block()) return -1;
+    if (-1 == next()) return -1;
+    while (valid && key < start) {
+      if (-1 == next()) return -1;
+    }
+    return 0;
+  }
+
+  int next() override {
+    const char* entry_key;
+    size_t key_len;
+    const uint8_t* entry_value;
+    uint32_t value_len;
+    while (!parse_entry(buf_, &at_, &entry_key, &key_len, &entry_value, &value_len)) {
+      if (at_ < buf_.size()) {
+        errno = EIO;
+        valid = false;
+        return -1;
+      }
+      if (block_ + 1 >= table_->last_keys.size() || buf_.empty()) {
+        valid = false;
+        return 0;
+      }
+      ++block_;
+      if (-1 == load_block()) return -1;
+    }
+    valid = true;
+    key.assign(entry_key, key_len);
+    deleted = value_len == TOMBSTONE_LEN;
+    value.assign((const char*) entry_value, deleted ? 0 : value_len);
+    return 0;
+  }
+
+private:
+  int load_block() {
+    at_ = 0;
+    if (-1 == table_->read_block(block_, &buf_)) {
+      valid = false;
+      return -1;
+    }
+    add_stat(bytes_read_, buf_.size());
+    return 0;
+  }
+
+  const std::shared_ptr<LsmStore::SSTable> table_;
+  uint64_t* const bytes_read_;
+  size_t block_ = 0;
+  size_t at_ = 0;
+  std::vector<uint8_t> buf_;
+};
+
+// Over a level's files, which are in key order and don't overlap, one after
+// another.
+class LevelIter : public LsmStore::Iter {
+public:
+  LevelIter(std::vector<std::shared_ptr<LsmStore::SSTable>> tables, uint64_t* const bytes_read)
+    : tables_(std::move(tables)), bytes_read_(bytes_read) {}
+
+  int seek(const std::string& start) {
+    next_table_ = 0;
+    while (next_table_ < tables_.size() && tables_[next_table_]->largest < start) ++next_table_;
+    return open_next(start);
+  }
+
+  int next() override {
+    if (-1 == current_->next()) return -1;
+    if (!current_->valid) return open_next(std::string());
+    take();
+    return 0;
+  }
+
+private:
+  // Moves on to the first entry >= start of the next file that has one.
+  int open_next(const std::string& start) {
+    while (next_table_ < tables_.size()) {
+      current_.reset(new TableIter(tables_[next_table_++], bytes_read_));
+      if (-1 == current_->seek(start)) return -1;
+      if (current_->valid) {
+        take();
+        return 0;
+      }
+    }
+    valid = false;
+    return 0;
+  }
+
+  void take() {
+    valid = true;
+    key.swap(current_->key);
+    value.swap(current_->value);
+    deleted = current_->deleted;
+  }
+
+  const std::vector<std::shared_ptr<LsmStore::SSTable>> tables_;
+  uint64_t* const bytes_read_;
+  size_t next_table_ = 0;
+  std::unique_ptr<TableIter> current_;
+};
+
+// Merges sources, given newest first, into one run: a key in several of them
+// takes its entry from the newest.
+class MergeIter : public LsmStore::Iter {
+public:
+  explicit MergeIter(std::vector<std::unique_ptr<LsmStore::Iter>> sources)
+    : sources_(std::move(sources)) {
+    pick();
+  }
+
+  int next() override {
+    for (const auto& source : sources_) {
+      if (source->valid && source->key == key && -1 == source->next()) {
+        valid = false;
+        return -1;
+      }
+    }
+    pick();
+    return 0;
+  }
+
+private:
+  void pick() {
+    const LsmStore::Iter* smallest = NULL;
+    for (const auto& source : sources_) {
+      // Strictly less, so that ties go to the newer source.
+      if (source->valid && (NULL == smallest || source->key < smallest->key)) smallest = source.get();
+    }
+    valid = NULL != smallest;
+    if (!valid) return;
+    key = smallest->key;
+    value = smallest->value;
+    deleted = smallest->deleted;
+  }
+
+  std::vector<std::unique_ptr<LsmStore::Iter>> sources_;
+};
+
+LsmStore* LsmStore::Open(const char* const dir, const LsmConfig& config) {
+  if (-1 == mkdir(dir, 0755) && EEXIST != errno) return NULL;
+  DIR* const listing = opendir(dir);
+  if (NULL == listing) return NULL;
+  while (const dirent* const entry = readdir(listing)) {
+    const size_t len = strlen(entry->d_name);
+    if (len > 4 && strcmp(entry->d_name + len - 4, ".sst") == 0) {
+      unlinkat(dirfd(listing), entry->d_name, 0);
+    }
+  }
+  closedir(listing);
+
+  LsmStore* const store = new LsmStore();
+  store->dir_ = dir;
+  store->config_ = config;
+  store->mem_ = std::make_shared<MemTable>();
+  store->version_ = std::make_shared<Version>();
+  const int err = pthread_create(&store->thread_, NULL, background_main, store);
+  if (0 != err) {
+    // The store is left behind, as it has no thread to join; the caller
+    // exits.
+    errno = err;
+    return NULL;
+  }
+  return store;
+}
+
+LsmStore::~LsmStore() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_signal(&work_cond_);
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+  for (const auto& level : version_->levels) {
+    for (const auto& table : level) __atomic_store_n(&table->obsolete, true, __ATOMIC_RELEASE);
+  }
+}
+
+int LsmStore::put(const char* const key, const size_t key_len, const uint8_t* const value, const size_t value_len) {
+  return write(key, key_len, value, value_len, false);
+}
+
+int LsmStore::del(const char* const key, const size_t key_len) {
+  return write(key, key_len, NULL, 0, true);
+}
+
+int LsmStore::write(
+  const char* const key,
+  const size_t key_len,
+  const uint8_t* const value,
+  const size_t value_len,
+  const bool deleted
+) {
+  pthread_mutex_lock(&mutex_);
+  uint64_t stall_start_us = 0;
+  while (0 == failed_
+         && ((NULL != imm_ && mem_->len >= config_.memtable_len)
+             || version_->levels[0].size() >= (size_t) config_.l0_stall_files)) {
+    if (0 == stall_start_us) stall_start_us = now_nsec() / 1000;
+    pthread_cond_wait(&done_cond_, &mutex_);
+  }
+  if (0 != failed_) {
+    pthread_mutex_unlock(&mutex_);
+    errno = failed_;
+    return -1;
+  }
+  if (0 != stall_start_us) add_stat(&stats_.stall_us, now_nsec() / 1000 - stall_start_us);
+
+  const auto inserted = mem_->entries.emplace(std::string(key, key_len), MemTable::Entry());
+  MemTable::Entry& entry = inserted.first->second;
+  if (inserted.second) {
+    mem_->len += ENTRY_HEAD_LEN + key_len;
+  } else {
+    mem_->len -= entry.value.size();
+  }
+  entry.value.assign((const char*) value, value_len);
+  entry.deleted = deleted;
+  mem_->len += value_len;
+  add_stat(&stats_.user_bytes_written, key_len + value_len);
+
+  if (NULL == imm_ && mem_->len >= config_.memtable_len) {
+    imm_ = mem_;
+    mem_ = std::make_shared<MemTable>();
+    busy_ = true;
+    pthread_cond_signal(&work_cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return 0;
+}
+
+// Looks for key in the table, counting what it costs into stats.
+//
+// Returns 1 if the table has a value for it, in *value, 0 if not, 2 if it has
+// a tombstone, and -1 on error.
+static int table_get(
+  const LsmStore::SSTable& table,
+  const std::string& key,
+  const uint64_t hash,
+  std::string* const value,
+  LsmStats* const stats
+) {
+  add_stat(&stats->get_files_probed, 1);
+  if (!table.may_contain(hash)) {
+    add_stat(&stats->get_bloom_skips, 1);
+    return 0;
+  }
+  const size_t block = table.find_block(key);
+  if (block == table.last_keys.size()) return 0;
+  static thread_local std::vector<uint8_t> buf;
+  if (-1 == table.read_block(block, &buf)) return -1;
+  add_stat(&stats->get_blocks_read, 1);
+  add_stat(&stats->get_bytes_read, buf.size());
+
+  size_t at = 0;
+  const char* entry_key;
+  size_t key_len;
+  const uint8_t* entry_value;
+  uint32_t value_len;
+  while (parse_entry(buf, &at, &entry_key, &key_len, &entry_value, &value_len)) {
+    const int cmp = key.compare(0, key.size(), entry_key, key_len);
+    if (cmp > 0) continue;
+    if (cmp < 0) return 0;
+    if (value_len == TOMBSTONE_LEN) return 2;
+    value->assign((const char*) entry_value, value_len);
+    return 1;
+  }
+  return 0;
+}
+
+int LsmStore::get(const char* const key, const size_t key_len, std::string* const value) {
+  const std::string wanted(key, key_len);
+  add_stat(&stats_.n_gets, 1);
+
+  pthread_mutex_lock(&mutex_);
+  const MemTable* const memtables[2] = {mem_.get(), imm_.get()};
+  for (const MemTable* const memtable : memtables) {
+    if (NULL == memtable) continue;
+    const auto found = memtable->entries.find(wanted);
+    if (found == memtable->entries.end()) continue;
+    const bool deleted = found->second.deleted;
+    if (!deleted) *value = found->second.value;
+    pthread_mutex_unlock(&mutex_);
+    if (!deleted) add_stat(&stats_.get_value_bytes, value->size());
+    return deleted ? 0 : 1;
+  }
+  const std::shared_ptr<const Version> version = version_;
+  pthread_mutex_unlock(&mutex_);
+
+  const uint64_t hash = hash_key(key, key_len);
+  int found = 0;
+  for (const auto& table : version->levels[0]) {
+    if (!table->covers(wanted)) continue;
+    found = table_get(*table, wanted, hash, value, &stats_);
+    if (0 != found) break;
+  }
+  for (int level = 1; level < N_LEVELS && 0 == found; ++level) {
+    const auto& tables = version->levels[level];
+    const auto table = std::lower_bound(
+      tables.begin(), tables.end(), wanted,
+      [](const std::shared_ptr<SSTable>& t, const std::string& k) { return t->largest < k; }
+    );
+    if (table == tables.end() || !(*table)->covers(wanted)) continue;
+    found = table_get(**table, wanted, hash, value, &stats_);
+  }
+  if (1 == found) add_stat(&stats_.get_value_bytes, value->size());
+  return 2 == found ? 0 : found;
+}
+
+size_t LsmStore::scan(
+  const char* const start,
+  const size_t start_len,
+  const char* const end,
+  const size_t end_len,
+  const bool has_end,
+  const size_t limit,
+  const ScanVisitor visit,
+  void* const arg
+) {
+  const std::string from(start, start_len);
+  const std::string to(end, end_len);
+
+  // The live memtable keeps changing, so its keys in range are copied out.
+  std::vector<std::unique_ptr<Iter>> sources;
+  pthread_mutex_lock(&mutex_);
+  const std::shared_ptr<MemTable> copy = std::make_shared<MemTable>();
+  for (auto it = mem_->entries.lower_bound(from);
+       it != mem_->entries.end() && (!has_end || it->first < to);
+       ++it) {
+    copy->entries.emplace_hint(copy->entries.end(), it->first, MemTable::Entry{std::string(), it->second.deleted});
+  }
+  const std::shared_ptr<const MemTable> imm = imm_;
+  const std::shared_ptr<const Version> version = version_;
+  pthread_mutex_unlock(&mutex_);
+
+  // Scans aren't counted in the stats, which are for gets.
+  uint64_t scan_bytes_read = 0;
+  sources.emplace_back(new MemIter(copy, from));
+  if (NULL != imm) sources.emplace_back(new MemIter(imm, from));
+  for (const auto& table : version->levels[0]) {
+    if (table->largest < from || (has_end && table->smallest >= to)) continue;
+    TableIter* const iter = new TableIter(table, &scan_bytes_read);
+    sources.emplace_back(iter);
+    if (-1 == iter->seek(from)) return 0;
+  }
+  for (int level = 1; level < N_LEVELS; ++level) {
+    if (version->levels[level].empty()) continue;
+    LevelIter* const iter = new LevelIter(version->levels[level], &scan_bytes_read);
+    sources.emplace_back(iter);
+    if (-1 == iter->seek(from)) return 0;
+  }
+
+  MergeIter merged(std::move(sources));
+  size_t n_visited = 0;
+  while (merged.valid && (!has_end || merged.key < to) && (0 == limit || n_visited < limit)) {
+    if (!merged.deleted) {
+      ++n_visited;
+      if (!visit(arg, merged.key.data(), merged.key.size())) break;
+    }
+    if (-1 == merged.next()) break;
+  }
+  return n_visited;
+}
+
+int LsmStore::settle() {
+  pthread_mutex_lock(&mutex_);
+  while (0 == failed_) {
+    if (NULL == imm_ && !mem_->entries.empty()) {
+      imm_ = mem_;
+      mem_ = std::make_shared<MemTable>();
+      busy_ = true;
+      pthread_cond_signal(&work_cond_);
+    } else if (NULL == imm_ && !busy_) {
+      break;
+    }
+    pthread_cond_wait(&done_cond_, &mutex_);
+  }
+  const int failed = failed_;
+  pthread_mutex_unlock(&mutex_);
+  if (0 != failed) {
+    errno = failed;
+    return -1;
+  }
+  return 0;
+}
+
+int LsmStore::new_file(uint64_t* const number, std::string* const path) {
+  pthread_mutex_lock(&mutex_);
+  *number = next_file_++;
+  pthread_mutex_unlock(&mutex_);
+  char name[32];
+  snprintf(name, sizeof(name), "/%06lu.sst", *number);
+  *path = dir_ + name;
+  return open(path->c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+int LsmStore::flush(const MemTable* const memtable) {
+  uint64_t number;
+  const std::shared_ptr<SSTable> table = std::make_shared<SSTable>();
+  table->fd = new_file(&number, &table->path);
+  if (-1 == table->fd) return -1;
+  TableBuilder builder(table.get(), config_.block_len, config_.bloom_bits_per_key);
+  for (const auto& entry : memtable->entries) {
+    const MemTable::Entry& e = entry.second;
+    if (-1 == builder.add(entry.first, (const uint8_t*) e.value.data(), e.value.size(), e.deleted)) return -1;
+  }
+  if (-1 == builder.finish()) return -1;
+
+  pthread_mutex_lock(&mutex_);
+  const std::shared_ptr<Version> version = std::make_shared<Version>(*version_);
+  version->levels[0].insert(version->levels[0].begin(), table);
+  version_ = version;
+  pthread_mutex_unlock(&mutex_);
+  add_stat(&stats_.flush_bytes, table->file_len);
+  add_stat(&stats_.n_flushes, 1);
+  return 0;
+}
+
+uint64_t LsmStore::level_limit(const int level) const {
+  uint64_t limit = config_.level_1_len;
+  for (int i = 1; i < level; ++i) limit *= config_.ratio;
+  return limit;
+}
+
+int LsmStore::merge_into(Iter* const input, const bool drop_deleted, std::vector<std::shared_ptr<SSTable>>* const outputs) {
+  std::shared_ptr<SSTable> table;
+  std::unique_ptr<TableBuilder> builder;
+  while (input->valid) {
+    if (!input->deleted || !drop_deleted) {
+      if (NULL == builder) {
+        uint64_t number;
+        table = std::make_shared<SSTable>();
+        table->fd = new_file(&number, &table->path);
+        if (-1 == table->fd) return -1;
+        builder.reset(new TableBuilder(table.get(), config_.block_len, config_.bloom_bits_per_key));
+      }
+      if (-1 == builder->add(input->key, (const uint8_t*) input->value.data(), input->value.size(), input->deleted)) {
+        return -1;
+      }
+      if (builder->len() >= config_.file_len) {
+        if (-1 == builder->finish()) return -1;
+        outputs->push_back(table);
+        builder.reset();
+      }
+    }
+    if (-1 == input->next()) return -1;
+  }
+  if (NULL != builder) {
+    if (-1 == builder->finish()) return -1;
+    outputs->push_back(table);
+  }
+  return 0;
+}
+
+int LsmStore::compact_once() {
+  // Only this thread installs versions, so this one stays current until it
+  // installs the next.
+  pthread_mutex_lock(&mutex_);
+  const std::shared_ptr<const Version> version = version_;
+  pthread_mutex_unlock(&mutex_);
+
+  int level = -1;
+  std::vector<std::shared_ptr<SSTable>> upper;
+  if (version->levels[0].size() >= (size_t) config_.l0_compact_files) {
+    level = 0;
+    upper = version->levels[0];
+  } else {
+    for (int i = 1; i < N_LEVELS - 1 && level < 0; ++i) {
+      const auto& tables = version->levels[i];
+      if (version->level_bytes(i) <= level_limit(i)) continue;
+      level = i;
+      // The first file past the last one compacted, wrapping around.
+      auto next = tables.begin();
+      while (next != tables.end() && (*next)->smallest <= compact_pointer_[i]) ++next;
+      upper.push_back(next == tables.end() ? tables.front() : *next);
+    }
+  }
+  if (level < 0) return 0;
+
+  std::string smallest = upper.front()->smallest;
+  std::string largest = upper.front()->largest;
+  for (const auto& table : upper) {
+    smallest = std::min(smallest, table->smallest);
+    largest = std::max(largest, table->largest);
+  }
+  std::vector<std::shared_ptr<SSTable>> lower;
+  for (const auto& table : version->levels[level + 1]) {
+    if (table->largest >= smallest && table->smallest <= largest) lower.push_back(table);
+  }
+
+  // Tombstones can go once nothing deeper has a value for them to hide.
+  bool deepest = true;
+  for (int i = level + 2; i < N_LEVELS; ++i) deepest = deepest && version->levels[i].empty();
+
+  // The inputs are merged whole: the lower files may start before the upper
+  // ones.
+  std::vector<std::unique_ptr<Iter>> sources;
+  for (const auto& table : upper) {
+    TableIter* const iter = new TableIter(table, &stats_.compaction_read_bytes);
+    sources.emplace_back(iter);
+    if (-1 == iter->seek(std::string())) return -1;
+  }
+  if (!lower.empty()) {
+    LevelIter* const iter = new LevelIter(lower, &stats_.compaction_read_bytes);
+    sources.emplace_back(iter);
+    if (-1 == iter->seek(std::string())) return -1;
+  }
+  MergeIter merged(std::move(sources));
+  std::vector<std::shared_ptr<SSTable>> outputs;
+  if (-1 == merge_into(&merged, deepest, &outputs)) return -1;
+
+  const std::shared_ptr<Version> next = std::make_shared<Version>(*version);
+  const auto replaced = [&](const std::shared_ptr<SSTable>& table) {
+    return std::find(upper.begin(), upper.end(), table) != upper.end()
+      || std::find(lower.begin(), lower.end(), table) != lower.end();
+  };
+  for (int i = level; i <= level + 1; ++i) {
+    auto& tables = next->levels[i];
+    tables.erase(std::remove_if(tables.begin(), tables.end(), replaced), tables.end());
+  }
+  auto& tables = next->levels[level + 1];
+  tables.insert(tables.end(), outputs.begin(), outputs.end());
+  std::sort(tables.begin(), tables.end(), [](const std::shared_ptr<SSTable>& a, const std::shared_ptr<SSTable>& b) {
+    return a->smallest < b->smallest;
+  });
+
+  uint64_t written = 0;
+  for (const auto& table : outputs) written += table->file_len;
+  pthread_mutex_lock(&mutex_);
+  version_ = next;
+  compact_pointer_[level] = largest;
+  pthread_mutex_unlock(&mutex_);
+  for (const auto& table : upper) __atomic_store_n(&table->obsolete, true, __ATOMIC_RELEASE);
+  for (const auto& table : lower) __atomic_store_n(&table->obsolete, true, __ATOMIC_RELEASE);
+  add_stat(&stats_.compaction_bytes, written);
+  add_stat(&stats_.n_compactions, 1);
+  return 1;
+}
+
+void* LsmStore::background_main(void* const void_store) {
+  LsmStore* const store = (LsmStore*) void_store;
+  pthread_mutex_lock(&store->mutex_);
+  while (0 == store->failed_) {
+    int result;
+    if (NULL != store->imm_) {
+      const std::shared_ptr<const MemTable> imm = store->imm_;
+      pthread_mutex_unlock(&store->mutex_);
+      result = store->flush(imm.get());
+      pthread_mutex_lock(&store->mutex_);
+      if (-1 != result) store->imm_.reset();
+    } else if (store->stopping_) {
+      break;
+    } else {
+      pthread_mutex_unlock(&store->mutex_);
+      result = store->compact_once();
+      pthread_mutex_lock(&store->mutex_);
+      if (0 == result) {
+        // Nothing to do until the next memtable fills up.
+        store->busy_ = false;
+        pthread_cond_broadcast(&store->done_cond_);
+        while (NULL == store->imm_ && !store->stopping_ && !store->busy_) {
+          pthread_cond_wait(&store->work_cond_, &store->mutex_);
+        }
+        store->busy_ = true;
+        continue;
+      }
+    }
+    if (-1 == result) {
+      store->failed_ = errno;
+      fprintf(stderr, "lsm: couldn't write a table, failing writes from now on: %m\n");
+    }
+    pthread_cond_broadcast(&store->done_cond_);
+  }
+  store->busy_ = false;
+  pthread_cond_broadcast(&store->done_cond_);
+  pthread_mutex_unlock(&store->mutex_);
+  return NULL;
+}
+
+LsmStats LsmStore::stats() const {
+  LsmStats copy;
+  const uint64_t* const from = (const uint64_t*) &stats_;
+  uint64_t* const to = (uint64_t*) &copy;
+  for (size_t i = 0; i < sizeof(LsmStats) / sizeof(uint64_t); ++i) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+  return copy;
+}
+
+uint64_t LsmStore::file_len() const {
+  pthread_mutex_lock(&mutex_);
+  const std::shared_ptr<const Version> version = version_;
+  pthread_mutex_unlock(&mutex_);
+  uint64_t n_bytes = 0;
+  for (int level = 0; level < N_LEVELS; ++level) n_bytes += version->level_bytes(level);
+  return n_bytes;
+}
+
+void LsmStore::print_stats(FILE* const out) const {
+  pthread_mutex_lock(&mutex_);
+  const std::shared_ptr<const Version> version = version_;
+  pthread_mutex_unlock(&mutex_);
+  const LsmStats stats = this->stats();
+
+  uint64_t file_bytes = 0;
+  fprintf(out, "%-6s %6s %12s %12s\n", "level", "files", "bytes", "limit");
+  for (int level = 0; level < N_LEVELS; ++level) {
+    const uint64_t n_bytes = version->level_bytes(level);
+    file_bytes += n_bytes;
+    if (version->levels[level].empty()) continue;
+    if (level == 0) {
+      fprintf(out, "L%-5d %6zu %12lu %12s\n", level, version->levels[level].size(), n_bytes, "-");
+    } else {
+      fprintf(out, "L%-5d %6zu %12lu %12lu\n", level, version->levels[level].size(), n_bytes, level_limit(level));
+    }
+  }
+  const double user = stats.user_bytes_written > 0 ? stats.user_bytes_written : 1;
+  const double gets = stats.n_gets > 0 ? stats.n_gets : 1;
+  fprintf(
+    out,
+    "writes: %lu user bytes; %lu flushed in %lu flushes, %lu compacted in %lu"
+    " compactions, %lu read back; write amplification %.2f; stalled %.1f ms\n",
+    stats.user_bytes_written,
+    stats.flush_bytes,
+    stats.n_flushes,
+    stats.compaction_bytes,
+    stats.n_compactions,
+    stats.compaction_read_bytes,
+    (stats.flush_bytes + stats.compaction_bytes) / user,
+    stats.stall_us / 1000.0
+  );
+  fprintf(
+    out,
+    "gets: %lu; per get %.2f files probed, %.2f skipped by Bloom filter,"
+    " %.2f blocks and %.0f bytes read; read amplification %.2f\n",
+    stats.n_gets,
+    stats.get_files_probed / gets,
+    stats.get_bloom_skips / gets,
+    stats.get_blocks_read / gets,
+    stats.get_bytes_read / gets,
+    stats.get_value_bytes > 0 ? (double) stats.get_bytes_read / stats.get_value_bytes : 0.0
+  );
+  fprintf(out, "files: %lu bytes\n", file_bytes);
+}
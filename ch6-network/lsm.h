@@ -0,0 +1,196 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// A log-structured merge tree, for keystores that don't fit in memory.
+//
+// Writes go to a sorted in-memory memtable. Once it holds memtable_len bytes,
+// it is frozen and a fresh one takes the writes, while a background thread
+// writes the frozen one out as an immutable, sorted SSTable file in level 0.
+//
+// Level 0's files may overlap one another. Once there are l0_compact_files of
+// them, the thread merges them, along with the files of level 1 they
+// overlap, into new level 1 files. Each level from 1 on is one sorted run,
+// split into files of up to file_len bytes that don't overlap, and holds up
+// to ratio times as many bytes as the one above it, level 1 holding
+// level_1_len. When a level holds more, the thread merges one of its files
+// into the files of the next level that it overlaps, taking the files in
+// turn through the key space. Writers stall while the frozen memtable is
+// still being written and the live one fills up too, or while level 0 has
+// l0_stall_files files.
+//
+// A read looks in the memtable, the frozen one, level 0's files from newest
+// to oldest, then at most one file in each level below, and stops at the
+// first that has the key. An SSTable is a series of data blocks of about
+// block_len bytes, then an index holding the last key of each block, then a
+// Bloom filter of all of its keys, and a footer. The index and filter of each
+// file are kept in memory, so that a file without the key is nearly always
+// skipped without reading it, and one with it costs one block read.
+//
+// A delete writes a tombstone, which hides older values of the key until a
+// compaction into the deepest level drops them both.
+//
+// The store starts out empty, with any files in its directory deleted, like
+// the blob file, and nothing is logged, so the memtable doesn't survive a
+// crash.
+
+struct LsmConfig {
+  size_t memtable_len = 4 << 20;
+  size_t block_len = 4 << 10;
+  int bloom_bits_per_key = 10;
+  int l0_compact_files = 4;
+  int l0_stall_files = 12;
+  size_t level_1_len = 16 << 20;
+  int ratio = 10;
+  size_t file_len = 4 << 20;
+};
+
+// Running totals, for amplification.
+struct LsmStats {
+  // Bytes of keys and values written and deleted by callers.
+  uint64_t user_bytes_written;
+  // Bytes written to files by flushes and by compactions.
+  uint64_t flush_bytes;
+  uint64_t compaction_bytes;
+  // Bytes read from files by compactions.
+  uint64_t compaction_read_bytes;
+
+  uint64_t n_gets;
+  // Bytes of values that gets returned.
+  uint64_t get_value_bytes;
+  // Files whose key range covered a get's key, those of them whose Bloom
+  // filter ruled the key out, and the blocks and bytes read from the rest.
+  uint64_t get_files_probed;
+  uint64_t get_bloom_skips;
+  uint64_t get_blocks_read;
+  uint64_t get_bytes_read;
+
+  uint64_t n_flushes;
+  uint64_t n_compactions;
+  // Time writers spent stalled.
+  uint64_t stall_us;
+};
+
+class LsmStore {
+public:
+  static constexpr int N_LEVELS = 7;
+
+  // Creates dir if need be, and deletes any SSTables in it.
+  //
+  // Returns NULL and sets errno on error.
+  static LsmStore* Open(const char* dir, const LsmConfig& config);
+
+  LsmStore(const LsmStore&) = delete;
+  LsmStore& operator=(const LsmStore&) = delete;
+
+  // Stores value under key, or a tombstone for del(). May stall until the
+  // background thread catches up.
+  //
+  // Returns -1 and sets errno if the background thread has failed to write a
+  // file.
+  int put(const char* key, size_t key_len, const uint8_t* value, size_t value_len);
+  int del(const char* key, size_t key_len);
+
+  // Copies the value stored under key into *value.
+  //
+  // Returns 1 if there is one, 0 if not, and -1 and sets errno on error.
+  int get(const char* key, size_t key_len, std::string* value);
+
+  // Called on each key found by scan(). Returns false to stop the scan.
+  typedef bool (*ScanVisitor)(void* arg, const char* key, size_t key_len);
+
+  // Visits up to limit (0 for no limit) keys that are >= start and < end, in
+  // order. If has_end is false, there is no upper bound.
+  //
+  // Returns the number of keys visited.
+  size_t scan(
+    const char* start,
+    size_t start_len,
+    const char* end,
+    size_t end_len,
+    bool has_end,
+    size_t limit,
+    ScanVisitor visit,
+    void* arg
+  );
+
+  // Writes out the memtable and waits for the background thread to run out
+  // of compactions to do, so that the shape of the tree is settled.
+  int settle();
+
+  LsmStats stats() const;
+
+  // Returns the bytes in the store's files.
+  uint64_t file_len() const;
+
+  // Prints the files and bytes in each level, and the amplification so far.
+  void print_stats(FILE* out) const;
+
+  // Stops the background thread and deletes the files.
+  ~LsmStore();
+
+  // Defined in lsm.cc.
+  struct SSTable;
+  struct MemTable;
+  struct Version;
+  class Iter;
+
+private:
+  LsmStore() = default;
+
+  static void* background_main(void* void_store);
+
+  // Inserts into the memtable, stalling first if it has no room.
+  int write(const char* key, size_t key_len, const uint8_t* value, size_t value_len, bool deleted);
+
+  // Writes the frozen memtable out to a level 0 file.
+  int flush(const MemTable* memtable);
+  // If a level is due for compaction, compacts it and returns 1, and
+  // otherwise returns 0, or -1 on error.
+  int compact_once();
+  // Merges input, newest source first, into new files, returned in *outputs,
+  // dropping tombstones if drop_deleted is set.
+  int merge_into(Iter* input, bool drop_deleted, std::vector<std::shared_ptr<SSTable>>* outputs);
+  // Returns a new table file, open for writing.
+  int new_file(uint64_t* number, std::string* path);
+
+  // Returns the most bytes level may hold before it is compacted.
+  uint64_t level_limit(int level) const;
+
+  std::string dir_;
+  LsmConfig config_;
+
+  mutable pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  // Signals the background thread that there is a memtable to write out, or
+  // that it should stop.
+  pthread_cond_t work_cond_ = PTHREAD_COND_INITIALIZER;
+  // Signals writers and settle() that the background thread made progress.
+  pthread_cond_t done_cond_ = PTHREAD_COND_INITIALIZER;
+
+  std::shared_ptr<MemTable> mem_;
+  // The frozen memtable being written out, or NULL.
+  std::shared_ptr<const MemTable> imm_;
+  // The files of each level. Replaced whole, so a reader can go on using the
+  // one it got while the background thread installs another.
+  std::shared_ptr<const Version> version_;
+  uint64_t next_file_ = 1;
+  // The largest key compacted out of each level last time, to take the
+  // next file after it next time.
+  std::string compact_pointer_[N_LEVELS];
+  // The background thread is compacting, or settle() asked for it to.
+  bool busy_ = false;
+  bool stopping_ = false;
+  // The errno of the background thread's failure, if it has failed.
+  int failed_ = 0;
+  pthread_t thread_;
+
+  // Updated with __atomic builtins, as gets run without mutex_.
+  LsmStats stats_ = {};
+};
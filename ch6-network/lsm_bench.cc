@@ -0,0 +1,242 @@
+// Compares the LSM tree with the in-memory KeyTable it can stand in for, on
+// the cost of a write and a read, and on how many bytes each moves and keeps
+// per byte the caller wrote or read.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "key_table.h"
+#include "lsm.h"
+#include "phases.h"
+#include "workload.h"
+
+struct Args {
+  size_t n_keys = 1000000;
+  size_t n_writes = 2000000;
+  size_t n_reads = 1000000;
+  size_t key_len = 16;
+  size_t value_len = 100;
+  const char* dir = "lsm_bench.lsm";
+  LsmConfig config;
+};
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tlsm_bench [-keys N] [-writes N] [-reads N] [-keylen LEN] [-vlen LEN]\n"
+    "\t          [-dir DIR] [-memtable BYTES] [-l1 BYTES] [-ratio N]\n"
+    "\n"
+    "Writes N (-writes, default 2000000) values of LEN (-vlen, default 100) bytes\n"
+    "under random keys of LEN (-keylen, default 16) bytes, out of N (-keys, default\n"
+    "1000000), so that some are overwritten, then reads N (-reads, default 1000000)\n"
+    "random keys, half of them never written. Does both with a KeyTable of\n"
+    "malloc()ed values, like the server's in-memory keystore, and with an LSM tree\n"
+    "in DIR (-dir, default lsm_bench.lsm), whose memtable, level 1 and level size\n"
+    "ratio can be set.\n"
+    "\n"
+    "Prints ns per write and read for each, and the LSM tree's levels and its\n"
+    "write amplification (bytes written to files per byte written), read\n"
+    "amplification (files probed, blocks and bytes read per get) and space\n"
+    "amplification (file bytes per live byte), next to the KeyTable's heap bytes\n"
+    "per live byte. The tree's files are fresh, so its reads come from the page\n"
+    "cache: the bytes it reads are what it would read from disk, but not the time.\n"
+  );
+}
+
+Args parse_args(const int argc, char** const argv) {
+  Args args;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) usage(), exit(1);
+    const size_t value = strtoull(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "-keys") == 0) {
+      args.n_keys = value;
+    } else if (strcmp(argv[i], "-writes") == 0) {
+      args.n_writes = value;
+    } else if (strcmp(argv[i], "-reads") == 0) {
+      args.n_reads = value;
+    } else if (strcmp(argv[i], "-keylen") == 0) {
+      args.key_len = value;
+    } else if (strcmp(argv[i], "-vlen") == 0) {
+      args.value_len = value;
+    } else if (strcmp(argv[i], "-dir") == 0) {
+      args.dir = argv[i + 1];
+    } else if (strcmp(argv[i], "-memtable") == 0) {
+      args.config.memtable_len = value;
+    } else if (strcmp(argv[i], "-l1") == 0) {
+      args.config.level_1_len = value;
+    } else if (strcmp(argv[i], "-ratio") == 0) {
+      args.config.ratio = value;
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (args.n_keys == 0 || args.n_writes == 0 || args.n_reads == 0
+      || args.key_len < 12 || args.key_len > UINT8_MAX
+      || args.config.memtable_len == 0 || args.config.ratio < 2) {
+    fprintf(
+      stderr,
+      "-keys, -writes, -reads and -memtable must be positive, -ratio at least 2,"
+      " and -keylen from 12 to %d\n",
+      UINT8_MAX
+    );
+    exit(1);
+  }
+  return args;
+}
+
+// Big tables are mmap()ed rather than carved out of the heap.
+size_t heap_in_use() {
+  const struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+}
+
+// Key i, padded to key_len. Odd i are never written, for missed reads.
+void make_key(const uint64_t i, const size_t key_len, char* const buf) {
+  char digits[32];
+  snprintf(digits, sizeof(digits), "user%08lu", i);
+  memset(buf, 'x', key_len);
+  memcpy(buf, digits, strlen(digits));
+}
+
+struct Result {
+  double write_ns;
+  double read_ns;
+  uint64_t n_found;
+};
+
+// The server's in-memory keystore, less the locking: each value a malloc()ed
+// copy, replaced whole by a write.
+class MemoryStore {
+public:
+  ~MemoryStore() { table_.for_each(free_value, NULL); }
+
+  int put(const char* const key, const size_t key_len, const uint8_t* const value, const size_t value_len) {
+    Value* const stored = (Value*) malloc(sizeof(Value) + value_len);
+    stored->len = value_len;
+    memcpy(stored->bytes, value, value_len);
+    free(table_.put(key, key_len, stored));
+    return 0;
+  }
+
+  int get(const char* const key, const size_t key_len, std::string* const value) {
+    const Value* const stored = (const Value*) table_.find(key, key_len);
+    if (NULL == stored) return 0;
+    value->assign((const char*) stored->bytes, stored->len);
+    return 1;
+  }
+
+private:
+  struct Value {
+    size_t len;
+    uint8_t bytes[];
+  };
+
+  static void free_value(void*, const char*, size_t, void* const value) { free(value); }
+
+  KeyTable table_;
+};
+
+// Store has put() and get() like LsmStore's. writes and reads are key
+// numbers for make_key().
+template <typename Store>
+Result measure(
+  const Args& args,
+  Store* const store,
+  const std::vector<uint64_t>& writes,
+  const std::vector<uint64_t>& reads,
+  const char* const name
+) {
+  std::vector<char> key(args.key_len);
+  std::vector<uint8_t> value(args.value_len, 'v');
+  uint64_t start_ns = now_nsec();
+  for (const uint64_t i : writes) {
+    make_key(i, args.key_len, key.data());
+    memcpy(value.data(), &i, std::min(sizeof(i), value.size()));
+    if (-1 == store->put(key.data(), args.key_len, value.data(), value.size())) {
+      fprintf(stderr, "%s: failed to write: %m\n", name);
+      exit(1);
+    }
+  }
+  const uint64_t write_ns = now_nsec() - start_ns;
+
+  std::vector<char> keys(reads.size() * args.key_len);
+  for (size_t i = 0; i < reads.size(); ++i) make_key(reads[i], args.key_len, &keys[i * args.key_len]);
+  std::string found;
+  uint64_t n_found = 0;
+  start_ns = now_nsec();
+  for (size_t i = 0; i < reads.size(); ++i) {
+    const int result = store->get(&keys[i * args.key_len], args.key_len, &found);
+    if (-1 == result) {
+      fprintf(stderr, "%s: failed to read: %m\n", name);
+      exit(1);
+    }
+    n_found += result;
+  }
+  const uint64_t read_ns = now_nsec() - start_ns;
+  return Result{(double) write_ns / writes.size(), (double) read_ns / reads.size(), n_found};
+}
+
+int main(int argc, char** argv) {
+  const Args args = parse_args(argc, argv);
+
+  Rng rng(1);
+  std::vector<uint64_t> writes(args.n_writes);
+  std::vector<bool> written(args.n_keys);
+  uint64_t n_live = 0;
+  for (uint64_t& key : writes) {
+    const uint64_t i = rng.below(args.n_keys);
+    key = 2 * i;
+    if (!written[i]) ++n_live;
+    written[i] = true;
+  }
+  std::vector<uint64_t> reads(args.n_reads);
+  for (uint64_t& key : reads) key = rng.below(2 * args.n_keys);
+  const double live_len = (double) n_live * (args.key_len + args.value_len);
+
+  const size_t heap_before = heap_in_use();
+  MemoryStore* const memory = new MemoryStore();
+  const Result in_memory = measure(args, memory, writes, reads, "memory");
+  const size_t heap_len = heap_in_use() - heap_before;
+  delete memory;
+
+  LsmStore* const lsm = LsmStore::Open(args.dir, args.config);
+  if (NULL == lsm) {
+    fprintf(stderr, "failed to open the LSM tree in \"%s\": %m\n", args.dir);
+    exit(1);
+  }
+  // Reads go to the tree as compaction leaves it, so that they are measured
+  // against its settled shape rather than whatever was in flight.
+  std::vector<uint64_t> no_reads;
+  const Result lsm_writes = measure(args, lsm, writes, no_reads, "lsm");
+  const uint64_t settle_start_ns = now_nsec();
+  if (-1 == lsm->settle()) {
+    perror("lsm: failed to settle");
+    exit(1);
+  }
+  const double settle_s = (now_nsec() - settle_start_ns) / 1e9;
+  const Result lsm_reads = measure(args, lsm, no_reads, reads, "lsm");
+
+  printf("%lu writes of %lu live keys, %lu reads\n", args.n_writes, n_live, args.n_reads);
+  printf("%-8s %12s %12s %12s %16s\n", "", "write ns", "read ns", "found", "bytes/live byte");
+  printf(
+    "%-8s %12.1f %12.1f %12lu %16.2f\n",
+    "memory", in_memory.write_ns, in_memory.read_ns, in_memory.n_found, heap_len / live_len
+  );
+  printf(
+    "%-8s %12.1f %12.1f %12lu %16.2f\n",
+    "lsm", lsm_writes.write_ns, lsm_reads.read_ns, lsm_reads.n_found, lsm->file_len() / live_len
+  );
+  printf("lsm: %.3f s settling compactions after the writes\n", settle_s);
+  lsm->print_stats(stdout);
+  delete lsm;
+  return 0;
+}
@@ -0,0 +1,46 @@
+// Merges latency histograms saved by `client -hist`, e.g. from several client
+// processes, and prints the combined percentiles.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+
+void usage(char** argv) {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\t%s [-o OUT_FILE] HIST_FILE...\n"
+    "\n"
+    "Prints the percentiles of all of the HIST_FILEs together.\n"
+    "With -o, also saves the merged histogram to OUT_FILE.\n",
+    argv[0]
+  );
+}
+
+int main(int argc, char** argv) {
+  const char* out_fn = NULL;
+  int next_arg = 1;
+  if (next_arg + 1 < argc && strcmp(argv[next_arg], "-o") == 0) {
+    out_fn = argv[next_arg + 1];
+    next_arg += 2;
+  }
+  if (next_arg >= argc) usage(argv), exit(1);
+
+  LatencyHistogram* merged = new LatencyHistogram();
+  for (; next_arg < argc; ++next_arg) {
+    if (!merged->merge_from_file(argv[next_arg])) {
+      fprintf(stderr, "failed to read histogram file \"%s\"\n", argv[next_arg]);
+      exit(1);
+    }
+  }
+
+  merged->print(stdout, 1000, "us");
+  if (NULL != out_fn && !merged->save(out_fn)) {
+    fprintf(stderr, "failed to save histogram to \"%s\": %m\n", out_fn);
+    exit(1);
+  }
+
+  return 0;
+}
@@ -10,19 +10,31 @@ WriteRequest* WriteRequest::Make(
   const char* const value,
   const uint32_t value_len
 ) {
-  if (value_len > 5 * 256 * 1024) return NULL;
+  if (value_len > MAX_VALUE_LEN) return NULL;
   size_t buf_size = sizeof(WriteRequest) + key_len + value_len;
-  void* buf = aligned_alloc(sizeof(WriteRequest), buf_size);
+  void* buf = malloc(buf_size);
 
+  WriteRequest* request = Init(buf, key_len, value_len);
+  memcpy(request->key(), key, key_len);
+  memcpy(request->value(), value, value_len);
+  return request;
+}
+
+WriteRequest* WriteRequest::Init(
+  void* const buf,
+  const uint8_t key_len,
+  const uint32_t value_len
+) {
+  if (value_len > MAX_VALUE_LEN) return NULL;
   WriteRequest* request = (WriteRequest*) buf;
   request->key_len_   = key_len;
+  memset(request->pad_, 0, sizeof(request->pad_));
   request->value_len_ = htonl(value_len);
-  memcpy(request->key(), key, key_len);
-  memcpy(request->value(), value, value_len);
   return request;
 }
 
 WriteRequest* WriteRequest::FromBody(void* rpc_body, size_t body_len) {
+  if (body_len < sizeof(WriteRequest)) return NULL;
   WriteRequest* request = (WriteRequest*) rpc_body;
   size_t request_len = sizeof(WriteRequest) + request->key_len() + request->value_len();
   if (request_len != body_len) return NULL;
@@ -50,3 +62,56 @@ size_t WriteRequest::full_len() {
   return sizeof(*this) + this->key_len() + this->value_len();
 }
 
+
+ScanRequest* ScanRequest::Init(
+  void* const buf,
+  const uint8_t start_len,
+  const uint8_t end_len,
+  const bool has_end,
+  const uint32_t limit
+) {
+  ScanRequest* request = (ScanRequest*) buf;
+  request->start_len_ = start_len;
+  request->end_len_   = has_end ? end_len : 0;
+  request->has_end_   = has_end;
+  request->pad_       = 0;
+  request->limit_     = htonl(limit);
+  return request;
+}
+
+ScanRequest* ScanRequest::FromBody(void* rpc_body, size_t body_len) {
+  if (body_len < sizeof(ScanRequest)) return NULL;
+  ScanRequest* request = (ScanRequest*) rpc_body;
+  if (request->full_len() != body_len) return NULL;
+  if (!request->has_end() && request->end_len() != 0) return NULL;
+
+  return request;
+}
+
+char* ScanRequest::start() {
+  return (char*) (this+1);
+}
+
+char* ScanRequest::end() {
+  return this->start_len() + (char*) (this+1);
+}
+
+size_t ScanRequest::start_len() {
+  return this->start_len_;
+}
+
+size_t ScanRequest::end_len() {
+  return this->end_len_;
+}
+
+bool ScanRequest::has_end() {
+  return this->has_end_ != 0;
+}
+
+uint32_t ScanRequest::limit() {
+  return ntohl(this->limit_);
+}
+
+size_t ScanRequest::full_len() {
+  return sizeof(*this) + this->start_len() + this->end_len();
+}
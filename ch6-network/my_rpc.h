@@ -1,24 +1,21 @@
 // Defines the RPC interface for the server in ch 6.
 
+#pragma once
+
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
-// A string with a length.
-// The string need not be null-terminated.
-struct LenStr {
-  size_t length;
-  char* data; // Owned.
-
-  LenStr(size_t length, char* data) : length(length), data(data) {}
-  ~LenStr() {
-    free(data);
-  }
-};
+// Keys and values longer than these can't be written.
+constexpr size_t MAX_KEY_LEN = UINT8_MAX;
+constexpr size_t MAX_VALUE_LEN = 5 * 256 * 1024;
 
-// Stored in the RPCMessage::body.
-class WriteRequest {
+// Stored in the RPCMessage::body. Packed, with the padding spelled out, so
+// that it can be read in place from a body at any offset: bodies in a receive
+// buffer, or entries in a replication batch, needn't be aligned.
+class __attribute__((packed)) WriteRequest {
   uint8_t key_len_;
+  uint8_t pad_[3];
   uint32_t value_len_;
 
 public:
@@ -29,6 +26,13 @@ public:
     uint32_t value_len
   );
 
+  // Lays out a request for a key and value of the given lengths in buf, which
+  // must hold sizeof(WriteRequest) + key_len + value_len bytes. The caller
+  // fills in key() and value().
+  //
+  // Returns NULL if value_len is too long.
+  static WriteRequest* Init(void* buf, uint8_t key_len, uint32_t value_len);
+
   // Parses an RPC body into a WriteRequest, returning a non-owning
   // pointer to the request.
   //
@@ -45,3 +49,69 @@ public:
   size_t full_len();
 };
 
+static_assert(sizeof(WriteRequest) == 8);
+
+
+// Stored in the RPCMessage::body of a scan, which asks for the keys from
+// start() up to but not including end(), at most limit() of them.
+//
+// The server answers with one or more responses, each carrying a batch of
+// keys: a u8 of flags (SCAN_LAST_BATCH on the last response), and then each
+// key as a u8 length followed by its bytes, in order.
+// Packed like WriteRequest.
+class __attribute__((packed)) ScanRequest {
+  uint8_t start_len_;
+  uint8_t end_len_;
+  // If 0, there is no end, and end_len_ is 0.
+  uint8_t has_end_;
+  uint8_t pad_;
+  uint32_t limit_;
+
+public:
+  // Lays out a request in buf, which must hold
+  // sizeof(ScanRequest) + start_len + end_len bytes. The caller fills in
+  // start() and end(). A limit of 0 means no limit.
+  static ScanRequest* Init(
+    void* buf,
+    uint8_t start_len,
+    uint8_t end_len,
+    bool has_end,
+    uint32_t limit
+  );
+
+  // Parses an RPC body into a ScanRequest, returning a non-owning pointer to
+  // the request.
+  //
+  // Returns NULL if parsing fails.
+  static ScanRequest* FromBody(void* rpc_body, size_t body_len);
+
+  // Return non-owning, non-null-terminated pointers to the bounds.
+  char* start();
+  char* end();
+  size_t start_len();
+  size_t end_len();
+  bool has_end();
+  uint32_t limit();
+  size_t full_len();
+};
+
+static_assert(sizeof(ScanRequest) == 8);
+
+constexpr uint8_t SCAN_LAST_BATCH = 1;
+
+// The server sends a batch once it holds this many keys.
+constexpr size_t SCAN_BATCH_KEYS = 128;
+
+// The body of the response to a snapshot, which the server writes to
+// server-START_PORT.snap (see snapshot.h) from a fork()ed child.
+struct SnapshotResult {
+  uint64_t n_keys;
+  uint64_t n_bytes;
+  // How long the server was stopped for the fork(), with the keystore
+  // locked.
+  uint64_t fork_us;
+  // From the fork() to the child having synced the file.
+  uint64_t duration_us;
+  // Pages copied on write by either process while the child wrote.
+  uint64_t cow_pages;
+};
@@ -1,7 +1,13 @@
 #include "network.h"
+#include "shm.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <linux/sockios.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <strings.h>
@@ -130,3 +136,216 @@ int readn(int sock_fd, void* buf, size_t n_bytes) {
   return 0;
 }
 
+
+int conn_readn(const Connection* const connection, void* const buf, const size_t n_bytes) {
+  if (NULL != connection->shm) return shm_readn(connection->shm, buf, n_bytes);
+  return readn(connection->sock_fd, buf, n_bytes);
+}
+
+struct RecvBuffer {
+  RecvChunk* chunk;
+  // The buffered bytes are chunk->bytes[start:end].
+  size_t start;
+  size_t end;
+};
+
+static RecvChunk* new_recv_chunk() {
+  RecvChunk* const chunk = (RecvChunk*) malloc(sizeof(RecvChunk) + RECV_CHUNK_LEN);
+  chunk->refs = 1;
+  return chunk;
+}
+
+void recv_chunk_ref(RecvChunk* const chunk) {
+  __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+}
+
+void recv_chunk_unref(RecvChunk* const chunk) {
+  if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) free(chunk);
+}
+
+int conn_fill(Connection* const connection, const size_t n_bytes) {
+  if (NULL == connection->recv) {
+    connection->recv = new RecvBuffer{new_recv_chunk(), 0, 0};
+  }
+  RecvBuffer* const recv = connection->recv;
+  const size_t n_buffered = recv->end - recv->start;
+  if (n_buffered >= n_bytes) return 0;
+
+  // Make room after the buffered bytes by moving them to the front, of a new
+  // chunk if messages still point into this one.
+  if (recv->start + n_bytes > RECV_CHUNK_LEN) {
+    RecvChunk* chunk = recv->chunk;
+    if (__atomic_load_n(&chunk->refs, __ATOMIC_ACQUIRE) != 1) {
+      chunk = new_recv_chunk();
+      memcpy(chunk->bytes, recv->chunk->bytes + recv->start, n_buffered);
+      recv_chunk_unref(recv->chunk);
+      recv->chunk = chunk;
+    } else {
+      memmove(chunk->bytes, chunk->bytes + recv->start, n_buffered);
+    }
+    recv->start = 0;
+    recv->end = n_buffered;
+  }
+
+  while (recv->end - recv->start < n_bytes) {
+    uint8_t* const dst = recv->chunk->bytes + recv->end;
+    if (NULL != connection->shm) {
+      // The channel can't say how much is waiting, so read just what's asked.
+      const size_t missing = n_bytes - (recv->end - recv->start);
+      if (-1 == shm_readn(connection->shm, dst, missing)) return -1;
+      recv->end += missing;
+      continue;
+    }
+    const ssize_t n_read = read(connection->sock_fd, dst, RECV_CHUNK_LEN - recv->end);
+    if (n_read <= 0) return -1;
+    recv->end += n_read;
+  }
+  return 0;
+}
+
+uint8_t* conn_buffered(const Connection* const connection, RecvChunk** const chunk) {
+  *chunk = connection->recv->chunk;
+  return connection->recv->chunk->bytes + connection->recv->start;
+}
+
+size_t conn_n_buffered(const Connection* const connection) {
+  if (NULL == connection->recv) return 0;
+  return connection->recv->end - connection->recv->start;
+}
+
+void conn_consume(Connection* const connection, const size_t n_bytes) {
+  connection->recv->start += n_bytes;
+}
+
+int conn_recv_into(Connection* const connection, void* const buf, const size_t n_bytes) {
+  const size_t n_buffered = conn_n_buffered(connection);
+  const size_t from_buffer = n_buffered < n_bytes ? n_buffered : n_bytes;
+  if (from_buffer > 0) {
+    RecvChunk* chunk;
+    memcpy(buf, conn_buffered(connection, &chunk), from_buffer);
+    conn_consume(connection, from_buffer);
+  }
+  return conn_readn(connection, (uint8_t*) buf + from_buffer, n_bytes - from_buffer);
+}
+
+int conn_writev(const Connection* const connection, const iovec* const iov, const int iovcnt) {
+  if (NULL != connection->shm) {
+    for (int i = 0; i < iovcnt; ++i) {
+      if (-1 == shm_write(connection->shm, iov[i].iov_base, iov[i].iov_len)) return -1;
+    }
+    return 0;
+  }
+
+  size_t n_bytes = 0;
+  for (int i = 0; i < iovcnt; ++i) n_bytes += iov[i].iov_len;
+  const ssize_t written_bytes = writev(connection->sock_fd, iov, iovcnt);
+  if (written_bytes != (ssize_t) n_bytes) return -1;
+  return 0;
+}
+
+int conn_send_file(
+  const Connection* const connection,
+  const iovec* const head,
+  const int fd,
+  off_t offset,
+  size_t n_bytes
+) {
+  if (NULL != connection->shm) {
+    if (-1 == shm_write(connection->shm, head->iov_base, head->iov_len)) return -1;
+    return conn_try_send_file(connection, fd, offset, n_bytes) == (ssize_t) n_bytes ? 0 : -1;
+  }
+
+  // MSG_MORE holds the header back to go out in the same packet as the
+  // start of the file.
+  const ssize_t head_bytes = send(connection->sock_fd, head->iov_base, head->iov_len, MSG_MORE);
+  if (head_bytes != (ssize_t) head->iov_len) return -1;
+  while (n_bytes > 0) {
+    const ssize_t n = sendfile(connection->sock_fd, fd, &offset, n_bytes);
+    if (n <= 0) return -1;
+    n_bytes -= n;
+  }
+  return 0;
+}
+
+ssize_t conn_try_writev(
+  const Connection* const connection,
+  const iovec* const iov,
+  const int iovcnt,
+  const bool more
+) {
+  if (NULL != connection->shm) {
+    if (-1 == conn_writev(connection, iov, iovcnt)) return -1;
+    size_t n_bytes = 0;
+    for (int i = 0; i < iovcnt; ++i) n_bytes += iov[i].iov_len;
+    return n_bytes;
+  }
+
+  msghdr msg = {};
+  msg.msg_iov = (iovec*) iov;
+  msg.msg_iovlen = iovcnt;
+  const ssize_t n = sendmsg(connection->sock_fd, &msg, MSG_DONTWAIT | (more ? MSG_MORE : 0));
+  if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) return 0;
+  return n;
+}
+
+ssize_t conn_try_send_file(
+  const Connection* const connection,
+  const int fd,
+  off_t offset,
+  const size_t n_bytes
+) {
+  if (NULL != connection->shm) {
+    // The channel is memory already, so the bytes are copied into it in
+    // pieces.
+    uint8_t buf[16 * 1024];
+    size_t left = n_bytes;
+    while (left > 0) {
+      const ssize_t n = pread(fd, buf, left < sizeof(buf) ? left : sizeof(buf), offset);
+      if (n <= 0 || -1 == shm_write(connection->shm, buf, n)) return -1;
+      offset += n;
+      left -= n;
+    }
+    return n_bytes;
+  }
+
+  // sendfile() has no flag for not waiting, and the socket is shared with
+  // the thread reading requests off of it, so it can't be made non-blocking.
+  // Instead, it is given no more than the send buffer has room for, which it
+  // takes without waiting. The bytes queued are kept to three quarters of
+  // the buffer, since its limit also counts the kernel's overhead per packet,
+  // which SIOCOUTQ leaves out. poll() reports the socket writable only below
+  // two thirds, so a flow told there's no room won't find it writable either.
+  int sndbuf;
+  socklen_t sndbuf_len = sizeof(sndbuf);
+  int queued;
+  if (-1 == getsockopt(connection->sock_fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuf_len)
+      || -1 == ioctl(connection->sock_fd, SIOCOUTQ, &queued)) {
+    return -1;
+  }
+  const int limit = sndbuf - sndbuf / 4;
+  const size_t room = queued < limit ? limit - queued : 0;
+  if (0 == room) return 0;
+  return sendfile(connection->sock_fd, fd, &offset, n_bytes < room ? n_bytes : room);
+}
+
+void conn_close(Connection* const connection) {
+  if (NULL != connection->shm) {
+    shm_close(connection->shm);
+    connection->shm = NULL;
+  }
+  if (NULL != connection->recv) {
+    recv_chunk_unref(connection->recv->chunk);
+    delete connection->recv;
+    connection->recv = NULL;
+  }
+  close(connection->sock_fd);
+}
+
+int net_connect(
+  const char* const server_addr_str,
+  const int server_port,
+  Connection* out_conn
+) {
+  if (is_shm_addr(server_addr_str)) return shm_connect(server_port, out_conn);
+  return tcp_connect(server_addr_str, server_port, out_conn);
+}
@@ -1,16 +1,75 @@
 #pragma once
 
 #include <aio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ShmChannel;
+struct RecvBuffer;
+
+// A chunk of bytes read off of a connection. Messages parsed out of it may
+// point their bodies into it rather than copying them out, each holding a
+// reference, so that it outlives the receive buffer moving on to a new one.
+struct RecvChunk {
+  uint32_t refs;
+  uint8_t bytes[];
+};
+
+// The size of each RecvChunk's bytes.
+constexpr size_t RECV_CHUNK_LEN = 64 * 1024;
+
+void recv_chunk_ref(RecvChunk* chunk);
+void recv_chunk_unref(RecvChunk* chunk);
+
+// How RPC marks and headers are encoded on a connection. See rpc.h.
+enum class WireFormat : uint8_t {
+  Full,
+  Compact,
+};
 
 struct Connection {
+  // For shared-memory connections, the Unix socket the channel was set up
+  // over. Otherwise the TCP socket.
   int sock_fd;
   uint32_t client_ip;
   uint32_t server_ip;
   uint16_t client_port;
   uint16_t server_port;
+
+  // Every connection starts out Full. Both ends switch to Compact after a
+  // successful rpc_negotiate_compact().
+  WireFormat wire_format = WireFormat::Full;
+
+  // Compact headers carry their timestamp as a delta from the previous one
+  // sent in the same direction on the connection. These are the previous
+  // ones, in microseconds.
+  uint64_t last_send_us = 0;
+  uint64_t last_recv_us = 0;
+
+  // The RpcPriority (see rpc.h) of requests sent on the connection.
+  uint8_t priority = 0;
+
+  // Non-NULL if the connection uses the shared-memory transport in shm.h
+  // rather than TCP.
+  ShmChannel* shm = NULL;
+
+  // Bytes read off of the connection but not parsed yet. Made on the first
+  // conn_fill().
+  RecvBuffer* recv = NULL;
 };
 
+// Connects to the server at server_addr_str and server_port over TCP, or over
+// shared memory if server_addr_str starts with SHM_ADDR_PREFIX.
+//
+// Returns 0 if successful, and -1 otherwise.
+int net_connect(
+  const char* server_addr_str,
+  int server_port,
+  Connection* out_conn
+);
+
 // Opens a TCP connection to the server with IP encoded in server_addr_str and
 // port server_port, and stores the resulting connection in *out_conn.
 //
@@ -30,3 +89,55 @@ int tcp_accept(int sockfd, Connection* connection);
 // Return -1 if we hit an error while trying to read that many bytes.
 int readn(int sock_fd, void* buf, size_t n_bytes);
 
+// Like readn(), but over whichever transport the connection uses.
+int conn_readn(const Connection* connection, void* buf, size_t n_bytes);
+
+// Makes sure that the next n_bytes of the stream, at most RECV_CHUNK_LEN, are
+// buffered in one piece at conn_buffered(). Over TCP, each read() asks for as
+// much as there is room for, so that one read() picks up whatever else the
+// peer has sent too, such as a burst of small requests.
+//
+// Returns -1 if the connection ends first.
+int conn_fill(Connection* connection, size_t n_bytes);
+
+// Returns the buffered bytes, and the chunk they are in.
+uint8_t* conn_buffered(const Connection* connection, RecvChunk** chunk);
+
+// Returns how many bytes are buffered.
+size_t conn_n_buffered(const Connection* connection);
+
+// Drops the first n_bytes buffered bytes, which have been parsed.
+void conn_consume(Connection* connection, size_t n_bytes);
+
+// Reads exactly n_bytes into buf, taking them from the buffer first. For
+// bytes that don't fit in a chunk.
+int conn_recv_into(Connection* connection, void* buf, size_t n_bytes);
+
+// Writes all of the given buffers to the connection, in order.
+//
+// Returns -1 if not everything could be written.
+int conn_writev(const Connection* connection, const iovec* iov, int iovcnt);
+
+// Writes head, then n_bytes of file fd from offset, which must be a regular
+// file. Over TCP, the file's bytes go from the page cache to the socket with
+// sendfile(), never passing through user space.
+//
+// Returns -1 if not everything could be written.
+int conn_send_file(const Connection* connection, const iovec* head, int fd, off_t offset, size_t n_bytes);
+
+// Writes as much of the buffers, in order, as fits in the socket's send
+// buffer right now, without waiting for more room. With more set, tells TCP
+// that more bytes are coming right after, so that it doesn't send a short
+// packet. Shared-memory connections write everything, waiting if need be.
+//
+// Returns the number of bytes written, which is 0 if there was no room, or
+// -1 on error.
+ssize_t conn_try_writev(const Connection* connection, const iovec* iov, int iovcnt, bool more);
+
+// Like conn_try_writev(), but writes up to n_bytes of file fd from offset,
+// which must be a regular file, with sendfile() over TCP. It writes no more
+// than the socket's send buffer has room for, so as not to wait.
+ssize_t conn_try_send_file(const Connection* connection, int fd, off_t offset, size_t n_bytes);
+
+void conn_close(Connection* connection);
+
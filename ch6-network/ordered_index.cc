@@ -0,0 +1,294 @@
+#include "ordered_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Keys are immutable once inserted, and never freed.
+struct OrderedIndex::Key {
+  uint32_t len;
+  char bytes[];
+};
+
+struct OrderedIndex::Node {
+  // Odd while the writer is changing the node.
+  uint64_t version;
+  uint32_t count;
+  // Set when the node is made, and never changed.
+  bool is_leaf;
+  // The first 8 bytes of each key, big-endian and zero-padded, so that
+  // comparing them as integers orders them like the keys.
+  uint64_t prefixes[NODE_SLOTS];
+  const Key* keys[NODE_SLOTS];
+  // Leaves only: the leaf to the right, holding the next keys.
+  Node* next;
+  // Inner nodes only: children[i] holds the keys below keys[i], and
+  // children[count] the rest.
+  Node* children[NODE_SLOTS + 1];
+};
+
+// Everything a reader reads out of a node that the writer may be changing is
+// read with relaxed atomics, and is only trusted if the node's version
+// hasn't changed since before the reads.
+template <typename T>
+static T load(const T* const p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+template <typename T>
+static void store(T* const p, const T value) {
+  __atomic_store_n(p, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t read_begin(const uint64_t* const version) {
+  uint64_t v;
+  while ((v = __atomic_load_n(version, __ATOMIC_ACQUIRE)) & 1) {
+#if defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+  }
+  return v;
+}
+
+static bool read_validate(const uint64_t* const version, const uint64_t v) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(version, __ATOMIC_RELAXED) == v;
+}
+
+static void write_begin(uint64_t* const version) {
+  store(version, *version + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(uint64_t* const version) {
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+static uint64_t key_prefix(const char* const bytes, const size_t len) {
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < 8; ++i) prefix = (prefix << 8) | (i < len ? (uint8_t) bytes[i] : 0);
+  return prefix;
+}
+
+static int compare_bytes(const char* const a, const size_t a_len, const char* const b, const size_t b_len) {
+  const int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp != 0) return cmp;
+  return a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+}
+
+// A key being looked for, with its prefix computed once.
+struct Probe {
+  uint64_t prefix;
+  const char* bytes;
+  size_t len;
+};
+
+// Returns the number of the node's first count slots whose keys are below
+// probe, or if upper is set, at most probe. A NULL key, which only a reader
+// racing with the writer can see, counts as above everything.
+template <typename Node, typename Key>
+static uint32_t search(const Node* const node, const uint32_t count, const Probe& probe, const bool upper) {
+  uint32_t lo = 0, hi = count;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    const uint64_t prefix = load(&node->prefixes[mid]);
+    int cmp;
+    if (prefix != probe.prefix) {
+      cmp = prefix < probe.prefix ? -1 : 1;
+    } else {
+      const Key* const key = load(&node->keys[mid]);
+      cmp = NULL == key ? 1 : compare_bytes(key->bytes, key->len, probe.bytes, probe.len);
+    }
+    if (cmp < 0 || (upper && cmp == 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+OrderedIndex::OrderedIndex() {
+  root_ = new Node();
+  root_->is_leaf = true;
+}
+
+OrderedIndex::Node* OrderedIndex::find_leaf(const char* const key, const size_t key_len) const {
+  const Probe probe = {key_prefix(key, key_len), key, key_len};
+  Node* node = __atomic_load_n(&root_, __ATOMIC_ACQUIRE);
+  while (!node->is_leaf) {
+    const uint64_t v = read_begin(&node->version);
+    uint32_t count = load(&node->count);
+    if (count > NODE_SLOTS) count = NODE_SLOTS;
+    const uint32_t i = search<Node, Key>(node, count, probe, /*upper=*/true);
+    Node* const child = load(&node->children[i]);
+    if (read_validate(&node->version, v) && NULL != child) node = child;
+  }
+  return node;
+}
+
+void OrderedIndex::insert(const char* const bytes, const size_t len) {
+  const Probe probe = {key_prefix(bytes, len), bytes, len};
+
+  // Only this thread changes the tree, so it can read it without checking
+  // versions.
+  Node* path[64];
+  int depth = 0;
+  Node* node = root_;
+  while (!node->is_leaf) {
+    path[depth++] = node;
+    node = node->children[search<Node, Key>(node, node->count, probe, /*upper=*/true)];
+  }
+  const uint32_t pos = search<Node, Key>(node, node->count, probe, /*upper=*/false);
+  if (pos < node->count
+      && node->prefixes[pos] == probe.prefix
+      && 0 == compare_bytes(node->keys[pos]->bytes, node->keys[pos]->len, bytes, len)) {
+    return;
+  }
+
+  Key* const key = (Key*) malloc(sizeof(Key) + len);
+  key->len = len;
+  memcpy(key->bytes, bytes, len);
+
+  // Insert (prefix, key, child) into node, splitting full nodes on the way up.
+  uint64_t prefix = probe.prefix;
+  const Key* up_key = key;
+  Node* child = NULL;
+  while (true) {
+    const Probe at = {prefix, up_key->bytes, up_key->len};
+    if (node->count < NODE_SLOTS) {
+      insert_at(node, search<Node, Key>(node, node->count, at, !node->is_leaf), prefix, up_key, child);
+      break;
+    }
+
+    // Split: the upper half moves to a new node to the right, and a
+    // separator goes up to the parent. The new node is filled in before
+    // anything points to it.
+    constexpr uint32_t MID = NODE_SLOTS / 2;
+    Node* const right = new Node();
+    right->is_leaf = node->is_leaf;
+    uint64_t sep_prefix;
+    const Key* sep_key;
+    if (node->is_leaf) {
+      right->count = NODE_SLOTS - MID;
+      memcpy(right->prefixes, node->prefixes + MID, right->count * sizeof(uint64_t));
+      memcpy(right->keys, node->keys + MID, right->count * sizeof(Key*));
+      right->next = node->next;
+      sep_prefix = right->prefixes[0];
+      sep_key = right->keys[0];
+
+      write_begin(&node->version);
+      store(&node->count, MID);
+      store(&node->next, right);
+      write_end(&node->version);
+    } else {
+      // The middle key moves up rather than being copied.
+      right->count = NODE_SLOTS - MID - 1;
+      memcpy(right->prefixes, node->prefixes + MID + 1, right->count * sizeof(uint64_t));
+      memcpy(right->keys, node->keys + MID + 1, right->count * sizeof(Key*));
+      memcpy(right->children, node->children + MID + 1, (right->count + 1) * sizeof(Node*));
+      sep_prefix = node->prefixes[MID];
+      sep_key = node->keys[MID];
+
+      write_begin(&node->version);
+      store(&node->count, MID);
+      write_end(&node->version);
+    }
+
+    // Put the pending entry in whichever half it belongs to. It can't equal
+    // the separator, which is already in the tree.
+    const bool goes_right = prefix != sep_prefix
+      ? prefix > sep_prefix
+      : compare_bytes(up_key->bytes, up_key->len, sep_key->bytes, sep_key->len) > 0;
+    Node* const half = goes_right ? right : node;
+    insert_at(half, search<Node, Key>(half, half->count, at, !half->is_leaf), prefix, up_key, child);
+
+    if (depth == 0) {
+      Node* const root = new Node();
+      root->is_leaf = false;
+      root->count = 1;
+      root->prefixes[0] = sep_prefix;
+      root->keys[0] = sep_key;
+      root->children[0] = node;
+      root->children[1] = right;
+      __atomic_store_n(&root_, root, __ATOMIC_RELEASE);
+      break;
+    }
+    node = path[--depth];
+    prefix = sep_prefix;
+    up_key = sep_key;
+    child = right;
+  }
+  __atomic_add_fetch(&n_keys_, 1, __ATOMIC_RELEASE);
+}
+
+void OrderedIndex::insert_at(
+  Node* const node,
+  const uint32_t pos,
+  const uint64_t prefix,
+  const Key* const key,
+  Node* const child
+) {
+  write_begin(&node->version);
+  for (uint32_t i = node->count; i > pos; --i) {
+    store(&node->prefixes[i], node->prefixes[i - 1]);
+    store(&node->keys[i], node->keys[i - 1]);
+  }
+  store(&node->prefixes[pos], prefix);
+  store(&node->keys[pos], key);
+  if (!node->is_leaf) {
+    for (uint32_t i = node->count + 1; i > pos + 1; --i) {
+      store(&node->children[i], node->children[i - 1]);
+    }
+    store(&node->children[pos + 1], child);
+  }
+  store(&node->count, node->count + 1);
+  write_end(&node->version);
+}
+
+size_t OrderedIndex::scan(
+  const char* const start,
+  const size_t start_len,
+  const char* const end,
+  const size_t end_len,
+  const bool has_end,
+  const size_t limit,
+  const ScanVisitor visit,
+  void* const arg
+) const {
+  // The last key visited, so that a leaf re-read after a split doesn't
+  // visit any twice.
+  const char* cursor = start;
+  size_t cursor_len = start_len;
+  bool inclusive = true;
+
+  size_t n_visited = 0;
+  const Node* leaf = find_leaf(start, start_len);
+  while (NULL != leaf && n_visited < limit) {
+    const Key* keys[NODE_SLOTS];
+    uint32_t count;
+    const Node* next;
+    while (true) {
+      const uint64_t v = read_begin(&leaf->version);
+      count = load(&leaf->count);
+      if (count > NODE_SLOTS) count = NODE_SLOTS;
+      for (uint32_t i = 0; i < count; ++i) keys[i] = load(&leaf->keys[i]);
+      next = load(&leaf->next);
+      if (read_validate(&leaf->version, v)) break;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+      const Key* const key = keys[i];
+      const int cmp = compare_bytes(key->bytes, key->len, cursor, cursor_len);
+      if (cmp < 0 || (cmp == 0 && !inclusive)) continue;
+      if (has_end && compare_bytes(key->bytes, key->len, end, end_len) >= 0) return n_visited;
+
+      ++n_visited;
+      if (!visit(arg, key->bytes, key->len) || n_visited == limit) return n_visited;
+      cursor = key->bytes;
+      cursor_len = key->len;
+      inclusive = false;
+    }
+    leaf = next;
+  }
+  return n_visited;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An ordered set of keys, for range scans over the keystore, whose hash map
+// can't do them.
+//
+// It's a B+-tree with wide nodes: each node holds up to NODE_SLOTS keys, with
+// the first 8 bytes of each packed into an array of big-endian integers, so
+// that most comparisons while searching a node are integer compares within a
+// couple of cache lines, and only ties chase a pointer to the full key.
+//
+// One writer at a time inserts, and any number of readers scan without taking
+// a lock, optimistically: every node has a version that the writer makes odd
+// while changing the node and even again after. A reader copies what it needs
+// out of a node and then checks that the version didn't change, retrying the
+// node if it did. Writers never wait for readers.
+//
+// That is safe because nothing is ever freed: keys can't be deleted, and a
+// split only moves the upper half of a node into a new node to its right. The
+// leaves are linked left to right, so a reader that lands to the left of
+// where it meant to, because it raced with a split, just walks right.
+class OrderedIndex {
+public:
+  static constexpr int NODE_SLOTS = 32;
+
+  OrderedIndex();
+
+  // Adds the key, if it isn't there already. Inserts must not run
+  // concurrently with each other; scans may run concurrently with anything.
+  void insert(const char* key, size_t key_len);
+
+  // Called on each key found by scan(). Returns false to stop the scan.
+  typedef bool (*ScanVisitor)(void* arg, const char* key, size_t key_len);
+
+  // Visits up to limit keys that are >= start and < end, in order. If
+  // has_end is false, there is no upper bound.
+  //
+  // Returns the number of keys visited.
+  size_t scan(
+    const char* start,
+    size_t start_len,
+    const char* end,
+    size_t end_len,
+    bool has_end,
+    size_t limit,
+    ScanVisitor visit,
+    void* arg
+  ) const;
+
+  // Returns the number of keys.
+  size_t size() const { return __atomic_load_n(&n_keys_, __ATOMIC_ACQUIRE); }
+
+private:
+  struct Key;
+  struct Node;
+
+  // Returns the leaf where key belongs, or one to the left of it.
+  Node* find_leaf(const char* key, size_t key_len) const;
+
+  // Inserts key at slot pos of a node with room for it, and if the node is
+  // an inner one, child to its right.
+  static void insert_at(Node* node, uint32_t pos, uint64_t prefix, const Key* key, Node* child);
+
+  Node* root_;
+  size_t n_keys_ = 0;
+};
@@ -0,0 +1,30 @@
+#include "phases.h"
+
+#include <unistd.h>
+
+const char* phase_name(const RequestPhase phase) {
+  switch (phase) {
+    case PHASE_STARTED:    return "started";
+    case PHASE_PARSED:     return "parsed";
+    case PHASE_LOCKED:     return "locked";
+    case PHASE_HANDLED:    return "handled";
+    case PHASE_FIRST_SENT: return "first_sent";
+    case PHASE_LAST_SENT:  return "last_sent";
+    default:               return "unknown";
+  }
+}
+
+static uint32_t measure_cycles_per_us() {
+  const uint64_t start_ns = now_nsec();
+  const uint64_t start_cycles = read_cycles();
+  usleep(10000);
+  const uint64_t elapsed_ns = now_nsec() - start_ns;
+  const uint64_t elapsed_cycles = read_cycles() - start_cycles;
+  const uint32_t per_us = (elapsed_cycles * 1000 + elapsed_ns / 2) / elapsed_ns;
+  return per_us > 0 ? per_us : 1;
+}
+
+uint32_t cycles_per_us() {
+  static const uint32_t per_us = measure_cycles_per_us();
+  return per_us;
+}
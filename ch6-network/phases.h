@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+// Where a server spends its time answering one request, as cycle counts taken
+// at the end of each phase, relative to when the request had been fully
+// received. The server logs them after the response's log record; see log.h.
+enum RequestPhase {
+  // A worker picked the request up. The time before it is queueing.
+  PHASE_STARTED,
+  // The handler has parsed the body.
+  PHASE_PARSED,
+  // The handler holds the keystore lock. 0 if it doesn't take it.
+  PHASE_LOCKED,
+  // The handler has its answer, and is about to send it.
+  PHASE_HANDLED,
+  // The response's first byte is about to be written, with the connection's
+  // send lock held.
+  PHASE_FIRST_SENT,
+  // The response's last byte has been written.
+  PHASE_LAST_SENT,
+  N_PHASES
+};
+
+const char* phase_name(RequestPhase phase);
+
+struct PhaseTimes {
+  // Cycle counter when the request had been fully received.
+  uint64_t recv_cycles;
+  // Cycles from recv_cycles to the end of each phase, saturating, or 0 if the
+  // phase didn't happen.
+  uint32_t cycles[N_PHASES];
+  // Cycle counter ticks per microsecond, for converting the above.
+  uint32_t cycles_per_us;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(PhaseTimes) == 40);
+
+// Returns the time by clock in nanoseconds: CLOCK_MONOTONIC, the default, for
+// wall time, or e.g. CLOCK_THREAD_CPUTIME_ID for the CPU time the calling
+// thread has used.
+inline uint64_t now_nsec(const clockid_t clock = CLOCK_MONOTONIC) {
+  timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Returns a constant-rate cycle counter: the TSC on x86, and nanoseconds
+// elsewhere.
+inline uint64_t read_cycles() {
+#if defined(__x86_64__)
+  return __rdtsc();
+#else
+  return now_nsec();
+#endif
+}
+
+// Returns read_cycles() ticks per microsecond. The first call measures it,
+// which takes about 10 ms.
+uint32_t cycles_per_us();
+
+// Starts timing a request that has just been fully received.
+inline void phases_start(PhaseTimes* const phases) {
+  phases->recv_cycles = read_cycles();
+  for (uint32_t& cycles : phases->cycles) cycles = 0;
+  phases->cycles_per_us = cycles_per_us();
+  phases->reserved = 0;
+}
+
+// Records the end of phase, if phases isn't NULL.
+inline void phases_mark(PhaseTimes* const phases, const RequestPhase phase) {
+  if (NULL == phases) return;
+  const uint64_t elapsed = read_cycles() - phases->recv_cycles;
+  phases->cycles[phase] = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+}
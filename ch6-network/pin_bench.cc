@@ -0,0 +1,187 @@
+// Compares the server's tail latency with its threads left to the scheduler
+// and with them pinned, by running ./server and a ./client mix process per
+// port against it, alternating between the two, and merging the clients'
+// latency histograms.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+struct Args {
+  int port = 15400;
+  int rounds = 3;
+  int n_clients = 4;
+  int n_rpcs = 20000;
+  // Extra server flags for the pinned runs, split on spaces.
+  const char* placement = "-auto-pin";
+};
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tpin_bench [-port P] [-rounds N] [-clients N] [-k N] [-placement FLAGS]\n"
+    "\n"
+    "Runs ./server unpinned and then with FLAGS (default -auto-pin), N (-rounds,\n"
+    "default 3) times each. Each run has N (-clients, default 4) ./client processes\n"
+    "send N (-k, default 20000) mix RPCs each at once, to a port each, and the\n"
+    "percentiles of all of their latencies are printed for each placement. The\n"
+    "runs use fresh ports from P (default 15400) up, one more per client each run.\n"
+    "\n"
+    "e.g. pin_bench -placement \"-nic eth0 -no-smt -workers 2\"\n"
+  );
+}
+
+Args parse_args(const int argc, char** const argv) {
+  Args args;
+  for (int i = 1; i < argc; i += 2) {
+    if (i + 1 >= argc) usage(), exit(1);
+    if (strcmp(argv[i], "-port") == 0) {
+      args.port = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-rounds") == 0) {
+      args.rounds = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-clients") == 0) {
+      args.n_clients = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-k") == 0) {
+      args.n_rpcs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-placement") == 0) {
+      args.placement = argv[i + 1];
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (args.rounds < 1 || args.n_clients < 1 || args.n_rpcs < 1) {
+    fprintf(stderr, "-rounds, -clients and -k must be positive\n");
+    exit(1);
+  }
+  return args;
+}
+
+// Starts argv[0] with its output sent to /dev/null.
+//
+// Returns the child's pid, or -1 on error.
+pid_t spawn(const std::vector<std::string>& args) {
+  std::vector<char*> argv;
+  for (const std::string& arg : args) argv.push_back((char*) arg.c_str());
+  argv.push_back(NULL);
+
+  const pid_t pid = fork();
+  if (0 == pid) {
+    if (!freopen("/dev/null", "w", stdout)) _exit(127);
+    execv(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  return pid;
+}
+
+// Returns true if the child exited with status 0.
+bool wait_for(const pid_t pid) {
+  int status;
+  return pid > 0 && pid == waitpid(pid, &status, 0) && WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
+
+// Waits up to 5 seconds for something to listen on port.
+bool wait_for_port(const int port) {
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    const bool connected = 0 == connect(fd, (sockaddr*) &addr, sizeof(addr));
+    close(fd);
+    if (connected) return true;
+    usleep(10000);
+  }
+  return false;
+}
+
+// Runs one server with the given extra flags on a port per client, from port
+// up, and the clients against it, adding their latencies to *latencies.
+bool run(const Args& args, const int port, const char* const flags, LatencyHistogram* const latencies) {
+  const int end_port = port + args.n_clients - 1;
+  std::vector<std::string> server_args = {"./server"};
+  for (const char* at = flags; *at; ) {
+    const size_t len = strcspn(at, " ");
+    if (len > 0) server_args.push_back(std::string(at, len));
+    at += len + (at[len] == ' ');
+  }
+  server_args.push_back(std::to_string(port));
+  server_args.push_back(std::to_string(end_port));
+  const pid_t server = spawn(server_args);
+  if (!wait_for_port(end_port)) {
+    fprintf(stderr, "server on ports %d-%d didn't start\n", port, end_port);
+    return false;
+  }
+
+  // The ports share a keystore, which gets every key written before any
+  // client starts.
+  const std::string k = std::to_string(args.n_rpcs);
+  bool ok = wait_for(spawn({
+    "./client", "127.0.0.1", std::to_string(port), "-k", "1", "mix", "-keys", "10000", "-preload"
+  }));
+  std::vector<pid_t> clients;
+  std::vector<std::string> hist_fns;
+  for (int i = 0; i < args.n_clients; ++i) {
+    const std::string port_str = std::to_string(port + i);
+    hist_fns.push_back("pin_bench-" + port_str + ".hist");
+    clients.push_back(spawn({
+      "./client", "127.0.0.1", port_str, "-k", k, "-hist", hist_fns.back(), "mix", "-keys", "10000"
+    }));
+  }
+  for (const pid_t client : clients) ok &= wait_for(client);
+  for (int p = port; p <= end_port; ++p) {
+    ok &= wait_for(spawn({"./client", "127.0.0.1", std::to_string(p), "quit"}));
+  }
+  ok &= wait_for(server);
+
+  for (const std::string& fn : hist_fns) {
+    ok &= latencies->merge_from_file(fn.c_str());
+    unlink(fn.c_str());
+  }
+  if (!ok) fprintf(stderr, "a run on port %d failed\n", port);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  const Args args = parse_args(argc, argv);
+
+  LatencyHistogram* const unpinned = new LatencyHistogram();
+  LatencyHistogram* const pinned = new LatencyHistogram();
+  int port = args.port;
+  for (int round = 0; round < args.rounds; ++round) {
+    if (!run(args, port, "", unpinned)) exit(1);
+    port += args.n_clients;
+    if (!run(args, port, args.placement, pinned)) exit(1);
+    port += args.n_clients;
+  }
+
+  const LatencyHistogram* const results[2] = {unpinned, pinned};
+  const char* const names[2] = {"unpinned", args.placement};
+  printf("%-24s %10s %10s %10s %10s %10s\n", "", "rpcs", "p50 us", "p99 us", "p99.9 us", "max us");
+  for (int i = 0; i < 2; ++i) {
+    printf(
+      "%-24s %10lu %10.1f %10.1f %10.1f %10.1f\n",
+      names[i],
+      results[i]->count(),
+      results[i]->percentile(0.5) / 1000.0,
+      results[i]->percentile(0.99) / 1000.0,
+      results[i]->percentile(0.999) / 1000.0,
+      results[i]->max() / 1000.0
+    );
+  }
+  return 0;
+}
@@ -0,0 +1,280 @@
+#include "placement.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+bool parse_cpu_list(const char* str, std::vector<int>* const out) {
+  while (*str) {
+    char* end;
+    const long first = strtol(str, &end, 10);
+    if (end == str || first < 0) return false;
+    long last = first;
+    if (*end == '-') {
+      str = end + 1;
+      last = strtol(str, &end, 10);
+      if (end == str || last < first) return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) out->push_back(cpu);
+
+    if (*end == ',') ++end;
+    else if (*end != '\0') return false;
+    str = end;
+  }
+  return !out->empty();
+}
+
+// Reads the first line of a file under /sys or /proc into buf, without its
+// newline.
+//
+// Returns false if the file can't be read.
+static bool read_line(const char* const path, char* const buf, const size_t len) {
+  FILE* const file = fopen(path, "r");
+  if (NULL == file) return false;
+  const bool ok = NULL != fgets(buf, len, file);
+  fclose(file);
+  if (!ok) return false;
+  buf[strcspn(buf, "\n")] = '\0';
+  return true;
+}
+
+static bool read_cpu_list(const char* const path, std::vector<int>* const out) {
+  char line[4096];
+  return read_line(path, line, sizeof(line)) && parse_cpu_list(line, out);
+}
+
+static bool contains(const std::vector<int>& cpus, const int cpu) {
+  return cpus.end() != std::find(cpus.begin(), cpus.end(), cpu);
+}
+
+// Returns the lowest numbered of cpu's SMT siblings, which names its core.
+static int cpu_core(const int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+  std::vector<int> siblings;
+  if (!read_cpu_list(path, &siblings)) return cpu;
+  return *std::min_element(siblings.begin(), siblings.end());
+}
+
+// Returns cpu's NUMA node, from the nodeN link in its directory. Without
+// one, the machine has a single node.
+static int cpu_node(const int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR* const dir = opendir(path);
+  if (NULL == dir) return 0;
+  int node = 0;
+  while (const dirent* const entry = readdir(dir)) {
+    if (1 == sscanf(entry->d_name, "node%d", &node)) break;
+  }
+  closedir(dir);
+  return node;
+}
+
+// The CPUs this process may run on, in order.
+static std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (0 != sched_getaffinity(0, sizeof(set), &set)) return cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// A network interface's device directory can be a function of a PCI device,
+// as with virtio, whose NUMA node and interrupts are then the parent's. Reads
+// the NIC's node into *node, and the CPUs its MSI interrupts go to into
+// *irq_cpus.
+//
+// Returns false if there is no such interface.
+static bool read_nic(const char* const nic, int* const node, std::vector<int>* const irq_cpus) {
+  char path[256];
+  struct stat st;
+  snprintf(path, sizeof(path), "/sys/class/net/%s", nic);
+  if (0 != stat(path, &st)) {
+    errno = ENODEV;
+    return false;
+  }
+
+  *node = -1;
+  irq_cpus->clear();
+  const char* const devices[2] = {"device", "device/.."};
+  for (const char* const device : devices) {
+    char line[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/%s/numa_node", nic, device);
+    if (*node < 0 && read_line(path, line, sizeof(line))) *node = atoi(line);
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/%s/msi_irqs", nic, device);
+    DIR* const dir = irq_cpus->empty() ? opendir(path) : NULL;
+    if (NULL == dir) continue;
+    while (const dirent* const entry = readdir(dir)) {
+      int irq;
+      if (1 != sscanf(entry->d_name, "%d", &irq)) continue;
+      // The affinity the kernel actually applied, where it says.
+      std::vector<int> cpus;
+      snprintf(path, sizeof(path), "/proc/irq/%d/effective_affinity_list", irq);
+      if (!read_cpu_list(path, &cpus)) {
+        snprintf(path, sizeof(path), "/proc/irq/%d/smp_affinity_list", irq);
+        if (!read_cpu_list(path, &cpus)) continue;
+      }
+      for (const int cpu : cpus) {
+        if (!contains(*irq_cpus, cpu)) irq_cpus->push_back(cpu);
+      }
+    }
+    closedir(dir);
+  }
+  std::sort(irq_cpus->begin(), irq_cpus->end());
+  return true;
+}
+
+bool plan_placement(
+  const PlacementConfig& config,
+  const int n_listeners,
+  const int n_workers,
+  Placement* const out
+) {
+  const std::vector<int> allowed = allowed_cpus();
+  const std::vector<int>* const lists[2] = {&config.listener_cpus, &config.worker_cpus};
+  for (const std::vector<int>* const cpus : lists) {
+    for (const int cpu : *cpus) {
+      if (!contains(allowed, cpu)) {
+        errno = EINVAL;
+        return false;
+      }
+    }
+  }
+
+  out->listener_cpus = config.listener_cpus;
+  out->worker_cpus = config.worker_cpus;
+  if (NULL != config.nic && !read_nic(config.nic, &out->nic_node, &out->irq_cpus)) return false;
+  if (!config.auto_place) return true;
+
+  std::vector<int> candidates;
+  for (const int cpu : allowed) {
+    if (out->nic_node < 0 || cpu_node(cpu) == out->nic_node) candidates.push_back(cpu);
+  }
+  if (candidates.empty()) candidates = allowed;
+
+  // One hardware thread of each core first, then the second of each, and so
+  // on, so that threads only land on siblings once every core has one.
+  std::vector<int> cores(candidates.size()), ranks(candidates.size());
+  for (size_t i = 0; i < candidates.size(); ++i) {
+    cores[i] = cpu_core(candidates[i]);
+    ranks[i] = std::count(cores.begin(), cores.begin() + i, cores[i]);
+  }
+  std::vector<size_t> order(candidates.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b) {
+    return ranks[a] < ranks[b];
+  });
+
+  if (out->listener_cpus.empty()) {
+    for (int pass = 0; pass < 2; ++pass) {
+      const bool irq = pass == 0;
+      for (const size_t i : order) {
+        if ((int) out->listener_cpus.size() == n_listeners) break;
+        if (irq == contains(out->irq_cpus, candidates[i])) out->listener_cpus.push_back(candidates[i]);
+      }
+    }
+  }
+
+  if (out->worker_cpus.empty()) {
+    std::vector<int> used_cores;
+    for (const int cpu : out->listener_cpus) used_cores.push_back(cpu_core(cpu));
+    for (int pass = 0; pass < 2; ++pass) {
+      const bool irq = pass == 1;
+      for (const size_t i : order) {
+        if ((int) out->worker_cpus.size() == n_workers) break;
+        const int cpu = candidates[i];
+        if (irq != contains(out->irq_cpus, cpu) || contains(out->listener_cpus, cpu)) continue;
+        if (config.no_smt && contains(used_cores, cores[i])) continue;
+        out->worker_cpus.push_back(cpu);
+        used_cores.push_back(cores[i]);
+      }
+    }
+    // Nothing left over, so the workers share the listeners' CPUs.
+    if (out->worker_cpus.empty()) {
+      for (const size_t i : order) {
+        if ((int) out->worker_cpus.size() == n_workers) break;
+        if (!config.no_smt || ranks[i] == 0) out->worker_cpus.push_back(candidates[i]);
+      }
+    }
+  }
+  return true;
+}
+
+// Writes cpus to buf as a CPU list, like "0-3,8".
+static void format_cpu_list(const std::vector<int>& cpus, char* const buf, const size_t len) {
+  size_t used = 0;
+  buf[0] = '\0';
+  for (size_t i = 0; i < cpus.size() && used < len; ) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+    used += j == i
+      ? snprintf(buf + used, len - used, "%s%d", i == 0 ? "" : ",", cpus[i])
+      : snprintf(buf + used, len - used, "%s%d-%d", i == 0 ? "" : ",", cpus[i], cpus[j]);
+    i = j + 1;
+  }
+}
+
+void print_placement(
+  FILE* const out,
+  const Placement& placement,
+  const char* const nic,
+  const int start_port,
+  const int n_listeners,
+  const int n_workers
+) {
+  if (NULL != nic) {
+    char irq_cpus[256];
+    format_cpu_list(placement.irq_cpus, irq_cpus, sizeof(irq_cpus));
+    if (placement.nic_node < 0) {
+      fprintf(out, "placement: NIC %s on an unknown NUMA node", nic);
+    } else {
+      fprintf(out, "placement: NIC %s on NUMA node %d", nic, placement.nic_node);
+    }
+    fprintf(out, ", interrupts on CPUs %s\n", placement.irq_cpus.empty() ? "unknown" : irq_cpus);
+  }
+
+  // Every pinned thread's CPU, listeners first, to find the ones sharing a
+  // core.
+  std::vector<int> cpus;
+  for (int i = 0; i < n_listeners && !placement.listener_cpus.empty(); ++i) {
+    cpus.push_back(placement.listener_cpus[i % placement.listener_cpus.size()]);
+  }
+  for (int i = 0; i < n_workers && !placement.worker_cpus.empty(); ++i) {
+    cpus.push_back(placement.worker_cpus[i % placement.worker_cpus.size()]);
+  }
+  std::vector<int> cores;
+  for (const int cpu : cpus) cores.push_back(cpu_core(cpu));
+
+  size_t next = 0;
+  for (int role = 0; role < 2; ++role) {
+    const std::vector<int>& role_cpus = role == 0 ? placement.listener_cpus : placement.worker_cpus;
+    const int n_threads = role == 0 ? n_listeners : n_workers;
+    for (int i = 0; i < n_threads; ++i) {
+      if (role == 0) {
+        fprintf(out, "placement: port %d listener", start_port + i);
+      } else {
+        fprintf(out, "placement: worker %d", i);
+      }
+      if (role_cpus.empty()) {
+        fprintf(out, " unpinned\n");
+        continue;
+      }
+      const int cpu = cpus[next];
+      const int core = cores[next++];
+      fprintf(out, " on CPU %d (node %d, core %d)", cpu, cpu_node(cpu), core);
+      if (contains(placement.irq_cpus, cpu)) fprintf(out, ", takes NIC interrupts");
+      const int n_sharing = std::count(cores.begin(), cores.end(), core) - 1;
+      if (n_sharing > 0) fprintf(out, ", shares its core with %d other thread%s", n_sharing, n_sharing == 1 ? "" : "s");
+      fprintf(out, "\n");
+    }
+  }
+}
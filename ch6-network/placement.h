@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <vector>
+
+// Decides which CPUs the server's listening threads and workers run on.
+//
+// Left alone, the scheduler moves threads between CPUs as it sees fit, and a
+// thread that moves leaves its warm caches behind. Pinning each thread to a
+// CPU of its own keeps them warm. Where the CPUs are matters too: a NIC
+// delivers packets into the memory of one NUMA node, and its interrupts run
+// the kernel's receive path on a few CPUs, so the threads that read from it
+// do best near both. And two hardware threads of one core (SMT siblings)
+// share its caches and execution units, so workers pinned to siblings slow
+// each other down.
+
+// Parses a comma-separated list of CPU numbers and inclusive CPU ranges, like
+// "0,2,4-7", appending the CPUs to *out. This is also the format of the CPU
+// lists in /sys.
+//
+// Returns false if parsing fails.
+bool parse_cpu_list(const char* str, std::vector<int>* out);
+
+struct PlacementConfig {
+  // CPUs to pin listening thread i and worker i to, cpus[i % cpus.size()].
+  // If empty, they are placed automatically if auto_place is set, and
+  // otherwise left to the scheduler.
+  std::vector<int> listener_cpus;
+  std::vector<int> worker_cpus;
+
+  bool auto_place = false;
+
+  // For automatic placement, the network interface whose NUMA node to stay
+  // on, or NULL for any node.
+  const char* nic = NULL;
+
+  // For automatic placement, gives each worker a core that no other pinned
+  // thread runs on, as long as there are enough.
+  bool no_smt = false;
+};
+
+struct Placement {
+  // As in PlacementConfig, empty for threads that aren't pinned.
+  std::vector<int> listener_cpus;
+  std::vector<int> worker_cpus;
+
+  // The NIC's NUMA node, or -1 if unknown, and the CPUs its interrupts are
+  // routed to.
+  int nic_node = -1;
+  std::vector<int> irq_cpus;
+};
+
+// Picks CPUs for n_listeners listening threads and n_workers workers.
+//
+// Automatic placement uses the CPUs this process may run on, limited to the
+// NIC's NUMA node if there is one. Listening threads go first to the CPUs
+// that take the NIC's interrupts, where the packets they read were just
+// handled, and then to one hardware thread of each core in turn. Workers get
+// the CPUs left over, avoiding the interrupts, or share the listeners' if
+// none are.
+//
+// Returns false and sets errno if a CPU list names a CPU this process can't
+// run on, or the NIC doesn't exist.
+bool plan_placement(const PlacementConfig& config, int n_listeners, int n_workers, Placement* out);
+
+// Prints where each thread runs, one line each: its CPU, that CPU's NUMA
+// node and core, and whether it takes NIC interrupts or shares a core with
+// another thread.
+void print_placement(
+  FILE* out,
+  const Placement& placement,
+  const char* nic,
+  int start_port,
+  int n_listeners,
+  int n_workers
+);
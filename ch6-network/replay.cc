@@ -0,0 +1,351 @@
+// Replays recorded requests against a server, at their original inter-arrival
+// times or a multiple of them, to reproduce a traffic pattern on a test box.
+//
+// Reads either a capture file from `server -capture`, which has every
+// request's full body, or a plain log file (client.log or server-PORT.log),
+// from which the bodies are rebuilt as well as the 24-byte body prefix
+// allows:
+//
+// - write: the key and value lengths are in the prefix, and so are the first
+//   16 bytes of the key. The rest of the key is padded with '_' and the value
+//   is filled with 'v'.
+// - read: the key is the prefix up to its first NUL.
+// - anything else: the body is the prefix, zero-extended to the smallest size
+//   that matches the logged req_len_log.
+//
+// quit and wirefmt requests are never replayed.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "histogram.h"
+#include "log.h"
+#include "my_rpc.h"
+#include "network.h"
+#include "phases.h"
+#include "rpc.h"
+
+struct ReplayRequest {
+  uint64_t send_time_us;
+  char method[8];
+  std::vector<uint8_t> body;
+};
+
+// One pipelined connection to the server. A sender thread sends its requests
+// on schedule while a receiver thread collects the responses.
+struct ReplayConn {
+  Connection connection;
+  std::vector<const ReplayRequest*> requests;
+
+  // Requests sent but not yet answered, capped at the pipeline depth.
+  int outstanding = 0;
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+  // How far behind schedule the sender fell, at worst.
+  uint64_t max_lag_ns = 0;
+  uint64_t n_errors = 0;
+  LatencyHistogram* latencies = new LatencyHistogram();
+
+  pthread_t sender;
+  pthread_t receiver;
+};
+
+struct Args {
+  const char* server;
+  uint16_t port;
+  const char* in_fn;
+  // Multiple of the original rate to replay at. 0 means as fast as the
+  // pipeline allows.
+  double speed = 1;
+  int n_conns = 1;
+  int depth = 16;
+  const char* hist_fn = NULL;
+};
+
+// Everything the sender threads need to agree on for the schedule.
+uint64_t start_ns;
+uint64_t first_send_time_us;
+Args args;
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\treplay [-speed X] [-conns N] [-depth N] [-hist FILE] SERVER PORT FILE\n"
+    "\n"
+    "Replays the requests in FILE, a capture file or a log file, against\n"
+    "SERVER:PORT at X times their original rate (default 1; 0 means as fast as\n"
+    "possible), over N (-conns) connections with up to N (-depth) requests\n"
+    "outstanding on each. -hist saves the latency histogram to FILE.\n"
+  );
+}
+
+Args parse_args(int argc, char** argv) {
+  Args args;
+  int next_arg = 1;
+  for (; next_arg < argc && argv[next_arg][0] == '-'; next_arg += 2) {
+    if (next_arg + 1 >= argc) usage(), exit(1);
+    const char* const value = argv[next_arg + 1];
+    if (strcmp("-speed", argv[next_arg]) == 0) {
+      args.speed = atof(value);
+    } else if (strcmp("-conns", argv[next_arg]) == 0) {
+      args.n_conns = atoi(value);
+    } else if (strcmp("-depth", argv[next_arg]) == 0) {
+      args.depth = atoi(value);
+    } else if (strcmp("-hist", argv[next_arg]) == 0) {
+      args.hist_fn = value;
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[next_arg]);
+      usage();
+      exit(1);
+    }
+  }
+  if (argc - next_arg != 3) usage(), exit(1);
+  args.server = argv[next_arg];
+  args.port = atoi(argv[next_arg + 1]);
+  args.in_fn = argv[next_arg + 2];
+
+  if (args.speed < 0 || args.n_conns < 1 || args.depth < 1) {
+    fprintf(stderr, "-speed must not be negative, and -conns and -depth must be positive\n");
+    exit(1);
+  }
+  return args;
+}
+
+bool is_replayable(const RPCHeader& header) {
+  return header.message_type == RpcMessageType::Request
+    && strncmp(header.method, "quit", 8) != 0
+    && strncmp(header.method, "wirefmt", 8) != 0
+    // Answered with several responses, where replay expects one.
+    && strncmp(header.method, "scan", 8) != 0
+    // Writes the whole keystore out, which would swamp what's measured.
+    && strncmp(header.method, "snapshot", 8) != 0;
+}
+
+bool load_capture(FILE* const file, std::vector<ReplayRequest>* const out) {
+  while (true) {
+    RPCHeader header;
+    uint32_t data_len;
+    if (1 != fread(&header, sizeof(header), 1, file)) return feof(file);
+    if (1 != fread(&data_len, sizeof(data_len), 1, file)) return false;
+
+    ReplayRequest request;
+    request.send_time_us = header.req_send_time_us;
+    memcpy(request.method, header.method, 8);
+    request.body.resize(data_len);
+    if (data_len > 0 && 1 != fread(request.body.data(), data_len, 1, file)) return false;
+    if (is_replayable(header)) out->push_back(std::move(request));
+  }
+}
+
+// Rebuilds a request body from a log record. See the top of the file.
+void rebuild_body(const RPCHeader& header, const uint8_t* const prefix, std::vector<uint8_t>* const body) {
+  constexpr size_t PREFIX_LEN = 24;
+
+  if (strncmp(header.method, "write", 8) == 0) {
+    const uint8_t key_len = prefix[0];
+    uint32_t value_len;
+    memcpy(&value_len, prefix + 4, 4);
+    value_len = ntohl(value_len);
+    if (value_len > MAX_VALUE_LEN) value_len = MAX_VALUE_LEN;
+
+    const size_t head_len = sizeof(WriteRequest);
+    body->assign(head_len + key_len + value_len, 'v');
+    memcpy(body->data(), prefix, head_len);
+    const size_t known_key_len = MIN(key_len, PREFIX_LEN - head_len);
+    memcpy(body->data() + head_len, prefix + head_len, known_key_len);
+    memset(body->data() + head_len + known_key_len, '_', key_len - known_key_len);
+    return;
+  }
+
+  if (strncmp(header.method, "read", 8) == 0) {
+    body->assign(prefix, prefix + strnlen((const char*) prefix, PREFIX_LEN));
+    return;
+  }
+
+  const size_t mark_and_header = sizeof(RPCMark) + sizeof(RPCHeader);
+  const size_t full_len = (size_t) 1 << header.req_len_log;
+  const size_t data_len = full_len > mark_and_header ? full_len - mark_and_header : 0;
+  body->assign(data_len, 0);
+  memcpy(body->data(), prefix, MIN(data_len, PREFIX_LEN));
+}
+
+// Of a columnar log, reads only the columns that go into a request.
+bool load_log(LogReader* const reader, std::vector<ReplayRequest>* const out) {
+  while (true) {
+    LogRecord record;
+    const int result = reader->next(&record);
+    if (result <= 0) return 0 == result;
+    const RPCHeader& header = record.header;
+    if (!is_replayable(header)) continue;
+
+    ReplayRequest request;
+    request.send_time_us = header.req_send_time_us;
+    memcpy(request.method, header.method, 8);
+    rebuild_body(header, record.body, &request.body);
+    out->push_back(std::move(request));
+  }
+}
+
+void* send_requests(void* const void_conn) {
+  ReplayConn* const conn = (ReplayConn*) void_conn;
+
+  for (const ReplayRequest* request : conn->requests) {
+    if (args.speed > 0) {
+      // Requests that were logged out of order go out as soon as possible.
+      const uint64_t offset_us = request->send_time_us > first_send_time_us
+        ? request->send_time_us - first_send_time_us
+        : 0;
+      const uint64_t due_ns = start_ns + (uint64_t) (offset_us * 1000 / args.speed);
+      const timespec due = {(time_t) (due_ns / 1000000000), (long) (due_ns % 1000000000)};
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+      const uint64_t now_ns = now_nsec();
+      if (now_ns > due_ns && now_ns - due_ns > conn->max_lag_ns) {
+        conn->max_lag_ns = now_ns - due_ns;
+      }
+    }
+
+    pthread_mutex_lock(&conn->mutex);
+    while (conn->outstanding >= args.depth) pthread_cond_wait(&conn->cond, &conn->mutex);
+    ++conn->outstanding;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (-1 == rpc_send_req(
+      &conn->connection,
+      request->body.data(),
+      request->body.size(),
+      /*parent_rpc=*/0,
+      request->method,
+      /*log_fd=*/-1
+    )) {
+      fprintf(stderr, "failed to send request: %m\n");
+      exit(1);
+    }
+  }
+  return NULL;
+}
+
+void* recv_responses(void* const void_conn) {
+  ReplayConn* const conn = (ReplayConn*) void_conn;
+
+  for (size_t i = 0; i < conn->requests.size(); ++i) {
+    RPCMessage response;
+    if (-1 == rpc_recv_resp(&conn->connection, &response)) {
+      fprintf(stderr, "failed to receive the response: %m\n");
+      exit(1);
+    }
+    // Responses may come back out of order, but each one echoes its request's
+    // send time.
+    const RPCHeader& header = response.header;
+    conn->latencies->record((header.res_recv_time_us - header.req_send_time_us) * 1000);
+    if (header.status != RpcStatus::Ok) ++conn->n_errors;
+    rpc_free_body(&response);
+
+    pthread_mutex_lock(&conn->mutex);
+    --conn->outstanding;
+    pthread_cond_signal(&conn->cond);
+    pthread_mutex_unlock(&conn->mutex);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  args = parse_args(argc, argv);
+
+  FILE* in_file = fopen(args.in_fn, "rb");
+  if (NULL == in_file) {
+    fprintf(stderr, "failed to open \"%s\": %m\n", args.in_fn);
+    exit(1);
+  }
+  char magic[sizeof(CAPTURE_MAGIC)];
+  const bool is_capture = 1 == fread(magic, sizeof(magic), 1, in_file)
+    && 0 == memcmp(magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+
+  std::vector<ReplayRequest> requests;
+  bool loaded;
+  if (is_capture) {
+    loaded = load_capture(in_file, &requests);
+    fclose(in_file);
+  } else {
+    fclose(in_file);
+    LogReader* const reader = LogReader::Open(
+      args.in_fn,
+      log_column_bit(LogColumn::Times) | log_column_bit(LogColumn::Lens)
+        | log_column_bit(LogColumn::Kind) | log_column_bit(LogColumn::Method)
+        | log_column_bit(LogColumn::Body)
+    );
+    if (NULL == reader) {
+      fprintf(stderr, "failed to open \"%s\": %m\n", args.in_fn);
+      exit(1);
+    }
+    loaded = load_log(reader, &requests);
+    delete reader;
+  }
+  if (!loaded) {
+    fprintf(stderr, "\"%s\" is truncated or corrupt\n", args.in_fn);
+    exit(1);
+  }
+  if (requests.empty()) {
+    fprintf(stderr, "no requests to replay in \"%s\"\n", args.in_fn);
+    exit(1);
+  }
+
+  std::vector<ReplayConn*> conns;
+  for (int i = 0; i < args.n_conns; ++i) {
+    ReplayConn* conn = new ReplayConn();
+    if (-1 == net_connect(args.server, args.port, &conn->connection)) {
+      fprintf(stderr, "failed to connect to %s:%d: %m\n", args.server, args.port);
+      exit(1);
+    }
+    conns.push_back(conn);
+  }
+  for (size_t i = 0; i < requests.size(); ++i) {
+    conns[i % conns.size()]->requests.push_back(&requests[i]);
+  }
+
+  first_send_time_us = requests[0].send_time_us;
+  start_ns = now_nsec();
+  for (ReplayConn* conn : conns) {
+    pthread_create(&conn->receiver, NULL, recv_responses, conn);
+    pthread_create(&conn->sender, NULL, send_requests, conn);
+  }
+
+  LatencyHistogram* latencies = new LatencyHistogram();
+  uint64_t max_lag_ns = 0;
+  uint64_t n_errors = 0;
+  for (ReplayConn* conn : conns) {
+    pthread_join(conn->sender, NULL);
+    pthread_join(conn->receiver, NULL);
+    conn_close(&conn->connection);
+    latencies->merge(*conn->latencies);
+    if (conn->max_lag_ns > max_lag_ns) max_lag_ns = conn->max_lag_ns;
+    n_errors += conn->n_errors;
+  }
+  const double elapsed_s = (now_nsec() - start_ns) / 1e9;
+
+  printf(
+    "replayed %zu requests from %s in %.3f s (%.0f rpcs/s), %lu not OK,"
+    " sends up to %.1f ms behind schedule\n",
+    requests.size(), is_capture ? "capture" : "log", elapsed_s,
+    requests.size() / elapsed_s, n_errors, max_lag_ns / 1e6
+  );
+  latencies->print(stdout, 1000, "us");
+  if (NULL != args.hist_fn && !latencies->save(args.hist_fn)) {
+    fprintf(stderr, "failed to save histogram to \"%s\": %m\n", args.hist_fn);
+    exit(1);
+  }
+
+  return 0;
+}
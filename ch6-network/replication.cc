@@ -0,0 +1,304 @@
+#include "replication.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "phases.h"
+#include "rpc.h"
+
+bool repl_next_entry(
+  const uint8_t** const p,
+  const uint8_t* const end,
+  uint8_t** const body,
+  size_t* const len
+) {
+  uint32_t entry_len;
+  if ((size_t) (end - *p) < sizeof(entry_len)) return false;
+  memcpy(&entry_len, *p, sizeof(entry_len));
+  if ((size_t) (end - *p) - sizeof(entry_len) < entry_len) return false;
+  *body = (uint8_t*) *p + sizeof(entry_len);
+  *len = entry_len;
+  *p += sizeof(entry_len) + entry_len;
+  return true;
+}
+
+ReplEntry* repl_entry_new(const uint8_t* const body, const size_t len) {
+  ReplEntry* const entry = (ReplEntry*) malloc(sizeof(ReplEntry) + len);
+  entry->seq = 0;
+  entry->refs = 1;
+  entry->len = len;
+  memcpy(entry->body, body, len);
+  return entry;
+}
+
+void ReplPrimary::unref(ReplEntry* const entry) {
+  if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) free(entry);
+}
+
+ReplPrimary* ReplPrimary::Start(const ReplConfig& config) {
+  ReplPrimary* const primary = new ReplPrimary();
+  primary->config_ = config;
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&primary->changed_, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (const ReplBackupAddr& addr : config.backups) {
+    Backup* const backup = new Backup();
+    backup->primary = primary;
+    backup->addr = addr;
+    const int err = pthread_create(&backup->thread, NULL, ship_main, backup);
+    if (0 != err) {
+      // The threads already started are left to run; the caller exits.
+      delete backup;
+      errno = err;
+      return NULL;
+    }
+    primary->backups_.push_back(backup);
+  }
+  return primary;
+}
+
+uint64_t ReplPrimary::append(ReplEntry* const entry) {
+  pthread_mutex_lock(&mutex_);
+  entry->seq = ++last_seq_;
+  log_.push_back(entry);
+  log_len_ += entry->len;
+  // Drop the furthest behind until the log fits again.
+  while (log_len_ > config_.max_log_len) {
+    Backup* slowest = NULL;
+    for (Backup* const backup : backups_) {
+      if (backup->dropped) continue;
+      if (NULL == slowest || backup->acked_seq < slowest->acked_seq) slowest = backup;
+    }
+    if (NULL == slowest) break;
+    // Its shipper answers the waiters this frees, as it stops, since this
+    // may be called under the keystore lock.
+    drop(slowest, "fell too far behind");
+    trim(NULL);
+  }
+  const uint64_t seq = entry->seq;
+  pthread_cond_broadcast(&changed_);
+  pthread_mutex_unlock(&mutex_);
+  return seq;
+}
+
+void ReplPrimary::when_acked(const uint64_t seq, void (*const done)(void* arg), void* const arg) {
+  pthread_mutex_lock(&mutex_);
+  if (min_acked() >= seq) {
+    pthread_mutex_unlock(&mutex_);
+    done(arg);
+    return;
+  }
+  waiters_.push_back(Waiter{seq, done, arg});
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ReplPrimary::wait_acked(const uint64_t seq) {
+  pthread_mutex_lock(&mutex_);
+  while (min_acked() < seq) pthread_cond_wait(&changed_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+uint64_t ReplPrimary::min_acked() const {
+  uint64_t acked = last_seq_;
+  for (const Backup* const backup : backups_) {
+    if (!backup->dropped && backup->acked_seq < acked) acked = backup->acked_seq;
+  }
+  return acked;
+}
+
+void ReplPrimary::drop(Backup* const backup, const char* const why) {
+  if (backup->dropped) return;
+  backup->dropped = true;
+  fprintf(
+    stderr,
+    "replication: dropping backup %s:%d at seq %lu of %lu: %s\n",
+    backup->addr.server, backup->addr.port, backup->acked_seq, last_seq_, why
+  );
+}
+
+void ReplPrimary::trim(std::vector<Waiter>* const ready) {
+  const uint64_t acked = min_acked();
+  while (!log_.empty() && log_.front()->seq <= acked) {
+    log_len_ -= log_.front()->len;
+    unref(log_.front());
+    log_.pop_front();
+    ++first_seq_;
+  }
+  pthread_cond_broadcast(&changed_);
+  if (NULL == ready) return;
+  size_t kept = 0;
+  for (const Waiter& waiter : waiters_) {
+    if (waiter.seq <= acked) {
+      ready->push_back(waiter);
+    } else {
+      waiters_[kept++] = waiter;
+    }
+  }
+  waiters_.resize(kept);
+}
+
+void* ReplPrimary::ship_main(void* const void_backup) {
+  Backup* const backup = (Backup*) void_backup;
+  ReplPrimary* const primary = backup->primary;
+  const ReplConfig& config = primary->config_;
+  Connection connection;
+  bool connected = false;
+  // Until the backup's first answer, it isn't known where it is up to.
+  bool known = false;
+  uint64_t next_seq = 0;
+  uint64_t unreachable_since_ms = now_nsec() / 1000000;
+  std::vector<ReplEntry*> batch;
+  std::vector<uint8_t> body;
+  std::vector<Waiter> ready;
+
+  pthread_mutex_lock(&primary->mutex_);
+  while (!backup->dropped) {
+    if (!connected) {
+      const bool behind = backup->acked_seq < primary->last_seq_;
+      if (primary->stopping_) break;
+      if (behind && now_nsec() / 1000000 - unreachable_since_ms > config.timeout_ms) {
+        primary->drop(backup, "unreachable");
+        break;
+      }
+      pthread_mutex_unlock(&primary->mutex_);
+      connected = 0 == tcp_connect(backup->addr.server, backup->addr.port, &connection);
+      if (connected && config.timeout_ms > 0) {
+        // So that a backup that stops answering can't hold up sync writes,
+        // or shutdown, for longer than timeout_ms.
+        const timeval timeout = {
+          (time_t) (config.timeout_ms / 1000),
+          (suseconds_t) (config.timeout_ms % 1000 * 1000),
+        };
+        setsockopt(connection.sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection.sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      }
+      if (!connected) {
+        const timespec retry = {0, 100 * 1000000};
+        nanosleep(&retry, NULL);
+      }
+      known = false;
+      pthread_mutex_lock(&primary->mutex_);
+      continue;
+    }
+
+    // Wait for entries to ship, or for the next heartbeat.
+    if (known && next_seq > primary->last_seq_) {
+      if (primary->stopping_) break;
+      timespec until;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_nsec += config.heartbeat_ms * 1000000l;
+      until.tv_sec += until.tv_nsec / 1000000000;
+      until.tv_nsec %= 1000000000;
+      const int waited = pthread_cond_timedwait(&primary->changed_, &primary->mutex_, &until);
+      if (backup->dropped) break;
+      if (0 == waited && next_seq > primary->last_seq_ && !primary->stopping_) continue;
+    }
+
+    // Take a batch, holding references to its entries so that they outlive
+    // a drop while they are sent.
+    ReplBatch head = {};
+    size_t batch_len = 0;
+    if (known && next_seq <= primary->last_seq_) {
+      if (next_seq < primary->first_seq_) {
+        primary->drop(backup, "its entries have left the log");
+        break;
+      }
+      for (size_t i = next_seq - primary->first_seq_; i < primary->log_.size(); ++i) {
+        ReplEntry* const entry = primary->log_[i];
+        if (!batch.empty() && batch_len + entry->len > config.batch_len) break;
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        batch.push_back(entry);
+        batch_len += entry->len;
+      }
+      head.first_seq = next_seq;
+    }
+    head.head_seq = primary->last_seq_;
+    head.n_entries = batch.size();
+    pthread_mutex_unlock(&primary->mutex_);
+
+    body.resize(sizeof(head) + batch.size() * sizeof(uint32_t) + batch_len);
+    memcpy(body.data(), &head, sizeof(head));
+    uint8_t* p = body.data() + sizeof(head);
+    for (ReplEntry* const entry : batch) {
+      memcpy(p, &entry->len, sizeof(entry->len));
+      memcpy(p + sizeof(entry->len), entry->body, entry->len);
+      p += sizeof(entry->len) + entry->len;
+      unref(entry);
+    }
+    batch.clear();
+
+    const uint64_t sent_ms = now_nsec() / 1000000;
+    RPCMessage response;
+    const bool answered = -1 != rpc_send_req(&connection, body.data(), body.size(), 0, "repl", -1)
+      && -1 != rpc_recv_resp(&connection, &response);
+    uint64_t applied_seq = 0;
+    const bool ok = answered && response.mark.data_len == sizeof(applied_seq);
+    if (ok) memcpy(&applied_seq, response.body, sizeof(applied_seq));
+    if (answered) rpc_free_body(&response);
+
+    pthread_mutex_lock(&primary->mutex_);
+    if (!ok) {
+      conn_close(&connection);
+      connected = false;
+      // Having run out the deadline, it is still there but not answering,
+      // which connecting again wouldn't change.
+      const uint64_t failed_ms = now_nsec() / 1000000;
+      if (config.timeout_ms > 0 && failed_ms - sent_ms >= config.timeout_ms) {
+        primary->drop(backup, "stopped answering");
+        break;
+      }
+      unreachable_since_ms = failed_ms;
+      continue;
+    }
+    if (response.header.status != RpcStatus::Ok) {
+      primary->drop(backup, "it is missing entries");
+      break;
+    }
+    ++backup->n_batches;
+    backup->acked_seq = applied_seq;
+    next_seq = applied_seq + 1;
+    known = true;
+    primary->trim(&ready);
+    if (!ready.empty()) {
+      pthread_mutex_unlock(&primary->mutex_);
+      for (const Waiter& waiter : ready) waiter.done(waiter.arg);
+      ready.clear();
+      pthread_mutex_lock(&primary->mutex_);
+    }
+  }
+  // Once dropped, it no longer holds up the log or sync writes.
+  primary->trim(&ready);
+  pthread_mutex_unlock(&primary->mutex_);
+
+  for (const Waiter& waiter : ready) waiter.done(waiter.arg);
+  if (connected) conn_close(&connection);
+  return NULL;
+}
+
+void ReplPrimary::shutdown(FILE* const out) {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&changed_);
+  pthread_mutex_unlock(&mutex_);
+  for (Backup* const backup : backups_) pthread_join(backup->thread, NULL);
+
+  for (const Backup* const backup : backups_) {
+    fprintf(
+      out,
+      "replication to %s:%d: acked %lu of %lu writes, in %lu batches%s\n",
+      backup->addr.server,
+      backup->addr.port,
+      backup->acked_seq,
+      last_seq_,
+      backup->n_batches,
+      backup->dropped ? " (dropped)" : ""
+    );
+  }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <vector>
+
+#include "network.h"
+
+// Primary/backup replication of writes, by log shipping.
+//
+// The primary numbers each write it applies with the next sequence number,
+// from 1, and keeps a copy of its body in an in-memory log. A shipper thread
+// per backup connects to it like a client and sends it the log in order, in
+// batches, as "repl" RPCs. The backup applies each batch under one
+// acquisition of its keystore lock and answers with the last sequence number
+// it has applied, which the primary takes as the backup's ack. Entries are
+// dropped from the log once every backup has acked them.
+//
+// Shipping is asynchronous: the primary answers a write as soon as it has
+// applied it, unless it is sync, in which case it answers only once every
+// backup has acked it.
+//
+// With nothing to ship, the shipper sends an empty batch every heartbeat_ms,
+// so that a backup knows how fresh it is: as of the last batch that brought
+// it up to what the primary had when it was sent, give or take the trip
+// over. A backup can refuse reads when that is too long ago.
+//
+// A backup that can't be reached for timeout_ms while it has entries to
+// catch up on, or that falls max_log_len bytes behind, is dropped: the
+// primary stops shipping to it, and sync writes stop waiting for it. So is
+// one that answers with a gap, e.g. because it restarted empty after its
+// entries left the log. Bringing a dropped backup back takes restarting both.
+
+// The body of a "repl" request: a ReplBatch, then n_entries entries in
+// sequence order from first_seq, each a u32 length and that many bytes of a
+// write's body (see WriteRequest).
+//
+// The response's body is a u64: the last sequence number the backup has
+// applied. A backup that is missing entries before first_seq applies none of
+// them and answers Failed, still with that body.
+struct ReplBatch {
+  uint64_t first_seq;
+  // The last sequence number the primary had given out when it sent the
+  // batch.
+  uint64_t head_seq;
+  uint32_t n_entries;
+  uint32_t pad;
+};
+
+// Reads the next entry of a batch starting at *p, before end, into *body and
+// *len, and moves *p past it.
+//
+// Returns false if there is no whole entry there.
+bool repl_next_entry(const uint8_t** p, const uint8_t* end, uint8_t** body, size_t* len);
+
+// A write in the primary's log: a copy of its body.
+struct ReplEntry {
+  uint64_t seq;
+  // Held by the log, and by each shipper sending it.
+  uint32_t refs;
+  uint32_t len;
+  uint8_t body[];
+};
+
+// Returns an entry holding a copy of len bytes of body, with one reference,
+// for ReplPrimary::append().
+ReplEntry* repl_entry_new(const uint8_t* body, size_t len);
+
+struct ReplBackupAddr {
+  const char* server;
+  uint16_t port;
+};
+
+struct ReplConfig {
+  std::vector<ReplBackupAddr> backups;
+  uint32_t heartbeat_ms = 10;
+  // How long a backup may stay unreachable with writes to ship, or take to
+  // accept or answer a batch, before it is dropped.
+  uint32_t timeout_ms = 1000;
+  size_t max_log_len = 64 << 20;
+  // Bytes of entries per batch, at most; a bigger entry goes alone.
+  size_t batch_len = 256 << 10;
+};
+
+class ReplPrimary {
+public:
+  // Starts a shipper thread for each backup. They connect in the
+  // background, retrying until timeout_ms has passed with writes to ship, and
+  // drop a backup that stays connected but stops answering for timeout_ms.
+  //
+  // Returns NULL and sets errno on error.
+  static ReplPrimary* Start(const ReplConfig& config);
+
+  // Gives entry the next sequence number, and appends it to the log, taking
+  // over its reference. Writes must be appended in the order they are
+  // applied, e.g. under the keystore lock, so entry is made beforehand.
+  //
+  // Returns the sequence number.
+  uint64_t append(ReplEntry* entry);
+
+  // Calls done(arg), from whichever thread gets there, once every backup
+  // not dropped has acked seq. That may be right away.
+  void when_acked(uint64_t seq, void (*done)(void* arg), void* arg);
+
+  // Blocks until every backup not dropped has acked seq.
+  void wait_acked(uint64_t seq);
+
+  // Ships what is left in the log to the backups that are connected, stops
+  // the shipper threads, and prints where each backup got to.
+  void shutdown(FILE* out);
+
+private:
+  ReplPrimary() = default;
+
+  struct Backup {
+    ReplPrimary* primary;
+    ReplBackupAddr addr;
+    pthread_t thread;
+    // The last sequence number it has acked.
+    uint64_t acked_seq = 0;
+    bool dropped = false;
+    uint64_t n_batches = 0;
+  };
+
+  struct Waiter {
+    uint64_t seq;
+    void (*done)(void* arg);
+    void* arg;
+  };
+
+  static void* ship_main(void* void_backup);
+
+  // With mutex_ held: the last sequence number every backup not dropped has
+  // acked.
+  uint64_t min_acked() const;
+  // With mutex_ held: stops shipping to backup.
+  void drop(Backup* backup, const char* why);
+  // With mutex_ held: frees the entries every backup has acked, and, unless
+  // ready is NULL, moves the waiters for them into *ready, to be called once
+  // the mutex is dropped.
+  void trim(std::vector<Waiter>* ready);
+  static void unref(ReplEntry* entry);
+
+  ReplConfig config_;
+  std::vector<Backup*> backups_;
+
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  // Broadcast when an entry is appended, a backup acks, or on shutdown.
+  pthread_cond_t changed_;
+  // Entries not yet acked by every backup, from first_seq_ on.
+  std::deque<ReplEntry*> log_;
+  uint64_t first_seq_ = 1;
+  uint64_t last_seq_ = 0;
+  size_t log_len_ = 0;
+  std::vector<Waiter> waiters_;
+  bool stopping_ = false;
+};
@@ -2,12 +2,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "print_hex.h"
 #include "network.h"
 #include "rpc.h"
+#include "varint.h"
 
 void RPCMark::pretty_print() {
   printf(
@@ -36,6 +38,9 @@ const char* status_str(RpcStatus status) {
     case RpcStatus::Ok:       return "OK";
     case RpcStatus::BadArg:   return "BAD_ARG";
     case RpcStatus::NotFound: return "NOT_FOUND";
+    case RpcStatus::Failed:   return "FAILED";
+    case RpcStatus::ReadOnly: return "READ_ONLY";
+    case RpcStatus::Stale:    return "STALE";
     default:                  return "UNRECOGNIZED";
   }
 }
@@ -120,21 +125,220 @@ static inline uint8_t ilog2(const uint32_t x) {
 #endif
 }
 
-// If log_fd < 0, does not log.
-int rpc_send_req(
-  const Connection* const connection,
+MethodId method_id(const char* const method) {
+  for (uint8_t id = 1; NULL != method_name((MethodId) id); ++id) {
+    if (strncmp(method, method_name((MethodId) id), 8) == 0) return (MethodId) id;
+  }
+  return MethodId::None;
+}
+
+const char* method_name(const MethodId id) {
+  switch (id) {
+    case MethodId::Ping:     return "ping";
+    case MethodId::Write:    return "write";
+    case MethodId::Read:     return "read";
+    case MethodId::Quit:     return "quit";
+    case MethodId::Scan:     return "scan";
+    case MethodId::Snapshot: return "snapshot";
+    default:                 return NULL;
+  }
+}
+
+// Encodes the header of message into buf, which must hold at least
+// 1 + COMPACT_HEADER_MAX_LEN bytes. Returns the number of bytes used.
+static size_t encode_compact(
+  Connection* const connection,
+  const RPCMessage* const message,
+  uint8_t* const buf
+) {
+  const RPCHeader& header = message->header;
+  const bool is_response = header.message_type == RpcMessageType::Response;
+  uint8_t* p = buf + 1;
+
+  const uint8_t priority = header.pad[0] == (char) RpcPriority::High ? 2 : 0;
+  *p++ = (is_response ? 1 : 0) | priority | ((uint8_t) header.status << 4);
+  const MethodId id = method_id(header.method);
+  *p++ = (uint8_t) id;
+  if (id == MethodId::None) {
+    memcpy(p, header.method, 8);
+    p += 8;
+  }
+  p += put_varint(p, message->mark.data_len);
+  p += put_varint(p, header.rpc_id);
+  p += put_varint(p, header.parent);
+
+  const uint64_t anchor_us = is_response
+    ? header.res_send_time_us
+    : header.req_send_time_us;
+  p += put_varint(p, zigzag(anchor_us - connection->last_send_us));
+  connection->last_send_us = anchor_us;
+
+  if (is_response) {
+    p += put_varint(p, header.res_send_time_us - header.req_recv_time_us);
+    p += put_varint(p, zigzag(header.req_recv_time_us - header.req_send_time_us));
+    *p++ = header.req_len_log;
+  }
+
+  buf[0] = p - (buf + 1);
+  return p - buf;
+}
+
+// Expands a compact header of len bytes into message->mark and
+// message->header.
+//
+// Returns -1 if the header is malformed.
+static int decode_compact(
+  Connection* const connection,
+  const uint8_t* buf,
+  const size_t len,
+  RPCMessage* const message
+) {
+  const uint8_t* const end = buf + len;
+  RPCHeader& header = message->header;
+  memset(&header, 0, sizeof(RPCHeader));
+
+  if (end - buf < 2) return -1;
+  const bool is_response = *buf & 1;
+  if (*buf & 2) header.pad[0] = (char) RpcPriority::High;
+  header.status = (RpcStatus) (*buf++ >> 4);
+  header.message_type = is_response ? RpcMessageType::Response : RpcMessageType::Request;
+
+  const MethodId id = (MethodId) *buf++;
+  if (id == MethodId::None) {
+    if (end - buf < 8) return -1;
+    memcpy(header.method, buf, 8);
+    buf += 8;
+  } else {
+    const char* const name = method_name(id);
+    if (NULL == name) return -1;
+    memcpy(header.method, name, strlen(name));
+  }
+
+  uint64_t data_len, rpc_id, parent, anchor_delta;
+  if (!get_varint(&buf, end, &data_len)) return -1;
+  if (!get_varint(&buf, end, &rpc_id)) return -1;
+  if (!get_varint(&buf, end, &parent)) return -1;
+  if (!get_varint(&buf, end, &anchor_delta)) return -1;
+  const uint64_t anchor_us = connection->last_recv_us + unzigzag(anchor_delta);
+  connection->last_recv_us = anchor_us;
+
+  header.rpc_id = rpc_id;
+  header.parent = parent;
+  // The lengths are logged as if the message had a full header, so that logs
+  // from compact and full connections can be compared directly.
+  const size_t full_len = sizeof(RPCMark) + sizeof(RPCHeader) + data_len;
+  if (is_response) {
+    uint64_t server_us, request_delta;
+    if (!get_varint(&buf, end, &server_us)) return -1;
+    if (!get_varint(&buf, end, &request_delta)) return -1;
+    if (end - buf < 1) return -1;
+    header.res_send_time_us = anchor_us;
+    header.req_recv_time_us = anchor_us - server_us;
+    header.req_send_time_us = header.req_recv_time_us - unzigzag(request_delta);
+    header.req_len_log = *buf++;
+    header.res_len_log = ilog2(full_len);
+  } else {
+    header.req_send_time_us = anchor_us;
+    header.req_len_log = ilog2(full_len);
+  }
+  if (buf != end) return -1;
+
+  header.client_ip   = connection->client_ip;
+  header.client_port = connection->client_port;
+  header.server_ip   = connection->server_ip;
+  header.server_port = connection->server_port;
+
+  message->mark.signature = MARK_SIGNATURE;
+  message->mark.header_len = sizeof(RPCHeader);
+  message->mark.data_len = data_len;
+  message->mark.checksum = 0;
+  return 0;
+}
+
+size_t rpc_encode_head(Connection* const connection, const RPCMessage* const message, uint8_t* const buf) {
+  if (connection->wire_format == WireFormat::Compact) return encode_compact(connection, message, buf);
+  memcpy(buf, &message->mark, sizeof(RPCMark));
+  memcpy(buf + sizeof(RPCMark), &message->header, sizeof(RPCHeader));
+  return sizeof(RPCMark) + sizeof(RPCHeader);
+}
+
+// Writes message's mark and header, in the connection's wire format, followed
+// by the body.
+static int send_message(
+  Connection* const connection,
+  RPCMessage* const message,
   const uint8_t* const body,
+  const size_t n_bytes
+) {
+  // One write for the header and the body, so that a small RPC is one
+  // small packet.
+  uint8_t head[RPC_HEAD_MAX_LEN];
+  const iovec iov[2] = {
+    {head, rpc_encode_head(connection, message, head)},
+    {(void*) body, n_bytes},
+  };
+  return conn_writev(connection, iov, 2);
+}
+
+// Reads a mark, header, and body in the connection's wire format, parsing
+// them straight out of the connection's receive buffer. A body that fits in
+// the buffer is left there, so a burst of small messages costs one read() for
+// all of them; a bigger one is malloc()ed.
+static int recv_message(Connection* const connection, RPCMessage* const message) {
+  RecvChunk* chunk;
+  size_t header_len;
+  if (connection->wire_format == WireFormat::Compact) {
+    if (-1 == conn_fill(connection, 1)) return -1;
+    header_len = 1 + *conn_buffered(connection, &chunk);
+    if (header_len > 1 + COMPACT_HEADER_MAX_LEN) return -1;
+    if (-1 == conn_fill(connection, header_len)) return -1;
+    const uint8_t* const buf = conn_buffered(connection, &chunk);
+    if (-1 == decode_compact(connection, buf + 1, header_len - 1, message)) return -1;
+  } else {
+    header_len = sizeof(RPCMark) + sizeof(RPCHeader);
+    if (-1 == conn_fill(connection, sizeof(RPCMark))) return -1;
+    memcpy(&message->mark, conn_buffered(connection, &chunk), sizeof(RPCMark));
+    if (message->mark.header_len != sizeof(RPCHeader)) {
+      return -1;
+    }
+    if (-1 == conn_fill(connection, header_len)) return -1;
+    memcpy(&message->header, conn_buffered(connection, &chunk) + sizeof(RPCMark), sizeof(RPCHeader));
+  }
+
+  const size_t data_len = message->mark.data_len;
+  if (header_len + data_len <= RECV_CHUNK_LEN) {
+    if (-1 == conn_fill(connection, header_len + data_len)) return -1;
+    message->body = conn_buffered(connection, &chunk) + header_len;
+    message->chunk = chunk;
+    recv_chunk_ref(chunk);
+    conn_consume(connection, header_len + data_len);
+    return 0;
+  }
+
+  conn_consume(connection, header_len);
+  message->body = (uint8_t*)malloc(data_len);
+  message->chunk = NULL;
+  if (-1 == conn_recv_into(connection, message->body, data_len)) {
+    free(message->body);
+    message->body = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int rpc_fill_req(
+  const Connection* const connection,
   const size_t n_bytes,
   const uint32_t parent_rpc,
   const char* const method,
-  int log_fd
+  RPCMessage* const out
 ) {
-  RPCMessage message;
+  RPCMessage& message = *out;
   message.mark.signature = MARK_SIGNATURE;
   message.mark.header_len = sizeof(RPCHeader);
   message.mark.data_len = n_bytes;
   // TODO: Set message.mark.checksum.
-  message.header.rpc_id = next_rpc_id++;
+  message.header.rpc_id = __atomic_fetch_add(&next_rpc_id, 1, __ATOMIC_RELAXED);
   message.header.parent = parent_rpc;
 
   if (-1 == now_usec(&message.header.req_send_time_us)) return -1;
@@ -159,65 +363,127 @@ int rpc_send_req(
   #pragma GCC diagnostic pop
 
   message.header.status = RpcStatus::Ok;
+  memset(message.header.pad, 0, sizeof(message.header.pad));
+  message.header.pad[0] = connection->priority;
+  return 0;
+}
 
-  size_t written_bytes = write(connection->sock_fd, &message, mark_and_header);
-  if (written_bytes != mark_and_header) {
-    return -1;
-  }
-  written_bytes = write(connection->sock_fd, body, n_bytes);
-  if (written_bytes != n_bytes) {
+// If log_fd < 0, does not log.
+int rpc_send_req(
+  Connection* const connection,
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const uint32_t parent_rpc,
+  const char* const method,
+  int log_fd
+) {
+  RPCMessage message;
+  if (-1 == rpc_fill_req(connection, n_bytes, parent_rpc, method, &message)) return -1;
+  if (-1 == send_message(connection, &message, body, n_bytes)) return -1;
+
+  if (log_fd >= 0) log(log_fd, &message);
+  return 0;
+}
+
+void rpc_prepare_resp(
+  PreparedResponse* const response,
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const RpcStatus status
+) {
+  response->mark.signature = MARK_SIGNATURE;
+  response->mark.header_len = sizeof(RPCHeader);
+  response->mark.data_len = n_bytes;
+  // TODO: Set response->mark.checksum.
+  response->mark.checksum = 0;
+
+  size_t mark_and_header = sizeof(RPCMark) + sizeof(RPCHeader);
+  response->header.res_len_log = ilog2(n_bytes + mark_and_header);
+  response->header.message_type = RpcMessageType::Response;
+  response->header.status = status;
+  response->body = body;
+}
+
+int rpc_fill_prepared(
+  const RPCMessage* const request,
+  const PreparedResponse* const response,
+  RPCMessage* const message
+) {
+  message->mark = response->mark;
+  message->header = request->header;
+  message->header.res_len_log = response->header.res_len_log;
+  message->header.message_type = RpcMessageType::Response;
+  message->header.status = response->header.status;
+  message->body = (uint8_t*) response->body;
+  message->phases = request->phases;
+  return now_usec(&message->header.res_send_time_us);
+}
+
+int rpc_send_prepared(
+  Connection* const connection,
+  const RPCMessage* const request,
+  const PreparedResponse* const response,
+  const int log_fd
+) {
+  RPCMessage message;
+  if (-1 == rpc_fill_prepared(request, response, &message)) return -1;
+  phases_mark(message.phases, PHASE_FIRST_SENT);
+  if (-1 == send_message(connection, &message, response->body, response->mark.data_len)) {
     return -1;
   }
+  phases_mark(message.phases, PHASE_LAST_SENT);
+
+  if (log_fd >= 0) log(log_fd, &message);
+  return 0;
+}
 
+int rpc_send_prepared_file(
+  Connection* const connection,
+  const RPCMessage* const request,
+  const PreparedResponse* const response,
+  const int fd,
+  const off_t offset,
+  const int log_fd
+) {
+  RPCMessage message;
+  if (-1 == rpc_fill_prepared(request, response, &message)) return -1;
+  uint8_t buf[RPC_HEAD_MAX_LEN];
+  const iovec head = {buf, rpc_encode_head(connection, &message, buf)};
+
+  phases_mark(message.phases, PHASE_FIRST_SENT);
+  if (-1 == conn_send_file(connection, &head, fd, offset, response->mark.data_len)) return -1;
+  phases_mark(message.phases, PHASE_LAST_SENT);
+
+  // The log gets no body bytes, which are only in the file.
   if (log_fd >= 0) log(log_fd, &message);
   return 0;
 }
 
 int rpc_send_resp(
-  const Connection* connection,
+  Connection* connection,
   const RPCMessage* request,
   uint8_t* body,
   size_t n_bytes,
   RpcStatus status,
   int log_fd
 ) {
-  RPCMessage message;
-  memcpy(&message, request, sizeof(RPCMessage));
-  message.body = body;
-  message.mark.data_len = n_bytes;
-  // TODO: Set message.mark.checksum.
-
-  if (-1 == now_usec(&message.header.res_send_time_us)) return -1;
-  size_t mark_and_header = sizeof(RPCMark) + sizeof(RPCHeader);
-  message.header.res_len_log = ilog2(n_bytes + mark_and_header);
-  message.header.message_type = RpcMessageType::Response;
-  message.header.status = status;
+  PreparedResponse response;
+  rpc_prepare_resp(&response, body, n_bytes, status);
+  return rpc_send_prepared(connection, request, &response, log_fd);
+}
 
-  size_t written_bytes = write(connection->sock_fd, &message, mark_and_header);
-  if (written_bytes != mark_and_header) {
-    return -1;
-  }
-  written_bytes = write(connection->sock_fd, body, n_bytes);
-  if (written_bytes != n_bytes) {
-    return -1;
+void rpc_free_body(RPCMessage* const message) {
+  if (NULL != message->chunk) {
+    recv_chunk_unref(message->chunk);
+  } else {
+    free(message->body);
   }
-
-  if (log_fd >= 0) log(log_fd, &message);
-  return 0;
+  message->body = NULL;
+  message->chunk = NULL;
 }
 
-int rpc_recv_req(const Connection* connection, RPCMessage* request) {
-  if (-1 == readn(connection->sock_fd, &request->mark, sizeof(RPCMark))) {
-    return -1;
-  }
-  if (request->mark.header_len != sizeof(RPCHeader)) {
-    return -1;
-  }
-  if (-1 == readn(connection->sock_fd, &request->header, sizeof(RPCHeader))) {
-    return -1;
-  }
-  request->body = (uint8_t*)malloc(request->mark.data_len);
-  if (-1 == readn(connection->sock_fd, request->body, request->mark.data_len)) {
+int rpc_recv_req(Connection* connection, RPCMessage* request) {
+  if (-1 == recv_message(connection, request)) {
     return -1;
   }
   if (-1 == now_usec(&request->header.req_recv_time_us)) {
@@ -226,23 +492,32 @@ int rpc_recv_req(const Connection* connection, RPCMessage* request) {
   return 0;
 }
 
-int rpc_recv_resp(const Connection* connection, RPCMessage* response) {
-  if (-1 == readn(connection->sock_fd, &response->mark, sizeof(RPCMark))) {
-    return -1;
-  }
-  if (response->mark.header_len != sizeof(RPCHeader)) {
-    return -1;
-  }
-  if (-1 == readn(connection->sock_fd, &response->header, sizeof(RPCHeader))) {
+int rpc_recv_resp(Connection* connection, RPCMessage* response) {
+  if (-1 == recv_message(connection, response)) {
     return -1;
   }
-  response->body = (uint8_t*)malloc(response->mark.data_len);
-  if (-1 == readn(connection->sock_fd, response->body, response->mark.data_len)) {
+  if (-1 == now_usec(&response->header.res_recv_time_us)) {
     return -1;
   }
-  if (-1 == now_usec(&response->header.res_recv_time_us)) {
+  return 0;
+}
+
+int rpc_negotiate_compact(Connection* const connection, const int log_fd) {
+  const uint8_t format = (uint8_t) WireFormat::Compact;
+  if (-1 == rpc_send_req(connection, &format, 1, /*parent_rpc=*/0, "wirefmt", log_fd)) {
     return -1;
   }
+  RPCMessage response;
+  if (-1 == rpc_recv_resp(connection, &response)) return -1;
+  if (log_fd >= 0) log(log_fd, &response);
+
+  const bool accepted = response.header.status == RpcStatus::Ok
+    && response.mark.data_len == 1
+    && response.body[0] == format;
+  rpc_free_body(&response);
+  if (!accepted) return -1;
+
+  connection->wire_format = WireFormat::Compact;
   return 0;
 }
 
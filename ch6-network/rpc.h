@@ -5,6 +5,7 @@
 
 #include "assert.h"
 #include "network.h"
+#include "phases.h"
 
 // An RPC request or response message starts with an RPC marker followed by an
 // RPC header followed optionally by a byte string that contains the argument
@@ -46,10 +47,25 @@ enum class RpcStatus : uint32_t {
   Ok,
   BadArg,
   NotFound,
+  // The request was understood, but the server couldn't carry it out.
+  Failed,
+  // A write sent to a backup, which only takes them from its primary.
+  ReadOnly,
+  // A read sent to a backup that hasn't heard from its primary for longer
+  // than it was told to allow.
+  Stale,
 };
 
 const char* status_str(RpcStatus status);
 
+// How a server orders the responses it has waiting to go out. A response has
+// its request's priority, and High responses go ahead of Normal ones, though
+// not of one that has started going out already.
+enum class RpcPriority : uint8_t {
+  Normal,
+  High,
+};
+
 struct RPCHeader {
   // Unique ID number for each outstanding request.
   uint32_t rpc_id;
@@ -83,6 +99,9 @@ struct RPCHeader {
   // Return-value status indicating success, failure, or specific error number.
   RpcStatus status;
 
+  // On the wire, a request's pad[0] is its RpcPriority, and the rest is
+  // unused. log() overwrites it in its records to flag an extended one; see
+  // log.h.
   char pad[4];
 
   void pretty_print();
@@ -95,6 +114,15 @@ struct RPCMessage {
   RPCHeader header;
   uint8_t* body = NULL;
 
+  // If not NULL, body points into this chunk of the connection's receive
+  // buffer, and holds a reference to it, rather than being malloc()ed. Such a
+  // body may be unaligned. rpc_free_body() frees either kind.
+  RecvChunk* chunk = NULL;
+
+  // If not NULL, where the server is timing this request. Sending a response
+  // to it marks the send phases, and logging the response logs the times.
+  PhaseTimes* phases = NULL;
+
   void pretty_print();
 
   int send(int sock_fd);
@@ -102,8 +130,76 @@ struct RPCMessage {
   size_t size();
 };
 
-int rpc_send_req(
+// Compact wire format.
+//
+// Once both ends of a connection have agreed to it with
+// rpc_negotiate_compact(), the mark and the header are replaced on the wire by
+// a length byte and a variable-length compact header:
+//
+// +-----+----------------+----------
+// | len | compact header | data ...
+// +-----+----------------+----------
+//   1 B     len B           0..N B
+//
+// The compact header holds, in order:
+//
+//   u8     type (bit 0: 0 = request, 1 = response), priority (bit 1: 1 =
+//          High), and status (bits 4..7)
+//   u8     method id, or 0 followed by the 8-byte method name if the method
+//          has no id
+//   varint data_len
+//   varint rpc_id
+//   varint parent
+//   varint zigzag(T - previous T sent on this connection), where T is T1 for
+//          a request and T3 for a response
+//
+// and for responses only:
+//
+//   varint T3 - T2
+//   varint zigzag(T2 - T1)
+//   u8     req_len_log
+//
+// The addresses are left out, since the receiver knows them from its
+// Connection. A 4-byte ping costs 10-15 B on the wire instead of 92 B.
+//
+// rpc_recv_req() and rpc_recv_resp() expand compact headers back into the
+// full RPCMark and RPCHeader, so the rest of the code (and the log) never sees
+// the difference.
+
+constexpr size_t COMPACT_HEADER_MAX_LEN = 2 + 8 + 6 * 10 + 1;
+static_assert(COMPACT_HEADER_MAX_LEN < 256);
+
+// Method ids used by the compact format. 0 means "no id, name follows".
+enum class MethodId : uint8_t {
+  None,
+  Ping,
+  Write,
+  Read,
+  Quit,
+  Scan,
+  Snapshot,
+};
+
+MethodId method_id(const char* method);
+
+// Returns NULL if the id isn't known.
+const char* method_name(MethodId id);
+
+// Fills in *message's mark and header as a new request on connection, with a
+// fresh rpc_id, for a sender that writes the request out itself. The body is
+// up to the caller.
+//
+// Returns -1 if the time can't be read.
+int rpc_fill_req(
   const Connection* connection,
+  size_t n_bytes,
+  uint32_t parent_rpc,
+  const char* method,
+  RPCMessage* message
+);
+
+int rpc_send_req(
+  Connection* connection,
   const uint8_t* body,
   size_t n_bytes,
   uint32_t parent_rpc,
@@ -112,7 +208,7 @@ int rpc_send_req(
 );
 
 int rpc_send_resp(
-  const Connection* connection,
+  Connection* connection,
   const RPCMessage* request,
   uint8_t* body,
   size_t n_bytes,
@@ -120,9 +216,72 @@ int rpc_send_resp(
   int log_fd
 );
 
-int rpc_recv_req(const Connection* connection, RPCMessage* request);
+// A response with its mark and the response's own header fields filled in
+// ahead of time, for answering many requests with the same body. Sending it
+// copies only the request's header fields; the body is written straight from
+// where it is, so it must stay put for as long as the response is in use.
+struct PreparedResponse {
+  RPCMark mark;
+  RPCHeader header;
+  const uint8_t* body;
+};
+
+void rpc_prepare_resp(
+  PreparedResponse* response,
+  const uint8_t* body,
+  size_t n_bytes,
+  RpcStatus status
+);
+
+// Fills in *message as the response to request from response, as of now, for
+// a sender that writes the response out itself with rpc_encode_head().
+//
+// Returns -1 if the time can't be read.
+int rpc_fill_prepared(const RPCMessage* request, const PreparedResponse* response, RPCMessage* message);
+
+// The most bytes rpc_encode_head() writes.
+constexpr size_t RPC_HEAD_MAX_LEN = sizeof(RPCMark) + sizeof(RPCHeader);
+static_assert(RPC_HEAD_MAX_LEN >= 1 + COMPACT_HEADER_MAX_LEN);
+
+// Encodes message's mark and header in the connection's wire format into
+// buf, and returns their length. The body goes right after. Compact headers
+// are encoded relative to the one sent before, so the encoded header must be
+// the next thing sent on the connection.
+size_t rpc_encode_head(Connection* connection, const RPCMessage* message, uint8_t* buf);
+
+// Answers request with a response from rpc_prepare_resp().
+int rpc_send_prepared(
+  Connection* connection,
+  const RPCMessage* request,
+  const PreparedResponse* response,
+  int log_fd
+);
+
+// Like rpc_send_prepared(), but the body is sent from n_bytes of file fd at
+// offset, with conn_send_file(), rather than from response->body, which may
+// be NULL. The response must have been prepared for n_bytes.
+int rpc_send_prepared_file(
+  Connection* connection,
+  const RPCMessage* request,
+  const PreparedResponse* response,
+  int fd,
+  off_t offset,
+  int log_fd
+);
+
+int rpc_recv_req(Connection* connection, RPCMessage* request);
+
+int rpc_recv_resp(Connection* connection, RPCMessage* response);
 
-int rpc_recv_resp(const Connection* connection, RPCMessage* response);
+// Releases the body of a message from rpc_recv_req() or rpc_recv_resp().
+void rpc_free_body(RPCMessage* message);
+
+// Asks the server to switch the connection to the compact wire format, and
+// switches this end of it if the server agrees. Must be called while no
+// other requests are outstanding on the connection.
+//
+// Returns 0 if the connection is now compact, and -1 otherwise.
+int rpc_negotiate_compact(Connection* connection, int log_fd);
 
 int now_usec(uint64_t* out);
 
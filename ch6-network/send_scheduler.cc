@@ -0,0 +1,350 @@
+#include "send_scheduler.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+OutMessage* out_message_new(const RPCMessage* const request, const size_t copy_len) {
+  OutMessage* const message = (OutMessage*) malloc(sizeof(OutMessage) + copy_len);
+  message->request = request->header;
+  message->timed = NULL != request->phases;
+  if (message->timed) message->phases = *request->phases;
+  message->fd = -1;
+  message->offset = 0;
+  message->priority = request->header.pad[0] == (char) RpcPriority::High
+    ? RpcPriority::High
+    : RpcPriority::Normal;
+  message->done = NULL;
+  message->arg = NULL;
+  message->head_len = 0;
+  message->sent = 0;
+  message->next = NULL;
+  return message;
+}
+
+static size_t total_len(const OutMessage* const message) {
+  return message->head_len + message->response.mark.data_len;
+}
+
+SendScheduler* SendScheduler::Start(const size_t chunk_len) {
+  SendScheduler* const scheduler = new SendScheduler();
+  scheduler->chunk_len_ = chunk_len;
+  scheduler->wake_fd_ = eventfd(0, EFD_NONBLOCK);
+  if (-1 == scheduler->wake_fd_) {
+    delete scheduler;
+    return NULL;
+  }
+  const int err = pthread_create(&scheduler->thread_, NULL, sender_main, scheduler);
+  if (0 != err) {
+    close(scheduler->wake_fd_);
+    delete scheduler;
+    errno = err;
+    return NULL;
+  }
+  return scheduler;
+}
+
+SendFlow* SendScheduler::add_flow(Connection* const connection, const int log_fd, void* const arg) {
+  // A response split over turns goes out in several writes, and Nagle would
+  // hold the last of them until the client's delayed ACK of the one before,
+  // tens of milliseconds later. MSG_MORE still keeps each write whole.
+  const int one = 1;
+  setsockopt(connection->sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  SendFlow* const flow = new SendFlow();
+  flow->connection = connection;
+  flow->log_fd = log_fd;
+  flow->arg = arg;
+  return flow;
+}
+
+void SendScheduler::remove_flow(SendFlow* const flow) {
+  delete flow;
+}
+
+void SendScheduler::wake() {
+  const uint64_t one = 1;
+  if (write(wake_fd_, &one, sizeof(one)) < 0) {
+    // The counter is full, so the sender thread is due to wake anyway.
+  }
+}
+
+void SendScheduler::make_ready(SendFlow* const flow) {
+  const OutMessage* const next = NULL != flow->current
+    ? flow->current
+    : NULL != flow->queued[(int) RpcPriority::High]
+    ? flow->queued[(int) RpcPriority::High]
+    : flow->queued[(int) RpcPriority::Normal];
+  flow->ready = true;
+  flow->ready_class = next->priority;
+  ready_[(int) flow->ready_class].push_back(flow);
+  wake();
+}
+
+OutMessage* SendScheduler::next_message(SendFlow* const flow) {
+  // High first.
+  for (int priority = (int) RpcPriority::High; priority >= 0; --priority) {
+    OutMessage* const message = flow->queued[priority];
+    if (NULL == message) continue;
+    flow->queued[priority] = message->next;
+    if (NULL == message->next) flow->queued_tail[priority] = NULL;
+    message->next = NULL;
+    return message;
+  }
+  return NULL;
+}
+
+void SendScheduler::submit(SendFlow* const flow, OutMessage* const message) {
+  std::vector<OutMessage*> finished;
+  pthread_mutex_lock(&mutex_);
+  if (flow->failed) {
+    pthread_mutex_unlock(&mutex_);
+    finished.push_back(message);
+    finish(flow, finished);
+    return;
+  }
+
+  const int priority = (int) message->priority;
+  if (NULL == flow->queued_tail[priority]) {
+    flow->queued[priority] = message;
+  } else {
+    flow->queued_tail[priority]->next = message;
+  }
+  flow->queued_tail[priority] = message;
+
+  if (flow->busy || flow->blocked) {
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+  if (flow->ready) {
+    // Move up to the High line, unless the flow is partway through a Normal
+    // response, which has to finish first anyway.
+    if (message->priority == RpcPriority::High
+        && flow->ready_class == RpcPriority::Normal
+        && NULL == flow->current) {
+      std::deque<SendFlow*>& normal = ready_[(int) RpcPriority::Normal];
+      for (auto it = normal.begin(); it != normal.end(); ++it) {
+        if (*it == flow) {
+          normal.erase(it);
+          break;
+        }
+      }
+      make_ready(flow);
+    }
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+
+  const bool alone = NULL == flow->current
+    && flow->queued[priority] == message
+    && NULL == flow->queued[1 - priority];
+  if (!alone || message->response.mark.data_len + RPC_HEAD_MAX_LEN > chunk_len_) {
+    make_ready(flow);
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+
+  // Send it from this thread.
+  flow->current = next_message(flow);
+  flow->busy = true;
+  pthread_mutex_unlock(&mutex_);
+  size_t n_sent;
+  const Sent result = send_some(flow, chunk_len_, &n_sent);
+  pthread_mutex_lock(&mutex_);
+  flow->busy = false;
+  after_send(flow, result, &finished);
+  pthread_mutex_unlock(&mutex_);
+  finish(flow, finished);
+}
+
+SendScheduler::Sent SendScheduler::send_some(
+  SendFlow* const flow,
+  const size_t max_bytes,
+  size_t* const n_sent
+) {
+  OutMessage* const message = flow->current;
+  Connection* const connection = flow->connection;
+  *n_sent = 0;
+
+  // The header is encoded as late as this, because a compact one depends on
+  // the one sent before it on the connection.
+  if (0 == message->head_len) {
+    RPCMessage request;
+    request.header = message->request;
+    RPCMessage response;
+    if (-1 == rpc_fill_prepared(&request, &message->response, &response)) return Sent::Failed;
+    message->mark = response.mark;
+    message->header = response.header;
+    message->head_len = rpc_encode_head(connection, &response, message->head);
+    if (message->timed) phases_mark(&message->phases, PHASE_FIRST_SENT);
+  }
+
+  const size_t total = total_len(message);
+  while (message->sent < total && *n_sent < max_bytes) {
+    const size_t want = std::min(total - message->sent, max_bytes - *n_sent);
+    ssize_t n;
+    if (message->sent < message->head_len) {
+      // The header, and as much of an in-memory body as fits in the turn.
+      const size_t head_left = message->head_len - message->sent;
+      iovec iov[2] = {
+        {message->head + message->sent, std::min(head_left, want)},
+        {(void*) message->response.body, 0},
+      };
+      if (message->fd < 0 && want > head_left) iov[1].iov_len = want - head_left;
+      n = conn_try_writev(connection, iov, 2, want > iov[0].iov_len + iov[1].iov_len);
+    } else {
+      const size_t body_at = message->sent - message->head_len;
+      if (message->fd >= 0) {
+        n = conn_try_send_file(connection, message->fd, message->offset + body_at, want);
+      } else {
+        const iovec iov = {(void*) (message->response.body + body_at), want};
+        n = conn_try_writev(connection, &iov, 1, false);
+      }
+    }
+    if (n < 0) return Sent::Failed;
+    message->sent += n;
+    *n_sent += n;
+    if (n == 0) return Sent::Blocked;
+  }
+  return message->sent == total ? Sent::Done : Sent::More;
+}
+
+void SendScheduler::after_send(SendFlow* const flow, const Sent result, std::vector<OutMessage*>* const finished) {
+  switch (result) {
+  case Sent::Done:
+    finished->push_back(flow->current);
+    flow->current = NULL;
+    break;
+  case Sent::More:
+    break;
+  case Sent::Blocked:
+    flow->blocked = true;
+    blocked_.push_back(flow);
+    wake();
+    return;
+  case Sent::Failed:
+    flow->failed = true;
+    // Nothing more can go out on the connection.
+    if (NULL != flow->current) finished->push_back(flow->current);
+    flow->current = NULL;
+    while (OutMessage* const message = next_message(flow)) finished->push_back(message);
+    return;
+  }
+  if (NULL != flow->current || NULL != flow->queued[0] || NULL != flow->queued[1]) make_ready(flow);
+}
+
+void SendScheduler::finish(SendFlow* const flow, const std::vector<OutMessage*>& finished) {
+  for (OutMessage* const message : finished) {
+    if (message->head_len > 0 && message->sent == total_len(message)) {
+      if (message->timed) phases_mark(&message->phases, PHASE_LAST_SENT);
+      if (flow->log_fd >= 0) {
+        RPCMessage sent;
+        sent.mark = message->mark;
+        sent.header = message->header;
+        sent.body = (uint8_t*) message->response.body;
+        sent.phases = message->timed ? &message->phases : NULL;
+        log(flow->log_fd, &sent);
+      }
+    }
+    if (NULL != message->done) message->done(flow->arg, message->arg);
+    free(message);
+  }
+}
+
+void* SendScheduler::sender_main(void* const void_scheduler) {
+  SendScheduler* const scheduler = (SendScheduler*) void_scheduler;
+  std::vector<pollfd> fds;
+  std::vector<OutMessage*> finished;
+
+  pthread_mutex_lock(&scheduler->mutex_);
+  while (true) {
+    std::deque<SendFlow*>* ready = &scheduler->ready_[(int) RpcPriority::High];
+    if (ready->empty()) ready = &scheduler->ready_[(int) RpcPriority::Normal];
+
+    if (!ready->empty()) {
+      // One turn.
+      SendFlow* const flow = ready->front();
+      ready->pop_front();
+      flow->ready = false;
+      flow->busy = true;
+      size_t deficit = scheduler->chunk_len_;
+      Sent result = Sent::More;
+      while (deficit > 0) {
+        if (NULL == flow->current) flow->current = next_message(flow);
+        if (NULL == flow->current) break;
+        pthread_mutex_unlock(&scheduler->mutex_);
+        size_t n_sent;
+        result = send_some(flow, deficit, &n_sent);
+        pthread_mutex_lock(&scheduler->mutex_);
+        deficit -= n_sent;
+        if (result != Sent::Done) break;
+        finished.push_back(flow->current);
+        flow->current = NULL;
+      }
+      flow->busy = false;
+      if (result != Sent::Done) {
+        scheduler->after_send(flow, result, &finished);
+      } else if (NULL != flow->queued[0] || NULL != flow->queued[1]) {
+        scheduler->make_ready(flow);
+      }
+      if (!finished.empty()) {
+        pthread_mutex_unlock(&scheduler->mutex_);
+        finish(flow, finished);
+        finished.clear();
+        pthread_mutex_lock(&scheduler->mutex_);
+      }
+      continue;
+    }
+
+    if (scheduler->stopping_ && scheduler->blocked_.empty()) break;
+
+    // Nothing can go out until a new message comes in, or a blocked flow's
+    // socket has room.
+    fds.clear();
+    fds.push_back({scheduler->wake_fd_, POLLIN, 0});
+    for (const SendFlow* const flow : scheduler->blocked_) {
+      fds.push_back({flow->connection->sock_fd, POLLOUT, 0});
+    }
+    pthread_mutex_unlock(&scheduler->mutex_);
+    poll(fds.data(), fds.size(), -1);
+    uint64_t n_wakes;
+    if (read(scheduler->wake_fd_, &n_wakes, sizeof(n_wakes)) < 0) {
+      // Nobody woke us, so a socket has room.
+    }
+    pthread_mutex_lock(&scheduler->mutex_);
+    // Flows are only ever added to blocked_ since the poll, so the first
+    // fds.size() - 1 are the ones polled.
+    std::vector<SendFlow*>& blocked = scheduler->blocked_;
+    size_t kept = 0;
+    for (size_t i = 0; i < blocked.size(); ++i) {
+      SendFlow* const flow = blocked[i];
+      if (i + 1 < fds.size() && 0 != fds[i + 1].revents) {
+        flow->blocked = false;
+        scheduler->make_ready(flow);
+      } else {
+        blocked[kept++] = flow;
+      }
+    }
+    blocked.resize(kept);
+  }
+  pthread_mutex_unlock(&scheduler->mutex_);
+  return NULL;
+}
+
+void SendScheduler::shutdown() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  wake();
+  pthread_mutex_unlock(&mutex_);
+  pthread_join(thread_, NULL);
+  close(wake_fd_);
+}
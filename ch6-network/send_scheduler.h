@@ -0,0 +1,168 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <vector>
+
+#include "network.h"
+#include "phases.h"
+#include "rpc.h"
+
+// A response waiting to go out on a SendFlow. Made with out_message_new(),
+// and freed by the scheduler once it is done with it.
+struct OutMessage {
+  // The header of the request it answers.
+  RPCHeader request;
+  // The request's phase times, if it was timed, to be logged with the
+  // response.
+  bool timed;
+  PhaseTimes phases;
+
+  PreparedResponse response;
+  // If not negative, the body is sent from this file at offset, rather than
+  // from response.body.
+  int fd;
+  off_t offset;
+  RpcPriority priority;
+
+  // Called once the message has gone out, or been dropped because the
+  // connection failed, with the flow's arg and this arg.
+  void (*done)(void* flow_arg, void* arg);
+  void* arg;
+
+  // Set by the scheduler once the message starts going out: the response's
+  // mark and header as sent, encoded into head.
+  RPCMark mark;
+  RPCHeader header;
+  uint8_t head[RPC_HEAD_MAX_LEN];
+  size_t head_len;
+  // Bytes of head and body sent so far.
+  size_t sent;
+  OutMessage* next;
+
+  // Room for a copy of the body, if asked for.
+  uint8_t copy[];
+};
+
+// Returns a message answering request, with copy_len bytes of room at copy
+// for the caller to copy the body into. The response and done are up to the
+// caller to fill in.
+OutMessage* out_message_new(const RPCMessage* request, size_t copy_len);
+
+// The responses queued for one connection.
+struct SendFlow {
+  Connection* connection;
+  int log_fd;
+  void* arg;
+
+  // Some thread is writing to the connection.
+  bool busy = false;
+  // Waiting for room in the socket's send buffer.
+  bool blocked = false;
+  // In a ready list, and which.
+  bool ready = false;
+  RpcPriority ready_class = RpcPriority::Normal;
+  // The connection failed. Everything queued was dropped, and anything
+  // submitted later is too.
+  bool failed = false;
+
+  // The message partly sent, if any. Nothing else goes out on the
+  // connection until it is done.
+  OutMessage* current = NULL;
+  // Messages not started yet, oldest first, by RpcPriority.
+  OutMessage* queued[2] = {};
+  OutMessage* queued_tail[2] = {};
+};
+
+// Sends responses in chunks, interleaving the chunks of big responses on
+// different connections, so that a small response on one connection doesn't
+// wait for a big one on another to be written out in full. Writing a 1 MB
+// response holds a worker for as long as the client takes to read it, which
+// over a slow link is many milliseconds.
+//
+// A sender thread serves the connections that have responses waiting with
+// deficit round-robin: each one with bytes to send gets a turn of up to
+// chunk_len bytes in turn, which may cover the rest of one response and the
+// start of the next. The unit is a byte, so a connection only leaves any of
+// its turn unused when it runs out of bytes, or of room in its socket
+// buffer. Connections whose next response is High priority take their turns
+// ahead of the rest.
+//
+// Bytes within one connection can't interleave, so a response waits for the
+// one going out ahead of it on the same connection to finish, but a High
+// response overtakes Normal ones that haven't started.
+//
+// A response no bigger than chunk_len, on a connection with nothing else
+// queued, is sent right away by the thread that submits it, without waiting
+// for the sender thread, as its turn would come up next anyway.
+class SendScheduler {
+public:
+  // Starts the sender thread.
+  //
+  // Returns NULL and sets errno on error.
+  static SendScheduler* Start(size_t chunk_len);
+
+  // Returns a flow for sending on connection, whose messages' done callbacks
+  // get arg. The connection must be over TCP: the sender thread waits for
+  // room with poll() on the socket, and writing to a full shared-memory ring
+  // would wait, holding up every other connection.
+  SendFlow* add_flow(Connection* connection, int log_fd, void* arg);
+
+  // Frees the flow, which must be done with: every message submitted to it
+  // has had its done callback called.
+  void remove_flow(SendFlow* flow);
+
+  // Queues message to go out on flow. Safe to call from any thread.
+  void submit(SendFlow* flow, OutMessage* message);
+
+  // Sends everything queued, then stops the sender thread.
+  void shutdown();
+
+private:
+  SendScheduler() = default;
+
+  static void* sender_main(void* void_scheduler);
+
+  // What came of a turn or an inline send.
+  enum class Sent {
+    Done,
+    More,
+    Blocked,
+    Failed,
+  };
+
+  // Writes up to max_bytes of flow->current to its connection.
+  static Sent send_some(SendFlow* flow, size_t max_bytes, size_t* n_sent);
+
+  // With mutex_ held: updates flow after a send that turned out as result,
+  // collecting messages that are finished into *finished, and puts the flow
+  // in line for another turn if it has more to send.
+  void after_send(SendFlow* flow, Sent result, std::vector<OutMessage*>* finished);
+
+  // With mutex_ held: takes the flow's next message off of its queues.
+  static OutMessage* next_message(SendFlow* flow);
+
+  void make_ready(SendFlow* flow);
+  void wake();
+
+  // Logs each message that went out, calls its done callback, and frees it.
+  static void finish(SendFlow* flow, const std::vector<OutMessage*>& finished);
+
+  size_t chunk_len_;
+
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  // Flows with something to send and room to send it, by the RpcPriority of
+  // what they send next.
+  std::deque<SendFlow*> ready_[2];
+  // Flows waiting for room in their socket buffers.
+  std::vector<SendFlow*> blocked_;
+  bool stopping_ = false;
+
+  // An eventfd that wakes the sender thread up out of poll().
+  int wake_fd_;
+  pthread_t thread_;
+};
@@ -2,23 +2,40 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <string>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <unordered_map>
+#include <vector>
 
+#include "blob.h"
+#include "busy_poll.h"
 #include "log.h"
+#include "executor.h"
+#include "key_table.h"
+#include "lsm.h"
 #include "my_rpc.h"
 #include "network.h"
+#include "ordered_index.h"
+#include "phases.h"
+#include "placement.h"
+#include "replication.h"
 #include "rpc.h"
+#include "send_scheduler.h"
+#include "shm.h"
+#include "singleflight.h"
+#include "snapshot.h"
 #include "spinlock.h"
+#include "udp.h"
+#include "../util/pmu.h"
 
 #define hton16 htons
 #define hton32 htonl
@@ -28,8 +45,118 @@
 bool verbose = false;
 #define VERBOSE(x) if (verbose) { x; }
 
+// If set, every request is also written in full to server-PORT.cap.
+bool capture_requests = false;
+
+// The format of server-PORT.log. See log.h.
+LogFormat log_format = LogFormat::Rows;
+
+// If set, each port also answers small RPCs sent to it over UDP. See udp.h.
+bool serve_udp = false;
+
+// If set, the server is a backup: it takes writes only from its primary, as
+// repl RPCs, and answers clients' writes ReadOnly. See replication.h.
+bool is_backup = false;
+// If not negative, a backup answers reads Stale once it was last up to date
+// with its primary longer ago than this many milliseconds.
+int max_staleness_ms = -1;
+// The last sequence number a backup has applied, written under the keystore
+// lock, and when it last had everything its primary had, by now_nsec().
+uint64_t repl_applied_seq = 0;
+uint64_t repl_fresh_ns = 0;
+
+// Ships writes to the backups, if there are any.
+ReplPrimary* replication = NULL;
+// If set, writes are answered only once every backup has them.
+bool sync_replication = false;
+
+// If not negative, the listener threads spin for up to this many
+// microseconds waiting for connections and requests before blocking, and
+// report what it cost on exit. See busy_poll.h.
+int busy_poll_us = -1;
+// If not 0, SO_BUSY_POLL for the sockets of accepted connections.
+uint32_t so_busy_poll_us = 0;
+
+// Values longer than this many bytes are spilled to the blob file, if there
+// is one, rather than kept on the heap.
+size_t spill_len = 64 * 1024;
+// Where spilled values go: server-START_PORT.blob. NULL if values are never
+// spilled.
+BlobFile* blobs = NULL;
+
+// If set, keys and values live in this LSM tree instead of the in-memory
+// keystore below, which then stays empty. See lsm.h.
+LsmStore* lsm = NULL;
+// If set, concurrent reads of the same key from the LSM tree share one get,
+// and one response. See singleflight.h.
+SingleFlight* lsm_reads = NULL;
+
+// A value in the keystore, along with the response that answers a read of
+// it. Immutable once stored: a write replaces the whole thing.
+//
+// A read takes a reference under the keystore lock and sends straight from
+// here after dropping it, so reads copy neither the value nor the response,
+// and the value outlives a write that replaces it mid-send. A spilled value
+// is sent straight from the blob file's pages in the page cache instead.
+struct StoredValue {
+  uint32_t refs;
+  PreparedResponse response;
+  // Where the value starts in the blob file if it was spilled there, and
+  // otherwise -1, with the value in value[].
+  int64_t blob_offset;
+  uint8_t value[];
+
+  // Return a value with one reference, held by the caller.
+  static StoredValue* Make(const char* value, size_t len);
+  static StoredValue* MakeSpilled(uint64_t blob_offset, size_t len);
+
+  bool spilled() const { return blob_offset >= 0; }
+
+  StoredValue* ref() {
+    __atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+    return this;
+  }
+
+  void unref() {
+    if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) == 0) free(this);
+  }
+};
+
+StoredValue* StoredValue::Make(const char* const value, const size_t len) {
+  StoredValue* const stored = (StoredValue*) malloc(sizeof(StoredValue) + len);
+  stored->refs = 1;
+  stored->blob_offset = -1;
+  memcpy(stored->value, value, len);
+  rpc_prepare_resp(&stored->response, stored->value, len, RpcStatus::Ok);
+  return stored;
+}
+
+StoredValue* StoredValue::MakeSpilled(const uint64_t blob_offset, const size_t len) {
+  StoredValue* const stored = (StoredValue*) malloc(sizeof(StoredValue));
+  stored->refs = 1;
+  stored->blob_offset = blob_offset;
+  rpc_prepare_resp(&stored->response, NULL, len, RpcStatus::Ok);
+  return stored;
+}
+
 LockAndHist lock;
-std::unordered_map<std::string, std::string> keystore;
+// Maps keys to StoredValues, each holding one reference for the keystore.
+KeyTable keystore;
+// The keystore's keys in order, for scans. Inserted into under the keystore
+// lock, which makes it the index's single writer; scanned without it.
+OrderedIndex key_index;
+
+// If set, each RPC's kernel events are counted and summed up per method. See
+// run_handler().
+bool count_events = false;
+
+// Runs the RPC handlers. If NULL, each listener thread runs the handlers for
+// its own connection inline.
+Executor* executor = NULL;
+
+// Sends the responses, interleaving big ones across connections. If NULL,
+// each response is written out in full by the thread that answers it.
+SendScheduler* scheduler = NULL;
 
 struct ListenArgs {
   const int port;
@@ -44,145 +171,1125 @@ enum class RpcAction {
   CONTINUE,
 };
 
-void handle_rpc_ping(
-  const Connection* const connection,
+// State for one client connection, shared between the listener thread that
+// reads requests off of it and the workers that answer them.
+struct ConnState {
+  Connection connection;
+  int log_fd;
+  int capture_fd = -1;
+
+  // Serializes responses. Workers may answer several requests from the same
+  // connection at once, and their bytes must not interleave on the wire.
+  pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+  // The connection's responses queued on the scheduler, if there is one.
+  // Each one counts as pending until it has gone out.
+  SendFlow* flow = NULL;
+
+  // Set for a port's UDP socket rather than a connection: responses are
+  // encoded into this batch, to go out together, to the address of the
+  // request being answered.
+  UdpBatch* udp_out = NULL;
+  sockaddr_in udp_peer;
+
+  // The listener thread's, if it busy-polls.
+  BusyPoll* busy_poll = NULL;
+
+  // Number of requests read off the connection but not yet answered.
+  int pending = 0;
+  pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+  // Scan batches queued on the scheduler but not yet sent, under
+  // pending_mutex. Also signalled through pending_cond.
+  int queued_scan_batches = 0;
+};
+
+void add_pending(ConnState* const conn) {
+  pthread_mutex_lock(&conn->pending_mutex);
+  ++conn->pending;
+  pthread_mutex_unlock(&conn->pending_mutex);
+}
+
+void remove_pending(ConnState* const conn) {
+  pthread_mutex_lock(&conn->pending_mutex);
+  if (--conn->pending == 0) pthread_cond_broadcast(&conn->pending_cond);
+  pthread_mutex_unlock(&conn->pending_mutex);
+}
+
+// Sends the response right away, even with a scheduler, ahead of anything
+// still queued on it.
+void send_resp_now(
+  ConnState* const conn,
   const RPCMessage* const request,
-  const int log_fd
+  uint8_t* const body,
+  const size_t n_bytes,
+  const RpcStatus status
 ) {
-  // Echo the request back to the client.
-  rpc_send_resp(
-    connection,
-    request,
-    request->body,
-    request->mark.data_len,
-    RpcStatus::Ok,
-    log_fd
-  );
+  pthread_mutex_lock(&conn->send_mutex);
+  rpc_send_resp(&conn->connection, request, body, n_bytes, status, conn->log_fd);
+  pthread_mutex_unlock(&conn->send_mutex);
 }
 
-void handle_rpc_write(
-  const Connection* const connection,
+// Adds the response to the batch going out on the UDP socket. One too big for
+// a datagram is answered Failed instead.
+void send_datagram_resp(
+  ConnState* const conn,
   const RPCMessage* const request,
-  const int log_fd
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const RpcStatus status
 ) {
+  PreparedResponse response;
+  rpc_prepare_resp(&response, body, n_bytes, status);
+  if (n_bytes > UDP_BODY_MAX_LEN) rpc_prepare_resp(&response, NULL, 0, RpcStatus::Failed);
+  RPCMessage message;
+  if (-1 == rpc_fill_prepared(request, &response, &message)) return;
+  phases_mark(message.phases, PHASE_FIRST_SENT);
+  udp_encode(conn->udp_out, conn->udp_peer, &message, response.body, response.mark.data_len);
+}
+
+// The done callback of responses queued on the scheduler. value is the
+// StoredValue the response was sent from, if any.
+void response_sent(void* const conn, void* const value) {
+  if (NULL != value) ((StoredValue*) value)->unref();
+  remove_pending((ConnState*) conn);
+}
+
+// Queues the response on the scheduler, or sends it right away if there is
+// none. body is copied, so it needn't outlive the call. done is called once a
+// queued response has gone out.
+void send_resp(
+  ConnState* const conn,
+  const RPCMessage* const request,
+  uint8_t* const body,
+  const size_t n_bytes,
+  const RpcStatus status,
+  void (*const done)(void* conn, void* value) = response_sent
+) {
+  if (NULL != conn->udp_out) {
+    send_datagram_resp(conn, request, body, n_bytes, status);
+    return;
+  }
+  if (NULL == conn->flow) {
+    send_resp_now(conn, request, body, n_bytes, status);
+    return;
+  }
+  OutMessage* const message = out_message_new(request, n_bytes);
+  if (n_bytes > 0) memcpy(message->copy, body, n_bytes);
+  rpc_prepare_resp(&message->response, message->copy, n_bytes, status);
+  message->done = done;
+  add_pending(conn);
+  scheduler->submit(conn->flow, message);
+}
+
+void handle_rpc_ping(ConnState* const conn, const RPCMessage* const request) {
+  phases_mark(request->phases, PHASE_PARSED);
+  phases_mark(request->phases, PHASE_HANDLED);
+  // Echo the request back to the client.
+  send_resp(conn, request, request->body, request->mark.data_len, RpcStatus::Ok);
+}
+
+// Returns the value of the write, with one reference, spilled to the blob
+// file if it is long.
+//
+// Returns NULL if it couldn't be spilled.
+StoredValue* make_value(WriteRequest* const write_req) {
+  if (NULL == blobs || write_req->value_len() <= spill_len) {
+    return StoredValue::Make(write_req->value(), write_req->value_len());
+  }
+  // Appended before the key points to it, so a read never sees a partly
+  // written value.
+  uint64_t offset;
+  if (-1 == blob_append(blobs, (const uint8_t*) write_req->value(), write_req->value_len(), &offset)) {
+    return NULL;
+  }
+  return StoredValue::MakeSpilled(offset, write_req->value_len());
+}
+
+// With the keystore lock held: stores value, taking over its reference, under
+// the write's key.
+//
+// Returns the value it replaced, if any, whose reference is the caller's to
+// drop once the lock is released.
+StoredValue* put_value(WriteRequest* const write_req, StoredValue* const value) {
+  StoredValue* const replaced = (StoredValue*) keystore.put(write_req->key(), write_req->key_len(), value);
+  if (NULL == replaced) key_index.insert(write_req->key(), write_req->key_len());
+  return replaced;
+}
+
+// A write waiting for the backups to have it before it is answered.
+struct ReplicatedWrite {
+  ConnState* conn;
+  RPCMessage request;
+};
+
+static void write_replicated(void* const arg) {
+  ReplicatedWrite* const write = (ReplicatedWrite*) arg;
+  send_resp(write->conn, &write->request, NULL, 0, RpcStatus::Ok);
+  remove_pending(write->conn);
+  delete write;
+}
+
+void handle_rpc_write(ConnState* const conn, const RPCMessage* const request) {
+  if (is_backup) {
+    send_resp(conn, request, NULL, 0, RpcStatus::ReadOnly);
+    return;
+  }
   WriteRequest* write_req = WriteRequest::FromBody(request->body, request->mark.data_len);
   if (NULL == write_req) {
     fprintf(
       stderr, "%d: failed to parse write request\n",
-      connection->server_port
+      conn->connection.server_port
     );
-    rpc_send_resp(connection, request, NULL, 0, RpcStatus::BadArg, log_fd);
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
     return;
   }
-  std::string key(write_req->key(), write_req->key_len());
-  std::string value(write_req->value(), write_req->value_len());
+  if (NULL != lsm) {
+    phases_mark(request->phases, PHASE_PARSED);
+    const int result = lsm->put(
+      write_req->key(), write_req->key_len(), (const uint8_t*) write_req->value(), write_req->value_len()
+    );
+    if (NULL != lsm_reads) lsm_reads->forget(write_req->key(), write_req->key_len());
+    phases_mark(request->phases, PHASE_HANDLED);
+    send_resp(conn, request, NULL, 0, -1 == result ? RpcStatus::Failed : RpcStatus::Ok);
+    return;
+  }
+  StoredValue* const value = make_value(write_req);
+  if (NULL == value) {
+    fprintf(stderr, "%d: failed to spill a value: %m\n", conn->connection.server_port);
+    send_resp(conn, request, NULL, 0, RpcStatus::Failed);
+    return;
+  }
+  // Copied for the backups before taking the lock, under which it is only
+  // appended to the log, so that they apply writes in the same order.
+  ReplEntry* const entry = NULL != replication
+    ? repl_entry_new(request->body, request->mark.data_len)
+    : NULL;
+  phases_mark(request->phases, PHASE_PARSED);
 
+  StoredValue* replaced = NULL;
+  uint64_t seq = 0;
   {
     SpinLock spinlock(&lock);
-    keystore.emplace(key, value);
+    phases_mark(request->phases, PHASE_LOCKED);
+    replaced = put_value(write_req, value);
+    if (NULL != entry) seq = replication->append(entry);
   }
+  // Readers still sending the old value hold their own references to it.
+  if (NULL != replaced) replaced->unref();
+  phases_mark(request->phases, PHASE_HANDLED);
 
-  rpc_send_resp(
-    connection,
-    request,
-    NULL,
-    0,
-    RpcStatus::Ok,
-    log_fd
-  );
+  if (sync_replication && NULL != entry) {
+    if (NULL != conn->udp_out) {
+      // The response goes out with the rest of its datagram batch, once the
+      // handlers for all of them have returned.
+      replication->wait_acked(seq);
+    } else {
+      // The request outlives this call, but its body and phases don't.
+      ReplicatedWrite* const write = new ReplicatedWrite{conn, *request};
+      write->request.body = NULL;
+      write->request.chunk = NULL;
+      write->request.phases = NULL;
+      add_pending(conn);
+      replication->when_acked(seq, write_replicated, write);
+      return;
+    }
+  }
+  send_resp(conn, request, NULL, 0, RpcStatus::Ok);
 }
 
-void handle_rpc_read(
-  const Connection* const connection,
-  const RPCMessage* const request,
-  const int log_fd
-) {
-  const std::string key((char*)request->body, request->mark.data_len);
+// Applies a batch of the primary's writes, in order, under one acquisition of
+// the keystore lock, and answers with the last sequence number applied.
+// Entries applied already, sent again after the primary lost its connection,
+// are skipped.
+void handle_rpc_repl(ConnState* const conn, const RPCMessage* const request) {
+  ReplBatch batch;
+  if (!is_backup || request->mark.data_len < sizeof(batch)) {
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
+    return;
+  }
+  memcpy(&batch, request->body, sizeof(batch));
+  const uint8_t* p = request->body + sizeof(batch);
+  const uint8_t* const end = request->body + request->mark.data_len;
+
+  // Batches come one at a time, from the primary's one connection, so this
+  // is the only writer.
+  uint64_t applied = __atomic_load_n(&repl_applied_seq, __ATOMIC_ACQUIRE);
+  if (batch.n_entries > 0 && batch.first_seq > applied + 1) {
+    send_resp(conn, request, (uint8_t*) &applied, sizeof(applied), RpcStatus::Failed);
+    return;
+  }
+
+  std::vector<WriteRequest*> writes;
+  std::vector<StoredValue*> values;
+  RpcStatus status = RpcStatus::Ok;
+  for (uint32_t i = 0; i < batch.n_entries; ++i) {
+    uint8_t* body;
+    size_t len;
+    WriteRequest* const write_req = repl_next_entry(&p, end, &body, &len)
+      ? WriteRequest::FromBody(body, len)
+      : NULL;
+    if (NULL == write_req) {
+      status = RpcStatus::BadArg;
+      break;
+    }
+    if (batch.first_seq + i <= applied) continue;
+    StoredValue* const value = make_value(write_req);
+    if (NULL == value) {
+      fprintf(stderr, "%d: failed to spill a value: %m\n", conn->connection.server_port);
+      status = RpcStatus::Failed;
+      break;
+    }
+    writes.push_back(write_req);
+    values.push_back(value);
+  }
+  if (status != RpcStatus::Ok) {
+    for (StoredValue* const value : values) value->unref();
+    send_resp(conn, request, (uint8_t*) &applied, sizeof(applied), status);
+    return;
+  }
+  phases_mark(request->phases, PHASE_PARSED);
 
-  bool found;
-  std::string result;
+  std::vector<StoredValue*> replaced;
   {
     SpinLock spinlock(&lock);
-    const auto iter = keystore.find(key);
-    if (iter == keystore.end()) {
-      found = false;
-    } else {
-      found = true;
-      result = iter->second;
+    phases_mark(request->phases, PHASE_LOCKED);
+    for (size_t i = 0; i < writes.size(); ++i) {
+      StoredValue* const old = put_value(writes[i], values[i]);
+      if (NULL != old) replaced.push_back(old);
     }
+    applied += writes.size();
+    __atomic_store_n(&repl_applied_seq, applied, __ATOMIC_RELEASE);
   }
+  for (StoredValue* const old : replaced) old->unref();
+  if (applied >= batch.head_seq) {
+    __atomic_store_n(&repl_fresh_ns, now_nsec(), __ATOMIC_RELAXED);
+  }
+  phases_mark(request->phases, PHASE_HANDLED);
+
+  send_resp(conn, request, (uint8_t*) &applied, sizeof(applied), RpcStatus::Ok);
+}
+
+// Whether the server is a backup too far behind its primary to answer reads.
+bool too_stale() {
+  if (!is_backup || max_staleness_ms < 0) return false;
+  const uint64_t fresh_ns = __atomic_load_n(&repl_fresh_ns, __ATOMIC_RELAXED);
+  return now_nsec() - fresh_ns > max_staleness_ms * 1000000ull;
+}
 
-  if (found) {
-    rpc_send_resp(
-      connection,
-      request,
-      (uint8_t*) result.c_str(),
-      result.size(),
-      RpcStatus::Ok,
-      log_fd
+// Sends value as the response to request, and drops the caller's reference
+// to it once it has gone out.
+static void send_value(ConnState* const conn, const RPCMessage* const request, StoredValue* const value) {
+  if (NULL != conn->udp_out) {
+    // The response is copied into its datagram, so a spilled value that
+    // fits is read back in first.
+    uint8_t spilled[UDP_BODY_MAX_LEN];
+    const size_t len = value->response.mark.data_len;
+    const uint8_t* body = value->response.body;
+    RpcStatus status = RpcStatus::Ok;
+    if (value->spilled() && len <= sizeof(spilled)) {
+      body = spilled;
+      if (-1 == blob_read(blobs, value->blob_offset, spilled, len)) status = RpcStatus::Failed;
+    }
+    send_resp(conn, request, (uint8_t*) body, status == RpcStatus::Ok ? len : 0, status);
+    value->unref();
+    return;
+  }
+  if (NULL != conn->flow) {
+    // The reference is dropped once the response has gone out.
+    OutMessage* const message = out_message_new(request, 0);
+    message->response = value->response;
+    if (value->spilled()) {
+      message->fd = blobs->fd;
+      message->offset = value->blob_offset;
+    }
+    message->done = response_sent;
+    message->arg = value;
+    add_pending(conn);
+    scheduler->submit(conn->flow, message);
+    return;
+  }
+  pthread_mutex_lock(&conn->send_mutex);
+  if (value->spilled()) {
+    rpc_send_prepared_file(
+      &conn->connection, request, &value->response, blobs->fd, value->blob_offset, conn->log_fd
+    );
+  } else {
+    rpc_send_prepared(&conn->connection, request, &value->response, conn->log_fd);
+  }
+  pthread_mutex_unlock(&conn->send_mutex);
+  value->unref();
+}
+
+// A read waiting on another's get of the same key from the LSM tree.
+struct CoalescedRead {
+  ConnState* conn;
+  RPCMessage request;
+};
+
+// What a get from the LSM tree found: 1 and the value, 0, or -1 on error.
+struct LsmReadResult {
+  int found;
+  StoredValue* value;
+};
+
+static void answer_coalesced(void* const arg, void* const void_result) {
+  CoalescedRead* const read = (CoalescedRead*) arg;
+  const LsmReadResult* const result = (const LsmReadResult*) void_result;
+  if (1 == result->found) {
+    send_value(read->conn, &read->request, result->value->ref());
+  } else {
+    send_resp(read->conn, &read->request, NULL, 0, 0 == result->found ? RpcStatus::NotFound : RpcStatus::Failed);
+  }
+  remove_pending(read->conn);
+  delete read;
+}
+
+// Answers a read from the LSM tree with a copy of the value, as its files
+// are rewritten by compactions. With lsm_reads, the copy is made into a
+// StoredValue that reads of the key which come while the get is under way
+// are answered from too, instead of each getting the key themselves.
+static void read_from_lsm(ConnState* const conn, const RPCMessage* const request) {
+  const char* const key = (const char*) request->body;
+  const size_t key_len = request->mark.data_len;
+  // A datagram's response has to go out before the handler returns, with
+  // the rest of its batch, so those don't wait on others.
+  SingleFlight::Flight* flight = NULL;
+  if (NULL != lsm_reads && NULL == conn->udp_out) {
+    // The request outlives this call if it joins a flight, but its body and
+    // phases don't.
+    CoalescedRead* const read = new CoalescedRead{conn, *request};
+    read->request.body = NULL;
+    read->request.chunk = NULL;
+    read->request.phases = NULL;
+    add_pending(conn);
+    flight = lsm_reads->join(key, key_len, answer_coalesced, read);
+    if (NULL == flight) {
+      phases_mark(request->phases, PHASE_HANDLED);
+      return;
+    }
+    remove_pending(conn);
+    delete read;
+  }
+
+  std::string value;
+  LsmReadResult result;
+  result.found = lsm->get(key, key_len, &value);
+  result.value = 1 == result.found ? StoredValue::Make(value.data(), value.size()) : NULL;
+  if (NULL != flight) lsm_reads->finish(flight, &result);
+  phases_mark(request->phases, PHASE_HANDLED);
+  if (1 == result.found) {
+    send_value(conn, request, result.value);
+  } else {
+    send_resp(conn, request, NULL, 0, 0 == result.found ? RpcStatus::NotFound : RpcStatus::Failed);
+  }
+}
+
+void handle_rpc_read(ConnState* const conn, const RPCMessage* const request) {
+  if (too_stale()) {
+    send_resp(conn, request, NULL, 0, RpcStatus::Stale);
+    return;
+  }
+  phases_mark(request->phases, PHASE_PARSED);
+  if (NULL != lsm) {
+    read_from_lsm(conn, request);
+    return;
+  }
+
+  StoredValue* value = NULL;
+  {
+    SpinLock spinlock(&lock);
+    phases_mark(request->phases, PHASE_LOCKED);
+    value = (StoredValue*) keystore.find((char*) request->body, request->mark.data_len);
+    if (NULL != value) value->ref();
+  }
+  phases_mark(request->phases, PHASE_HANDLED);
+
+  if (NULL == value) {
+    send_resp(conn, request, NULL, 0, RpcStatus::NotFound);
+    return;
+  }
+  send_value(conn, request, value);
+}
+
+// Deletes the key in the body. Only the LSM tree can: the in-memory keystore
+// has no way to take a key back out of its index, so it answers Failed.
+void handle_rpc_delete(ConnState* const conn, const RPCMessage* const request) {
+  if (NULL == lsm) {
+    send_resp(conn, request, NULL, 0, RpcStatus::Failed);
+    return;
+  }
+  if (0 == request->mark.data_len || request->mark.data_len > MAX_KEY_LEN) {
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
+    return;
+  }
+  phases_mark(request->phases, PHASE_PARSED);
+  const int result = lsm->del((const char*) request->body, request->mark.data_len);
+  if (NULL != lsm_reads) lsm_reads->forget((const char*) request->body, request->mark.data_len);
+  phases_mark(request->phases, PHASE_HANDLED);
+  send_resp(conn, request, NULL, 0, -1 == result ? RpcStatus::Failed : RpcStatus::Ok);
+}
+
+// A scan's batch of keys being built, in the layout described at
+// ScanRequest.
+struct ScanBatch {
+  ConnState* conn;
+  const RPCMessage* request;
+  size_t n_keys;
+  size_t len;
+  uint8_t body[1 + SCAN_BATCH_KEYS * (1 + MAX_KEY_LEN)];
+};
+
+// How many of a connection's scan batches may be queued on the scheduler at
+// once. A scan that gets this far ahead of the client waits for some to go
+// out, rather than copying the whole range into the queue.
+constexpr int MAX_QUEUED_SCAN_BATCHES = 4;
+
+static void scan_batch_sent(void* const conn_arg, void* const value) {
+  ConnState* const conn = (ConnState*) conn_arg;
+  pthread_mutex_lock(&conn->pending_mutex);
+  --conn->queued_scan_batches;
+  pthread_cond_broadcast(&conn->pending_cond);
+  pthread_mutex_unlock(&conn->pending_mutex);
+  response_sent(conn, value);
+}
+
+static void send_batch(ScanBatch* const batch) {
+  ConnState* const conn = batch->conn;
+  if (NULL == conn->flow) {
+    send_resp(conn, batch->request, batch->body, batch->len, RpcStatus::Ok);
+    return;
+  }
+  pthread_mutex_lock(&conn->pending_mutex);
+  while (conn->queued_scan_batches >= MAX_QUEUED_SCAN_BATCHES) {
+    pthread_cond_wait(&conn->pending_cond, &conn->pending_mutex);
+  }
+  ++conn->queued_scan_batches;
+  pthread_mutex_unlock(&conn->pending_mutex);
+  send_resp(conn, batch->request, batch->body, batch->len, RpcStatus::Ok, scan_batch_sent);
+}
+
+static bool add_to_batch(void* const arg, const char* const key, const size_t key_len) {
+  ScanBatch* const batch = (ScanBatch*) arg;
+  batch->body[batch->len++] = key_len;
+  memcpy(batch->body + batch->len, key, key_len);
+  batch->len += key_len;
+  if (++batch->n_keys == SCAN_BATCH_KEYS) {
+    send_batch(batch);
+    batch->n_keys = 0;
+    batch->len = 1;
+  }
+  return true;
+}
+
+// Streams the keys in the requested range back in batches, sending each as it
+// fills up. The index is read without the keystore lock, so a long scan holds
+// up neither writers nor other readers; it sees each key that was in the
+// keystore when it started, and maybe some written since.
+void handle_rpc_scan(ConnState* const conn, const RPCMessage* const request) {
+  ScanRequest* const scan_req = ScanRequest::FromBody(request->body, request->mark.data_len);
+  if (NULL == scan_req) {
+    fprintf(
+      stderr, "%d: failed to parse scan request\n",
+      conn->connection.server_port
+    );
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
+    return;
+  }
+  if (too_stale()) {
+    send_resp(conn, request, NULL, 0, RpcStatus::Stale);
+    return;
+  }
+  phases_mark(request->phases, PHASE_PARSED);
+
+  // Batches go out back to back with no request in between to carry the
+  // client's ACKs, so Nagle would hold each one until the client's delayed
+  // ACK of the last, tens of milliseconds later.
+  if (NULL == conn->connection.shm) {
+    const int one = 1;
+    setsockopt(conn->connection.sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+
+  ScanBatch* const batch = (ScanBatch*) malloc(sizeof(ScanBatch));
+  batch->conn = conn;
+  batch->request = request;
+  batch->n_keys = 0;
+  batch->body[0] = 0;
+  batch->len = 1;
+  if (NULL != lsm) {
+    lsm->scan(
+      scan_req->start(),
+      scan_req->start_len(),
+      scan_req->end(),
+      scan_req->end_len(),
+      scan_req->has_end(),
+      scan_req->limit(),
+      add_to_batch,
+      batch
     );
   } else {
-    rpc_send_resp(
-      connection,
-      request,
-      NULL,
-      0,
-      RpcStatus::NotFound,
-      log_fd
+    key_index.scan(
+      scan_req->start(),
+      scan_req->start_len(),
+      scan_req->end(),
+      scan_req->end_len(),
+      scan_req->has_end(),
+      scan_req->limit() == 0 ? SIZE_MAX : scan_req->limit(),
+      add_to_batch,
+      batch
     );
   }
+  phases_mark(request->phases, PHASE_HANDLED);
+
+  batch->body[0] = SCAN_LAST_BATCH;
+  send_batch(batch);
+  free(batch);
 }
 
-void handle_rpc_chksum(const Connection* const connection);
-void handle_rpc_delete(const Connection* const connection);
-void handle_rpc_stats(const Connection* const connection);
-void handle_rpc_reset(const Connection* const connection);
+// Where snapshots go: server-START_PORT.snap.
+char snapshot_fn[64];
+// Set while a snapshot is being written. One at a time.
+bool snapshot_running = false;
 
-RpcAction handle_rpc_conn(
-  const Connection* const connection,
-  const int log_fd
-) {
-  const uint16_t port = connection->server_port;
+static void add_to_snapshot(void* const arg, const char* const key, const size_t key_len, void* const value) {
+  SnapshotWriter* const writer = (SnapshotWriter*) arg;
+  const StoredValue* const stored = (const StoredValue*) value;
+  const uint8_t* bytes = stored->value;
+  const size_t len = stored->response.mark.data_len;
+  if (stored->spilled()) {
+    // The parent only ever appends to the blob file, so the bytes there are
+    // still the ones from when the child was forked.
+    static uint8_t* const spilled = (uint8_t*) malloc(MAX_VALUE_LEN);
+    if (-1 == blob_read(blobs, stored->blob_offset, spilled, len)) {
+      perror("couldn't read a spilled value for the snapshot");
+      _exit(1);
+    }
+    bytes = spilled;
+  }
+  if (-1 == snapshot_add(writer, key, key_len, bytes, len)) {
+    perror("couldn't write the snapshot");
+    _exit(1);
+  }
+}
+
+// Runs in the child. Writes the keystore it was forked with to snapshot_fn,
+// going through a temporary file so that a snapshot is never seen half
+// written, and reports how it went on result_fd.
+static void write_snapshot(const int result_fd, const uint64_t fork_start_us) {
+  const uint64_t private_at_start = private_pages();
+  char tmp_fn[sizeof(snapshot_fn) + 4];
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", snapshot_fn);
+  SnapshotWriter* const writer = snapshot_open(tmp_fn);
+  if (NULL == writer) {
+    perror("couldn't create the snapshot");
+    _exit(1);
+  }
+  keystore.for_each(add_to_snapshot, writer);
+
+  SnapshotResult result;
+  result.n_keys = writer->n_keys;
+  result.n_bytes = writer->n_bytes;
+  // The write buffer's pages are the child's own, not copies.
+  const uint64_t own_pages = SNAPSHOT_WRITE_LEN / sysconf(_SC_PAGESIZE);
+  const uint64_t private_at_end = private_pages();
+  result.cow_pages = private_at_end > private_at_start + own_pages
+    ? private_at_end - private_at_start - own_pages
+    : 0;
+  if (-1 == snapshot_close(writer) || -1 == rename(tmp_fn, snapshot_fn)) {
+    perror("couldn't write the snapshot");
+    _exit(1);
+  }
+  uint64_t now_us;
+  now_usec(&now_us);
+  result.duration_us = now_us - fork_start_us;
+  if (sizeof(result) != write(result_fd, &result, sizeof(result))) _exit(1);
+  _exit(0);
+}
+
+// A snapshot being written by a child, to be answered once it's done.
+struct SnapshotWait {
+  ConnState* conn;
+  RPCMessage request;
+  pid_t pid;
+  int result_fd;
+  uint64_t fork_us;
+};
+
+static void* wait_for_snapshot(void* const arg) {
+  SnapshotWait* const wait = (SnapshotWait*) arg;
+  SnapshotResult result;
+  bool ok = sizeof(result) == read(wait->result_fd, &result, sizeof(result));
+  close(wait->result_fd);
+  int status;
+  ok = -1 != waitpid(wait->pid, &status, 0) && ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  __atomic_store_n(&snapshot_running, false, __ATOMIC_RELEASE);
 
+  if (ok) {
+    result.fork_us = wait->fork_us;
+    VERBOSE(printf(
+      "snapshot: %lu keys, %lu bytes in %lu us (fork %lu us), %lu pages copied on write\n",
+      result.n_keys, result.n_bytes, result.duration_us, result.fork_us, result.cow_pages
+    ));
+    send_resp(wait->conn, &wait->request, (uint8_t*) &result, sizeof(result), RpcStatus::Ok);
+  } else {
+    send_resp(wait->conn, &wait->request, NULL, 0, RpcStatus::Failed);
+  }
+  remove_pending(wait->conn);
+  delete wait;
+  return NULL;
+}
+
+// Forks, and has the child write the keystore out while this process goes on
+// answering requests. The fork() is the only time writers are held up: it
+// copies the page tables under the keystore lock, so the child starts from a
+// consistent keystore. After that, both processes share the keystore's pages
+// until one of them writes to one, which copies it, so a snapshot costs at
+// most one more copy of the pages written to while it runs.
+//
+// Answers with a SnapshotResult once the child is done, from a thread of its
+// own, so as not to tie up a worker for that long. The LSM tree's files are
+// its own snapshot, so with it the RPC answers Failed.
+void handle_rpc_snapshot(ConnState* const conn, const RPCMessage* const request) {
+  phases_mark(request->phases, PHASE_PARSED);
+  if (NULL != lsm || __atomic_exchange_n(&snapshot_running, true, __ATOMIC_ACQUIRE)) {
+    send_resp(conn, request, NULL, 0, RpcStatus::Failed);
+    return;
+  }
+
+  int result_fds[2];
+  if (-1 == pipe(result_fds)) {
+    perror("couldn't snapshot");
+    __atomic_store_n(&snapshot_running, false, __ATOMIC_RELEASE);
+    send_resp(conn, request, NULL, 0, RpcStatus::Failed);
+    return;
+  }
+  uint64_t fork_start_us, fork_end_us;
+  pid_t pid;
+  {
+    SpinLock spinlock(&lock);
+    phases_mark(request->phases, PHASE_LOCKED);
+    now_usec(&fork_start_us);
+    pid = fork();
+    if (0 == pid) {
+      close(result_fds[0]);
+      write_snapshot(result_fds[1], fork_start_us);
+    }
+  }
+  now_usec(&fork_end_us);
+  close(result_fds[1]);
+  phases_mark(request->phases, PHASE_HANDLED);
+  if (-1 == pid) {
+    perror("couldn't fork");
+    close(result_fds[0]);
+    __atomic_store_n(&snapshot_running, false, __ATOMIC_RELEASE);
+    send_resp(conn, request, NULL, 0, RpcStatus::Failed);
+    return;
+  }
+
+  // The request outlives this call, but its body and phases don't.
+  SnapshotWait* const wait = new SnapshotWait{conn, *request, pid, result_fds[0], fork_end_us - fork_start_us};
+  wait->request.body = NULL;
+  wait->request.chunk = NULL;
+  wait->request.phases = NULL;
+  add_pending(conn);
+  pthread_t thread;
+  if (0 != pthread_create(&thread, NULL, wait_for_snapshot, wait)) {
+    // Wait here after all.
+    wait_for_snapshot(wait);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// Switches the connection to the wire format named by the one-byte body. The
+// response still goes out in the old format.
+void handle_rpc_wirefmt(ConnState* const conn, const RPCMessage* const request) {
+  if (request->mark.data_len != 1) {
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
+    return;
+  }
+  const WireFormat format = (WireFormat) request->body[0];
+  if (format != WireFormat::Full && format != WireFormat::Compact) {
+    send_resp(conn, request, NULL, 0, RpcStatus::BadArg);
+    return;
+  }
+  send_resp_now(conn, request, request->body, 1, RpcStatus::Ok);
+  conn->connection.wire_format = format;
+}
+
+void handle_rpc_chksum(ConnState* conn, const RPCMessage* request);
+void handle_rpc_stats(ConnState* conn, const RPCMessage* request);
+void handle_rpc_reset(ConnState* conn, const RPCMessage* request);
+
+typedef void (*RpcHandler)(ConnState* conn, const RPCMessage* request);
+
+struct RpcMethod {
+  const char* name;
+  RpcHandler handler;
+};
+
+// Methods that are answered by a handler. quit() is not in here, because it
+// is handled by the listener thread itself.
+const RpcMethod RPC_METHODS[] = {
+  {"ping",  handle_rpc_ping},
+  {"write", handle_rpc_write},
+  {"read",  handle_rpc_read},
+  {"delete", handle_rpc_delete},
+  {"scan",  handle_rpc_scan},
+  {"snapshot", handle_rpc_snapshot},
+  {"repl",  handle_rpc_repl},
+};
+
+constexpr int N_RPC_METHODS = sizeof(RPC_METHODS) / sizeof(RPC_METHODS[0]);
+
+// Returns NULL if the method is not recognized.
+RpcHandler find_handler(const char* const method) {
+  for (const RpcMethod& rpc_method : RPC_METHODS) {
+    if (strncmp(method, rpc_method.name, 8) == 0) return rpc_method.handler;
+  }
+  return NULL;
+}
+
+// Kernel events counted per RPC with -pmu, to see whether slow RPCs are the
+// ones that got preempted, faulted or moved. The cycle counter is a hardware
+// event, so it reads 0 where there is no PMU, as in most VMs.
+const PMUEvent RPC_EVENTS[] = {
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+};
+const char* const RPC_EVENT_NAMES[] = {"ctx_switches", "page_faults", "migrations", "cycles"};
+constexpr int N_RPC_EVENTS = sizeof(RPC_EVENTS) / sizeof(RPC_EVENTS[0]);
+
+// RPCs are bucketed by how long their handler ran, in powers of two of
+// microseconds: [0, 1), [1, 2), [2, 4), ..., and the last bucket has the rest.
+constexpr int N_DURATION_BUCKETS = 20;
+
+// Totals for the RPCs of one method in one duration bucket.
+struct RpcEventTotals {
+  uint64_t n_rpcs;
+  uint64_t events[N_RPC_EVENTS];
+};
+
+RpcEventTotals event_totals[N_RPC_METHODS][N_DURATION_BUCKETS];
+
+// Each thread that runs handlers counts its own events. NULL until its first
+// RPC, and left NULL if the counters can't be opened.
+thread_local PMUGroup* thread_events = NULL;
+thread_local bool thread_events_failed = false;
+
+PMUGroup* open_thread_events() {
+  if (NULL != thread_events || thread_events_failed) return thread_events;
+  PMUGroup* const group = new PMUGroup();
+  if (!OpenPMUGroup(RPC_EVENTS, N_RPC_EVENTS, group)) {
+    fprintf(stderr, "couldn't open the kernel event counters, not counting them: %m\n");
+    delete group;
+    thread_events_failed = true;
+    return NULL;
+  }
+  thread_events = group;
+  return group;
+}
+
+// Runs handler on request. With -pmu, reads this thread's event counters on
+// either side of it, and adds the difference to the totals for the method and
+// for how long it took.
+void run_handler(ConnState* const conn, const RpcHandler handler, const RPCMessage* const request) {
+  PMUGroup* const group = count_events ? open_thread_events() : NULL;
+  uint64_t before[N_RPC_EVENTS];
+  if (NULL == group || !ReadPMUGroup(group, before)) {
+    handler(conn, request);
+    return;
+  }
+  const uint64_t start_cycles = read_cycles();
+
+  handler(conn, request);
+
+  const uint64_t elapsed_us = (read_cycles() - start_cycles) / cycles_per_us();
+  uint64_t after[N_RPC_EVENTS];
+  if (!ReadPMUGroup(group, after)) return;
+
+  int method = 0;
+  while (method < N_RPC_METHODS && RPC_METHODS[method].handler != handler) ++method;
+  if (method == N_RPC_METHODS) return;
+  int bucket = elapsed_us == 0 ? 0 : 64 - __builtin_clzll(elapsed_us);
+  if (bucket >= N_DURATION_BUCKETS) bucket = N_DURATION_BUCKETS - 1;
+
+  RpcEventTotals& totals = event_totals[method][bucket];
+  __atomic_add_fetch(&totals.n_rpcs, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < N_RPC_EVENTS; ++i) {
+    __atomic_add_fetch(&totals.events[i], after[i] - before[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Prints the -pmu totals as events per RPC, by method and handler duration.
+void print_event_totals(FILE* const out) {
+  fprintf(out, "%-8s %-16s %10s", "method", "handler_us", "rpcs");
+  for (const char* name : RPC_EVENT_NAMES) fprintf(out, " %13s", name);
+  fprintf(out, "    (events per rpc)\n");
+
+  for (int method = 0; method < N_RPC_METHODS; ++method) {
+    for (int bucket = 0; bucket < N_DURATION_BUCKETS; ++bucket) {
+      const RpcEventTotals& totals = event_totals[method][bucket];
+      if (totals.n_rpcs == 0) continue;
+      char range[32];
+      if (bucket == 0) {
+        snprintf(range, sizeof(range), "[0, 1)");
+      } else if (bucket == N_DURATION_BUCKETS - 1) {
+        snprintf(range, sizeof(range), "[%lu, inf)", 1ul << (bucket - 1));
+      } else {
+        snprintf(range, sizeof(range), "[%lu, %lu)", 1ul << (bucket - 1), 1ul << bucket);
+      }
+      fprintf(out, "%-8s %-16s %10lu", RPC_METHODS[method].name, range, totals.n_rpcs);
+      for (const uint64_t events : totals.events) {
+        fprintf(out, " %13.3f", (double) events / totals.n_rpcs);
+      }
+      fprintf(out, "\n");
+    }
+  }
+}
+
+// A request that has been read off of a connection and is waiting for a
+// worker to answer it.
+struct RpcTask {
+  ConnState* conn;
+  RpcHandler handler;
+  RPCMessage message;
+  PhaseTimes phases;
+};
+
+void run_rpc_task(void* const arg) {
+  RpcTask* const task = (RpcTask*) arg;
+  ConnState* const conn = task->conn;
+  phases_mark(&task->phases, PHASE_STARTED);
+  run_handler(conn, task->handler, &task->message);
+  rpc_free_body(&task->message);
+  delete task;
+  remove_pending(conn);
+}
+
+// Blocks until every request read off of the connection has been answered.
+void wait_for_pending(ConnState* const conn) {
+  pthread_mutex_lock(&conn->pending_mutex);
+  while (conn->pending > 0) {
+    pthread_cond_wait(&conn->pending_cond, &conn->pending_mutex);
+  }
+  pthread_mutex_unlock(&conn->pending_mutex);
+}
+
+// Reads requests off of the connection and hands them to the executor, until
+// the client hangs up. Returns once every request has been answered.
+RpcAction handle_rpc_conn(ConnState* const conn) {
+  const uint16_t port = conn->connection.server_port;
+
+  RpcAction action = RpcAction::CONTINUE;
   while (true) {
     VERBOSE(printf("%d: listening for message\n", port));
     RPCMessage message;
-    if (-1 == rpc_recv_req(connection, &message)) break;
-    log(log_fd, &message);
+    PhaseTimes phases;
+    // Shared-memory connections spin on their own. See shm.h.
+    if (NULL != conn->busy_poll && NULL == conn->connection.shm
+        && 0 == conn_n_buffered(&conn->connection)) {
+      pollfd readable = {conn->connection.sock_fd, POLLIN, 0};
+      busy_poll_wait(conn->busy_poll, &readable, 1);
+    }
+    if (-1 == rpc_recv_req(&conn->connection, &message)) break;
+    phases_start(&phases);
+    log(conn->log_fd, &message);
+    if (conn->capture_fd >= 0) capture(conn->capture_fd, &message);
     VERBOSE({
       printf("%d ", port);
       message.pretty_print();
     });
 
     // Process command.
-    if (strncmp(message.header.method, "ping", 8) == 0) {
-      handle_rpc_ping(connection, &message, log_fd);
-    } else if (strncmp(message.header.method, "write", 8) == 0) {
-      handle_rpc_write(connection, &message, log_fd);
-    } else if (strncmp(message.header.method, "read", 8) == 0) {
-      handle_rpc_read(connection, &message, log_fd);
-    } else if (strncmp(message.header.method, "quit", 8) == 0) {
-      // On quit(), close socket.
-      rpc_send_resp(
-        connection,
-        &message,
-        NULL,
-        0,
-        RpcStatus::Ok,
-        log_fd
-      );
-      free(message.body);
-      return RpcAction::QUIT;
-    } else {
+    if (strncmp(message.header.method, "quit", 8) == 0) {
+      // On quit(), answer everything before it, then close socket.
+      wait_for_pending(conn);
+      send_resp_now(conn, &message, NULL, 0, RpcStatus::Ok);
+      rpc_free_body(&message);
+      action = RpcAction::QUIT;
+      break;
+    }
+
+    if (strncmp(message.header.method, "wirefmt", 8) == 0) {
+      // The format decides how the next request is read, so switch it here
+      // rather than on a worker, once the workers are done sending in the
+      // old one.
+      wait_for_pending(conn);
+      handle_rpc_wirefmt(conn, &message);
+      rpc_free_body(&message);
+      continue;
+    }
+
+    const RpcHandler handler = find_handler(message.header.method);
+    if (NULL == handler) {
       fprintf(stderr, "%d: unrecognized command \"%.8s\"", port, message.header.method);
-      return RpcAction::CONTINUE;
+      rpc_free_body(&message);
+      break;
+    }
+
+    if (NULL == executor) {
+      message.phases = &phases;
+      phases_mark(&phases, PHASE_STARTED);
+      run_handler(conn, handler, &message);
+      rpc_free_body(&message);
+      continue;
+    }
+
+    add_pending(conn);
+    RpcTask* const task = new RpcTask{conn, handler, message, phases};
+    task->message.phases = &task->phases;
+    executor->submit(Task{run_rpc_task, task});
+  }
+
+  wait_for_pending(conn);
+  VERBOSE(if (action == RpcAction::CONTINUE) printf("ending connection\n"));
+  return action;
+}
+
+// Responses the UDP thread of each port remembers, to answer requests that
+// are sent again. At 1.5 KB each, this covers a few milliseconds of traffic,
+// which is as long as a client waits before sending again.
+constexpr size_t UDP_REPLY_CACHE_LEN = 2048;
+
+// The methods answered over UDP: the ones whose single response goes out
+// before their handler returns.
+RpcHandler find_udp_handler(const char* const method) {
+  if (strncmp(method, "ping", 8) != 0
+      && strncmp(method, "read", 8) != 0
+      && strncmp(method, "write", 8) != 0) {
+    return NULL;
+  }
+  return find_handler(method);
+}
+
+// Prints what the calling thread's busy-polling cost it since start_wall_ns
+// and start_cpu_ns.
+void report_busy_poll(
+  const char* const name,
+  const uint16_t port,
+  const BusyPoll* const poller,
+  const uint64_t start_wall_ns,
+  const uint64_t start_cpu_ns
+) {
+  busy_poll_report(
+    stdout,
+    name,
+    port,
+    poller,
+    now_nsec(CLOCK_THREAD_CPUTIME_ID) - start_cpu_ns,
+    now_nsec() - start_wall_ns
+  );
+}
+
+struct UdpListenArgs {
+  uint16_t port;
+  int sock_fd;
+  int log_fd;
+  // Written to to stop the thread.
+  int stop_fd;
+  bool stopping = false;
+};
+
+// Answers the requests that arrive on a port's UDP socket, a batch at a time:
+// each recvmmsg() is answered with one sendmmsg(). The handlers run here
+// rather than on the workers, since they are short, and the batch can't go
+// out until they are all done.
+void* udp_listen_thread(void* const void_args) {
+  UdpListenArgs* const args = (UdpListenArgs*) void_args;
+  ConnState conn;
+  conn.log_fd = args->log_fd;
+  conn.connection.sock_fd = args->sock_fd;
+  conn.connection.server_port = htons(args->port);
+  UdpBatch* const requests = new UdpBatch();
+  conn.udp_out = new UdpBatch();
+  UdpReplyCache* const replies = new UdpReplyCache(UDP_REPLY_CACHE_LEN);
+  PhaseTimes phases[UDP_BATCH_MAX];
+  // The phases of each response in udp_out, or NULL for one sent again from
+  // the cache, which isn't logged again.
+  PhaseTimes* out_phases[UDP_BATCH_MAX];
+
+  BusyPoll* const poller = busy_poll_us >= 0 ? new BusyPoll(busy_poll_us) : NULL;
+  const uint64_t start_wall_ns = now_nsec();
+  const uint64_t start_cpu_ns = now_nsec(CLOCK_THREAD_CPUTIME_ID);
+
+  while (!__atomic_load_n(&args->stopping, __ATOMIC_ACQUIRE)) {
+    int timeout_ms = -1;
+    if (NULL != poller) {
+      pollfd fds[2] = {
+        {args->sock_fd, POLLIN, 0},
+        {args->stop_fd, POLLIN, 0},
+      };
+      busy_poll_wait(poller, fds, 2);
+      timeout_ms = 0;
+    }
+    const int n = udp_recv_batch(args->sock_fd, requests, timeout_ms, args->stop_fd);
+    if (-1 == n) {
+      fprintf(stderr, "%d: couldn't receive datagrams: %m\n", args->port);
+      break;
+    }
+
+    UdpBatch* const out = conn.udp_out;
+    out->n = 0;
+    for (int i = 0; i < n; ++i) {
+      RPCMessage request;
+      if (-1 == udp_decode(&requests->datagrams[i], &request)) continue;
+      phases_start(&phases[i]);
+      now_usec(&request.header.req_recv_time_us);
+      const sockaddr_in& peer = requests->datagrams[i].addr;
+
+      const UdpDatagram* const cached = replies->find(peer, request.header.rpc_id);
+      if (NULL != cached) {
+        VERBOSE(printf("%d: sending the response to rpc %u again\n", args->port, request.header.rpc_id));
+        out->datagrams[out->n] = *cached;
+        out_phases[out->n++] = NULL;
+        continue;
+      }
+
+      log(args->log_fd, &request);
+      VERBOSE({
+        printf("%d udp ", args->port);
+        request.pretty_print();
+      });
+      conn.udp_peer = peer;
+      request.phases = &phases[i];
+      const int n_out = out->n;
+      const RpcHandler handler = find_udp_handler(request.header.method);
+      if (NULL == handler) {
+        send_resp(&conn, &request, NULL, 0, RpcStatus::BadArg);
+      } else {
+        phases_mark(&phases[i], PHASE_STARTED);
+        run_handler(&conn, handler, &request);
+      }
+      if (out->n > n_out) {
+        out_phases[n_out] = &phases[i];
+        replies->add(out->datagrams[n_out], request.header.rpc_id);
+      }
     }
+    if (out->n == 0) continue;
 
-    free(message.body);
+    if (-1 == udp_send_batch(args->sock_fd, out)) {
+      fprintf(stderr, "%d: couldn't send datagrams: %m\n", args->port);
+    }
+    for (int i = 0; i < out->n; ++i) {
+      if (NULL == out_phases[i]) continue;
+      RPCMessage response;
+      udp_decode(&out->datagrams[i], &response);
+      response.phases = out_phases[i];
+      phases_mark(response.phases, PHASE_LAST_SENT);
+      log(args->log_fd, &response);
+    }
   }
 
-  VERBOSE(printf("ending connection\n"));
-  return RpcAction::CONTINUE;
+  if (NULL != poller) {
+    report_busy_poll("udp", args->port, poller, start_wall_ns, start_cpu_ns);
+    delete poller;
+  }
+  delete replies;
+  delete conn.udp_out;
+  delete requests;
+  return NULL;
 }
 
 void* rpc_listen(void* void_args) {
@@ -194,20 +1301,78 @@ void* rpc_listen(void* void_args) {
     fprintf(stderr, "%d: couldn't open listening socket: %s\n", args->port, errstr);
     return NULL;
   }
+  // Same-host clients can connect over shared memory instead. See shm.h.
+  int shm_listen_fd = shm_listen(args->port, SOCK_BACKLOG);
+  if (-1 == shm_listen_fd) {
+    fprintf(stderr, "%d: couldn't open shared-memory listening socket: %m\n", args->port);
+    close(listen_sock_fd);
+    return NULL;
+  }
   VERBOSE(printf("%d: listening!\n", args->port));
 
   char log_fn[128];
   snprintf(log_fn, 128, "server-%d.log", args->port);
-  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
-  int log_fd = creat(log_fn, RW_MODE);
+  int log_fd = log_open(log_fn, log_format);
   if (-1 == log_fd) {
     fprintf(stderr, "failed to open log file \"%s\": %m\n", log_fn);
     exit(1);
   }
 
+  int capture_fd = -1;
+  if (capture_requests) {
+    char capture_fn[128];
+    snprintf(capture_fn, 128, "server-%d.cap", args->port);
+    capture_fd = capture_open(capture_fn);
+    if (-1 == capture_fd) {
+      fprintf(stderr, "failed to open capture file \"%s\": %m\n", capture_fn);
+      exit(1);
+    }
+  }
+
+  UdpListenArgs udp_args;
+  pthread_t udp_thread;
+  if (serve_udp) {
+    udp_args.port = args->port;
+    udp_args.sock_fd = udp_listen(args->port);
+    udp_args.log_fd = log_fd;
+    udp_args.stop_fd = eventfd(0, 0);
+    if (-1 == udp_args.sock_fd || -1 == udp_args.stop_fd) {
+      fprintf(stderr, "%d: couldn't open UDP socket: %m\n", args->port);
+      exit(1);
+    }
+    if (0 != pthread_create(&udp_thread, NULL, udp_listen_thread, &udp_args)) {
+      fprintf(stderr, "%d: couldn't start the UDP thread\n", args->port);
+      exit(1);
+    }
+  }
+
+  BusyPoll* const poller = busy_poll_us >= 0 ? new BusyPoll(busy_poll_us) : NULL;
+  const uint64_t start_wall_ns = now_nsec();
+  const uint64_t start_cpu_ns = now_nsec(CLOCK_THREAD_CPUTIME_ID);
+
   while (true) {
-    Connection connection;
-    tcp_accept(listen_sock_fd, &connection);
+    ConnState conn;
+    conn.log_fd = log_fd;
+    conn.capture_fd = capture_fd;
+    conn.busy_poll = poller;
+    Connection& connection = conn.connection;
+
+    pollfd listen_fds[2] = {
+      {listen_sock_fd, POLLIN, 0},
+      {shm_listen_fd,  POLLIN, 0},
+    };
+    const int n_ready = NULL != poller
+      ? busy_poll_wait(poller, listen_fds, 2)
+      : poll(listen_fds, 2, -1);
+    if (-1 == n_ready) continue;
+    const int accepted = listen_fds[0].revents & POLLIN
+      ? tcp_accept(listen_sock_fd, &connection)
+      : shm_accept(shm_listen_fd, args->port, &connection);
+    if (-1 == accepted) continue;
+    if (so_busy_poll_us > 0 && NULL == connection.shm
+        && -1 == busy_poll_socket(connection.sock_fd, so_busy_poll_us)) {
+      fprintf(stderr, "%d: couldn't set SO_BUSY_POLL: %m\n", args->port);
+    }
     VERBOSE(printf(
       "%d: accepted connection from %d.%d.%d.%d:%d to %d.%d.%d.%d:%d\n",
       args->port,
@@ -223,16 +1388,38 @@ void* rpc_listen(void* void_args) {
       connection.server_port
     ));
 
+    // Shared-memory connections write their responses from the workers, as
+    // the sender thread can't wait for room in a ring without holding up the
+    // other connections.
+    if (NULL != scheduler && NULL == connection.shm) {
+      conn.flow = scheduler->add_flow(&connection, log_fd, &conn);
+    }
+
     // Handle as many RPCs as they send.
-    const auto action = handle_rpc_conn(&connection, log_fd);
-    close(connection.sock_fd);
+    const auto action = handle_rpc_conn(&conn);
+    if (NULL != conn.flow) scheduler->remove_flow(conn.flow);
+    conn_close(&connection);
     // TODO: Actually, quit() should kill the whole server.
     if (action == RpcAction::QUIT) break;
   }
 
   VERBOSE(printf("%d: closing, goodbye!\n", args->port));
+  if (NULL != poller) {
+    report_busy_poll("listener", args->port, poller, start_wall_ns, start_cpu_ns);
+    delete poller;
+  }
+  if (serve_udp) {
+    __atomic_store_n(&udp_args.stopping, true, __ATOMIC_RELEASE);
+    const uint64_t one = 1;
+    if (write(udp_args.stop_fd, &one, sizeof(one)) < 0) perror("couldn't stop the UDP thread");
+    pthread_join(udp_thread, NULL);
+    close(udp_args.sock_fd);
+    close(udp_args.stop_fd);
+  }
   close(listen_sock_fd);
-  close(log_fd);
+  close(shm_listen_fd);
+  if (-1 == log_close(log_fd)) fprintf(stderr, "failed to write log file \"%s\": %m\n", log_fn);
+  if (capture_fd >= 0) close(capture_fd);
   return NULL;
 }
 
@@ -240,39 +1427,264 @@ void usage(FILE* fd, const char* argv0) {
   fprintf(
     fd,
     "usage:\n"
-    "\t%s [-v] [START_PORT END_PORT]\n"
+    "\t%s [-v] [-workers N] [-pin CPU_LIST] [-pin-listeners CPU_LIST]\n"
+    "\t\t[-auto-pin] [-nic IFACE] [-no-smt] [-spill BYTES] [-chunk BYTES]\n"
+    "\t\t[-udp] [-busy-poll USEC] [-so-busy-poll USEC] [-capture] [-pmu]\n"
+    "\t\t[-log-format rows|columns]\n"
+    "\t\t[-replicate-to HOST:PORT]... [-sync] [-backup [-max-staleness MS]]\n"
+    "\t\t[-engine memory|lsm] [-lsm-dir DIR] [-coalesce-reads]\n"
+    "\t\t[START_PORT END_PORT]\n"
     "\n"
     "Opens a dedicated listening thread for each port in the inclusive range"
     " [START_PORT, END_PORT].\n"
     "START_PORT defaults to 12345.\n"
-    "END_PORT defaults to 12348.\n",
+    "END_PORT defaults to 12348.\n"
+    "\n"
+    "The listening threads only read requests. The requests are answered by a"
+    " pool of N work-stealing\n"
+    "worker threads, N defaulting to the number of online CPUs. With -workers 0,"
+    " each listening\n"
+    "thread answers its own requests.\n"
+    "\n"
+    "-pin pins worker i to the i-th CPU of CPU_LIST, wrapping around,"
+    " e.g. -pin 2,3,6-7.\n"
+    "-pin-listeners does the same for the listening thread of the i-th port.\n"
+    "-auto-pin pins the threads without a CPU_LIST to CPUs of their own:"
+    " listening threads first to the\n"
+    "CPUs that take the NIC's interrupts, then one hardware thread per core,"
+    " and workers to what is left.\n"
+    "-nic IFACE keeps them on IFACE's NUMA node, and -no-smt gives each worker"
+    " a core to itself while\n"
+    "there are enough cores. Both imply -auto-pin.\n"
+    "The placement of every thread is printed at startup.\n"
+    "\n"
+    "-spill keeps values longer than BYTES (default 65536) out of memory, in"
+    " server-START_PORT.blob,\n"
+    "which reads send from with sendfile(). -spill 0 keeps every value in"
+    " memory.\n"
+    "\n"
+    "-chunk sends responses from one sender thread, BYTES (default 65536) of"
+    " one connection's at a time,\n"
+    "taking turns between connections so that big responses don't hold up"
+    " small ones. Requests sent\n"
+    "with high priority are answered ahead of the rest. -chunk 0 has each"
+    " response written out in full\n"
+    "by the thread that answers it, as do shared-memory connections.\n"
+    "\n"
+    "-udp also answers ping, read and write requests sent to each port over"
+    " UDP, one per datagram, on\n"
+    "a thread per port. Responses that don't fit in a datagram come back"
+    " Failed.\n"
+    "\n"
+    "-busy-poll has the listening threads, and with -udp the UDP threads,"
+    " spin for up to USEC waiting\n"
+    "for connections and requests before blocking, to save the wakeup. The"
+    " spin shrinks while nothing\n"
+    "comes, down to blocking right away. On exit, each thread prints how often"
+    " spinning paid off and\n"
+    "the CPU it used. -busy-poll 0 never spins, but still prints, for"
+    " comparison.\n"
+    "-so-busy-poll sets SO_BUSY_POLL to USEC on accepted connections, so that"
+    " the kernel polls the NIC\n"
+    "before a blocking read sleeps. Above net.core.busy_read, it needs"
+    " CAP_NET_ADMIN.\n"
+    "\n"
+    "-replicate-to ships every write to the backup server listening on"
+    " HOST:PORT, which has to be started\n"
+    "with -backup, as it happens, from a thread of its own; give it once per"
+    " backup. The backup's\n"
+    "PORT is taken up by the primary's connection, so give it a port of its own"
+    " for that. A backup\n"
+    "that can't be reached for a second while there are writes to ship, that"
+    " stops answering for a\n"
+    "second, or that falls 64 MiB behind, is dropped. With -sync, writes are"
+    " answered only once every\n"
+    "backup not dropped has them.\n"
+    "-backup refuses writes from clients, answering them READ_ONLY, and serves"
+    " reads of what its\n"
+    "primary has shipped. With -max-staleness, it answers reads and scans"
+    " STALE if it was last up to\n"
+    "date with its primary more than MS milliseconds ago.\n"
+    "\n"
+    "-engine lsm keeps the keys and values in an LSM tree of files in DIR"
+    " (-lsm-dir, default\n"
+    "server-START_PORT.lsm) instead of in memory, and takes delete RPCs. It"
+    " starts out empty, can't\n"
+    "snapshot or replicate, and prints its write and read amplification on"
+    " exit.\n"
+    "-coalesce-reads has reads of a key that come while another read of it is"
+    " getting it from the tree\n"
+    "wait for that one's value and share its response, rather than each"
+    " getting the key. It prints\n"
+    "how many did on exit.\n"
+    "\n"
+    "-capture writes every request in full to server-PORT.cap, for replay.\n"
+    "\n"
+    "-log-format columns writes server-PORT.log in blocks of columns, several"
+    " times smaller than the\n"
+    "default 96-byte rows, and written out a block at a time. dumplogfile and"
+    " replay read either.\n"
+    "\n"
+    "-pmu counts the context switches, page faults, CPU migrations and cycles"
+    " of each RPC's handler,\n"
+    "and prints them per RPC by method and handler duration on exit. Needs"
+    " perf_event_paranoid <= 1.\n"
+    "\n"
+    "The snapshot RPC writes the keystore to server-START_PORT.snap from a"
+    " fork()ed child, while the server\n"
+    "goes on answering requests.\n",
     argv0
   );
 }
 
 struct Args {
   bool verbose = false;
+  bool capture = false;
+  LogFormat log_format = LogFormat::Rows;
+  bool udp = false;
+  bool pmu = false;
+  // -1 for no busy-polling.
+  int busy_poll_us = -1;
+  uint32_t so_busy_poll_us = 0;
+  std::vector<ReplBackupAddr> replicate_to;
+  bool sync = false;
+  bool backup = false;
+  // -1 for no bound.
+  int max_staleness_ms = -1;
+  bool lsm = false;
+  // NULL for server-START_PORT.lsm.
+  const char* lsm_dir = NULL;
+  bool coalesce_reads = false;
+  int n_workers;
+  // 0 for no spilling.
+  size_t spill_len = 64 * 1024;
+  // 0 for no scheduler.
+  size_t chunk_len = 64 * 1024;
+  PlacementConfig placement;
   int start_port;
   int end_port;
 };
 
 Args parse_args(int argc, const char* const* argv) {
   Args args;
+  args.n_workers = sysconf(_SC_NPROCESSORS_ONLN);
 
   const char* bin_name = argv[0];
   argc--; argv++;
 
-  if (argc > 0 && strcmp(argv[0], "-v") == 0) {
-    args.verbose = true;
-    argc--; argv++;
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0], "-v") == 0) {
+      args.verbose = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-capture") == 0) {
+      args.capture = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-log-format") == 0 && argc >= 2) {
+      if (strcmp(argv[1], "columns") == 0) {
+        args.log_format = LogFormat::Columns;
+      } else if (strcmp(argv[1], "rows") != 0) {
+        fprintf(stderr, "err: -log-format must be rows or columns, not \"%s\"\n", argv[1]);
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-udp") == 0) {
+      args.udp = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-replicate-to") == 0 && argc >= 2) {
+      const char* const colon = strrchr(argv[1], ':');
+      if (NULL == colon || atoi(colon + 1) <= 0) {
+        fprintf(stderr, "err: -replicate-to needs HOST:PORT, not \"%s\"\n", argv[1]);
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      args.replicate_to.push_back({strndup(argv[1], colon - argv[1]), (uint16_t) atoi(colon + 1)});
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-sync") == 0) {
+      args.sync = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-backup") == 0) {
+      args.backup = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-max-staleness") == 0 && argc >= 2) {
+      args.max_staleness_ms = atoi(argv[1]);
+      if (args.max_staleness_ms < 0) {
+        fprintf(stderr, "err: -max-staleness must not be negative\n");
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-engine") == 0 && argc >= 2) {
+      if (strcmp(argv[1], "lsm") == 0) {
+        args.lsm = true;
+      } else if (strcmp(argv[1], "memory") != 0) {
+        fprintf(stderr, "err: -engine must be memory or lsm, not \"%s\"\n", argv[1]);
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-lsm-dir") == 0 && argc >= 2) {
+      args.lsm_dir = argv[1];
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-coalesce-reads") == 0) {
+      args.coalesce_reads = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-busy-poll") == 0 && argc >= 2) {
+      args.busy_poll_us = atoi(argv[1]);
+      if (args.busy_poll_us < 0) {
+        fprintf(stderr, "err: -busy-poll must not be negative\n");
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-so-busy-poll") == 0 && argc >= 2) {
+      args.so_busy_poll_us = strtoul(argv[1], NULL, 10);
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-spill") == 0 && argc >= 2) {
+      args.spill_len = strtoull(argv[1], NULL, 10);
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-chunk") == 0 && argc >= 2) {
+      args.chunk_len = strtoull(argv[1], NULL, 10);
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-pmu") == 0) {
+      args.pmu = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-workers") == 0 && argc >= 2) {
+      args.n_workers = atoi(argv[1]);
+      argc -= 2; argv += 2;
+    } else if ((strcmp(argv[0], "-pin") == 0 || strcmp(argv[0], "-pin-listeners") == 0) && argc >= 2) {
+      std::vector<int>* const cpus = strcmp(argv[0], "-pin") == 0
+        ? &args.placement.worker_cpus
+        : &args.placement.listener_cpus;
+      if (!parse_cpu_list(argv[1], cpus)) {
+        fprintf(stderr, "err: couldn't parse CPU list \"%s\"\n", argv[1]);
+        usage(stderr, bin_name);
+        exit(1);
+      }
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-auto-pin") == 0) {
+      args.placement.auto_place = true;
+      argc--; argv++;
+    } else if (strcmp(argv[0], "-nic") == 0 && argc >= 2) {
+      args.placement.nic = argv[1];
+      args.placement.auto_place = true;
+      argc -= 2; argv += 2;
+    } else if (strcmp(argv[0], "-no-smt") == 0) {
+      args.placement.no_smt = true;
+      args.placement.auto_place = true;
+      argc--; argv++;
+    } else {
+      usage(stderr, bin_name);
+      exit(1);
+    }
   }
 
   if (argc == 0) {
     args.start_port = 12345;
     args.end_port   = 12348;
   } else if (argc == 2) {
-    args.start_port = atoi(argv[1]);
-    args.end_port   = atoi(argv[2]);
+    args.start_port = atoi(argv[0]);
+    args.end_port   = atoi(argv[1]);
   } else {
     usage(stderr, bin_name);
     exit(1);
@@ -290,13 +1702,117 @@ Args parse_args(int argc, const char* const* argv) {
     exit(1);
   }
 
+  if (args.backup && !args.replicate_to.empty()) {
+    fprintf(stderr, "err: a -backup can't -replicate-to backups of its own\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+  if (args.sync && args.replicate_to.empty()) {
+    fprintf(stderr, "err: -sync needs -replicate-to\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+  if (args.max_staleness_ms >= 0 && !args.backup) {
+    fprintf(stderr, "err: -max-staleness needs -backup\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+  if (args.lsm && (args.backup || !args.replicate_to.empty())) {
+    fprintf(stderr, "err: -engine lsm can't replicate\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+  if ((NULL != args.lsm_dir || args.coalesce_reads) && !args.lsm) {
+    fprintf(stderr, "err: -lsm-dir and -coalesce-reads need -engine lsm\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+
+  if (args.n_workers < 0) {
+    fprintf(stderr, "err: -workers must not be negative\n");
+    usage(stderr, bin_name);
+    exit(1);
+  }
+
   return args;
 }
 
 int main(int argc, char** argv) {
   Args args = parse_args(argc, argv);
   verbose = args.verbose;
+  capture_requests = args.capture;
+  log_format = args.log_format;
+  serve_udp = args.udp;
+  busy_poll_us = args.busy_poll_us;
+  is_backup = args.backup;
+  max_staleness_ms = args.max_staleness_ms;
+  sync_replication = args.sync;
+  so_busy_poll_us = args.so_busy_poll_us;
+  count_events = args.pmu;
+  snprintf(snapshot_fn, sizeof(snapshot_fn), "server-%d.snap", args.start_port);
+  if (args.lsm) {
+    char lsm_dir[64];
+    snprintf(lsm_dir, sizeof(lsm_dir), "server-%d.lsm", args.start_port);
+    const char* const dir = NULL != args.lsm_dir ? args.lsm_dir : lsm_dir;
+    lsm = LsmStore::Open(dir, LsmConfig());
+    if (NULL == lsm) {
+      fprintf(stderr, "failed to open the LSM tree in \"%s\": %m\n", dir);
+      exit(1);
+    }
+    if (args.coalesce_reads) lsm_reads = new SingleFlight();
+  } else if (args.spill_len > 0) {
+    char blob_fn[64];
+    snprintf(blob_fn, sizeof(blob_fn), "server-%d.blob", args.start_port);
+    blobs = blob_open(blob_fn);
+    if (NULL == blobs) {
+      fprintf(stderr, "failed to open blob file \"%s\": %m\n", blob_fn);
+      exit(1);
+    }
+    spill_len = args.spill_len;
+  }
   memset(&lock, 0, sizeof(LockAndHist));
+  // Calibrate the cycle counter now rather than on the first request.
+  cycles_per_us();
+
+  const int n_threads = args.end_port - args.start_port + 1;
+  Placement placement;
+  if (!plan_placement(args.placement, n_threads, args.n_workers, &placement)) {
+    perror(NULL != args.placement.nic && ENODEV == errno
+      ? "couldn't find the -nic interface"
+      : "couldn't pin threads to the CPUs asked for");
+    exit(1);
+  }
+  print_placement(stdout, placement, args.placement.nic, args.start_port, n_threads, args.n_workers);
+
+  if (args.n_workers > 0) {
+    ExecutorConfig config;
+    config.n_workers = args.n_workers;
+    config.cpus = placement.worker_cpus;
+    executor = Executor::Start(config);
+    if (NULL == executor) {
+      perror("couldn't start the worker threads");
+      exit(1);
+    }
+    VERBOSE(printf("main: started %d worker threads\n", args.n_workers));
+  }
+
+  if (args.chunk_len > 0) {
+    scheduler = SendScheduler::Start(args.chunk_len);
+    if (NULL == scheduler) {
+      perror("couldn't start the sender thread");
+      exit(1);
+    }
+  }
+
+  if (!args.replicate_to.empty()) {
+    ReplConfig config;
+    config.backups = args.replicate_to;
+    replication = ReplPrimary::Start(config);
+    if (NULL == replication) {
+      perror("couldn't start the replication threads");
+      exit(1);
+    }
+  }
 
   VERBOSE(printf(
     "Starting rpc_listen() threads for port ids [%d,%d].\n",
@@ -304,12 +1820,22 @@ int main(int argc, char** argv) {
     args.end_port
   ));
 
-  const int n_threads = args.end_port - args.start_port + 1;
   pthread_t* thread_ids = (pthread_t*) malloc(sizeof(pthread_t) * n_threads);
   for (int i = 0; i < n_threads; ++i) {
     int port = args.start_port + i;
     VERBOSE(printf("main: start thread for port %d\n", port));
-    if (0 != pthread_create(&thread_ids[i], NULL, rpc_listen, new ListenArgs(port))) { // error
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (!placement.listener_cpus.empty()) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(placement.listener_cpus[i % placement.listener_cpus.size()], &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    const int err = pthread_create(&thread_ids[i], &attr, rpc_listen, new ListenArgs(port));
+    pthread_attr_destroy(&attr);
+    if (0 != err) { // error
+      errno = err;
       perror("couldn't spawn the requested number of rpc_listen() threads");
       exit(1);
       // TODO: Will the child threads properly clean up their sockets on exit?
@@ -324,6 +1850,21 @@ int main(int argc, char** argv) {
     VERBOSE(printf("main: joined thread for port %d\n", args.start_port + i));
   }
 
+  if (NULL != executor) executor->shutdown();
+  if (NULL != replication) replication->shutdown(stdout);
+  if (NULL != scheduler) scheduler->shutdown();
+  if (NULL != lsm_reads) {
+    printf(
+      "coalesced reads: %lu of %lu waited on another's get\n",
+      lsm_reads->n_joined(),
+      lsm_reads->n_joined() + lsm_reads->n_led()
+    );
+  }
+  if (NULL != lsm) {
+    lsm->print_stats(stdout);
+    delete lsm;
+  }
+  if (count_events) print_event_totals(stdout);
   VERBOSE(puts("main: last thread joined; terminating\n"));
 
   return 0;
@@ -0,0 +1,213 @@
+#include "shard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+// FNV-1a, followed by MurmurHash3's finalizer to spread FNV's weak high bits
+// over the whole ring.
+static uint64_t hash_bytes(const char* const bytes, const size_t n_bytes) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < n_bytes; ++i) {
+    h ^= (uint8_t) bytes[i];
+    h *= 0x100000001b3ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+ConnectionPool::ConnectionPool(
+  const char* const server,
+  const uint16_t port,
+  const bool compact,
+  const int log_fd
+) : server_(server), port_(port), compact_(compact), log_fd_(log_fd) {}
+
+ConnectionPool::~ConnectionPool() {
+  for (Connection* const connection : idle_) {
+    conn_close(connection);
+    delete connection;
+  }
+}
+
+Connection* ConnectionPool::acquire() {
+  pthread_mutex_lock(&mutex_);
+  if (!idle_.empty()) {
+    Connection* const connection = idle_.back();
+    idle_.pop_back();
+    pthread_mutex_unlock(&mutex_);
+    return connection;
+  }
+  pthread_mutex_unlock(&mutex_);
+
+  Connection* const connection = new Connection();
+  if (-1 == net_connect(server_, port_, connection)) {
+    delete connection;
+    return NULL;
+  }
+  if (compact_ && -1 == rpc_negotiate_compact(connection, log_fd_)) {
+    conn_close(connection);
+    delete connection;
+    return NULL;
+  }
+  return connection;
+}
+
+void ConnectionPool::release(Connection* const connection, const bool broken) {
+  if (broken) {
+    conn_close(connection);
+    delete connection;
+    return;
+  }
+  pthread_mutex_lock(&mutex_);
+  idle_.push_back(connection);
+  pthread_mutex_unlock(&mutex_);
+}
+
+ShardedClient::ShardedClient(const int vnodes, const bool compact, const int log_fd)
+  : vnodes_(vnodes), compact_(compact), log_fd_(log_fd) {}
+
+ShardedClient::~ShardedClient() {
+  for (Endpoint& endpoint : endpoints_) delete endpoint.pool;
+}
+
+int ShardedClient::add_endpoint(const char* const server, const uint16_t port) {
+  ConnectionPool* const pool = new ConnectionPool(server, port, compact_, log_fd_);
+  // Connect now, both to fail early and so that the first RPC's latency
+  // doesn't include it.
+  Connection* const connection = pool->acquire();
+  if (NULL == connection) {
+    delete pool;
+    return -1;
+  }
+  pool->release(connection, /*broken=*/false);
+
+  const int index = endpoints_.size();
+  endpoints_.push_back(Endpoint{pool, 0});
+
+  previous_ring_ = ring_;
+  for (int i = 0; i < vnodes_; ++i) {
+    char name[128];
+    const int len = snprintf(name, sizeof(name), "%s:%u#%d", server, port, i);
+    ring_.push_back(RingPoint{hash_bytes(name, len), index});
+  }
+  std::sort(ring_.begin(), ring_.end());
+  return index;
+}
+
+int ShardedClient::owner_on(const std::vector<RingPoint>& ring, const uint64_t hash) {
+  // The first point at or after the hash, wrapping around.
+  auto iter = std::lower_bound(ring.begin(), ring.end(), RingPoint{hash, 0});
+  if (iter == ring.end()) iter = ring.begin();
+  return iter->endpoint;
+}
+
+int ShardedClient::owner(const char* const key, const size_t key_len) const {
+  return owner_on(ring_, hash_bytes(key, key_len));
+}
+
+int ShardedClient::previous_owner(const uint64_t hash, const int owner) const {
+  if (previous_ring_.empty()) return -1;
+  const int previous = owner_on(previous_ring_, hash);
+  return previous == owner ? -1 : previous;
+}
+
+int ShardedClient::call(
+  const int endpoint,
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const char* const method,
+  RPCMessage* const response
+) {
+  ConnectionPool* const pool = endpoints_[endpoint].pool;
+  Connection* const connection = pool->acquire();
+  if (NULL == connection) return -1;
+
+  const bool ok = -1 != rpc_send_req(connection, body, n_bytes, /*parent_rpc=*/0, method, log_fd_)
+    && -1 != rpc_recv_resp(connection, response);
+  pool->release(connection, /*broken=*/!ok);
+  if (!ok) return -1;
+
+  __atomic_add_fetch(&endpoints_[endpoint].n_rpcs, 1, __ATOMIC_RELAXED);
+  if (log_fd_ >= 0) log(log_fd_, response);
+  return 0;
+}
+
+// Writes key and value to endpoint. Returns -1 on error, including the
+// endpoint refusing the write.
+static int copy_to(
+  ShardedClient* const client,
+  const int endpoint,
+  const char* const key,
+  const size_t key_len,
+  const uint8_t* const value,
+  const size_t value_len
+) {
+  WriteRequest* const request = WriteRequest::Make(key, key_len, (const char*) value, value_len);
+  if (NULL == request) return -1;
+  RPCMessage response;
+  const int result = client->call(endpoint, (uint8_t*) request, request->full_len(), "write", &response);
+  free(request);
+  if (-1 == result) return -1;
+  rpc_free_body(&response);
+  return response.header.status == RpcStatus::Ok ? 0 : -1;
+}
+
+int ShardedClient::read(const char* const key, const size_t key_len, RPCMessage* const response) {
+  const uint64_t hash = hash_bytes(key, key_len);
+  const int endpoint = owner_on(ring_, hash);
+  if (-1 == call(endpoint, (const uint8_t*) key, key_len, "read", response)) return -1;
+  if (response->header.status != RpcStatus::NotFound) return 0;
+
+  const int previous = previous_owner(hash, endpoint);
+  if (previous < 0) return 0;
+  RPCMessage old_response;
+  if (-1 == call(previous, (const uint8_t*) key, key_len, "read", &old_response)) return -1;
+  if (old_response.header.status != RpcStatus::Ok) {
+    rpc_free_body(&old_response);
+    return 0;
+  }
+
+  // Found it where it used to live. Answer with that, and move it in.
+  if (-1 == copy_to(this, endpoint, key, key_len, old_response.body, old_response.mark.data_len)) {
+    rpc_free_body(&old_response);
+    return -1;
+  }
+  rpc_free_body(response);
+  *response = old_response;
+  return 0;
+}
+
+int ShardedClient::write(WriteRequest* const request, RPCMessage* const response) {
+  const int endpoint = owner(request->key(), request->key_len());
+  return call(endpoint, (uint8_t*) request, request->full_len(), "write", response);
+}
+
+int ShardedClient::migrate(const char* const key, const size_t key_len) {
+  const uint64_t hash = hash_bytes(key, key_len);
+  const int endpoint = owner_on(ring_, hash);
+  const int previous = previous_owner(hash, endpoint);
+  if (previous < 0) return 0;
+
+  RPCMessage response;
+  if (-1 == call(endpoint, (const uint8_t*) key, key_len, "read", &response)) return -1;
+  rpc_free_body(&response);
+  if (response.header.status == RpcStatus::Ok) return 0;
+
+  if (-1 == call(previous, (const uint8_t*) key, key_len, "read", &response)) return -1;
+  if (response.header.status != RpcStatus::Ok) {
+    rpc_free_body(&response);
+    return 0;
+  }
+  const int result = copy_to(this, endpoint, key, key_len, response.body, response.mark.data_len);
+  rpc_free_body(&response);
+  return result == -1 ? -1 : 1;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "my_rpc.h"
+#include "network.h"
+#include "rpc.h"
+
+// Client-side sharding of the keystore over several server endpoints, e.g.
+// the ports of one server's START_PORT..END_PORT range, with no proxy in
+// between.
+//
+// Keys are placed on a consistent-hash ring: each endpoint owns the arcs that
+// end at its virtual nodes, vnodes points hashed from its address, and a key
+// belongs to the endpoint owning the arc its hash lands on. Adding an endpoint
+// takes over about 1/n of the keys, all from the endpoints it lands between,
+// and leaves every other key where it was.
+//
+// After an add, a moved key's value is still on its old owner. read() falls
+// back to the owner from before the last add if the new owner doesn't have
+// the key, and copies it over if found there; migrate() does the same for a
+// key up front. Old copies are left behind, since there is no delete RPC.
+
+// Idle connections to one endpoint, for reuse by later RPCs.
+//
+// The server answers one connection per port at a time, so a single-threaded
+// caller should stick to one connection per endpoint, which acquire() and
+// release() do naturally: a connection is only opened if none is idle.
+class ConnectionPool {
+public:
+  ConnectionPool(const char* server, uint16_t port, bool compact, int log_fd);
+  ~ConnectionPool();
+
+  // Returns an idle connection, or a new one if there are none.
+  //
+  // Returns NULL if a new one can't be opened.
+  Connection* acquire();
+
+  // Returns connection to the pool, or closes it if broken is set.
+  void release(Connection* connection, bool broken);
+
+  const char* server() const { return server_; }
+  uint16_t port() const { return port_; }
+
+private:
+  const char* server_;
+  uint16_t port_;
+  bool compact_;
+  int log_fd_;
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  std::vector<Connection*> idle_;
+};
+
+class ShardedClient {
+public:
+  // Each endpoint gets vnodes points on the ring. More spread the keys more
+  // evenly, at the cost of a bigger ring to search. Requests and responses
+  // are logged to log_fd, unless it is negative.
+  ShardedClient(int vnodes, bool compact, int log_fd);
+  ~ShardedClient();
+
+  // Connects to server:port and places it on the ring, taking over some keys
+  // from the endpoints already there. Not safe to call concurrently with
+  // RPCs.
+  //
+  // Returns the new endpoint's index, or -1 if it can't be connected to.
+  int add_endpoint(const char* server, uint16_t port);
+
+  size_t n_endpoints() const { return endpoints_.size(); }
+  const ConnectionPool& endpoint(int i) const { return *endpoints_[i].pool; }
+  uint64_t n_rpcs(int i) const { return endpoints_[i].n_rpcs; }
+
+  // Returns the index of the endpoint that owns key.
+  int owner(const char* key, size_t key_len) const;
+
+  // Sends a request to the given endpoint and waits for the response. The
+  // response body is malloc()ed.
+  //
+  // Returns 0 if successful, and -1 otherwise.
+  int call(
+    int endpoint,
+    const uint8_t* body,
+    size_t n_bytes,
+    const char* method,
+    RPCMessage* response
+  );
+
+  // Reads key from its owner, falling back to its previous owner as above.
+  int read(const char* key, size_t key_len, RPCMessage* response);
+
+  // Writes request's key on its owner.
+  int write(WriteRequest* request, RPCMessage* response);
+
+  // Copies key from its previous owner to its current one, if the last
+  // add_endpoint() moved it and the new owner doesn't already have it.
+  //
+  // Returns 1 if the key was copied, 0 if there was nothing to do, and -1 on
+  // error.
+  int migrate(const char* key, size_t key_len);
+
+private:
+  struct RingPoint {
+    uint64_t hash;
+    int endpoint;
+
+    bool operator<(const RingPoint& other) const { return hash < other.hash; }
+  };
+
+  struct Endpoint {
+    ConnectionPool* pool;
+    uint64_t n_rpcs;
+  };
+
+  static int owner_on(const std::vector<RingPoint>& ring, uint64_t hash);
+
+  // The previous owner of the key with the given hash, or -1 if it hasn't
+  // changed owners.
+  int previous_owner(uint64_t hash, int owner) const;
+
+  int vnodes_;
+  bool compact_;
+  int log_fd_;
+  std::vector<Endpoint> endpoints_;
+  // Sorted by hash.
+  std::vector<RingPoint> ring_;
+  // The ring before the last add_endpoint().
+  std::vector<RingPoint> previous_ring_;
+};
@@ -0,0 +1,371 @@
+#include "shm.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Spin budget for a wait, in polls of the ring. Starts at SPIN_INITIAL and
+// adapts between SPIN_MIN and SPIN_MAX.
+constexpr uint32_t SPIN_MIN     = 64;
+constexpr uint32_t SPIN_INITIAL = 4096;
+constexpr uint32_t SPIN_MAX     = 64 * 1024;
+
+// How long a sleeping wait lasts before it checks whether the peer is still
+// there. A peer that dies can't set closed or wake us, but the kernel closes
+// its end of the Unix socket.
+constexpr long PEER_CHECK_NSEC = 50 * 1000 * 1000;
+
+// One direction of a channel. Lives in the shared mapping.
+//
+// head and tail count bytes ever written and read, so the ring holds
+// head - tail bytes starting at data[tail % SHM_RING_SIZE]. Each is written by
+// only one side, and they sit on separate cache lines so the two sides don't
+// fight over one.
+struct ShmRing {
+  alignas(64) uint64_t head;
+  alignas(64) uint64_t tail;
+
+  // Futex words, bumped by one side every time it wakes the other. The
+  // *_sleeping flags say whether anyone is (about to be) waiting on them.
+  alignas(64) uint32_t data_seq;
+  uint32_t reader_sleeping;
+  uint32_t space_seq;
+  uint32_t writer_sleeping;
+
+  // Set by either side on close.
+  uint32_t closed;
+
+  alignas(64) uint8_t data[SHM_RING_SIZE];
+};
+
+// The whole shared mapping. rings[0] carries client-to-server bytes and
+// rings[1] server-to-client bytes.
+struct ShmRegion {
+  ShmRing rings[2];
+};
+
+struct ShmChannel {
+  ShmRegion* region;
+  ShmRing* tx;
+  ShmRing* rx;
+
+  // The connection's Unix socket, polled for hangup while waiting. Owned by
+  // the Connection, not the channel.
+  int sock_fd;
+
+  // Adaptive spin budgets for waiting on rx data and on tx space.
+  uint32_t read_spins = SPIN_INITIAL;
+  uint32_t write_spins = SPIN_INITIAL;
+};
+
+bool is_shm_addr(const char* const server_addr_str) {
+  return strncmp(server_addr_str, SHM_ADDR_PREFIX, strlen(SHM_ADDR_PREFIX)) == 0;
+}
+
+static inline void cpu_relax() {
+#ifdef __x86_64__
+  __builtin_ia32_pause();
+#endif
+}
+
+// Sleeps while *word == expected, for at most timeout. Returns true if the
+// wait timed out.
+static bool futex_wait(uint32_t* const word, const uint32_t expected, const timespec* const timeout) {
+  // Not FUTEX_PRIVATE_FLAG: the word is shared with another process.
+  return -1 == syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout, NULL, 0)
+    && ETIMEDOUT == errno;
+}
+
+static void futex_wake(uint32_t* const word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Returns true if the peer has closed its end of sock_fd, which the kernel
+// does when the peer process dies.
+static bool peer_hung_up(const int sock_fd) {
+  pollfd pfd = {sock_fd, POLLRDHUP, 0};
+  return 1 == poll(&pfd, 1, 0) && (pfd.revents & (POLLRDHUP|POLLHUP|POLLERR));
+}
+
+// Waits until ready() or the ring is closed, spinning for up to *spins polls
+// and then sleeping on *seq. Adjusts *spins for next time.
+//
+// If the peer hangs up sock_fd while we sleep, marks the ring closed, so that
+// a dead peer looks the same as one that called shm_close().
+template <typename Ready>
+static void wait_for(
+  ShmRing* const ring,
+  const int sock_fd,
+  uint32_t* const seq,
+  uint32_t* const sleeping,
+  uint32_t* const spins,
+  Ready ready
+) {
+  for (uint32_t i = 0; i < *spins; ++i) {
+    if (ready() || __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+      if (*spins < SPIN_MAX) *spins *= 2;
+      return;
+    }
+    cpu_relax();
+  }
+  if (*spins > SPIN_MIN) *spins /= 2;
+
+  while (true) {
+    const uint32_t seen_seq = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+    // Pairs with the check of *sleeping in wake_if_sleeping(): either the peer
+    // sees that we're going to sleep and bumps *seq, or we see its update.
+    __atomic_store_n(sleeping, 1, __ATOMIC_SEQ_CST);
+    if (ready() || __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) break;
+    const timespec timeout = {0, PEER_CHECK_NSEC};
+    if (futex_wait(seq, seen_seq, &timeout) && peer_hung_up(sock_fd)) {
+      __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+      errno = ECONNRESET;
+      break;
+    }
+    __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+  __atomic_store_n(sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static void wake_if_sleeping(uint32_t* const seq, uint32_t* const sleeping) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(sleeping, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(seq);
+  }
+}
+
+int shm_readn(ShmChannel* const channel, void* const buf, size_t n_bytes) {
+  ShmRing* const ring = channel->rx;
+  uint8_t* out = (uint8_t*) buf;
+  const uint64_t tail = ring->tail;
+  uint64_t pos = tail;
+
+  while (n_bytes > 0) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == pos) {
+      wait_for(ring, channel->sock_fd, &ring->data_seq, &ring->reader_sleeping, &channel->read_spins,
+               [&]() { return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != pos; });
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      if (head == pos) return -1; // Closed.
+    }
+
+    const size_t offset = pos % SHM_RING_SIZE;
+    size_t n = head - pos;
+    if (n > n_bytes) n = n_bytes;
+    if (n > SHM_RING_SIZE - offset) n = SHM_RING_SIZE - offset;
+    memcpy(out, ring->data + offset, n);
+    out     += n;
+    pos     += n;
+    n_bytes -= n;
+
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+    wake_if_sleeping(&ring->space_seq, &ring->writer_sleeping);
+  }
+  return 0;
+}
+
+int shm_write(ShmChannel* const channel, const void* const buf, size_t n_bytes) {
+  ShmRing* const ring = channel->tx;
+  const uint8_t* in = (const uint8_t*) buf;
+  uint64_t pos = ring->head;
+
+  while (n_bytes > 0) {
+    if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) return -1;
+
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (pos - tail == SHM_RING_SIZE) {
+      wait_for(ring, channel->sock_fd, &ring->space_seq, &ring->writer_sleeping, &channel->write_spins,
+               [&]() { return pos - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < SHM_RING_SIZE; });
+      continue;
+    }
+
+    const size_t offset = pos % SHM_RING_SIZE;
+    size_t n = SHM_RING_SIZE - (pos - tail);
+    if (n > n_bytes) n = n_bytes;
+    if (n > SHM_RING_SIZE - offset) n = SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, in, n);
+    in      += n;
+    pos     += n;
+    n_bytes -= n;
+
+    __atomic_store_n(&ring->head, pos, __ATOMIC_RELEASE);
+    wake_if_sleeping(&ring->data_seq, &ring->reader_sleeping);
+  }
+  return 0;
+}
+
+void shm_close(ShmChannel* const channel) {
+  ShmRing* const rings[2] = {channel->tx, channel->rx};
+  for (ShmRing* ring : rings) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&ring->data_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->data_seq);
+    __atomic_add_fetch(&ring->space_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&ring->space_seq);
+  }
+  munmap(channel->region, sizeof(ShmRegion));
+  delete channel;
+}
+
+// Fills in the abstract Unix socket address that the server listens on for
+// shared-memory connections for port.
+static socklen_t shm_sock_addr(const int port, sockaddr_un* const addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // A leading NUL puts the name in the abstract namespace, so there's no
+  // socket file to clean up.
+  const int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "usd-shm-%d", port);
+  return offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+static ShmChannel* map_channel(const int memfd, const int sock_fd, const bool is_server) {
+  void* mem = mmap(NULL, sizeof(ShmRegion), PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (MAP_FAILED == mem) return NULL;
+
+  ShmChannel* channel = new ShmChannel();
+  channel->region = (ShmRegion*) mem;
+  channel->tx = &channel->region->rings[is_server ? 1 : 0];
+  channel->rx = &channel->region->rings[is_server ? 0 : 1];
+  channel->sock_fd = sock_fd;
+  return channel;
+}
+
+// Fills in the Connection fields that TCP would get from the socket addresses.
+// Ports are in network byte order, as with TCP.
+static void fill_local_addrs(Connection* const conn, const int server_port, const int client_port) {
+  conn->server_ip   = htonl(INADDR_LOOPBACK);
+  conn->client_ip   = htonl(INADDR_LOOPBACK);
+  conn->server_port = htons(server_port);
+  conn->client_port = htons(client_port);
+}
+
+int shm_connect(const int server_port, Connection* const out_conn) {
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == sock_fd) return -1;
+
+  sockaddr_un addr;
+  const socklen_t addr_len = shm_sock_addr(server_port, &addr);
+  if (-1 == connect(sock_fd, (sockaddr*) &addr, addr_len)) {
+    int err_save = errno;
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  // The rings start out zeroed, which is a valid empty state.
+  int memfd = memfd_create("usd-shm", 0);
+  if (-1 == memfd || -1 == ftruncate(memfd, sizeof(ShmRegion))) {
+    int err_save = errno;
+    if (memfd != -1) close(memfd);
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  // Pass the memfd to the server, along with one byte of real data, since
+  // ancillary data can't be sent by itself.
+  uint8_t byte = 0;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+  ShmChannel* channel = NULL;
+  if (1 == sendmsg(sock_fd, &msg, 0)) channel = map_channel(memfd, sock_fd, /*is_server=*/false);
+  int err_save = errno;
+  close(memfd);
+  if (NULL == channel) {
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  out_conn->sock_fd = sock_fd;
+  out_conn->shm = channel;
+  fill_local_addrs(out_conn, server_port, getpid());
+  return 0;
+}
+
+int shm_listen(const uint16_t port, const int backlog) {
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (-1 == sock_fd) return -1;
+
+  sockaddr_un addr;
+  const socklen_t addr_len = shm_sock_addr(port, &addr);
+  if (-1 == bind(sock_fd, (sockaddr*) &addr, addr_len)
+      || -1 == listen(sock_fd, backlog)) {
+    const int err_save = errno;
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+  return sock_fd;
+}
+
+int shm_accept(const int listen_fd, const uint16_t server_port, Connection* const connection) {
+  int sock_fd = accept(listen_fd, NULL, NULL);
+  if (-1 == sock_fd) return -1;
+
+  uint8_t byte;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (1 != recvmsg(sock_fd, &msg, 0)) {
+    int err_save = errno;
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (NULL == cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+    close(sock_fd);
+    errno = EPROTO;
+    return -1;
+  }
+  int memfd;
+  memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+  ShmChannel* channel = map_channel(memfd, sock_fd, /*is_server=*/true);
+  int err_save = errno;
+  close(memfd);
+  if (NULL == channel) {
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  ucred peer;
+  socklen_t peer_len = sizeof(peer);
+  if (-1 == getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len)) {
+    peer.pid = 0;
+  }
+
+  connection->sock_fd = sock_fd;
+  connection->shm = channel;
+  fill_local_addrs(connection, server_port, peer.pid);
+  return 0;
+}
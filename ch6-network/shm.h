@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+
+// Shared-memory transport for a client and server on the same host.
+//
+// A connection is a pair of single-producer, single-consumer byte rings, one
+// per direction, in a memfd that the client creates and hands to the server
+// over a Unix domain socket. The Unix socket stays open for the life of the
+// connection, but no RPC bytes go through it.
+//
+// A reader with nothing to read, or a writer with no room to write, spins for
+// a while and then sleeps on a futex in the shared memory. The peer only makes
+// the futex syscall to wake it if it actually went to sleep. How long to spin
+// adapts: each end spins longer after waits that spinning satisfied, and
+// shorter after waits that ended up sleeping anyway.
+//
+// A sleeping end wakes every so often to check the Unix socket, and treats a
+// hangup there, e.g. because the peer process died, as if the peer had closed
+// the channel.
+
+// Prefix of a server address that selects this transport, e.g. "shm:local".
+constexpr char SHM_ADDR_PREFIX[] = "shm:";
+
+// Bytes in each direction's ring. A larger message streams through it.
+constexpr size_t SHM_RING_SIZE = 1 << 20;
+
+struct ShmChannel;
+
+// Returns true if server_addr_str selects the shared-memory transport.
+bool is_shm_addr(const char* server_addr_str);
+
+// Connects to the server on this host that is listening for shared-memory
+// connections for server_port.
+//
+// Returns 0 if successful, and -1 otherwise.
+int shm_connect(int server_port, Connection* out_conn);
+
+// Listens for shared-memory connections for server_port. Returns the
+// listening file descriptor, or -1 on error.
+int shm_listen(uint16_t server_port, int backlog);
+
+// Accepts a shared-memory connection on a socket from shm_listen(server_port).
+int shm_accept(int listen_fd, uint16_t server_port, Connection* connection);
+
+// Read exactly n bytes from the channel into buf.
+//
+// Return -1 if the peer closes the channel or dies first.
+int shm_readn(ShmChannel* channel, void* buf, size_t n_bytes);
+
+// Write all n bytes of buf to the channel.
+//
+// Return -1 if the peer closes the channel or dies first.
+int shm_write(ShmChannel* channel, const void* buf, size_t n_bytes);
+
+// Closes the channel, waking the peer if it is waiting on us.
+void shm_close(ShmChannel* channel);
@@ -0,0 +1,56 @@
+#include "singleflight.h"
+
+struct SingleFlight::Flight {
+  std::string key;
+  // Cleared by forget(), once the flight is no longer in flights_.
+  bool joinable;
+
+  struct Follower {
+    Callback done;
+    void* arg;
+  };
+  std::vector<Follower> followers;
+};
+
+SingleFlight::Flight* SingleFlight::join(
+  const char* const key,
+  const size_t key_len,
+  const Callback done,
+  void* const arg
+) {
+  std::string wanted(key, key_len);
+  pthread_mutex_lock(&mutex_);
+  const auto found = flights_.find(wanted);
+  if (found != flights_.end()) {
+    found->second->followers.push_back(Flight::Follower{done, arg});
+    __atomic_add_fetch(&n_joined_, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&mutex_);
+    return NULL;
+  }
+  Flight* const flight = new Flight();
+  flight->key = std::move(wanted);
+  flight->joinable = true;
+  flights_.emplace(flight->key, flight);
+  __atomic_add_fetch(&n_led_, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&mutex_);
+  return flight;
+}
+
+void SingleFlight::finish(Flight* const flight, void* const result) {
+  pthread_mutex_lock(&mutex_);
+  if (flight->joinable) flights_.erase(flight->key);
+  pthread_mutex_unlock(&mutex_);
+  // No one can join it any more, so its followers are all there.
+  for (const Flight::Follower& follower : flight->followers) follower.done(follower.arg, result);
+  delete flight;
+}
+
+void SingleFlight::forget(const char* const key, const size_t key_len) {
+  pthread_mutex_lock(&mutex_);
+  const auto found = flights_.find(std::string(key, key_len));
+  if (found != flights_.end()) {
+    found->second->joinable = false;
+    flights_.erase(found);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Coalescing of concurrent calls for the same key into one.
+//
+// The first caller for a key leads a flight: it does the work, e.g. a lookup
+// that has to read from disk, and passes the result to finish(). Callers for
+// the same key that come while it is in flight join it instead of repeating
+// the work, and are called back with the leader's result from finish(). A
+// thundering herd of reads of one key then costs one lookup.
+//
+// A follower must not see a result older than a write that finished before
+// it joined, so a write to a key forget()s the flight in flight for it: calls
+// from then on start a flight of their own, while the ones that had joined
+// still get the old result, which they were concurrent with.
+class SingleFlight {
+public:
+  typedef void (*Callback)(void* arg, void* result);
+
+  struct Flight;
+
+  SingleFlight() = default;
+  SingleFlight(const SingleFlight&) = delete;
+  SingleFlight& operator=(const SingleFlight&) = delete;
+
+  // If a flight for key is in the air, queues done(arg, result) to be called
+  // with its result and returns NULL. Otherwise returns a new flight that the
+  // caller leads, and has to finish().
+  Flight* join(const char* key, size_t key_len, Callback done, void* arg);
+
+  // Calls back the flight's followers with result, from this thread, and
+  // frees the flight.
+  void finish(Flight* flight, void* result);
+
+  // Keeps calls for key from joining the flight in the air for it, if any.
+  void forget(const char* key, size_t key_len);
+
+  // Totals since the start: flights led, and calls that joined one.
+  uint64_t n_led() const { return __atomic_load_n(&n_led_, __ATOMIC_RELAXED); }
+  uint64_t n_joined() const { return __atomic_load_n(&n_joined_, __ATOMIC_RELAXED); }
+
+private:
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  std::unordered_map<std::string, Flight*> flights_;
+  uint64_t n_led_ = 0;
+  uint64_t n_joined_ = 0;
+};
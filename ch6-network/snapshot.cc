@@ -0,0 +1,97 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int write_all(const int fd, const uint8_t* buf, size_t n_bytes) {
+  while (n_bytes > 0) {
+    const ssize_t n = write(fd, buf, n_bytes);
+    if (n < 0) return -1;
+    buf += n;
+    n_bytes -= n;
+  }
+  return 0;
+}
+
+static int flush(SnapshotWriter* const writer) {
+  if (-1 == write_all(writer->fd, writer->buf, writer->used)) return -1;
+  writer->used = 0;
+  return 0;
+}
+
+SnapshotWriter* snapshot_open(const char* const path) {
+  constexpr mode_t RW_MODE = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH;
+  const int fd = creat(path, RW_MODE);
+  if (-1 == fd) return NULL;
+  uint8_t* const buf = (uint8_t*) malloc(SNAPSHOT_WRITE_LEN);
+  if (NULL == buf) {
+    close(fd);
+    return NULL;
+  }
+
+  SnapshotWriter* const writer = new SnapshotWriter{fd, buf, 0, 0, 0};
+  memcpy(writer->buf, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  writer->used = writer->n_bytes = sizeof(SNAPSHOT_MAGIC);
+  return writer;
+}
+
+int snapshot_add(
+  SnapshotWriter* const writer,
+  const char* const key,
+  const uint8_t key_len,
+  const uint8_t* const value,
+  const uint32_t value_len
+) {
+  uint8_t header[5];
+  header[0] = key_len;
+  memcpy(header + 1, &value_len, sizeof(value_len));
+  const struct {
+    const void* bytes;
+    size_t len;
+  } parts[3] = {{header, sizeof(header)}, {key, key_len}, {value, value_len}};
+
+  // Values can be bigger than the buffer, so parts may be split over
+  // several writes.
+  for (const auto& part : parts) {
+    const uint8_t* bytes = (const uint8_t*) part.bytes;
+    size_t len = part.len;
+    while (len > 0) {
+      if (writer->used == SNAPSHOT_WRITE_LEN && -1 == flush(writer)) return -1;
+      const size_t n = len < SNAPSHOT_WRITE_LEN - writer->used ? len : SNAPSHOT_WRITE_LEN - writer->used;
+      memcpy(writer->buf + writer->used, bytes, n);
+      writer->used += n;
+      bytes += n;
+      len -= n;
+    }
+  }
+  ++writer->n_keys;
+  writer->n_bytes += sizeof(header) + key_len + value_len;
+  return 0;
+}
+
+int snapshot_close(SnapshotWriter* const writer) {
+  const bool ok = -1 != flush(writer) && -1 != fsync(writer->fd);
+  const bool closed = -1 != close(writer->fd);
+  free(writer->buf);
+  delete writer;
+  return ok && closed ? 0 : -1;
+}
+
+uint64_t private_pages() {
+  FILE* const file = fopen("/proc/self/smaps_rollup", "r");
+  if (NULL == file) return 0;
+  uint64_t private_kb = 0;
+  char line[256];
+  while (NULL != fgets(line, sizeof(line), file)) {
+    unsigned long kb;
+    if (1 == sscanf(line, "Private_Clean: %lu kB", &kb) || 1 == sscanf(line, "Private_Dirty: %lu kB", &kb)) {
+      private_kb += kb;
+    }
+  }
+  fclose(file);
+  return private_kb * 1024 / sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Snapshot files hold the whole keystore. A snapshot file starts with
+// SNAPSHOT_MAGIC, followed by one record per key, in no particular order:
+//
+// +---------+-----------+-----+-------
+// | key_len | value_len | key | value
+// +---------+-----------+-----+-------
+//     1 B       4 B
+constexpr char SNAPSHOT_MAGIC[8] = "USDSNP1";
+
+// Records are gathered in a buffer of this many bytes and written out a whole
+// buffer at a time.
+constexpr size_t SNAPSHOT_WRITE_LEN = 1 << 20;
+
+struct SnapshotWriter {
+  int fd;
+  uint8_t* buf;
+  size_t used;
+  uint64_t n_keys;
+  // Written to the file so far, and buffered.
+  uint64_t n_bytes;
+};
+
+// Creates the snapshot file at path, truncating it if it exists.
+//
+// Returns NULL on error.
+SnapshotWriter* snapshot_open(const char* path);
+
+// Appends a record for key and value.
+int snapshot_add(
+  SnapshotWriter* writer,
+  const char* key,
+  uint8_t key_len,
+  const uint8_t* value,
+  uint32_t value_len
+);
+
+// Writes out what is buffered, syncs the file and closes it. Frees writer,
+// even on error.
+int snapshot_close(SnapshotWriter* writer);
+
+// Returns the number of this process's pages that no other process maps, from
+// /proc/self/smaps_rollup, or 0 if that can't be read.
+//
+// After a fork(), the child's pages are all shared with the parent until one
+// of them writes to a page, which copies it. So the child's private pages
+// grow by one for each page either of them has copied since.
+uint64_t private_pages();
@@ -2,6 +2,8 @@
 // Copyright 2021 Richard L. Sites
 // Quite possibly flawed
 
+#pragma once
+
 #include <stdint.h>
 
 struct LockAndHist {
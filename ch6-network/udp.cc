@@ -0,0 +1,304 @@
+#include "udp.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "phases.h"
+
+int udp_listen(const uint16_t server_port) {
+  const int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (-1 == sock_fd) return -1;
+
+  sockaddr_in server_addr = {};
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (-1 == bind(sock_fd, (sockaddr*) &server_addr, sizeof(server_addr))) {
+    const int err_save = errno;
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+  return sock_fd;
+}
+
+int udp_connect(const char* const server_addr_str, const int server_port, Connection* const out_conn) {
+  const int sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (-1 == sock_fd) return -1;
+
+  sockaddr_in server_addr = {};
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(server_port);
+  sockaddr_in client_addr;
+  socklen_t addr_len = sizeof(client_addr);
+  if (1 != inet_pton(AF_INET, server_addr_str, &server_addr.sin_addr)
+      || -1 == connect(sock_fd, (sockaddr*) &server_addr, sizeof(server_addr))
+      || -1 == getsockname(sock_fd, (sockaddr*) &client_addr, &addr_len)) {
+    const int err_save = errno;
+    close(sock_fd);
+    errno = err_save;
+    return -1;
+  }
+
+  out_conn->sock_fd = sock_fd;
+  out_conn->server_ip   = server_addr.sin_addr.s_addr;
+  out_conn->server_port = server_addr.sin_port;
+  out_conn->client_ip   = client_addr.sin_addr.s_addr;
+  out_conn->client_port = client_addr.sin_port;
+  return 0;
+}
+
+int udp_send_batch(const int sock_fd, UdpBatch* const batch) {
+  mmsghdr msgs[UDP_BATCH_MAX];
+  iovec iovs[UDP_BATCH_MAX];
+  for (int i = 0; i < batch->n; ++i) {
+    UdpDatagram& datagram = batch->datagrams[i];
+    iovs[i] = {datagram.bytes, datagram.len};
+    msgs[i].msg_hdr = {};
+    msgs[i].msg_hdr.msg_name = &datagram.addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(datagram.addr);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  // sendmmsg() stops at the first datagram that fails, or that would block.
+  int sent = 0;
+  while (sent < batch->n) {
+    const int n = sendmmsg(sock_fd, msgs + sent, batch->n - sent, 0);
+    if (n < 0) {
+      if (EINTR == errno) continue;
+      return -1;
+    }
+    sent += n;
+  }
+  return 0;
+}
+
+int udp_recv_batch(const int sock_fd, UdpBatch* const batch, const int timeout_ms, const int wake_fd) {
+  batch->n = 0;
+  pollfd fds[2] = {
+    {sock_fd, POLLIN, 0},
+    {wake_fd, POLLIN, 0},
+  };
+  const int n_ready = poll(fds, wake_fd >= 0 ? 2 : 1, timeout_ms);
+  if (n_ready < 0) return EINTR == errno ? 0 : -1;
+  if (!(fds[0].revents & POLLIN)) return 0;
+
+  mmsghdr msgs[UDP_BATCH_MAX];
+  iovec iovs[UDP_BATCH_MAX];
+  for (int i = 0; i < UDP_BATCH_MAX; ++i) {
+    UdpDatagram& datagram = batch->datagrams[i];
+    iovs[i] = {datagram.bytes, sizeof(datagram.bytes)};
+    msgs[i].msg_hdr = {};
+    msgs[i].msg_hdr.msg_name = &datagram.addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(datagram.addr);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  const int n = recvmmsg(sock_fd, msgs, UDP_BATCH_MAX, MSG_DONTWAIT, NULL);
+  if (n < 0) return EAGAIN == errno || EINTR == errno ? 0 : -1;
+  for (int i = 0; i < n; ++i) {
+    // A datagram too big for the buffer can't be a whole message.
+    batch->datagrams[i].len = msgs[i].msg_hdr.msg_flags & MSG_TRUNC ? 0 : msgs[i].msg_len;
+  }
+  batch->n = n;
+  return n;
+}
+
+int udp_encode(
+  UdpBatch* const batch,
+  const sockaddr_in& addr,
+  const RPCMessage* const message,
+  const uint8_t* const body,
+  const size_t n_bytes
+) {
+  if (n_bytes > UDP_BODY_MAX_LEN) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (batch->n == UDP_BATCH_MAX) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  UdpDatagram& datagram = batch->datagrams[batch->n++];
+  datagram.addr = addr;
+  memcpy(datagram.bytes, &message->mark, sizeof(RPCMark));
+  memcpy(datagram.bytes + sizeof(RPCMark), &message->header, sizeof(RPCHeader));
+  if (n_bytes > 0) memcpy(datagram.bytes + sizeof(RPCMark) + sizeof(RPCHeader), body, n_bytes);
+  datagram.len = sizeof(RPCMark) + sizeof(RPCHeader) + n_bytes;
+  return 0;
+}
+
+int udp_decode(UdpDatagram* const datagram, RPCMessage* const message) {
+  constexpr size_t head_len = sizeof(RPCMark) + sizeof(RPCHeader);
+  if (datagram->len < head_len) return -1;
+  memcpy(&message->mark, datagram->bytes, sizeof(RPCMark));
+  memcpy(&message->header, datagram->bytes + sizeof(RPCMark), sizeof(RPCHeader));
+  if (message->mark.signature != MARK_SIGNATURE
+      || message->mark.header_len != sizeof(RPCHeader)
+      || message->mark.data_len != datagram->len - head_len) {
+    return -1;
+  }
+  message->body = datagram->bytes + head_len;
+  message->chunk = NULL;
+  message->phases = NULL;
+  return 0;
+}
+
+UdpReplyCache::UdpReplyCache(const size_t capacity)
+  : responses_(capacity), keys_(capacity) {
+  index_.reserve(capacity);
+}
+
+UdpReplyCache::Key UdpReplyCache::make_key(const sockaddr_in& addr, const uint32_t rpc_id) {
+  return Key{(uint64_t) addr.sin_addr.s_addr << 16 | addr.sin_port, rpc_id};
+}
+
+const UdpDatagram* UdpReplyCache::find(const sockaddr_in& addr, const uint32_t rpc_id) const {
+  const auto it = index_.find(make_key(addr, rpc_id));
+  return it == index_.end() ? NULL : &responses_[it->second];
+}
+
+void UdpReplyCache::add(const UdpDatagram& response, const uint32_t rpc_id) {
+  if (n_ == responses_.size()) {
+    // The oldest, unless the same key has been added again since.
+    const auto it = index_.find(keys_[next_]);
+    if (it != index_.end() && it->second == next_) index_.erase(it);
+  } else {
+    ++n_;
+  }
+  responses_[next_] = response;
+  keys_[next_] = make_key(response.addr, rpc_id);
+  index_[keys_[next_]] = next_;
+  next_ = (next_ + 1) % responses_.size();
+}
+
+void udp_close(UdpClient* const client) {
+  close(client->connection.sock_fd);
+  delete client->requests;
+  delete client->resends;
+  delete client->responses;
+  delete client;
+}
+
+int udp_call_batch(UdpClient* const client, UdpCall* const calls, const int n_calls, const int log_fd) {
+  if (n_calls > UDP_BATCH_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  const Connection* const connection = &client->connection;
+  sockaddr_in server_addr = {};
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = connection->server_ip;
+  server_addr.sin_port = connection->server_port;
+
+  UdpBatch* const requests = client->requests;
+  requests->n = 0;
+  uint32_t rpc_ids[UDP_BATCH_MAX];
+  for (int i = 0; i < n_calls; ++i) {
+    UdpCall& call = calls[i];
+    call.response.body = NULL;
+    call.response.chunk = NULL;
+    call.response.phases = NULL;
+    RPCMessage request;
+    if (-1 == rpc_fill_req(connection, call.n_bytes, /*parent_rpc=*/0, call.method, &request)
+        || -1 == udp_encode(requests, server_addr, &request, call.body, call.n_bytes)) {
+      return -1;
+    }
+    if (log_fd >= 0) log(log_fd, &request);
+    rpc_ids[i] = request.header.rpc_id;
+  }
+  if (-1 == udp_send_batch(connection->sock_fd, requests)) return -1;
+
+  // Each request's next timeout, and when it runs out.
+  uint64_t timeout_ns[UDP_BATCH_MAX];
+  uint64_t deadline_ns[UDP_BATCH_MAX];
+  int n_tries[UDP_BATCH_MAX];
+  bool answered[UDP_BATCH_MAX];
+  const uint64_t sent_ns = now_nsec();
+  for (int i = 0; i < n_calls; ++i) {
+    timeout_ns[i] = client->timeout_us * 1000ull;
+    deadline_ns[i] = sent_ns + timeout_ns[i];
+    n_tries[i] = 1;
+    answered[i] = false;
+  }
+
+  int n_left = n_calls;
+  while (n_left > 0) {
+    uint64_t next_deadline_ns = UINT64_MAX;
+    for (int i = 0; i < n_calls; ++i) {
+      if (!answered[i] && deadline_ns[i] < next_deadline_ns) next_deadline_ns = deadline_ns[i];
+    }
+    const uint64_t wait_start_ns = now_nsec();
+    const int wait_ms = next_deadline_ns > wait_start_ns
+      ? (next_deadline_ns - wait_start_ns + 999999) / 1000000
+      : 0;
+    if (-1 == udp_recv_batch(connection->sock_fd, client->responses, wait_ms)) return -1;
+
+    const uint64_t received_ns = now_nsec();
+    uint64_t received_us;
+    if (-1 == now_usec(&received_us)) return -1;
+    for (int j = 0; j < client->responses->n; ++j) {
+      RPCMessage response;
+      if (-1 == udp_decode(&client->responses->datagrams[j], &response)) continue;
+      if (RpcMessageType::Response != response.header.message_type) continue;
+      int i = 0;
+      while (i < n_calls && (answered[i] || rpc_ids[i] != response.header.rpc_id)) ++i;
+      // Another answer to a request that was sent again.
+      if (i == n_calls) continue;
+
+      UdpCall& call = calls[i];
+      call.response.mark = response.mark;
+      call.response.header = response.header;
+      call.response.header.res_recv_time_us = received_us;
+      call.response.body = (uint8_t*) malloc(response.mark.data_len);
+      memcpy(call.response.body, response.body, response.mark.data_len);
+      call.answered_ns = received_ns;
+      answered[i] = true;
+      --n_left;
+      if (log_fd >= 0) log(log_fd, &call.response);
+    }
+
+    // Send whatever is overdue again, waiting twice as long this time.
+    UdpBatch* const resends = client->resends;
+    resends->n = 0;
+    for (int i = 0; i < n_calls; ++i) {
+      if (answered[i] || deadline_ns[i] > received_ns) continue;
+      if (n_tries[i] == client->max_tries) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      resends->datagrams[resends->n++] = requests->datagrams[i];
+      ++n_tries[i];
+      timeout_ns[i] *= 2;
+      deadline_ns[i] = received_ns + timeout_ns[i];
+    }
+    if (resends->n > 0) {
+      client->n_retransmits += resends->n;
+      if (-1 == udp_send_batch(connection->sock_fd, resends)) return -1;
+    }
+  }
+  return 0;
+}
+
+int udp_call(
+  UdpClient* const client,
+  const uint8_t* const body,
+  const size_t n_bytes,
+  const char* const method,
+  const int log_fd,
+  RPCMessage* const response
+) {
+  UdpCall call;
+  call.body = body;
+  call.n_bytes = n_bytes;
+  call.method = method;
+  const int result = udp_call_batch(client, &call, 1, log_fd);
+  *response = call.response;
+  return result;
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include "network.h"
+#include "rpc.h"
+
+// Datagram transport for small RPCs.
+//
+// Each RPC is one UDP datagram: the full RPCMark and RPCHeader, then the
+// body. There is no connection, so no handshake, no Nagle, and no delayed
+// ACKs, but also no delivery guarantee. A client sends a request again if no
+// response comes within its timeout, and the server remembers its recent
+// responses by client address and rpc_id, so that a request it has already
+// answered is answered again from memory rather than run twice.
+//
+// Datagrams are sent and received in batches of up to UDP_BATCH_MAX, with one
+// sendmmsg() or recvmmsg() each.
+//
+// A message that doesn't fit in UDP_DATAGRAM_MAX_LEN can't go this way. The
+// server answers a request whose response is too big with RpcStatus::Failed
+// and no body.
+
+// What fits in one Ethernet frame, so that datagrams are never fragmented.
+constexpr size_t UDP_DATAGRAM_MAX_LEN = 1500 - 20 - 8;
+constexpr size_t UDP_BODY_MAX_LEN = UDP_DATAGRAM_MAX_LEN - sizeof(RPCMark) - sizeof(RPCHeader);
+
+constexpr int UDP_BATCH_MAX = 32;
+
+struct UdpDatagram {
+  // Where it came from, or where it goes.
+  sockaddr_in addr;
+  size_t len;
+  uint8_t bytes[UDP_DATAGRAM_MAX_LEN];
+};
+
+// Datagrams to send, or just received.
+struct UdpBatch {
+  int n = 0;
+  UdpDatagram datagrams[UDP_BATCH_MAX];
+};
+
+// Opens a UDP socket bound to server_port on every address.
+//
+// Returns the socket, or -1 on error.
+int udp_listen(uint16_t server_port);
+
+// Opens a UDP socket connected to the server at server_addr_str and
+// server_port, so that it only receives datagrams from there, and fills in
+// *out_conn's socket and addresses. The rest of the Connection is unused.
+//
+// Returns 0 if successful, and -1 otherwise.
+int udp_connect(const char* server_addr_str, int server_port, Connection* out_conn);
+
+// Sends every datagram in the batch, to its addr unless the socket is
+// connected.
+//
+// Returns -1 if not everything could be sent.
+int udp_send_batch(int sock_fd, UdpBatch* batch);
+
+// Waits up to timeout_ms (-1 for no limit) for a datagram to arrive on
+// sock_fd or on wake_fd, if it isn't -1, and then receives as many as have
+// arrived, up to UDP_BATCH_MAX, into the batch.
+//
+// Returns the number received, which is 0 if the time ran out or wake_fd
+// became readable first, or -1 on error.
+int udp_recv_batch(int sock_fd, UdpBatch* batch, int timeout_ms, int wake_fd = -1);
+
+// Encodes message and n_bytes of body as the next datagram in the batch, to
+// addr.
+//
+// Returns -1 and sets errno to EMSGSIZE if it doesn't fit in a datagram.
+int udp_encode(
+  UdpBatch* batch,
+  const sockaddr_in& addr,
+  const RPCMessage* message,
+  const uint8_t* body,
+  size_t n_bytes
+);
+
+// Decodes the datagram into *message, whose body points into the datagram
+// and must not be passed to rpc_free_body().
+//
+// Returns -1 if the datagram isn't a well-formed message.
+int udp_decode(UdpDatagram* datagram, RPCMessage* message);
+
+// The last responses sent from a server's socket, to answer requests sent
+// again without running them again. Holds as many as it was made with, and
+// drops the oldest first.
+class UdpReplyCache {
+public:
+  explicit UdpReplyCache(size_t capacity);
+
+  // Returns the response sent to the request from addr with rpc_id, or NULL
+  // if it isn't remembered.
+  const UdpDatagram* find(const sockaddr_in& addr, uint32_t rpc_id) const;
+
+  // Remembers response, sent to its addr, as the answer to rpc_id.
+  void add(const UdpDatagram& response, uint32_t rpc_id);
+
+private:
+  struct Key {
+    uint64_t addr;
+    uint32_t rpc_id;
+
+    bool operator==(const Key& other) const {
+      return addr == other.addr && rpc_id == other.rpc_id;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return (key.addr ^ ((uint64_t) key.rpc_id << 24)) * 0x9e3779b97f4a7c15ull >> 16;
+    }
+  };
+
+  static Key make_key(const sockaddr_in& addr, uint32_t rpc_id);
+
+  // A ring of responses, and where each one's key is.
+  std::vector<UdpDatagram> responses_;
+  std::vector<Key> keys_;
+  size_t next_ = 0;
+  size_t n_ = 0;
+  std::unordered_map<Key, size_t, KeyHash> index_;
+};
+
+// A request to send over UDP, and once it's answered, its response.
+struct UdpCall {
+  const uint8_t* body;
+  size_t n_bytes;
+  const char* method;
+
+  // Filled in by udp_call_batch(). The response's body is malloc()ed, for
+  // rpc_free_body().
+  RPCMessage response;
+  // When the response came in, by CLOCK_MONOTONIC, in nanoseconds.
+  uint64_t answered_ns;
+};
+
+// The client end of the datagram transport.
+struct UdpClient {
+  Connection connection;
+
+  // How long to wait for a response before sending the request again. The
+  // wait doubles each time.
+  uint32_t timeout_us = 5000;
+  // How many times to send a request before giving up on it.
+  int max_tries = 6;
+
+  // Requests sent again so far.
+  uint64_t n_retransmits = 0;
+
+  // The requests of the calls in progress, in order, the ones among them to
+  // send again, and the responses coming in.
+  UdpBatch* requests = new UdpBatch();
+  UdpBatch* resends = new UdpBatch();
+  UdpBatch* responses = new UdpBatch();
+};
+
+// Closes the client's socket and frees it.
+void udp_close(UdpClient* client);
+
+// Sends up to UDP_BATCH_MAX requests at once, and waits for all of their
+// responses, logging each request and response unless log_fd < 0.
+//
+// Returns -1 and sets errno to ETIMEDOUT if some request goes unanswered
+// after max_tries sends, or to something else on error. The responses
+// received by then are in their calls, with the rest's bodies NULL.
+int udp_call_batch(UdpClient* client, UdpCall* calls, int n_calls, int log_fd);
+
+// Sends one request and waits for its response, like rpc_send_req() and
+// rpc_recv_resp() over TCP.
+int udp_call(
+  UdpClient* client,
+  const uint8_t* body,
+  size_t n_bytes,
+  const char* method,
+  int log_fd,
+  RPCMessage* response
+);
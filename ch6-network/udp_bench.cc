@@ -0,0 +1,221 @@
+// Compares the TCP and UDP transports on small RPCs, by sending the same
+// requests over each to a server started with -udp, in rounds of -depth
+// requests sent back to back before waiting for their responses, and
+// printing the throughput and latency percentiles of each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "histogram.h"
+#include "my_rpc.h"
+#include "network.h"
+#include "phases.h"
+#include "rpc.h"
+#include "udp.h"
+
+struct Args {
+  const char* server;
+  int port;
+  int n_rpcs = 100000;
+  int depth = 1;
+  int rounds = 3;
+  const char* method = "ping";
+  size_t size = 64;
+};
+
+void usage() {
+  fprintf(
+    stderr,
+    "usage:\n"
+    "\tudp_bench [-k N] [-depth N] [-rounds N] [-method ping|read] [-size BYTES]\n"
+    "\t          SERVER PORT\n"
+    "\n"
+    "Sends N (-k, default 100000) RPCs over TCP and then over UDP to a server\n"
+    "started with -udp, N (-rounds, default 3) times each. Each connection sends\n"
+    "N (-depth, default 1, at most %d) requests at once and waits for all of\n"
+    "their responses before sending more; over UDP, with one sendmmsg() and as\n"
+    "few recvmmsg() as it takes. ping sends BYTES (default 64) of body, and read\n"
+    "reads a value of BYTES that is written first.\n",
+    UDP_BATCH_MAX
+  );
+}
+
+Args parse_args(const int argc, char** const argv) {
+  Args args;
+  int i = 1;
+  for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+    if (strcmp(argv[i], "-k") == 0) {
+      args.n_rpcs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-depth") == 0) {
+      args.depth = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-rounds") == 0) {
+      args.rounds = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-method") == 0) {
+      args.method = argv[i + 1];
+    } else if (strcmp(argv[i], "-size") == 0) {
+      args.size = strtoull(argv[i + 1], NULL, 10);
+    } else {
+      fprintf(stderr, "unrecognized arg: %s\n", argv[i]);
+      usage();
+      exit(1);
+    }
+  }
+  if (i + 2 != argc) usage(), exit(1);
+  args.server = argv[i];
+  args.port = atoi(argv[i + 1]);
+
+  if (args.n_rpcs < 1 || args.rounds < 1 || args.depth < 1 || args.depth > UDP_BATCH_MAX) {
+    fprintf(stderr, "-k and -rounds must be positive, and -depth from 1 to %d\n", UDP_BATCH_MAX);
+    exit(1);
+  }
+  if (strcmp(args.method, "ping") != 0 && strcmp(args.method, "read") != 0) {
+    fprintf(stderr, "-method must be ping or read\n");
+    exit(1);
+  }
+  if (args.size > UDP_BODY_MAX_LEN) {
+    fprintf(stderr, "-size must be at most %zu to fit in a datagram\n", UDP_BODY_MAX_LEN);
+    exit(1);
+  }
+  return args;
+}
+
+const char KEY[] = "udp_bench";
+
+// The results of every round over one transport.
+struct Results {
+  LatencyHistogram* latencies = new LatencyHistogram();
+  uint64_t n_rpcs = 0;
+  uint64_t elapsed_ns = 0;
+  uint64_t n_retransmits = 0;
+};
+
+void check_response(const RPCMessage& response) {
+  if (response.header.status != RpcStatus::Ok) {
+    fprintf(stderr, "an RPC failed: %s\n", status_str(response.header.status));
+    exit(1);
+  }
+}
+
+void run_tcp(const Args& args, const std::vector<uint8_t>& body, Results* const results) {
+  Connection connection;
+  if (-1 == tcp_connect(args.server, args.port, &connection)) {
+    perror("couldn't connect over TCP");
+    exit(1);
+  }
+  const uint64_t start_ns = now_nsec();
+  for (int sent = 0; sent < args.n_rpcs; sent += args.depth) {
+    const int n = args.n_rpcs - sent < args.depth ? args.n_rpcs - sent : args.depth;
+    const uint64_t round_ns = now_nsec();
+    for (int i = 0; i < n; ++i) {
+      if (-1 == rpc_send_req(&connection, body.data(), body.size(), /*parent_rpc=*/0, args.method, -1)) {
+        perror("couldn't send over TCP");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      RPCMessage response;
+      if (-1 == rpc_recv_resp(&connection, &response)) {
+        perror("couldn't receive over TCP");
+        exit(1);
+      }
+      results->latencies->record(now_nsec() - round_ns);
+      check_response(response);
+      rpc_free_body(&response);
+    }
+  }
+  results->elapsed_ns += now_nsec() - start_ns;
+  results->n_rpcs += args.n_rpcs;
+  conn_close(&connection);
+}
+
+void run_udp(const Args& args, const std::vector<uint8_t>& body, Results* const results) {
+  UdpClient* const client = new UdpClient();
+  if (-1 == udp_connect(args.server, args.port, &client->connection)) {
+    perror("couldn't open a UDP socket");
+    exit(1);
+  }
+  UdpCall calls[UDP_BATCH_MAX];
+  const uint64_t start_ns = now_nsec();
+  for (int sent = 0; sent < args.n_rpcs; sent += args.depth) {
+    const int n = args.n_rpcs - sent < args.depth ? args.n_rpcs - sent : args.depth;
+    for (int i = 0; i < n; ++i) {
+      calls[i].body = body.data();
+      calls[i].n_bytes = body.size();
+      calls[i].method = args.method;
+    }
+    const uint64_t round_ns = now_nsec();
+    if (-1 == udp_call_batch(client, calls, n, -1)) {
+      perror("couldn't call over UDP");
+      exit(1);
+    }
+    for (int i = 0; i < n; ++i) {
+      results->latencies->record(calls[i].answered_ns - round_ns);
+      check_response(calls[i].response);
+      rpc_free_body(&calls[i].response);
+    }
+  }
+  results->elapsed_ns += now_nsec() - start_ns;
+  results->n_rpcs += args.n_rpcs;
+  results->n_retransmits += client->n_retransmits;
+  udp_close(client);
+}
+
+int main(int argc, char** argv) {
+  const Args args = parse_args(argc, argv);
+
+  std::vector<uint8_t> body;
+  if (strcmp(args.method, "read") == 0) {
+    // Write the value to read first.
+    std::vector<uint8_t> write_buf(sizeof(WriteRequest) + sizeof(KEY) - 1 + args.size);
+    WriteRequest* const write_req = (WriteRequest*) write_buf.data();
+    WriteRequest::Init(write_req, sizeof(KEY) - 1, args.size);
+    memcpy(write_req->key(), KEY, sizeof(KEY) - 1);
+    memset(write_req->value(), 'v', args.size);
+    Connection connection;
+    RPCMessage response;
+    if (-1 == tcp_connect(args.server, args.port, &connection)
+        || -1 == rpc_send_req(&connection, write_buf.data(), write_req->full_len(), 0, "write", -1)
+        || -1 == rpc_recv_resp(&connection, &response)) {
+      perror("couldn't write the value to read");
+      exit(1);
+    }
+    check_response(response);
+    rpc_free_body(&response);
+    conn_close(&connection);
+    body.assign(KEY, KEY + sizeof(KEY) - 1);
+  } else {
+    body.assign(args.size, 'p');
+  }
+
+  Results tcp;
+  Results udp;
+  for (int round = 0; round < args.rounds; ++round) {
+    run_tcp(args, body, &tcp);
+    run_udp(args, body, &udp);
+  }
+
+  printf(
+    "%-4s %10s %10s %10s %10s %10s %10s %8s\n",
+    "", "rpcs", "rpcs/s", "p50 us", "p99 us", "p99.9 us", "max us", "resent"
+  );
+  const Results* const results[2] = {&tcp, &udp};
+  const char* const names[2] = {"tcp", "udp"};
+  for (int i = 0; i < 2; ++i) {
+    const Results& r = *results[i];
+    printf(
+      "%-4s %10lu %10.0f %10.1f %10.1f %10.1f %10.1f %8lu\n",
+      names[i],
+      r.n_rpcs,
+      r.n_rpcs / (r.elapsed_ns / 1e9),
+      r.latencies->percentile(0.5) / 1000.0,
+      r.latencies->percentile(0.99) / 1000.0,
+      r.latencies->percentile(0.999) / 1000.0,
+      r.latencies->max() / 1000.0,
+      r.n_retransmits
+    );
+  }
+  return 0;
+}
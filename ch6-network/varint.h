@@ -0,0 +1,48 @@
+#pragma once
+
+// LEB128-style variable-length integers: 7 bits per byte, low bits first, high
+// bit set on every byte but the last.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest encoding of a uint64_t.
+constexpr size_t VARINT_MAX_LEN = 10;
+
+// Writes value to buf, which must have room for VARINT_MAX_LEN bytes.
+// Returns the number of bytes written.
+inline size_t put_varint(uint8_t* const buf, uint64_t value) {
+  size_t i = 0;
+  while (value >= 0x80) {
+    buf[i++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[i++] = value;
+  return i;
+}
+
+// Reads a varint starting at *buf and advances *buf past it.
+//
+// Returns false if the varint runs past end.
+inline bool get_varint(const uint8_t** const buf, const uint8_t* const end, uint64_t* const out) {
+  uint64_t value = 0;
+  for (int shift = 0; *buf < end && shift < 64; shift += 7) {
+    const uint8_t byte = *(*buf)++;
+    value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *out = value;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Maps signed deltas to unsigned ones so that small negative deltas (e.g. from
+// clock skew between client and server) still encode in a byte or two.
+inline uint64_t zigzag(const int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+inline int64_t unzigzag(const uint64_t value) {
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
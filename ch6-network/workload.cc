@@ -0,0 +1,158 @@
+#include "workload.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <numeric>
+
+AliasTable::AliasTable(const std::vector<double>& weights)
+  : cutoff_(weights.size()), alias_(weights.size()) {
+  const size_t n = weights.size();
+  const double sum = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+  // Scale so the average slot holds exactly 1, then repeatedly top up a slot
+  // holding less than 1 from one holding more.
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    scaled[i] = weights[i] * n / sum;
+    (scaled[i] < 1 ? small : large).push_back(i);
+  }
+  while (!small.empty() && !large.empty()) {
+    const uint32_t s = small.back(), l = large.back();
+    small.pop_back();
+    cutoff_[s] = scaled[s] * 4294967296.0;
+    alias_[s] = l;
+    scaled[l] -= 1 - scaled[s];
+    if (scaled[l] < 1) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Whatever is left holds 1, give or take rounding.
+  for (const uint32_t i : small) cutoff_[i] = UINT32_MAX, alias_[i] = i;
+  for (const uint32_t i : large) cutoff_[i] = UINT32_MAX, alias_[i] = i;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+  while (b != 0) {
+    const uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+KeyDist::KeyDist(const KeyDistConfig& config) : config_(config) {
+  switch (config.kind) {
+    case KeyDistKind::Zipfian: {
+      std::vector<double> weights(config.n_keys);
+      for (uint64_t i = 0; i < config.n_keys; ++i) weights[i] = pow(i + 1, -config.theta);
+      ranks_ = AliasTable(weights);
+
+      // Any multiplier coprime to n_keys will do; a big one near n_keys times
+      // the golden ratio lands consecutive ranks far apart.
+      scatter_ = (uint64_t) (config.n_keys * 0.6180339887) | 1;
+      while (gcd(scatter_, config.n_keys) != 1) scatter_ += 2;
+      break;
+    }
+    case KeyDistKind::Hotspot:
+      n_hot_ = config.n_keys * config.hot_keys;
+      if (n_hot_ < 1) n_hot_ = 1;
+      if (n_hot_ >= config.n_keys) n_hot_ = config.n_keys - 1;
+      hot_cutoff_ = ldexp(config.hot_ops, 64);
+      break;
+    default:
+      break;
+  }
+}
+
+// Parses an unsigned decimal at *s, advancing *s past it.
+static bool parse_size(const char** const s, size_t* const out) {
+  char* end;
+  errno = 0;
+  const unsigned long long value = strtoull(*s, &end, 10);
+  if (errno != 0 || end == *s || **s == '-') return false;
+  *s = end;
+  *out = value;
+  return true;
+}
+
+// Parses a fraction in (0, 1) at *s, advancing *s past it.
+static bool parse_fraction(const char** const s, double* const out) {
+  char* end;
+  errno = 0;
+  const double value = strtod(*s, &end);
+  if (errno != 0 || end == *s || !(value > 0 && value < 1)) return false;
+  *s = end;
+  *out = value;
+  return true;
+}
+
+bool SizeDist::parse(const char* spec) {
+  *this = SizeDist();
+  size_t first;
+  if (!parse_size(&spec, &first)) return false;
+
+  if (*spec == '\0') {
+    min_ = max_ = first;
+    return true;
+  }
+  if (*spec == '-') {
+    ++spec;
+    if (!parse_size(&spec, &max_) || *spec != '\0' || max_ < first) return false;
+    min_ = first;
+    return true;
+  }
+
+  std::vector<double> weights;
+  size_t size = first;
+  while (true) {
+    if (*spec++ != '@') return false;
+    char* end;
+    const double weight = strtod(spec, &end);
+    if (end == spec || !(weight > 0)) return false;
+    spec = end;
+    sizes_.push_back(size);
+    weights.push_back(weight);
+    if (size > max_) max_ = size;
+
+    if (*spec == '\0') break;
+    if (*spec++ != ',' || !parse_size(&spec, &size)) return false;
+  }
+  weights_ = AliasTable(weights);
+  return true;
+}
+
+bool parse_key_dist(const char* spec, KeyDistConfig* const config) {
+  KeyDistConfig parsed = *config;
+  if (strcmp(spec, "uniform") == 0) {
+    parsed.kind = KeyDistKind::Uniform;
+  } else if (strncmp(spec, "zipf", 4) == 0) {
+    parsed.kind = KeyDistKind::Zipfian;
+    spec += 4;
+    if (*spec == ':') {
+      ++spec;
+      char* end;
+      parsed.theta = strtod(spec, &end);
+      if (end == spec || !(parsed.theta > 0)) return false;
+      spec = end;
+    }
+    if (*spec != '\0') return false;
+  } else if (strncmp(spec, "hotspot", 7) == 0) {
+    parsed.kind = KeyDistKind::Hotspot;
+    spec += 7;
+    if (*spec == ':') {
+      ++spec;
+      if (!parse_fraction(&spec, &parsed.hot_keys)) return false;
+      if (*spec++ != ':' || !parse_fraction(&spec, &parsed.hot_ops)) return false;
+    }
+    if (*spec != '\0') return false;
+  } else {
+    return false;
+  }
+  *config = parsed;
+  return true;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Random choices for the client's mixed workloads: which operation to send,
+// which key it touches, and how big a written value is.
+//
+// Every draw is O(1): distributions that aren't simple arithmetic, like a
+// Zipfian over a million keys, are turned into an alias table up front, so
+// the per-RPC cost is one random number, a multiply, an index and a compare.
+
+// A small, fast, statistically decent generator (SplitMix64). Not for crypto.
+class Rng {
+public:
+  explicit Rng(uint64_t seed) : state_(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state_ += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  // Returns a uniformly random double in [0, 1).
+  double uniform() {
+    return (next() >> 11) * 0x1p-53;
+  }
+
+  // Returns a uniformly random integer in [0, n).
+  uint64_t below(uint64_t n) {
+    return (uint64_t) (((unsigned __int128) next() * n) >> 64);
+  }
+
+private:
+  uint64_t state_;
+};
+
+// Walker's alias method: draws index i with probability weights[i] / sum.
+class AliasTable {
+public:
+  AliasTable() = default;
+  explicit AliasTable(const std::vector<double>& weights);
+
+  size_t size() const { return cutoff_.size(); }
+
+  uint32_t draw(Rng* rng) const {
+    const uint64_t r = rng->next();
+    const uint32_t i = ((r >> 32) * cutoff_.size()) >> 32;
+    return (uint32_t) r < cutoff_[i] ? i : alias_[i];
+  }
+
+private:
+  // Slot i yields i if the low half of the random number is below cutoff_[i],
+  // and alias_[i] otherwise.
+  std::vector<uint32_t> cutoff_;
+  std::vector<uint32_t> alias_;
+};
+
+enum class KeyDistKind {
+  Uniform,
+  // Key ranks follow a Zipfian with exponent theta, and ranks are scattered
+  // over the keyspace so that the hot keys aren't all neighbours.
+  Zipfian,
+  // A fraction hot_keys of the keyspace gets a fraction hot_ops of the draws.
+  Hotspot
+};
+
+struct KeyDistConfig {
+  KeyDistKind kind = KeyDistKind::Uniform;
+  uint64_t n_keys = 100000;
+  double theta = 0.99;
+  double hot_keys = 0.2;
+  double hot_ops = 0.8;
+};
+
+// Draws key indices in [0, n_keys).
+class KeyDist {
+public:
+  // Keyspaces larger than this can't be Zipfian, because the alias table
+  // would take more than a GB.
+  static constexpr uint64_t MAX_ZIPFIAN_KEYS = 1 << 27;
+
+  explicit KeyDist(const KeyDistConfig& config);
+
+  uint64_t draw(Rng* rng) const {
+    switch (config_.kind) {
+      case KeyDistKind::Zipfian:
+        return (ranks_.draw(rng) * scatter_) % config_.n_keys;
+      case KeyDistKind::Hotspot:
+        return rng->next() < hot_cutoff_
+          ? rng->below(n_hot_)
+          : n_hot_ + rng->below(config_.n_keys - n_hot_);
+      default:
+        return rng->below(config_.n_keys);
+    }
+  }
+
+private:
+  KeyDistConfig config_;
+  AliasTable ranks_;
+  // Multiplier coprime to n_keys, so rank -> rank * scatter_ % n_keys is a
+  // permutation of the keyspace.
+  uint64_t scatter_ = 1;
+  uint64_t n_hot_ = 0;
+  uint64_t hot_cutoff_ = 0;
+};
+
+// Value lengths to write: either uniform in [min, max], or one of a list of
+// sizes, each with a weight.
+class SizeDist {
+public:
+  // Always len.
+  explicit SizeDist(size_t len = 0) : min_(len), max_(len) {}
+
+  // Parses "LEN", "MIN-MAX" or "LEN@WEIGHT,LEN@WEIGHT,...", e.g.
+  // "100@90,4096@9,1000000@1".
+  //
+  // Returns false if spec doesn't parse.
+  bool parse(const char* spec);
+
+  size_t max() const { return max_; }
+
+  size_t draw(Rng* rng) const {
+    if (!sizes_.empty()) return sizes_[weights_.draw(rng)];
+    return min_ + rng->below(max_ - min_ + 1);
+  }
+
+private:
+  size_t min_ = 0;
+  size_t max_ = 0;
+  std::vector<size_t> sizes_;
+  AliasTable weights_;
+};
+
+// Parses a key distribution: "uniform", "zipf[:THETA]" or
+// "hotspot[:HOT_KEYS:HOT_OPS]", with the fractions in (0, 1).
+//
+// Returns false if spec doesn't parse, leaving n_keys as is.
+bool parse_key_dist(const char* spec, KeyDistConfig* config);
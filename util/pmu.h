@@ -1,4 +1,5 @@
 #include <asm/unistd.h>
+#include <errno.h>
 #include <linux/perf_event.h>
 #include <linux/hw_breakpoint.h>
 #include <stdint.h>
@@ -73,3 +74,87 @@ long long StopPMU(int fd) {
   assert(bytesRead == sizeof(count));
   return count;
 }
+
+struct PMUEvent {
+  uint32_t type;
+  uint64_t config;
+};
+
+// Up to this many counters in a PMUGroup.
+constexpr int PMU_GROUP_MAX = 8;
+
+// A group of counters on the calling thread that are read all at once.
+struct PMUGroup {
+  int n_events = 0;
+  int leader_fd = -1;
+  // fds[i] counts the ith event, or is -1 if it couldn't be opened, e.g.
+  // hardware events in a VM. slots[i] is its place in a group read.
+  int fds[PMU_GROUP_MAX];
+  int slots[PMU_GROUP_MAX];
+  int n_open = 0;
+};
+
+// Opens the events as one group counting the calling thread only, in user
+// and kernel mode, and starts them.
+//
+// Software events, like PERF_COUNT_SW_CONTEXT_SWITCHES, happen in the kernel,
+// so this needs perf_event_paranoid <= 1 or CAP_PERFMON.
+//
+// Returns false, with errno set, if none of the events could be opened.
+inline bool OpenPMUGroup(const PMUEvent* const events, const int n_events, PMUGroup* const group) {
+  if (n_events > PMU_GROUP_MAX) {
+    errno = EINVAL;
+    return false;
+  }
+  group->n_events = n_events;
+  group->leader_fd = -1;
+  group->n_open = 0;
+  int err = 0;
+  for (int i = 0; i < n_events; ++i) {
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = events[i].type;
+    pe.size = sizeof(pe);
+    pe.config = events[i].config;
+    pe.read_format = PERF_FORMAT_GROUP;
+    pe.exclude_hv = 1;
+
+    group->fds[i] = perf_event_open(&pe, 0, -1, group->leader_fd, 0);
+    group->slots[i] = -1;
+    if (-1 == group->fds[i]) {
+      err = errno;
+      continue;
+    }
+    if (-1 == group->leader_fd) group->leader_fd = group->fds[i];
+    group->slots[i] = group->n_open++;
+  }
+  if (-1 == group->leader_fd) {
+    errno = err;
+    return false;
+  }
+  return true;
+}
+
+// Reads the running totals of the group's counters into counts[0, n_events),
+// with one read(). Events that couldn't be opened read as 0. Subtract two
+// reads to count what happened in between.
+//
+// Returns false if the read fails.
+inline bool ReadPMUGroup(const PMUGroup* const group, uint64_t* const counts) {
+  // PERF_FORMAT_GROUP reads the number of counters, then each one's value.
+  uint64_t values[1 + PMU_GROUP_MAX];
+  const ssize_t want = (1 + group->n_open) * sizeof(uint64_t);
+  if (want != read(group->leader_fd, values, want)) return false;
+  for (int i = 0; i < group->n_events; ++i) {
+    counts[i] = group->slots[i] < 0 ? 0 : values[1 + group->slots[i]];
+  }
+  return true;
+}
+
+inline void ClosePMUGroup(PMUGroup* const group) {
+  for (int i = 0; i < group->n_events; ++i) {
+    if (group->fds[i] >= 0) close(group->fds[i]);
+  }
+  group->leader_fd = -1;
+  group->n_open = 0;
+}